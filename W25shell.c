@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // Needed for memrchr() and a few Linux-only calls
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,11 +7,53 @@
 #include <sys/wait.h>
 #include <signal.h> // Added for kill() function
 #include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/file.h> // flock(), when OFD locks aren't there
+#include <linux/fs.h> // FICLONERANGE, for reflink copies
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 intrinsics for the fast substring search
+#endif
+#include "w25plugin.h" // The interface "load" plugins are built against
 
 #define MAX_INPUT_SIZE 1024
 #define MAX_ARGS 5     // Maximum 5 arguments including the command itself
 #define MAX_COMMANDS 6 // Maximum of 6 commands (with 5 pipes between them)
 
+// Exit status of the last command line, like $? in bash
+// Server mode sends this back to the client when a command finishes
+int last_exit_status = 0;
+
+/**
+ * Saves the exit status from a waitpid() status value
+ * Killed by a signal counts as 128 + signal number, same as other shells
+ */
+void remember_exit_status(int wait_status)
+{
+    if (WIFEXITED(wait_status))
+        last_exit_status = WEXITSTATUS(wait_status);
+    else if (WIFSIGNALED(wait_status))
+        last_exit_status = 128 + WTERMSIG(wait_status);
+}
+
 /**
  * This function breaks the user's input into separate words
  * I'm using it to split commands like "ls -l" into ["ls", "-l", NULL]
@@ -58,1623 +101,12886 @@ int parse_command(char *input, char **args)
 }
 
 /**
- * This function handles commands with multiple pipes like "ls | grep txt | wc -l"
- * I had to learn a lot about pipes to make this work!
+ * Writes a whole buffer to a file descriptor
+ * write() is allowed to write less than we asked, so keep going until it's all out
  */
-int handle_multi_pipe(char *input)
+int write_all(int fd, const char *data, size_t length)
 {
-    // First I need to make a copy of the input string because strtok will change it
-    // I learned this the hard way when my original input got messed up
-    char my_input_copy[MAX_INPUT_SIZE];
-    strcpy(my_input_copy, input);
-
-    // Now I need to count how many pipe symbols are in the command
-    // This tells me how many commands the user wants to connect
-    int number_of_pipes = 0;
-    int position = 0;
-
-    // Loop through each character and count the pipes
-    while (my_input_copy[position] != '\0')
+    while (length > 0)
     {
-        if (my_input_copy[position] == '|')
+        ssize_t written = write(fd, data, length);
+        if (written < 0)
         {
-            number_of_pipes = number_of_pipes + 1; // Count this pipe
+            if (errno == EINTR)
+                continue; // Interrupted by a signal, just try again
+            return 0;
         }
-        position = position + 1;
-    }
-
-    // Professor said we only need to support up to 5 pipes
-    if (number_of_pipes > 5)
-    {
-        fprintf(stderr, "Error: Too many pipes! I can only handle 5 pipe operations\n");
-        return 0; // Return error
+        data += written;
+        length -= written;
     }
+    return 1;
+}
 
-    // Figure out how many commands we have (always 1 more than pipes)
-    // For example: "ls | grep | wc" has 2 pipes but 3 commands
-    int number_of_commands = number_of_pipes + 1;
-
-    // Make an array to store each command as a string
-    char *command_strings[MAX_COMMANDS];
-
-    // Split the input at each pipe symbol
-    char *part = strtok(my_input_copy, "|");
-    int command_index = 0;
+/**
+ * Redirections as a list of "file actions", like posix_spawn_file_actions
+ *   [n]<file  [n]>file  [n]>>file  [n]<>file  [n]>&m  [n]<&m  [n]>&-  &>file  &>>file
+ *   [n]>z file  [n]>>z file  (gzip compressed, see start_gzip_output)
+ * split_redirections() pulls them out of a command and leaves the plain words.
+ * The new child carries the actions out in order right before exec, so
+ * "make 2>&1 > log.txt" needs no "sh -c" in between.
+ */
+#define MAX_FILE_ACTIONS 10
+#define MAX_REDIRECT_FD 1023 // Biggest fd number we accept in "n>file"
 
-    // Get all the command parts and store them
-    while (part != NULL && command_index < number_of_commands)
-    {
-        // Remove spaces at the beginning of commands
-        // I noticed these cause problems with execution
-        while (*part == ' ')
-        {
-            part++; // Move past space
-        }
+enum
+{
+    FILE_ACTION_OPEN,  // Open path and put it on fd
+    FILE_ACTION_DUP,   // Make fd a copy of source_fd
+    FILE_ACTION_CLOSE, // Close fd
+    FILE_ACTION_GZIP,  // fd goes through the >z compressor into path
+};
 
-        // Save this command
-        command_strings[command_index] = part;
-        command_index++;
+struct file_action
+{
+    int kind;
+    int fd;        // The fd in the command that this sets up
+    int source_fd; // FILE_ACTION_DUP only
+    int flags;     // FILE_ACTION_OPEN only, flags for open()
+    char *path;    // FILE_ACTION_OPEN only, points into text below
+};
+
+struct file_actions
+{
+    int count;
+    struct file_action list[MAX_FILE_ACTIONS];
+    char text[MAX_INPUT_SIZE * 2]; // The words and file names, each NUL terminated
+};
 
-        // Get the next command part
-        part = strtok(NULL, "|");
-    }
+static int is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
 
-    // Now I need to create actual pipe connections between commands
-    // Each pipe has 2 ends: read end and write end
-    int my_pipes[MAX_COMMANDS - 1][2]; // Need one pipe between each pair of commands
+// Does a redirection start here? ("<", ">", "2>", "&>" ...)
+static int is_redirection_start(const char *text)
+{
+    if (text[0] == '&' && text[1] == '>')
+        return 1;
+    while (is_digit(*text))
+        text++;
+    return *text == '<' || *text == '>';
+}
 
-    // Create all the pipes we need
-    for (int i = 0; i < number_of_pipes; i++)
+static int add_file_action(struct file_actions *actions, int kind, int fd, int source_fd, int flags, char *path)
+{
+    if (actions->count == MAX_FILE_ACTIONS)
     {
-        // The pipe() function creates a pipe and puts file descriptors in my_pipes[i][0] and my_pipes[i][1]
-        if (pipe(my_pipes[i]) < 0)
-        {
-            // Uh oh, pipe creation failed
-            perror("Oh no! Can't create pipe");
-            return 0;
-        }
+        fprintf(stderr, "Error: Too many redirections (max is %d)\n", MAX_FILE_ACTIONS);
+        return 0;
     }
+    struct file_action *action = &actions->list[actions->count++];
+    action->kind = kind;
+    action->fd = fd;
+    action->source_fd = source_fd;
+    action->flags = flags;
+    action->path = path;
+    return 1;
+}
 
-    // Now for the tricky part - creating a process for each command
-    pid_t child_pids[MAX_COMMANDS]; // Store the process IDs
+/**
+ * Splits a command into words and redirections
+ * The words point into actions->text, so they live as long as actions does
+ * Returns the number of words (it can be more than max_words, only max_words
+ * are stored) or -1 if a redirection was written wrong
+ */
+int split_redirections(const char *input, char **words, int max_words, struct file_actions *actions)
+{
+    char *out = actions->text;
+    const char *cursor = input;
+    int word_count = 0;
+    actions->count = 0;
 
-    // Create a process for each command
-    for (int cmd_idx = 0; cmd_idx < number_of_commands; cmd_idx++)
+    while (1)
     {
-        // First, break down this command into its arguments
-        char *cmd_args[MAX_ARGS + 1]; // +1 because execvp needs NULL at the end
-
-        // Make a copy of this command for parsing
-        char cmd_copy[MAX_INPUT_SIZE];
-        strcpy(cmd_copy, command_strings[cmd_idx]);
-
-        // Split command into arguments (program name and its options)
-        int num_args = 0;
-        char *arg = strtok(cmd_copy, " ");
+        while (*cursor == ' ' || *cursor == '\t')
+            cursor++;
+        if (*cursor == '\0')
+            break;
 
-        while (arg != NULL && num_args < MAX_ARGS)
+        if (!is_redirection_start(cursor))
         {
-            cmd_args[num_args++] = arg;
-            arg = strtok(NULL, " ");
+            // A normal word ends at a space or where a redirection starts ("sort<in.txt")
+            char *word = out;
+            while (*cursor != '\0' && *cursor != ' ' && *cursor != '\t' && *cursor != '<' &&
+                   *cursor != '>' && !(cursor[0] == '&' && cursor[1] == '>'))
+                *out++ = *cursor++;
+            *out++ = '\0';
+            if (word_count < max_words)
+                words[word_count] = word;
+            word_count++;
+            continue;
         }
-        cmd_args[num_args] = NULL; // Important! execvp needs NULL at the end
 
-        // Check if command has valid number of arguments (rule 3 of assignment)
-        if (num_args == 0 || num_args > MAX_ARGS)
+        // Optional fd number, then the operator itself
+        int fd = -1;
+        int both = 0; // &> sends stdout and stderr to the same place
+        if (*cursor == '&')
         {
-            fprintf(stderr, "Error: Each command must have between 1 and 5 arguments\n");
-            return 0;
+            both = 1;
+            cursor++;
         }
-
-        // Create a new process for this command using fork()
-        // This was really confusing at first!
-        child_pids[cmd_idx] = fork();
-
-        // Check if fork worked
-        if (child_pids[cmd_idx] < 0)
+        else if (is_digit(*cursor))
         {
-            perror("Fork failed! Can't create process");
-            return 0;
+            fd = 0;
+            while (is_digit(*cursor))
+            {
+                fd = fd * 10 + (*cursor++ - '0');
+                if (fd > MAX_REDIRECT_FD)
+                {
+                    fprintf(stderr, "Error: fd number in redirection is too big\n");
+                    return -1;
+                }
+            }
         }
 
-        // Child process code (this runs in the new process)
-        if (child_pids[cmd_idx] == 0)
+        char direction = *cursor++; // '<' or '>'
+        int append = 0, read_write = 0, duplicate = 0, compressed = 0;
+        if (direction == '>' && *cursor == '>')
         {
-            // I need to connect this process to the right pipes
-
-            // If this isn't the first command, connect its input to previous pipe
-            if (cmd_idx > 0)
+            append = 1;
+            cursor++;
+        }
+        // ">z out.gz" - the z has to stand alone with a file name after it,
+        // ">zoo.txt" is just a file called zoo.txt and a ">z" at the end is a file called z
+        if (direction == '>' && !both && cursor[0] == 'z' && (cursor[1] == ' ' || cursor[1] == '\t'))
+        {
+            const char *after_z = cursor + 1;
+            while (*after_z == ' ' || *after_z == '\t')
+                after_z++;
+            if (*after_z != '\0' && *after_z != '<' && *after_z != '>')
             {
-                // Close the write end of previous pipe (we only need to read)
-                close(my_pipes[cmd_idx - 1][1]);
-
-                // Redirect stdin to read from the pipe
-                // This was hard to understand but cool when it worked!
-                dup2(my_pipes[cmd_idx - 1][0], STDIN_FILENO);
-
-                // Close original pipe read end (not needed anymore)
-                close(my_pipes[cmd_idx - 1][0]);
+                compressed = 1;
+                cursor++;
             }
+        }
+        else if (direction == '<' && *cursor == '>' && !both)
+        {
+            read_write = 1;
+            cursor++;
+        }
+        else if (*cursor == '&' && !both && !append)
+        {
+            duplicate = 1;
+            cursor++;
+        }
+        if (fd < 0)
+            fd = (direction == '<') ? STDIN_FILENO : STDOUT_FILENO;
+
+        // The target can be stuck to the operator or be the next word
+        while (*cursor == ' ' || *cursor == '\t')
+            cursor++;
+        char *target = out;
+        while (*cursor != '\0' && *cursor != ' ' && *cursor != '\t' && *cursor != '<' && *cursor != '>')
+            *out++ = *cursor++;
+        *out++ = '\0';
+        if (target[0] == '\0')
+        {
+            fprintf(stderr, "Error: Missing file name after redirection\n");
+            return -1;
+        }
 
-            // If this isn't the last command, connect its output to next pipe
-            if (cmd_idx < number_of_commands - 1)
+        if (duplicate)
+        {
+            if (strcmp(target, "-") == 0)
             {
-                // Close read end of current pipe (we only need to write)
-                close(my_pipes[cmd_idx][0]);
-
-                // Redirect stdout to write to the pipe
-                dup2(my_pipes[cmd_idx][1], STDOUT_FILENO);
-
-                // Close original pipe write end
-                close(my_pipes[cmd_idx][1]);
+                if (!add_file_action(actions, FILE_ACTION_CLOSE, fd, -1, 0, NULL))
+                    return -1;
+                continue;
             }
 
-            // Close all other pipes this process doesn't need
-            // This took me a while to get right!
-            for (int j = 0; j < number_of_pipes; j++)
+            int source_fd = 0;
+            const char *digit = target;
+            while (is_digit(*digit) && source_fd <= MAX_REDIRECT_FD)
+                source_fd = source_fd * 10 + (*digit++ - '0');
+            if (*digit == '\0' && source_fd <= MAX_REDIRECT_FD)
             {
-                if (j != cmd_idx - 1 && j != cmd_idx)
-                {
-                    close(my_pipes[j][0]);
-                    close(my_pipes[j][1]);
-                }
+                if (!add_file_action(actions, FILE_ACTION_DUP, fd, source_fd, 0, NULL))
+                    return -1;
+                continue;
             }
+            if (direction == '<' || fd != STDOUT_FILENO)
+            {
+                fprintf(stderr, "Error: %s isn't an fd number\n", target);
+                return -1;
+            }
+            both = 1; // ">&file" is the old way of writing "&>file"
+        }
 
-            // Now run the actual command!
-            execvp(cmd_args[0], cmd_args);
-
-            // If we get here, something went wrong with the command
-            perror("Command didn't work");
-            exit(EXIT_FAILURE);
+        int flags = O_RDONLY;
+        if (compressed)
+        {
+            flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+            if (!add_file_action(actions, FILE_ACTION_GZIP, fd, -1, flags, target))
+                return -1;
+            continue;
         }
+        if (read_write)
+            flags = O_RDWR | O_CREAT;
+        else if (direction == '>')
+            flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+        if (!add_file_action(actions, FILE_ACTION_OPEN, fd, -1, flags, target))
+            return -1;
+        if (both && !add_file_action(actions, FILE_ACTION_DUP, STDERR_FILENO, STDOUT_FILENO, 0, NULL))
+            return -1;
     }
 
-    // Parent process code (continues here after creating all children)
+    words[word_count < max_words ? word_count : max_words] = NULL;
+    return word_count;
+}
 
-    // Parent should close all pipe ends since it doesn't use them
-    // Otherwise pipes won't close properly
-    for (int p = 0; p < number_of_pipes; p++)
+/**
+ * Carries out the actions in a new child, right before exec
+ * Any failure ends the child with status 1 (same as bash's "No such file")
+ */
+static void apply_file_actions(const struct file_actions *actions)
+{
+    for (int i = 0; i < actions->count; i++)
     {
-        close(my_pipes[p][0]); // Close read end
-        close(my_pipes[p][1]); // Close write end
+        const struct file_action *action = &actions->list[i];
+        if (action->kind == FILE_ACTION_OPEN)
+        {
+            int fd = open(action->path, action->flags, 0644);
+            if (fd < 0)
+            {
+                fprintf(stderr, "w25shell: %s: %s\n", action->path, strerror(errno));
+                _exit(1);
+            }
+            if (fd != action->fd)
+            {
+                dup2(fd, action->fd);
+                close(fd);
+            }
+        }
+        else if (action->kind == FILE_ACTION_DUP)
+        {
+            // dup2 onto itself does nothing, but the fd still has to survive exec
+            int worked = (action->source_fd == action->fd)
+                             ? fcntl(action->fd, F_SETFD, 0) == 0
+                             : dup2(action->source_fd, action->fd) >= 0;
+            if (!worked)
+            {
+                fprintf(stderr, "w25shell: %d: %s\n", action->source_fd, strerror(errno));
+                _exit(1);
+            }
+        }
+        else
+        {
+            close(action->fd);
+        }
     }
+}
 
-    // Wait for all child processes to finish
-    for (int c = 0; c < number_of_commands; c++)
+/**
+ * Same thing for builtins, which run inside the shell itself
+ * saved[] gets a copy of every fd we change so undo_file_actions_here() can put it back
+ * Returns 1 if they all worked (if not, the ones that did are already undone)
+ */
+static void undo_file_actions_here(const struct file_actions *actions, int *saved, int done)
+{
+    // Backwards, so an fd that was changed twice ends up how it started
+    for (int i = done - 1; i >= 0; i--)
     {
-        waitpid(child_pids[c], NULL, 0);
+        if (saved[i] >= 0)
+        {
+            dup2(saved[i], actions->list[i].fd);
+            close(saved[i]);
+        }
+        else
+        {
+            close(actions->list[i].fd);
+        }
     }
+}
 
-    // Everything worked!
+static int apply_file_actions_here(const struct file_actions *actions, int *saved)
+{
+    for (int i = 0; i < actions->count; i++)
+    {
+        const struct file_action *action = &actions->list[i];
+        saved[i] = fcntl(action->fd, F_DUPFD_CLOEXEC, 10); // -1 if it wasn't open
+        int worked = 1;
+        if (action->kind == FILE_ACTION_OPEN)
+        {
+            int fd = open(action->path, action->flags | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                fprintf(stderr, "w25shell: %s: %s\n", action->path, strerror(errno));
+                worked = 0;
+            }
+            else if (fd != action->fd)
+            {
+                dup2(fd, action->fd);
+                close(fd);
+            }
+        }
+        else if (action->kind == FILE_ACTION_GZIP)
+        {
+            fprintf(stderr, "w25shell: >z only works for programs, not builtins\n");
+            worked = 0;
+        }
+        else if (action->kind == FILE_ACTION_DUP)
+        {
+            if (action->source_fd != action->fd && dup2(action->source_fd, action->fd) < 0)
+            {
+                fprintf(stderr, "w25shell: %d: %s\n", action->source_fd, strerror(errno));
+                worked = 0;
+            }
+        }
+        else
+        {
+            close(action->fd);
+        }
+
+        if (!worked)
+        {
+            if (saved[i] >= 0)
+                close(saved[i]);
+            undo_file_actions_here(actions, saved, i);
+            return 0;
+        }
+    }
     return 1;
 }
 
 /**
- * This function handles reverse piping with the = symbol
- * It's like regular piping but runs commands in reverse order
+ * CPU and priority settings for a new program (pin=, nice=, sched=), plus
+ * the resource limits from "limit" (mem=, cpu=, nofile=)
+ * Like the file actions they're done inside the child before exec, so the
+ * program never runs a single instruction in the wrong place
  */
-int handle_reverse_pipe(char *input)
+struct placement
 {
-    // Need to copy the input because strtok will change it
-    char copied_input[MAX_INPUT_SIZE];
-    strcpy(copied_input, input);
+    int pin_auto;   // pin=auto, turned into cpus before the spawn
+    int has_cpus;   // pin=0-3,6
+    cpu_set_t cpus;
+    int has_nice;   // nice=N
+    int nice;
+    int policy;     // sched=: SCHED_OTHER, SCHED_BATCH or SCHED_IDLE, -1 to leave alone
+    long long mem_bytes; // mem=2G, 0 for no limit
+    int cpu_percent;     // cpu=150%, 0 for no limit (only a cgroup can do this one)
+    long nofile;         // nofile=4096, 0 to leave alone
+    char cgroup[256];    // The job's cgroup directory, "" when it's rlimits only
+};
+
+static void placement_reset(struct placement *place)
+{
+    memset(place, 0, sizeof(*place));
+    place->policy = -1;
+}
 
-    // Count how many = symbols are in the command
-    int reverse_pipe_count = 0;
-    for (int index = 0; input[index] != '\0'; index++)
+// Is there anything in place for the child to do?
+static int placement_is_set(const struct placement *place)
+{
+    return place->has_cpus || place->has_nice || place->policy >= 0 || place->mem_bytes > 0 || place->nofile > 0 ||
+           place->cgroup[0] != '\0';
+}
+
+// Runs in the new child, a setting that doesn't work is only a warning
+static void apply_placement(const struct placement *place)
+{
+    // Join the job's cgroup first, so memory.max covers everything the program allocates
+    int in_cgroup = 0;
+    if (place->cgroup[0] != '\0')
     {
-        if (input[index] == '=')
-            reverse_pipe_count++;
+        char path[sizeof(place->cgroup) + 16], pid_text[16];
+        snprintf(path, sizeof(path), "%s/cgroup.procs", place->cgroup);
+        int length = snprintf(pid_text, sizeof(pid_text), "%d", getpid());
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd >= 0 && write(fd, pid_text, length) == length)
+            in_cgroup = 1;
+        else
+            perror("Warning: couldn't join the job's cgroup, using rlimits");
+        if (fd >= 0)
+            close(fd);
+    }
+    if (place->nofile > 0)
+    {
+        struct rlimit files = {place->nofile, place->nofile};
+        if (setrlimit(RLIMIT_NOFILE, &files) < 0)
+            perror("Warning: couldn't set nofile=");
+    }
+    // Without a cgroup the closest thing to mem= is capping the address space
+    if (place->mem_bytes > 0 && !in_cgroup)
+    {
+        struct rlimit memory = {place->mem_bytes, place->mem_bytes};
+        if (setrlimit(RLIMIT_AS, &memory) < 0)
+            perror("Warning: couldn't set mem=");
     }
 
-    // Assignment says maximum 5 pipe operations
-    if (reverse_pipe_count > 5)
+    if (place->has_cpus && sched_setaffinity(0, sizeof(place->cpus), &place->cpus) < 0)
+        perror("Warning: couldn't pin the command");
+    if (place->policy >= 0)
     {
-        fprintf(stderr, "Error: Maximum 5 reverse pipe operations are supported\n");
-        return 0;
+        struct sched_param priority = {0};
+        if (sched_setscheduler(0, place->policy, &priority) < 0)
+            perror("Warning: couldn't set sched=");
     }
+    // After sched= because switching policy can reset the nice value
+    if (place->has_nice && setpriority(PRIO_PROCESS, 0, place->nice) < 0)
+        perror("Warning: couldn't set nice=");
+}
 
-    // Calculate how many commands we have
-    int command_count = reverse_pipe_count + 1;
+/**
+ * Compressed output: "cmd >z out.gz" and "cmd >>z out.gz"
+ *
+ * The command writes into a pipe and threads in the shell turn that into a
+ * gzip file, pigz style: a reader cuts the stream into 128KB blocks, one
+ * worker per CPU compresses blocks at the same time, and a writer puts them
+ * out in order. Every block is its own gzip member, and gzip/zcat read a
+ * file made of several members as one stream (so >>z just adds members).
+ *
+ * zlib is loaded with dlopen so the shell still builds without it. If it
+ * isn't installed the blocks are stored uncompressed - still a valid .gz file.
+ */
+#define GZIP_BLOCK_SIZE (128 * 1024)
+#define GZIP_MAX_WORKERS 32
+#define GZIP_LEVEL 6 // Same default as gzip
 
-    // Make an array to store all the commands
-    char *command_list[MAX_COMMANDS];
+enum
+{
+    GZIP_BLOCK_EMPTY,   // Free for the reader
+    GZIP_BLOCK_READY,   // Has input, waiting for a worker
+    GZIP_BLOCK_WORKING, // A worker is compressing it
+    GZIP_BLOCK_DONE,    // Compressed, waiting for the writer
+};
 
-    // Split the input by = symbol to get each command
-    char *command_piece = strtok(copied_input, "=");
-    int index = 0;
+struct gzip_block
+{
+    int state;
+    unsigned char *input;
+    size_t input_length;
+    unsigned char *output; // A whole gzip member
+    size_t output_length;
+    size_t output_space;
+};
+
+struct gzip_output
+{
+    pid_t pid; // The command writing to us, wait_program() finishes us off with it
+    int in_fd; // Read end of the command's pipe
+    int out_fd;
+    int failed;
+    struct gzip_block *blocks;
+    int block_count;
+    long next_read, next_compress, next_write; // Block sequence numbers
+    int reading_done;
+    int worker_count;
+    pthread_t reader, writer, workers[GZIP_MAX_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct gzip_output *next;
+};
+
+static struct gzip_output *gzip_outputs = NULL; // Started but not finished yet
+
+// zlib functions, found with dlsym (NULL when zlib isn't there)
+static int (*zlib_compress2)(unsigned char *, unsigned long *, const unsigned char *, unsigned long, int);
+static unsigned long (*zlib_compress_bound)(unsigned long);
+static unsigned long (*zlib_crc32)(unsigned long, const unsigned char *, unsigned int);
+static uint32_t gzip_crc_table[256]; // For the stored fallback
+
+static void load_zlib(void)
+{
+    static int tried = 0;
+    if (tried)
+        return;
+    tried = 1;
 
-    // Get each command and store it
-    while (command_piece != NULL && index < command_count)
+    void *zlib = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (zlib != NULL)
     {
-        // Remove spaces at the beginning
-        while (*command_piece == ' ')
-            command_piece++;
-
-        // Store this command
-        command_list[index] = command_piece;
-        index++;
-
-        // Get next command
-        command_piece = strtok(NULL, "=");
+        zlib_compress2 = dlsym(zlib, "compress2");
+        zlib_compress_bound = dlsym(zlib, "compressBound");
+        zlib_crc32 = dlsym(zlib, "crc32");
     }
-
-    // Need to make pipes to connect the commands
-    // Each pipe connects two commands together
-    int pipe_array[MAX_COMMANDS - 1][2];
-
-    // Create all the pipes we need
-    for (int p = 0; p < reverse_pipe_count; p++)
+    if (zlib_compress2 == NULL || zlib_compress_bound == NULL || zlib_crc32 == NULL)
     {
-        if (pipe(pipe_array[p]) < 0)
+        zlib_compress2 = NULL;
+        fprintf(stderr, "Warning: zlib not found, >z files will be stored uncompressed\n");
+        for (uint32_t i = 0; i < 256; i++)
         {
-            perror("Error creating pipe");
-            return 0;
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            gzip_crc_table[i] = crc;
         }
     }
+}
 
-    // For reverse piping, we need to start from the last command
-    // This is different from regular piping!
-    pid_t process_ids[MAX_COMMANDS];
+static void put_le32(unsigned char *where, uint32_t value)
+{
+    where[0] = value;
+    where[1] = value >> 8;
+    where[2] = value >> 16;
+    where[3] = value >> 24;
+}
 
-    // Create processes in reverse order (from right to left)
-    for (int cmd_index = command_count - 1; cmd_index >= 0; cmd_index--)
+/**
+ * Turns one block into a gzip member: 10 byte header, raw deflate data, CRC32, size
+ * compress2() makes zlib format, which is the same deflate data with a 2 byte
+ * header and a 4 byte Adler-32 on the end - so we just cut those off
+ */
+static int gzip_compress_block(struct gzip_block *block)
+{
+    size_t length = block->input_length;
+    size_t space = zlib_compress2 ? zlib_compress_bound(length) + 18
+                                  : length + 5 * (length / 65535 + 1) + 18;
+    if (space > block->output_space)
     {
-        // We need to break down each command into its parts
-        char *arguments[MAX_ARGS + 1];
-        int arg_count = parse_command(command_list[cmd_index], arguments);
+        free(block->output);
+        block->output = malloc(space);
+        block->output_space = block->output == NULL ? 0 : space;
+        if (block->output == NULL)
+            return 0;
+    }
 
-        // Check if command has valid number of arguments
-        if (arg_count == 0 || arg_count > MAX_ARGS)
-        {
-            fprintf(stderr, "Error: Each command must have between 1 and 5 arguments\n");
+    unsigned char *out = block->output;
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3}; // deflate, Unix
+    memcpy(out, header, sizeof(header));
+
+    uint32_t crc;
+    size_t deflate_length;
+    if (zlib_compress2 != NULL)
+    {
+        // Compress to out + 8 so the raw deflate part starts right after our header
+        unsigned long zlib_length = space - 8;
+        if (zlib_compress2(out + 8, &zlib_length, block->input, length, GZIP_LEVEL) != 0 || zlib_length < 6)
             return 0;
-        }
+        memcpy(out, header, sizeof(header)); // The zlib header landed on our last 2 bytes
+        deflate_length = zlib_length - 6;
+        crc = zlib_crc32(0, block->input, length);
+    }
+    else
+    {
+        // Stored blocks: final bit, then LEN and ~LEN, then the bytes as they are
+        unsigned char *cursor = out + 10;
+        size_t done = 0;
+        do
+        {
+            size_t piece = length - done < 65535 ? length - done : 65535;
+            *cursor++ = (done + piece == length) ? 1 : 0;
+            cursor[0] = piece;
+            cursor[1] = piece >> 8;
+            cursor[2] = ~piece;
+            cursor[3] = (~piece) >> 8;
+            memcpy(cursor + 4, block->input + done, piece);
+            cursor += 4 + piece;
+            done += piece;
+        } while (done < length);
+        deflate_length = cursor - (out + 10);
+
+        crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < length; i++)
+            crc = gzip_crc_table[(crc ^ block->input[i]) & 0xFF] ^ (crc >> 8);
+        crc ^= 0xFFFFFFFFu;
+    }
 
-        // Create a child process for this command
-        process_ids[cmd_index] = fork();
+    put_le32(out + 10 + deflate_length, crc);
+    put_le32(out + 14 + deflate_length, (uint32_t)length);
+    block->output_length = deflate_length + 18;
+    return 1;
+}
 
-        if (process_ids[cmd_index] < 0)
+// Cuts the command's output into blocks
+static void *gzip_reader_main(void *arg)
+{
+    struct gzip_output *gz = arg;
+    while (1)
+    {
+        pthread_mutex_lock(&gz->lock);
+        struct gzip_block *block = &gz->blocks[gz->next_read % gz->block_count];
+        while (block->state != GZIP_BLOCK_EMPTY)
+            pthread_cond_wait(&gz->changed, &gz->lock);
+        pthread_mutex_unlock(&gz->lock);
+
+        // Fill the whole block unless the command finished
+        size_t filled = 0;
+        while (filled < GZIP_BLOCK_SIZE)
         {
-            perror("Error forking process");
-            return 0;
+            ssize_t got = read(gz->in_fd, block->input + filled, GZIP_BLOCK_SIZE - filled);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                break;
+            filled += got;
         }
 
-        // Code for the child process
-        if (process_ids[cmd_index] == 0)
+        pthread_mutex_lock(&gz->lock);
+        // An empty block is only worth sending if it's the whole file (gzip wants one member)
+        int finished = filled < GZIP_BLOCK_SIZE;
+        if (filled > 0 || gz->next_read == 0)
         {
-            // The tricky part - connecting pipes in reverse
+            block->input_length = filled;
+            block->state = GZIP_BLOCK_READY;
+            gz->next_read++;
+        }
+        if (finished)
+            gz->reading_done = 1;
+        pthread_cond_broadcast(&gz->changed);
+        pthread_mutex_unlock(&gz->lock);
+        if (finished)
+            return NULL;
+    }
+}
 
-            // If this isn't the rightmost command, connect its input
-            if (cmd_index < command_count - 1)
-            {
-                close(pipe_array[cmd_index][1]);              // Close write end
-                dup2(pipe_array[cmd_index][0], STDIN_FILENO); // Connect read end to stdin
-                close(pipe_array[cmd_index][0]);              // Close original read end
-            }
+static void *gzip_worker_main(void *arg)
+{
+    struct gzip_output *gz = arg;
+    pthread_mutex_lock(&gz->lock);
+    while (1)
+    {
+        if (gz->next_compress < gz->next_read)
+        {
+            struct gzip_block *block = &gz->blocks[gz->next_compress % gz->block_count];
+            gz->next_compress++;
+            block->state = GZIP_BLOCK_WORKING;
+            pthread_mutex_unlock(&gz->lock);
 
-            // If this isn't the leftmost command, connect its output
-            if (cmd_index > 0)
-            {
-                close(pipe_array[cmd_index - 1][0]);               // Close read end
-                dup2(pipe_array[cmd_index - 1][1], STDOUT_FILENO); // Connect write end to stdout
-                close(pipe_array[cmd_index - 1][1]);               // Close original write end
-            }
+            int worked = gzip_compress_block(block);
 
-            // Need to close all other pipes so they don't stay open
-            for (int j = 0; j < reverse_pipe_count; j++)
+            pthread_mutex_lock(&gz->lock);
+            if (!worked)
             {
-                if ((j != cmd_index) && (j != cmd_index - 1))
-                {
-                    close(pipe_array[j][0]);
-                    close(pipe_array[j][1]);
-                }
+                gz->failed = 1;
+                block->output_length = 0;
             }
-
-            // Run the command
-            execvp(arguments[0], arguments);
-
-            // If we get here, something went wrong
-            perror("Command execution failed");
-            exit(EXIT_FAILURE);
+            block->state = GZIP_BLOCK_DONE;
+            pthread_cond_broadcast(&gz->changed);
+        }
+        else if (gz->reading_done)
+        {
+            break;
+        }
+        else
+        {
+            pthread_cond_wait(&gz->changed, &gz->lock);
         }
     }
+    pthread_mutex_unlock(&gz->lock);
+    return NULL;
+}
 
-    // Parent process needs to close all pipes
-    for (int p = 0; p < reverse_pipe_count; p++)
+// Writes the members out in the same order the blocks came in
+static void *gzip_writer_main(void *arg)
+{
+    struct gzip_output *gz = arg;
+    pthread_mutex_lock(&gz->lock);
+    while (1)
     {
-        close(pipe_array[p][0]);
-        close(pipe_array[p][1]);
+        struct gzip_block *block = &gz->blocks[gz->next_write % gz->block_count];
+        if (gz->next_write < gz->next_read && block->state == GZIP_BLOCK_DONE)
+        {
+            pthread_mutex_unlock(&gz->lock);
+            int worked = write_all(gz->out_fd, (char *)block->output, block->output_length);
+            pthread_mutex_lock(&gz->lock);
+            if (!worked)
+                gz->failed = 1;
+            block->state = GZIP_BLOCK_EMPTY;
+            gz->next_write++;
+            pthread_cond_broadcast(&gz->changed);
+        }
+        else if (gz->reading_done && gz->next_write == gz->next_read)
+        {
+            break;
+        }
+        else
+        {
+            pthread_cond_wait(&gz->changed, &gz->lock);
+        }
     }
+    pthread_mutex_unlock(&gz->lock);
+    return NULL;
+}
 
-    // Wait for all children to finish
-    for (int c = 0; c < command_count; c++)
+static void free_gzip_output(struct gzip_output *gz)
+{
+    for (int i = 0; i < gz->block_count; i++)
     {
-        waitpid(process_ids[c], NULL, 0);
+        free(gz->blocks[i].input);
+        free(gz->blocks[i].output);
     }
-
-    return 1; // Success
+    free(gz->blocks);
+    pthread_mutex_destroy(&gz->lock);
+    pthread_cond_destroy(&gz->changed);
+    free(gz);
 }
 
 /**
- * Checks if the user typed any of our special shell commands
- * First thing I learned: functions need return values!
+ * Opens path and starts the compressing threads
+ * Returns the write end of the pipe for the command (CLOEXEC, the file action
+ * dup2s it into place) or -1 with errno set
  */
-int handle_special_commands(char **args)
+static int start_gzip_output(const char *path, int flags, struct gzip_output **started)
 {
-    // My program needs to check two special commands
+    load_zlib();
 
-    // First special command: killterm (exits just this shell)
-    // strcmp returns 0 when strings match - that confused me at first!
-    if (strcmp(args[0], "killterm") == 0)
+    int out_fd = open(path, flags | O_CLOEXEC, 0644);
+    if (out_fd < 0)
+        return -1;
+    int pipe_ends[2];
+    if (pipe2(pipe_ends, O_CLOEXEC) < 0)
     {
-        // Tell user what's happening
-        printf("Goodbye! Closing this shell now...\n");
-
-        // exit(0) terminates program with success code
-        // I tried return 0 first but that doesn't actually exit!
-        exit(0);
-
-        // This code never runs but compiler wants a return value
-        return 1;
+        close(out_fd);
+        return -1;
     }
+    fcntl(pipe_ends[0], F_SETPIPE_SZ, 1024 * 1024); // Fewer wakeups, fine if it's refused
 
-    // Second special command: killallterms (exits ALL shells)
-    // Need to check if first word is this command
-    if (strcmp(args[0], "killallterms") == 0)
+    struct gzip_output *gz = calloc(1, sizeof(struct gzip_output));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus < 1 ? 1 : cpus > GZIP_MAX_WORKERS ? GZIP_MAX_WORKERS : (int)cpus;
+    if (gz != NULL)
     {
-        // Let user know we're working on it
-        printf("Starting termination of all w25shell processes...\n");
-
-        // Here's the tricky part! Need to find all processes named w25shell
-        // and send them termination signals
-
-        // First get our own process ID so we don't kill ourselves too early
-        pid_t my_own_pid = getpid();
-
-        // Using popen to run external command - cool trick I found online!
-        FILE *process_list;
-        char process_id_text[20]; // Should be enough for any PID
-
-        // Run pgrep command to find all w25shell processes
-        process_list = popen("pgrep -f w25shell", "r");
-
-        // Check if pgrep command worked
-        if (process_list == NULL)
-        {
-            // Something went wrong with pgrep
-            perror("Oops! Cannot find processes");
-            // Return 1 to indicate we handled the command anyway
-            return 1;
-        }
-
-        // Count how many processes we kill (not necessary but interesting)
-        int kill_count = 0;
-
-        // For each line in the output (each process ID)
-        while (fgets(process_id_text, sizeof(process_id_text), process_list) != NULL)
-        {
-            // Convert text PID to number (atoi = ASCII to Integer)
-            int process_id_number = atoi(process_id_text);
-
-            // Don't kill ourselves yet - we need to finish the loop first!
-            if (process_id_number != my_own_pid)
-            {
-                // Try to kill this process
-                int kill_result = kill(process_id_number, SIGTERM);
-
-                // Did it work?
-                if (kill_result == 0)
-                {
-                    // printf("Successfully terminated process: %d\n", process_id_number);
-                    kill_count++;
-                }
-                else
-                {
-                    // printf("Failed to terminate process: %d\n", process_id_number);
-                }
-            }
-        }
-
-        // Done with process list, close it
-        pclose(process_list);
-
-        // Tell user how many processes we killed
-        printf("Terminated %d other shell processes\n", kill_count);
-
-        // Now we can kill our own process
-        printf("Now terminating this shell... goodbye!\n");
-        exit(0);
+        // Twice as many blocks as workers so reading and writing never wait on each other
+        gz->block_count = workers * 2 + 2;
+        gz->blocks = calloc(gz->block_count, sizeof(struct gzip_block));
+    }
+    int allocated = gz != NULL && gz->blocks != NULL;
+    for (int i = 0; allocated && i < gz->block_count; i++)
+        allocated = (gz->blocks[i].input = malloc(GZIP_BLOCK_SIZE)) != NULL;
+    if (!allocated)
+    {
+        if (gz != NULL && gz->blocks != NULL)
+            free_gzip_output(gz);
+        else
+            free(gz);
+        close(out_fd);
+        close(pipe_ends[0]);
+        close(pipe_ends[1]);
+        errno = ENOMEM;
+        return -1;
+    }
 
-        // This line never executes but it makes the compiler happy
-        return 1;
+    gz->pid = -1;
+    gz->in_fd = pipe_ends[0];
+    gz->out_fd = out_fd;
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->changed, NULL);
+    pthread_create(&gz->reader, NULL, gzip_reader_main, gz);
+    pthread_create(&gz->writer, NULL, gzip_writer_main, gz);
+    for (; gz->worker_count < workers; gz->worker_count++)
+    {
+        if (pthread_create(&gz->workers[gz->worker_count], NULL, gzip_worker_main, gz) != 0)
+            break; // Fewer workers is still fine as long as there's one
     }
 
-    // If we got here, it wasn't a special command
-    return 0;
+    gz->next = gzip_outputs;
+    gzip_outputs = gz;
+    *started = gz;
+    return pipe_ends[1];
 }
 
 /**
- * This function runs any command the user types
- * It took me a while to understand how fork and exec work together!
+ * Waits for the compressing threads of every >z output the given command had
+ * Called once the command has exited, so the reader is about to see EOF
  */
-int execute_command(char **args)
+static void finish_gzip_outputs(pid_t pid)
 {
-    // First count the number of arguments
-    int arg_count = 0;
-    while (args[arg_count] != NULL)
+    struct gzip_output **link = &gzip_outputs;
+    while (*link != NULL)
     {
-        arg_count++;
+        struct gzip_output *gz = *link;
+        if (gz->pid != pid)
+        {
+            link = &gz->next;
+            continue;
+        }
+        *link = gz->next;
+
+        pthread_join(gz->reader, NULL);
+        for (int i = 0; i < gz->worker_count; i++)
+            pthread_join(gz->workers[i], NULL);
+        pthread_join(gz->writer, NULL);
+        if (gz->failed)
+            fprintf(stderr, "Warning: compressed output wasn't written completely\n");
+        close(gz->in_fd);
+        close(gz->out_fd);
+        free_gzip_output(gz);
     }
+}
 
-    // Check if argument count exceeds maximum allowed (5)
-    if (arg_count > 5)
-    {
-        fprintf(stderr, "Error: Too many arguments. Maximum allowed is 5.\n");
-        return 0; // Return failure
-    }
+/**
+ * Stats: latency histograms per operator and per command, plus a few counters
+ * ("stats" prints them, --metrics-file writes them for Prometheus)
+ *
+ * The histograms are HDR style: every power of two of microseconds is cut
+ * into 16 equal sub-buckets, so any latency from 1us to days lands in a
+ * bucket at most ~6% wide and recording one is a couple of adds.
+ * Everything lives in one MAP_SHARED mapping made before the zygote is
+ * forked, so programs started by the zygote and forked server workers count
+ * into the same numbers. Updates are atomic adds, no locks.
+ */
+#define STATS_SUB_BUCKETS 16
+#define STATS_SUB_BITS 4 // log2(STATS_SUB_BUCKETS)
+#define STATS_BUCKETS (39 * STATS_SUB_BUCKETS) // Up to 2^42 us, about 50 days
+#define STATS_MAX_COMMANDS 64
+#define STATS_NAME_SIZE 32
+#define STATS_MAX_RUNNING 32
+
+enum stats_operator
+{
+    STATS_OP_COMMAND,
+    STATS_OP_BUILTIN,
+    STATS_OP_PIPE,
+    STATS_OP_REVERSE_PIPE,
+    STATS_OP_WORD_COUNT,
+    STATS_OP_CONCAT,
+    STATS_OP_APPEND,
+    STATS_OP_REDIRECTION,
+    STATS_OP_SEQUENTIAL,
+    STATS_OP_CONDITIONAL,
+    STATS_OP_COUNT
+};
+
+static const char *stats_operator_names[STATS_OP_COUNT] = {
+    "command", "builtin", "pipe", "reverse_pipe", "word_count", "concat", "append", "redirection", "sequential",
+    "conditional"};
+
+struct latency_histogram
+{
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[STATS_BUCKETS];
+};
 
-    // We need these variables for process management
-    pid_t child_process_id;
-    int command_result;
+struct shell_stats
+{
+    pthread_mutex_t names_lock; // Process-shared, only for adding a new command name
+    int command_count;
+    char command_names[STATS_MAX_COMMANDS][STATS_NAME_SIZE];
+    struct latency_histogram commands[STATS_MAX_COMMANDS + 1]; // The extra one is "(other)"
+    struct latency_histogram operators[STATS_OP_COUNT];
+    uint64_t forks;
+    uint64_t exec_failures;
+    uint64_t operator_bytes[STATS_OP_COUNT]; // Read + written by ~, # and +
+};
+
+static struct shell_stats *shell_stats; // NULL if the mapping failed, then nothing is counted
+
+// A program we started and haven't waited for yet (each process keeps its own list)
+struct stats_running
+{
+    pid_t pid;
+    int command;
+    struct timespec started;
+};
+static struct stats_running stats_running[STATS_MAX_RUNNING];
+static int stats_running_count = 0;
+
+// Set by the dispatcher so dispatch_command_line() knows what kind of line it timed
+static int stats_line_operator = STATS_OP_COMMAND;
+
+// Called at the very start of main(), before anything forks
+static void stats_init(void)
+{
+    void *memory = mmap(NULL, sizeof(struct shell_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return;
+    shell_stats = memory; // Fresh anonymous memory is already zeroed
+    pthread_mutexattr_t shared;
+    pthread_mutexattr_init(&shared);
+    pthread_mutexattr_setpshared(&shared, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&shell_stats->names_lock, &shared);
+    pthread_mutexattr_destroy(&shared);
+}
 
-    // First step is to create a new process using fork()
-    // This basically makes a copy of our program!
-    // printf("Attempting to execute: %s\n", args[0]);
-    child_process_id = fork();
+// Which bucket a latency goes in: values below 16us get one each, above that
+// the top 5 significant bits pick the power of two and the sub-bucket
+static int stats_bucket(uint64_t us)
+{
+    if (us < STATS_SUB_BUCKETS)
+        return (int)us;
+    int shift = 63 - __builtin_clzll(us) - STATS_SUB_BITS;
+    int index = (shift + 1) * STATS_SUB_BUCKETS + (int)((us >> shift) & (STATS_SUB_BUCKETS - 1));
+    return index < STATS_BUCKETS ? index : STATS_BUCKETS - 1;
+}
 
-    // Check if fork worked correctly
-    if (child_process_id < 0)
+// Smallest latency (in us) that lands in bucket index, the bucket is width wide
+static uint64_t stats_bucket_start(int index, uint64_t *width)
+{
+    if (index < STATS_SUB_BUCKETS)
     {
-        // Something went wrong with creating the process
-        perror("Oh no! Fork creation failed");
-        return 0; // Return failure
+        *width = 1;
+        return (uint64_t)index;
     }
-    else if (child_process_id == 0)
-    {
-        // This code runs in the child process only
-        // The parent and child are running at the same time!
+    int shift = index / STATS_SUB_BUCKETS - 1;
+    *width = (uint64_t)1 << shift;
+    return (uint64_t)(STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS) << shift;
+}
 
-        // execvp replaces the current process with the command
-        // args[0] is the command name, and args has all arguments
-        int exec_result = execvp(args[0], args);
+static void stats_record(struct latency_histogram *histogram, uint64_t us)
+{
+    __atomic_add_fetch(&histogram->buckets[stats_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum_us, us, __ATOMIC_RELAXED);
+    uint64_t seen = __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED);
+    while (us > seen && !__atomic_compare_exchange_n(&histogram->max_us, &seen, us, 1, __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED))
+        ;
+}
 
-        // If we get here, execvp failed because it should never return
-        // When execvp works, the process is completely replaced
-        if (exec_result == -1)
-        {
-            perror("Command couldn't be executed");
+static uint64_t stats_microseconds_since(const struct timespec *started)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t us = (now.tv_sec - started->tv_sec) * 1000000LL + (now.tv_nsec - started->tv_nsec) / 1000;
+    return us > 0 ? (uint64_t)us : 0;
+}
 
-            // Need to exit because we're in the child process
-            // Using EXIT_FAILURE (value is 1) to show it failed
-            exit(EXIT_FAILURE);
-        }
-    }
-    else
+// Slot for a command name, adding it the first time (STATS_MAX_COMMANDS when the table is full)
+static int stats_command_slot(const char *name)
+{
+    const char *short_name = strrchr(name, '/');
+    if (short_name != NULL)
+        name = short_name + 1;
+
+    int known = __atomic_load_n(&shell_stats->command_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < known; i++)
+        if (strncmp(shell_stats->command_names[i], name, STATS_NAME_SIZE - 1) == 0)
+            return i;
+
+    pthread_mutex_lock(&shell_stats->names_lock);
+    int slot = STATS_MAX_COMMANDS;
+    int count = shell_stats->command_count;
+    for (int i = known; i < count && slot == STATS_MAX_COMMANDS; i++) // Someone else may have just added it
+        if (strncmp(shell_stats->command_names[i], name, STATS_NAME_SIZE - 1) == 0)
+            slot = i;
+    if (slot == STATS_MAX_COMMANDS && count < STATS_MAX_COMMANDS)
     {
-        // This code runs in the parent process only
-        // We need to wait for the child to finish
+        snprintf(shell_stats->command_names[count], STATS_NAME_SIZE, "%s", name);
+        __atomic_store_n(&shell_stats->command_count, count + 1, __ATOMIC_RELEASE);
+        slot = count;
+    }
+    pthread_mutex_unlock(&shell_stats->names_lock);
+    return slot;
+}
 
-        // waitpid makes the parent process wait for the child
-        // The status variable will hold information about how the child exited
-        int wait_result = waitpid(child_process_id, &command_result, 0);
+// spawn_process() calls this for every program it starts
+static void stats_program_started(pid_t pid, const char *name)
+{
+    if (shell_stats == NULL)
+        return;
+    __atomic_add_fetch(&shell_stats->forks, 1, __ATOMIC_RELAXED);
+    if (stats_running_count == STATS_MAX_RUNNING)
+        return; // Coprocesses can pile up, those just don't get timed
+    struct stats_running *entry = &stats_running[stats_running_count++];
+    entry->pid = pid;
+    entry->command = stats_command_slot(name);
+    clock_gettime(CLOCK_MONOTONIC, &entry->started);
+}
 
-        // Could check wait_result here to see if waitpid worked
-        if (wait_result < 0)
+// And wait_program() calls this once the program is gone
+static void stats_program_finished(pid_t pid)
+{
+    for (int i = 0; i < stats_running_count; i++)
+    {
+        if (stats_running[i].pid == pid)
         {
-            printf("Warning: Error waiting for command to finish\n");
+            stats_record(&shell_stats->commands[stats_running[i].command],
+                         stats_microseconds_since(&stats_running[i].started));
+            stats_running[i] = stats_running[--stats_running_count];
+            return;
         }
     }
+}
 
-    // If we got here, everything worked (or at least we tried)
-    return 1; // Return success
+// Bytes read and written by the file operators (~, #, +)
+static void stats_count_bytes(int operator, uint64_t bytes)
+{
+    if (shell_stats != NULL)
+        __atomic_add_fetch(&shell_stats->operator_bytes[operator], bytes, __ATOMIC_RELAXED);
 }
 
 /**
- * This function handles the special ~ operator which appends two text files to each other
- * Assignment rule said we need to implement file1.txt ~ file2.txt to append them to each other
+ * Timeouts: "timeout 5s cmd", "timeout 2m --kill-after 10s a | b", or
+ * "w25shell --timeout 30s" for every command
+ * Every program started while a timed job is open gets remembered, and
+ * wait_program() waits on a pidfd with poll() instead of sitting in waitpid(),
+ * so there's no watchdog process and no SIGALRM. When the time is up every
+ * stage that's still running (and everything it started) gets SIGTERM, and
+ * SIGKILL kill_after seconds later if it's still there
  */
-int handle_append(char *input)
-{
-    // First need to make a copy because strtok will change the original string
-    // Took me some time to figure out this was needed!
-    char command_copy[MAX_INPUT_SIZE];
-    strcpy(command_copy, input);
-
-    // Need to find the two filenames on either side of the ~ symbol
-    char *first_filename = NULL;
-    char *second_filename = NULL;
+#define MAX_TIMED_STAGES 16
+#define TIMED_NAME_SIZE 24
 
-    // Split by the ~ character - this gives us the file names
-    first_filename = strtok(command_copy, "~");
-    second_filename = strtok(NULL, "~");
+struct timed_job
+{
+    int active;
+    double seconds;    // How long the job gets
+    double kill_after; // Time between SIGTERM and SIGKILL
+    struct timespec started;
+    int stage_count;
+    pid_t pids[MAX_TIMED_STAGES];
+    char names[MAX_TIMED_STAGES][TIMED_NAME_SIZE];
+    int fired; // 0 still in time, 1 SIGTERM sent, 2 SIGKILL sent
+};
+
+static struct timed_job timed_job;
+static double default_timeout = 0; // --timeout, 0 for none
+static double default_kill_after = 5;
+
+// Reads "5", "5s", "500ms", "1.5m", "2h" or "1d" into seconds
+static int parse_duration(const char *text, double *seconds)
+{
+    char *unit;
+    double value = strtod(text, &unit);
+    if (unit == text || value < 0)
+        return 0;
+    if (*unit == '\0' || strcmp(unit, "s") == 0)
+        *seconds = value;
+    else if (strcmp(unit, "ms") == 0)
+        *seconds = value / 1000;
+    else if (strcmp(unit, "m") == 0)
+        *seconds = value * 60;
+    else if (strcmp(unit, "h") == 0)
+        *seconds = value * 3600;
+    else if (strcmp(unit, "d") == 0)
+        *seconds = value * 86400;
+    else
+        return 0;
+    return 1;
+}
 
-    // Need to remove extra spaces around filenames
-    // First let's handle the first filename
-    if (first_filename != NULL)
+/**
+ * Takes "timeout DURATION [--kill-after D]" (or "timeout --kill-after D DURATION")
+ * off the front of a command and fills in seconds/kill_after
+ * Returns where the command starts (command itself when there's no prefix),
+ * or NULL after printing an error
+ */
+static char *take_timeout_prefix(char *command, double *seconds, double *kill_after)
+{
+    char *start = command;
+    while (*start == ' ' || *start == '\t')
+        start++;
+    if (strncmp(start, "timeout", 7) != 0 || (start[7] != ' ' && start[7] != '\t'))
+        return command;
+
+    char *cursor = start + 7;
+    int have_duration = 0;
+    while (1)
     {
-        // Skip spaces at the beginning
-        while (first_filename[0] == ' ')
-        {
-            first_filename++; // Move pointer past spaces
-        }
+        while (*cursor == ' ' || *cursor == '\t')
+            cursor++;
+        size_t length = strcspn(cursor, " \t");
+        char word[64];
+        if (length == 0 || length >= sizeof(word))
+            break;
+        memcpy(word, cursor, length);
+        word[length] = '\0';
 
-        // Remove spaces at the end (this took me a while to figure out!)
-        int name_length = strlen(first_filename);
-        while (name_length > 0 && first_filename[name_length - 1] == ' ')
+        if (strcmp(word, "--kill-after") == 0 || strcmp(word, "-k") == 0)
         {
-            first_filename[name_length - 1] = '\0'; // Replace space with string terminator
-            name_length--;                          // Check next character
+            cursor += length;
+            while (*cursor == ' ' || *cursor == '\t')
+                cursor++;
+            length = strcspn(cursor, " \t");
+            if (length == 0 || length >= sizeof(word))
+                break;
+            memcpy(word, cursor, length);
+            word[length] = '\0';
+            if (!parse_duration(word, kill_after))
+            {
+                fprintf(stderr, "Error: --kill-after wants a duration like 10s\n");
+                return NULL;
+            }
         }
-    }
-
-    // Now same thing for the second filename
-    if (second_filename != NULL)
-    {
-        // Skip spaces at the beginning
-        while (second_filename[0] == ' ')
+        else if (!have_duration && parse_duration(word, seconds))
         {
-            second_filename++; // Move pointer past spaces
+            have_duration = 1;
         }
-
-        // Remove spaces at the end
-        int name_length = strlen(second_filename);
-        while (name_length > 0 && second_filename[name_length - 1] == ' ')
+        else
         {
-            second_filename[name_length - 1] = '\0';
-            name_length--;
+            break; // The command starts here
         }
+        cursor += length;
     }
 
-    // Make sure we have both filenames
-    if (first_filename == NULL || second_filename == NULL)
+    if (!have_duration || *cursor == '\0')
     {
-        fprintf(stderr, "Error: Need two files for the ~ operation!\n");
-        return 0; // Failed
+        fprintf(stderr, "Usage: timeout DURATION [--kill-after DURATION] command (durations like 5, 500ms, 2m, 1h)\n");
+        return NULL;
     }
+    return cursor;
+}
 
-    // Now check if both files are .txt files (requirement from assignment)
-    // Need to find where the .txt part starts in each filename
-    char *dot_position_1 = strrchr(first_filename, '.'); // Find the last dot
-    char *dot_position_2 = strrchr(second_filename, '.');
+// Opens a timed job; seconds = 0 means the job has no time limit
+static void timed_job_start(double seconds, double kill_after)
+{
+    timed_job.active = seconds > 0;
+    timed_job.seconds = seconds;
+    timed_job.kill_after = kill_after;
+    timed_job.stage_count = 0;
+    timed_job.fired = 0;
+    clock_gettime(CLOCK_MONOTONIC, &timed_job.started);
+}
 
-    // Check if extensions exist and are .txt
-    if (dot_position_1 == NULL || dot_position_2 == NULL ||
-        strcmp(dot_position_1, ".txt") != 0 || strcmp(dot_position_2, ".txt") != 0)
-    {
-        fprintf(stderr, "Error: Both files must be .txt files for ~ operation!\n");
-        return 0; // Failed
-    }
+// Called by spawn_process() for every program it starts
+static void timed_job_add(pid_t pid, const char *name)
+{
+    if (!timed_job.active || timed_job.stage_count == MAX_TIMED_STAGES)
+        return;
+    const char *short_name = strrchr(name, '/');
+    snprintf(timed_job.names[timed_job.stage_count], TIMED_NAME_SIZE, "%s", short_name != NULL ? short_name + 1 : name);
+    timed_job.pids[timed_job.stage_count++] = pid;
+}
 
-    // Time to read contents of first file
-    FILE *file1_handle = fopen(first_filename, "r");
-    if (file1_handle == NULL)
-    {
-        perror("Can't open first file");
-        return 0; // Failed
-    }
+// Is pid still running (not gone and not a zombie waiting to be reaped)?
+static int process_still_running(pid_t pid)
+{
+    char path[64], buffer[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    ssize_t got = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (got <= 0)
+        return 0;
+    buffer[got] = '\0';
+    char *after_name = strrchr(buffer, ')');
+    return after_name != NULL && after_name[1] == ' ' && after_name[2] != 'Z' && after_name[2] != 'X';
+}
 
-    // Need to get size of file1 to allocate memory
-    // Using fseek and ftell to find the size - learned this from class!
-    fseek(file1_handle, 0, SEEK_END);       // Go to end of file
-    long file1_bytes = ftell(file1_handle); // Get position (= file size)
-    fseek(file1_handle, 0, SEEK_SET);       // Go back to beginning
-
-    // Allocate memory for file1 contents (+1 for null terminator)
-    char *file1_data = malloc(file1_bytes + 1);
-    if (file1_data == NULL)
+/**
+ * Sends sig to pid and everything below it
+ * Stages stay in the shell's process group (there's no job control to hand
+ * them the terminal), so "sh -c ..." children are found through /proc instead.
+ * The whole tree is listed before anything is signalled - once a parent dies
+ * its children get reparented and we couldn't find them any more
+ */
+static void signal_process_tree(pid_t root, int sig)
+{
+    static pid_t pids[4096], parents[4096];
+    int count = 0;
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    while (proc != NULL && count < 4096 && (entry = readdir(proc)) != NULL)
     {
-        printf("Error: Can't allocate memory for first file\n");
-        fclose(file1_handle);
-        return 0; // Failed
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9')
+            continue;
+        char path[64], buffer[512];
+        pid_t pid = atoi(entry->d_name);
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        ssize_t got = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        if (got <= 0)
+            continue;
+        buffer[got] = '\0';
+        char *after_name = strrchr(buffer, ')');
+        int parent;
+        if (after_name != NULL && sscanf(after_name + 2, "%*c %d", &parent) == 1)
+        {
+            pids[count] = pid;
+            parents[count++] = parent;
+        }
     }
+    if (proc != NULL)
+        closedir(proc);
 
-    // Read all data from first file
-    long bytes_read = fread(file1_data, 1, file1_bytes, file1_handle);
-    file1_data[bytes_read] = '\0'; // Add null terminator
-    fclose(file1_handle);          // Done with the file for now
-
-    // Same process for the second file
-    FILE *file2_handle = fopen(second_filename, "r");
-    if (file2_handle == NULL)
+    static pid_t tree[4096];
+    int tree_count = 0;
+    tree[tree_count++] = root;
+    for (int next = 0; next < tree_count; next++) // Breadth first, tree grows as we go
     {
-        perror("Can't open second file");
-        free(file1_data); // Don't forget to free memory!
-        return 0;         // Failed
+        for (int i = 0; i < count && tree_count < 4096; i++)
+            if (parents[i] == tree[next])
+                tree[tree_count++] = pids[i];
     }
+    for (int i = 0; i < tree_count; i++)
+        kill(tree[i], sig);
+}
 
-    // Get size of file2
-    fseek(file2_handle, 0, SEEK_END);
-    long file2_bytes = ftell(file2_handle);
-    fseek(file2_handle, 0, SEEK_SET);
-
-    // Allocate memory for file2 contents
-    char *file2_data = malloc(file2_bytes + 1);
-    if (file2_data == NULL)
+// Time's up (fired 0 -> 1) or the grace period is over (1 -> 2): signal what's left
+static void timed_job_escalate(void)
+{
+    int sig = (timed_job.fired == 0) ? SIGTERM : SIGKILL;
+    for (int i = 0; i < timed_job.stage_count; i++)
     {
-        printf("Error: Can't allocate memory for second file\n");
-        free(file1_data);
-        fclose(file2_handle);
-        return 0; // Failed
+        if (!process_still_running(timed_job.pids[i]))
+            continue;
+        char stage[16] = "";
+        if (timed_job.stage_count > 1)
+            snprintf(stage, sizeof(stage), "[%d] ", i + 1);
+        if (sig == SIGTERM)
+            fprintf(stderr, "timeout: %s%s still running after %gs, sending SIGTERM\n", stage, timed_job.names[i],
+                    timed_job.seconds);
+        else
+            fprintf(stderr, "timeout: %s%s ignored SIGTERM for %gs, sending SIGKILL\n", stage, timed_job.names[i],
+                    timed_job.kill_after);
+        signal_process_tree(timed_job.pids[i], sig);
     }
+    timed_job.fired++;
+}
+
+// What a timed-out job exits with, same numbers as coreutils timeout
+static int timed_out_status(void)
+{
+    return timed_job.fired == 2 ? 128 + SIGKILL : 124;
+}
 
-    // Read all data from second file
-    bytes_read = fread(file2_data, 1, file2_bytes, file2_handle);
-    file2_data[bytes_read] = '\0'; // Add null terminator
-    fclose(file2_handle);
+/**
+ * Blocks until pid exits, firing the timeout on the way if it runs out
+ * Returns straight away when no timed job is open (or there's no pidfd),
+ * wait_program() then reaps the process as usual
+ */
+static void timed_job_wait(pid_t pid)
+{
+    if (!timed_job.active || timed_job.fired == 2)
+        return;
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0)
+        return;
 
-    // Now the fun part - append file2 data to file1
-    file1_handle = fopen(first_filename, "a"); // Open in append mode
-    if (file1_handle == NULL)
+    while (timed_job.fired < 2)
     {
-        perror("Can't open first file for appending");
-        free(file1_data);
-        free(file2_data);
-        return 0; // Failed
+        double due = timed_job.seconds + (timed_job.fired == 1 ? timed_job.kill_after : 0);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - timed_job.started.tv_sec) + (now.tv_nsec - timed_job.started.tv_nsec) / 1e9;
+        double left = due - elapsed;
+        if (left <= 0)
+        {
+            timed_job_escalate();
+            continue;
+        }
+
+        struct pollfd watch = {pidfd, POLLIN, 0};
+        int wait_ms = left > 86400 ? 86400000 : (int)(left * 1000) + 1;
+        int ready = poll(&watch, 1, wait_ms);
+        if (ready > 0)
+            break; // It exited
+        if (ready < 0 && errno != EINTR)
+            break;
     }
+    close(pidfd);
+}
 
-    // Write file2's contents to the end of file1
-    fprintf(file1_handle, "%s", file2_data);
-    fclose(file1_handle);
+/**
+ * Starting programs: spawn_program() and wait_program()
+ *
+ * Normally this is just fork + execvp. With "w25shell --zygote" a small helper
+ * process (the "zygote") is forked right at startup while the shell is still
+ * tiny, and commands get forked from that helper instead of from the shell.
+ * fork() has to copy the page tables of whoever calls it, so forking from a
+ * small process stays fast even after the shell has built up big caches.
+ *
+ * The shell sends the helper the working directory, argv, environment and file
+ * actions over a socketpair, with stdin/stdout/stderr attached as SCM_RIGHTS. The helper answers
+ * with a 'P' reply (the child's pid) and later an 'X' reply (its wait status).
+ */
+#define ZYGOTE_MAX_REQUEST (64 * 1024) // Bigger requests just use a normal fork
 
-    // And append file1 data to file2
-    file2_handle = fopen(second_filename, "a"); // Open in append mode
-    if (file2_handle == NULL)
-    {
-        perror("Can't open second file for appending");
-        free(file1_data);
-        free(file2_data);
-        return 0; // Failed
-    }
+static int zygote_fd = -1;    // Our end of the socketpair, -1 when there's no zygote
+static pid_t zygote_owner = 0; // Only this process (and only its main thread) talks to it
+static pid_t zygote_pid = 0;   // The helper itself, 0 when there's none
+static int inherited_fd_count = 0; // Open <(...) / >(...) fds - the zygote can't hand those on
+static int zygote_bypass = 0;      // pipestat needs its stages as our own children, to read them as zombies
 
-    // Write file1's contents to the end of file2
-    fprintf(file2_handle, "%s", file1_data);
-    fclose(file2_handle);
+struct zygote_reply
+{
+    char type;  // 'P' = started (pid < 0 is -errno from fork), 'X' = exited
+    pid_t pid;
+    int status; // waitpid() status for 'X'
+};
 
-    // All done! Free the memory we allocated
-    free(file1_data);
-    free(file2_data);
+// Exit statuses that showed up while we were waiting for a different child
+struct finished_child
+{
+    pid_t pid;
+    int status;
+};
+static struct finished_child *zygote_finished = NULL;
+static int zygote_finished_count = 0;
+static int zygote_finished_capacity = 0;
 
-    // Let user know it worked
-    printf("Successfully combined the files.\n");
-    return 1; // Success!
+/**
+ * The part of starting a program that runs inside the new child
+ * Hooks up stdin/stdout/stderr, does the redirections and placement (either
+ * can be NULL) and replaces the process with the program
+ */
+static void exec_in_child(char **argv, char **envp, int in_fd, int out_fd, int err_fd,
+                          const struct file_actions *actions, const struct placement *place)
+{
+    if (in_fd != STDIN_FILENO)
+        dup2(in_fd, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO)
+        dup2(out_fd, STDOUT_FILENO);
+    if (err_fd != STDERR_FILENO)
+        dup2(err_fd, STDERR_FILENO);
+    if (actions != NULL)
+        apply_file_actions(actions);
+    if (place != NULL)
+        apply_placement(place);
+
+    if (envp != NULL)
+        execvpe(argv[0], argv, envp);
+    else
+        execvp(argv[0], argv);
+
+    // If we get here, the command couldn't be run
+    // _exit so we don't flush a copy of the parent's stdio buffers
+    perror("Command couldn't be executed");
+    if (shell_stats != NULL)
+        __atomic_add_fetch(&shell_stats->exec_failures, 1, __ATOMIC_RELAXED);
+    _exit(EXIT_FAILURE);
 }
 
 /**
- * This function counts all the words in a text file
- * I used the # symbol as required in the assignment
+ * Runs in a fresh child of the zygote: unpacks the request and execs it
+ * Request layout: argc, envc, action count (uint32 each), then cwd, argv, env
+ * and the file actions as C strings ("O<fd> <flags> <path>", "D<fd> <from>", "C<fd>"),
+ * plus "P<policy> <nice or X> <CPU mask in hex or X> <mem> <nofile> <cgroup or X>" for placement
  */
-int handle_word_count(char *input)
+static void zygote_child(char *request, size_t length, int *fds)
 {
-    // Need to copy input string because we'll change it
-    // I had a bug before when I didn't do this!
-    char command_copy[MAX_INPUT_SIZE];
-    strcpy(command_copy, input);
-
-    // Setting up variables we'll need
-    char *file_to_count = NULL; // Will store the filename
-    int total_words = 0;        // Counter for words
-    int currently_in_word = 0;  // This is like a flag - are we in a word right now?
-    FILE *text_file;            // For opening the file
-    char current_character;     // To read file character by character
-
-    // Step 1: Need to find where the # symbol is
-    char *hash_symbol_location = strchr(command_copy, '#');
+    uint32_t counts[3];
+    memcpy(counts, request, sizeof(counts));
+    if (counts[2] > MAX_FILE_ACTIONS + 1)
+        _exit(EXIT_FAILURE);
+
+    char **words = malloc(sizeof(char *) * (counts[0] + counts[1] + 2));
+    if (words == NULL)
+        _exit(EXIT_FAILURE);
+
+    // Every string is NUL terminated and the request was checked for that
+    char *cursor = request + sizeof(counts);
+    char *cwd = cursor;
+    cursor += strlen(cursor) + 1;
+    for (uint32_t i = 0; i < counts[0] + counts[1]; i++)
+    {
+        if (cursor >= request + length)
+            _exit(EXIT_FAILURE);
+        words[i + (i >= counts[0] ? 1 : 0)] = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    words[counts[0]] = NULL;                 // End of argv
+    words[counts[0] + counts[1] + 1] = NULL; // End of envp
+
+    static struct file_actions actions;
+    struct placement place;
+    int placed = 0;
+    actions.count = 0;
+    for (uint32_t i = 0; i < counts[2]; i++)
+    {
+        if (cursor >= request + length)
+            _exit(EXIT_FAILURE);
+        char kind = *cursor;
+        char *rest;
+        if (kind == 'P')
+        {
+            placement_reset(&place);
+            place.policy = (int)strtol(cursor + 1, &rest, 10);
+            rest++;
+            if (*rest != 'X')
+            {
+                place.has_nice = 1;
+                place.nice = (int)strtol(rest, &rest, 10);
+            }
+            else
+            {
+                rest++;
+            }
+            rest++;
+            if (*rest != 'X')
+            {
+                place.has_cpus = 1;
+                unsigned char *mask = (unsigned char *)&place.cpus;
+                for (size_t byte = 0; byte < sizeof(place.cpus) && rest[0] && rest[1]; byte++, rest += 2)
+                {
+                    char hex[3] = {rest[0], rest[1], '\0'};
+                    mask[byte] = (unsigned char)strtol(hex, NULL, 16);
+                }
+            }
+            // Then the limits: mem bytes, nofile and the cgroup path (which goes last, it could have spaces)
+            rest = strchr(rest, ' ');
+            int path_at = 0;
+            if (rest != NULL && sscanf(rest, " %lld %ld %n", &place.mem_bytes, &place.nofile, &path_at) == 2 &&
+                path_at > 0 && strcmp(rest + path_at, "X") != 0)
+                snprintf(place.cgroup, sizeof(place.cgroup), "%s", rest + path_at);
+            placed = 1;
+            cursor += strlen(cursor) + 1;
+            continue;
+        }
+        if (actions.count == MAX_FILE_ACTIONS)
+            _exit(EXIT_FAILURE);
+        struct file_action *action = &actions.list[actions.count++];
+        action->fd = (int)strtol(cursor + 1, &rest, 10);
+        action->kind = (kind == 'O') ? FILE_ACTION_OPEN : (kind == 'D') ? FILE_ACTION_DUP : FILE_ACTION_CLOSE;
+        if (kind == 'O')
+        {
+            action->flags = (int)strtol(rest, &rest, 10);
+            action->path = rest + 1; // Skip the space before the path
+        }
+        else if (kind == 'D')
+        {
+            action->source_fd = (int)strtol(rest, &rest, 10);
+        }
+        cursor += strlen(cursor) + 1;
+    }
 
-    // Make sure the command has the # symbol
-    if (hash_symbol_location == NULL)
+    if (chdir(cwd) < 0)
     {
-        // No # symbol found!
-        fprintf(stderr, "Error: Can't find # symbol in the command\n");
-        return 0; // Return failure
+        perror("Couldn't change to the shell's directory");
+        _exit(EXIT_FAILURE);
     }
+    exec_in_child(words, words + counts[0] + 1, fds[0], fds[1], fds[2], &actions, placed ? &place : NULL);
+}
 
-    // Step 2: Get the filename after the # symbol
-    // Need to skip past the # and any spaces after it
-    char *after_hash = hash_symbol_location + 1; // +1 moves past the #
+/**
+ * Main loop of the zygote process - never returns
+ * It forks a child for every request and reports children as they exit
+ */
+static void zygote_main(int fd)
+{
+    // SIGCHLD comes in through a signalfd so one poll() covers everything
+    sigset_t child_signal, original_mask;
+    sigemptyset(&child_signal);
+    sigaddset(&child_signal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_signal, &original_mask);
+    int signal_fd = signalfd(-1, &child_signal, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signal_fd < 0)
+        _exit(EXIT_FAILURE);
+
+    // Ctrl-C goes to the whole terminal process group, but it's meant for the command
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    static char request[ZYGOTE_MAX_REQUEST + 1];
+    struct pollfd watch[2] = {{fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
 
-    // Skip any spaces or tabs
-    while (*after_hash == ' ' || *after_hash == '\t')
+    while (1)
     {
-        after_hash = after_hash + 1; // Move forward one character
-    }
+        if (poll(watch, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
 
-    // Now after_hash should point to the filename
-    file_to_count = after_hash;
+        if (watch[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) > 0)
+                ; // Just drain it, waitpid tells us who finished
 
-    // Step 3: Remove any spaces at the end of filename
-    int filename_length = strlen(file_to_count);
+            int status;
+            pid_t done;
+            while ((done = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                struct zygote_reply reply = {'X', done, status};
+                send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+            }
+        }
 
-    // Keep removing spaces/tabs from the end
-    while (filename_length > 0)
-    {
-        // Check if last character is space or tab
-        if (file_to_count[filename_length - 1] == ' ' ||
-            file_to_count[filename_length - 1] == '\t')
+        if (watch[0].revents == 0)
+            continue;
+
+        int fds[3];
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct iovec part = {request, ZYGOTE_MAX_REQUEST};
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        // MSG_CMSG_CLOEXEC so the fds we receive never leak into other children
+        ssize_t got = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            _exit(0); // The shell went away, so we're done too
+
+        int fd_count = 0;
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
         {
-            // Replace with string terminator
-            file_to_count[filename_length - 1] = '\0';
-            // Reduce length by 1
-            filename_length = filename_length - 1;
+            fd_count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (fd_count > 3)
+                fd_count = 3;
+            memcpy(fds, CMSG_DATA(header), fd_count * sizeof(int));
         }
-        else
+
+        struct zygote_reply reply = {'P', -EINVAL, 0};
+        if (fd_count == 3 && (size_t)got > sizeof(uint32_t) * 3 && request[got - 1] == '\0')
         {
-            // No more spaces at the end
-            break;
+            reply.pid = fork();
+            if (reply.pid == 0)
+            {
+                sigprocmask(SIG_SETMASK, &original_mask, NULL);
+                signal(SIGINT, SIG_DFL);
+                signal(SIGQUIT, SIG_DFL);
+                close(fd);
+                close(signal_fd);
+                zygote_child(request, got, fds);
+            }
+            if (reply.pid < 0)
+                reply.pid = -errno;
         }
-    }
 
-    // Step 4: Make sure we actually have a filename
-    if (filename_length == 0)
-    {
-        fprintf(stderr, "Error: You didn't provide a filename after #\n");
-        return 0; // Return failure
+        for (int i = 0; i < fd_count; i++)
+            close(fds[i]);
+        send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
     }
+}
 
-    // Step 5: Check if it's a .txt file
-    // The assignment says we must only count words in .txt files
-    char *dot_position = strrchr(file_to_count, '.');
-
-    // Check if there's a dot and if it's followed by "txt"
-    if (dot_position == NULL)
+/**
+ * Forks the zygote - call this as early as possible so it stays small
+ * Returns 1 if it's running, 0 if we carry on with plain fork()
+ */
+int start_zygote(void)
+{
+    int pair[2];
+    // SEQPACKET keeps every request and reply as its own message
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
     {
-        fprintf(stderr, "Error: Filename has no extension - must be .txt\n");
+        perror("Couldn't create the zygote socket");
         return 0;
     }
 
-    // Compare the extension (should be .txt)
-    if (strcmp(dot_position, ".txt") != 0)
+    pid_t helper = fork();
+    if (helper < 0)
     {
-        fprintf(stderr, "Error: File must have .txt extension, not %s\n", dot_position);
+        perror("Couldn't start the zygote");
+        close(pair[0]);
+        close(pair[1]);
         return 0;
     }
+    if (helper == 0)
+    {
+        close(pair[0]);
+        zygote_main(pair[1]);
+    }
 
-    // Step 6: Try to open the file
-    text_file = fopen(file_to_count, "r"); // r means read mode
+    close(pair[1]);
+    zygote_fd = pair[0];
+    zygote_owner = getpid();
+    zygote_pid = helper;
+    return 1;
+}
 
-    if (text_file == NULL)
+// The zygote died or the socket broke - go back to plain fork()
+static void zygote_give_up(void)
+{
+    if (zygote_fd >= 0)
     {
-        // Couldn't open the file
-        perror("Cannot open file for counting");
+        fprintf(stderr, "Warning: zygote stopped, using plain fork from now on\n");
+        close(zygote_fd);
+        zygote_fd = -1;
+    }
+}
+
+// Reads one reply from the zygote, returns 0 if it's gone
+static int zygote_receive(struct zygote_reply *reply)
+{
+    while (1)
+    {
+        ssize_t got = recv(zygote_fd, reply, sizeof(*reply), 0);
+        if (got == (ssize_t)sizeof(*reply))
+            return 1;
+        if (got < 0 && errno == EINTR)
+            continue;
+        zygote_give_up();
         return 0;
     }
+}
 
-    // Step 7: Count the words!
-    // This algorithm was tricky for me to understand at first
-    // We read character by character and count transitions from non-word to word
+static void zygote_remember_finished(pid_t pid, int status)
+{
+    if (zygote_finished_count == zygote_finished_capacity)
+    {
+        int new_capacity = zygote_finished_capacity ? zygote_finished_capacity * 2 : 16;
+        struct finished_child *bigger = realloc(zygote_finished, sizeof(struct finished_child) * new_capacity);
+        if (bigger == NULL)
+            return; // Can't happen in practice, and we'd only lose one status
+        zygote_finished = bigger;
+        zygote_finished_capacity = new_capacity;
+    }
+    zygote_finished[zygote_finished_count].pid = pid;
+    zygote_finished[zygote_finished_count].status = status;
+    zygote_finished_count++;
+}
 
-    printf("Counting words in %s...\n", file_to_count);
+// Appends one string to a zygote request, returns 0 if it doesn't fit
+static int zygote_pack(char *request, size_t *used, const char *text)
+{
+    size_t length = strlen(text) + 1;
+    if (*used + length > ZYGOTE_MAX_REQUEST)
+        return 0;
+    memcpy(request + *used, text, length);
+    *used += length;
+    return 1;
+}
 
-    // Loop through each character in the file
-    while ((current_character = fgetc(text_file)) != EOF) // EOF means End Of File
+/**
+ * The zygote only has the three fds we send it, so "3>&5" style copies of
+ * any other shell fd have to be done by a child of ours
+ */
+static int file_actions_need_our_fds(const struct file_actions *actions)
+{
+    int opened[MAX_FILE_ACTIONS];
+    for (int i = 0; i < actions->count; i++)
     {
-        // Check if this character is a word separator
-        int is_separator = (current_character == ' ' ||
-                            current_character == '\n' ||
-                            current_character == '\t');
+        const struct file_action *action = &actions->list[i];
+        opened[i] = action->kind == FILE_ACTION_CLOSE ? -1 : action->fd;
+        if (action->kind != FILE_ACTION_DUP || action->source_fd <= STDERR_FILENO)
+            continue;
+        int set_up_earlier = 0;
+        for (int j = 0; j < i; j++)
+            if (opened[j] == action->source_fd)
+                set_up_earlier = 1;
+        if (!set_up_earlier)
+            return 1;
+    }
+    return 0;
+}
 
-        // Case 1: We were in a word, but hit a separator
-        if (is_separator && currently_in_word == 1)
+/**
+ * Asks the zygote to start a program
+ * Returns the pid, -1 if the fork failed (errno set), or -2 if the zygote
+ * can't take this one and the caller should fork itself
+ */
+static pid_t zygote_spawn(char **argv, int in_fd, int out_fd, const struct file_actions *actions,
+                          const struct placement *place)
+{
+    static char request[ZYGOTE_MAX_REQUEST];
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return -2;
+
+    uint32_t counts[3] = {0, 0, 0};
+    size_t used = sizeof(counts);
+    if (!zygote_pack(request, &used, cwd))
+        return -2;
+    for (; argv[counts[0]] != NULL; counts[0]++)
+        if (!zygote_pack(request, &used, argv[counts[0]]))
+            return -2;
+    // Send our environment too, so changes made after startup still reach the program
+    for (; environ[counts[1]] != NULL; counts[1]++)
+        if (!zygote_pack(request, &used, environ[counts[1]]))
+            return -2;
+    for (; actions != NULL && (int)counts[2] < actions->count; counts[2]++)
+    {
+        const struct file_action *action = &actions->list[counts[2]];
+        char packed[PATH_MAX + 32];
+        if (action->kind == FILE_ACTION_OPEN)
+            snprintf(packed, sizeof(packed), "O%d %d %s", action->fd, action->flags, action->path);
+        else if (action->kind == FILE_ACTION_DUP)
+            snprintf(packed, sizeof(packed), "D%d %d", action->fd, action->source_fd);
+        else
+            snprintf(packed, sizeof(packed), "C%d", action->fd);
+        if (!zygote_pack(request, &used, packed))
+            return -2;
+    }
+    if (place != NULL)
+    {
+        char packed[96 + sizeof(cpu_set_t) * 2 + sizeof(place->cgroup)];
+        int at = snprintf(packed, sizeof(packed), "P%d ", place->policy);
+        at += place->has_nice ? snprintf(packed + at, sizeof(packed) - at, "%d ", place->nice)
+                              : snprintf(packed + at, sizeof(packed) - at, "X ");
+        if (place->has_cpus)
         {
-            // We just left a word
-            currently_in_word = 0;
+            const unsigned char *mask = (const unsigned char *)&place->cpus;
+            for (size_t byte = 0; byte < sizeof(place->cpus); byte++)
+                at += snprintf(packed + at, sizeof(packed) - at, "%02x", mask[byte]);
         }
-        // Case 2: We weren't in a word, but hit a non-separator
-        else if (!is_separator && currently_in_word == 0)
+        else
         {
-            // We just started a new word!
-            currently_in_word = 1;
-            // Count this new word
-            total_words = total_words + 1;
+            at += snprintf(packed + at, sizeof(packed) - at, "X");
         }
-        // (Other cases: still in a word or still in separators - do nothing)
+        snprintf(packed + at, sizeof(packed) - at, " %lld %ld %s", place->mem_bytes, place->nofile,
+                 place->cgroup[0] != '\0' ? place->cgroup : "X");
+        if (!zygote_pack(request, &used, packed))
+            return -2;
+        counts[2]++;
+    }
+    memcpy(request, counts, sizeof(counts));
+
+    int fds[3] = {in_fd, out_fd, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec part = {request, used};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+    ssize_t sent;
+    do
+        sent = sendmsg(zygote_fd, &message, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR);
+    if (sent < 0)
+    {
+        if (errno == EMSGSIZE)
+            return -2; // Socket buffer is smaller than we hoped
+        zygote_give_up();
+        return -2;
     }
 
-    // Step 8: Close the file and show the results
-    fclose(text_file);
-
-    // Print the result for the user
-    printf("Number of words in %s: %d\n", file_to_count, total_words);
-
-    // Everything worked!
-    return 1;
+    // Replies come back in order, but exit reports for older children can be mixed in
+    struct zygote_reply reply;
+    while (zygote_receive(&reply))
+    {
+        if (reply.type == 'X')
+        {
+            zygote_remember_finished(reply.pid, reply.status);
+            continue;
+        }
+        if (reply.pid < 0)
+        {
+            errno = -reply.pid;
+            return -1;
+        }
+        return reply.pid;
+    }
+    return -2;
 }
 
 /**
- * This function combines multiple text files and shows their content
- * I needed to learn about file handling for this one!
+ * Starts argv[0] with the given stdin/stdout (stderr is always ours),
+ * then the redirections in actions and the placement (NULL for none) on top of that
+ * use_zygote = 0 forces a plain fork, the spawn-bench command uses that
+ * Returns the child's pid, or -1 with errno set if it couldn't be started
  */
-int handle_concat(char *input)
+static pid_t spawn_process(char **argv, int in_fd, int out_fd, int use_zygote, const struct file_actions *actions,
+                           const struct placement *place)
 {
-    // Need to make a copy of the input string
-    // I tried without copying once and got weird bugs
-    char my_command[MAX_INPUT_SIZE];
-    strcpy(my_command, input);
+    // Builtin threads and forked server workers can't share the zygote socket,
+    // and programs that need a /dev/fd/N from process substitution must come from us
+    if (use_zygote && !zygote_bypass && zygote_fd >= 0 && inherited_fd_count == 0 && getpid() == zygote_owner &&
+        gettid() == zygote_owner && (actions == NULL || !file_actions_need_our_fds(actions)))
+    {
+        pid_t pid = zygote_spawn(argv, in_fd, out_fd, actions, place);
+        if (pid > 0)
+        {
+            timed_job_add(pid, argv[0]);
+            stats_program_started(pid, argv[0]);
+        }
+        if (pid != -2)
+            return pid;
+    }
 
-    // Keep track of files and how many we've found
-    char *file_list[5]; // Assignment says max 5 files
-    int num_files = 0;
-    FILE *current_file; // For opening each file
+    pid_t pid = fork();
+    if (pid == 0)
+        exec_in_child(argv, NULL, in_fd, out_fd, STDERR_FILENO, actions, place);
+    if (pid > 0)
+    {
+        timed_job_add(pid, argv[0]);
+        stats_program_started(pid, argv[0]);
+    }
+    return pid;
+}
 
-    // First, need to split the command by + symbols
-    // strtok is really useful for this!
-    char *file_name = strtok(my_command, "+");
+pid_t spawn_program(char **argv, int in_fd, int out_fd)
+{
+    return spawn_process(argv, in_fd, out_fd, 1, NULL, NULL);
+}
 
-    // Process each file name we find
-    while (file_name != NULL && num_files < 5)
+// Same, plus the redirections split_redirections() found in the command and
+// a placement (NULL for none) from pin=/nice=/sched=
+pid_t spawn_program_placed(char **argv, int in_fd, int out_fd, const struct file_actions *actions,
+                           const struct placement *place)
+{
+    int compressed = 0;
+    for (int i = 0; i < actions->count; i++)
+        compressed += actions->list[i].kind == FILE_ACTION_GZIP;
+    if (compressed == 0)
+        return spawn_process(argv, in_fd, out_fd, 1, actions->count > 0 ? actions : NULL, place);
+
+    // Every >z becomes a pipe into its compressor, the child just dup2s the pipe
+    struct file_actions ready = *actions;
+    struct gzip_output *started[MAX_FILE_ACTIONS];
+    int pipe_fds[MAX_FILE_ACTIONS];
+    int started_count = 0;
+    for (int i = 0; i < ready.count; i++)
     {
-        // Get rid of spaces at the beginning
-        // These spaces caused problems when I tried to open files
-        while (*file_name == ' ' || *file_name == '\t')
+        struct file_action *action = &ready.list[i];
+        if (action->kind != FILE_ACTION_GZIP)
+            continue;
+        int write_fd = start_gzip_output(action->path, action->flags, &started[started_count]);
+        if (write_fd < 0)
         {
-            file_name = file_name + 1; // Move past the space
+            // Let the child try the open itself, so the error shows up like any other
+            action->kind = FILE_ACTION_OPEN;
+            continue;
         }
+        pipe_fds[started_count++] = write_fd;
+        action->kind = FILE_ACTION_DUP;
+        action->source_fd = write_fd;
+    }
 
-        // Remove spaces at the end too
-        int name_length = strlen(file_name);
-        while (name_length > 0 && (file_name[name_length - 1] == ' ' || file_name[name_length - 1] == '\t'))
-        {
-            file_name[name_length - 1] = '\0'; // Replace with string terminator
-            name_length = name_length - 1;
-        }
+    pid_t pid = spawn_process(argv, in_fd, out_fd, 1, &ready, place);
+    for (int i = 0; i < started_count; i++)
+    {
+        close(pipe_fds[i]); // Only the command holds the write end now
+        started[i]->pid = pid;
+    }
+    if (pid < 0)
+        finish_gzip_outputs(pid); // Nobody's writing, the readers see EOF right away
+    return pid;
+}
 
-        // If there's anything left after trimming spaces, save it
-        if (name_length > 0)
+pid_t spawn_program_redirected(char **argv, int in_fd, int out_fd, const struct file_actions *actions)
+{
+    return spawn_program_placed(argv, in_fd, out_fd, actions, NULL);
+}
+
+/**
+ * Waits for a program started by spawn_program() and fills in its wait status
+ * Returns 1 when it finished, 0 if we couldn't wait for it
+ */
+int wait_program(pid_t pid, int *status)
+{
+    // With a timeout running, wait on a pidfd first so we can step in
+    timed_job_wait(pid);
+
+    while (1)
+    {
+        pid_t done = waitpid(pid, status, 0);
+        if (done == pid)
         {
-            // Add this file to our list
-            file_list[num_files] = file_name;
-            num_files = num_files + 1;
+            // A >z file is only complete once its compressor has drained the pipe
+            finish_gzip_outputs(pid);
+            stats_program_finished(pid);
+            return 1;
+        }
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0 && errno == ECHILD)
+            break; // Not our child, so the zygote started it
+        return 0;
+    }
 
-            // Debug message - helpful when I was testing
-            // printf("Found file: %s\n", file_name);
+    while (1)
+    {
+        for (int i = 0; i < zygote_finished_count; i++)
+        {
+            if (zygote_finished[i].pid == pid)
+            {
+                *status = zygote_finished[i].status;
+                zygote_finished[i] = zygote_finished[--zygote_finished_count];
+                stats_program_finished(pid);
+                return 1;
+            }
         }
 
-        // Get the next file name
-        file_name = strtok(NULL, "+");
+        struct zygote_reply reply;
+        if (zygote_fd < 0 || getpid() != zygote_owner || !zygote_receive(&reply))
+            return 0;
+        if (reply.type == 'X')
+            zygote_remember_finished(reply.pid, reply.status);
     }
+}
 
-    // Make sure we have at least one file
-    if (num_files == 0)
+static int compare_latencies(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Times count spawn + wait rounds of argv and prints p50/p99, returns 0 if all ran
+static int time_spawns(const char *label, char **argv, int count, int use_zygote, int null_fd)
+{
+    double *latencies = malloc(sizeof(double) * count);
+    if (latencies == NULL)
+        return 0;
+
+    int done = 0;
+    for (; done < count; done++)
     {
-        fprintf(stderr, "Error: You need to specify at least one file to concatenate!\n");
-        return 0; // Failed
+        struct timespec started, finished;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int status;
+        pid_t pid = spawn_process(argv, null_fd, null_fd, use_zygote, NULL, NULL);
+        if (pid < 0 || !wait_program(pid, &status))
+            break;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        latencies[done] = (finished.tv_sec - started.tv_sec) * 1e6 + (finished.tv_nsec - started.tv_nsec) / 1e3;
     }
 
-    // Make sure we don't have too many files
-    if (file_name != NULL) // If there are still more tokens
+    if (done > 0)
     {
-        fprintf(stderr, "Error: Too many files! I can only handle up to 5 files.\n");
-        return 0; // Failed
+        qsort(latencies, done, sizeof(double), compare_latencies);
+        printf("%-14s %6d runs  p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", label, done,
+               latencies[done / 2], latencies[(int)(done * 0.99)], latencies[done - 1]);
     }
+    free(latencies);
+    return done == count;
+}
 
-    // Now we can process each file one by one
-    for (int file_index = 0; file_index < num_files; file_index++)
+/**
+ * spawn-bench N [--heap MB] command [args]
+ * Starts the command N times and prints the latency of plain fork + exec and,
+ * when the shell was started with --zygote, of spawning through the zygote.
+ * --heap touches MB of memory first so the shell looks like one that has grown.
+ */
+int run_spawn_bench(char **args)
+{
+    int word = 1;
+    int count = args[word] ? atoi(args[word++]) : 0;
+    long heap_mb = 0;
+    if (args[word] != NULL && strcmp(args[word], "--heap") == 0 && args[word + 1] != NULL)
     {
-        // First check if it's a .txt file
-        // The assignment says we must only use .txt files
-        char *extension = strrchr(file_list[file_index], '.');
+        heap_mb = atol(args[word + 1]);
+        word += 2;
+    }
+    if (count <= 0 || args[word] == NULL)
+    {
+        fprintf(stderr, "Usage: spawn-bench N [--heap MB] command [args]\n");
+        return 2;
+    }
 
-        if (extension == NULL || strcmp(extension, ".txt") != 0)
+    char *ballast = NULL;
+    if (heap_mb > 0)
+    {
+        ballast = malloc(heap_mb * 1024 * 1024);
+        if (ballast == NULL)
         {
-            fprintf(stderr, "Error: File %s isn't a .txt file! All files must end with .txt\n",
-                    file_list[file_index]);
-            return 0; // Failed
+            fprintf(stderr, "spawn-bench: couldn't allocate %ld MB\n", heap_mb);
+            return 1;
         }
+        memset(ballast, 1, heap_mb * 1024 * 1024); // Touch it so the pages really exist
+    }
 
-        // Try to open the file
-        current_file = fopen(file_list[file_index], "r");
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (null_fd < 0)
+    {
+        perror("spawn-bench: /dev/null");
+        free(ballast);
+        return 1;
+    }
 
-        if (current_file == NULL)
+    fflush(stdout);
+    int all_ran = time_spawns("fork+exec", args + word, count, 0, null_fd);
+    if (zygote_fd >= 0)
+        all_ran = time_spawns("zygote", args + word, count, 1, null_fd) && all_ran;
+    else
+        printf("(start the shell with --zygote to compare against the zygote)\n");
+
+    close(null_fd);
+    free(ballast);
+    return all_ran ? 0 : 1;
+}
+
+/**
+ * Glob expansion (*, ?, [...] and **) for command arguments and file lists
+ *
+ * Directory listings are read with getdents64 and cached for the rest of the
+ * command line, so "a*.txt + b*.txt" only reads the directory once. Patterns
+ * with ** walk the whole tree using several threads at once.
+ */
+#define GLOB_READ_BUFFER (64 * 1024) // getdents64 buffer, fits thousands of names per syscall
+#define GLOB_CACHE_SLOTS 1024        // Starting size of the listing cache (power of 2)
+#define GLOB_MAX_WALKERS 8           // Most threads we use for a ** walk
+
+// This is the layout the kernel uses for getdents64 records
+struct kernel_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct listing_entry
+{
+    const char *name;    // Points into the listing's names block
+    unsigned char type;  // DT_DIR, DT_REG, DT_LNK... (never DT_UNKNOWN)
+};
+
+struct dir_listing
+{
+    char *path; // Directory this listing belongs to ("." for the current one)
+    struct listing_entry *entries;
+    int entry_count;
+    char *names; // All names packed one after the other
+    int failed;  // 1 if the directory couldn't be read (we cache that too)
+};
+
+// The cache of listings. One lock is fine - each slot is only filled once per line
+static struct dir_listing **glob_cache_slots = NULL;
+static size_t glob_cache_capacity = 0;
+static size_t glob_cache_used = 0;
+static pthread_mutex_t glob_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Forgets every cached directory listing
+ * Called before each new command line, and before each command of a ; && or || line,
+ * so we never use stale listings
+ */
+void glob_cache_reset(void)
+{
+    pthread_mutex_lock(&glob_cache_lock);
+    for (size_t i = 0; i < glob_cache_capacity; i++)
+    {
+        struct dir_listing *listing = glob_cache_slots[i];
+        if (listing == NULL)
+            continue;
+        free(listing->path);
+        free(listing->entries);
+        free(listing->names);
+        free(listing);
+        glob_cache_slots[i] = NULL;
+    }
+    glob_cache_used = 0;
+    pthread_mutex_unlock(&glob_cache_lock);
+}
+
+// Reads one directory with raw getdents64 calls (no readdir/opendir overhead)
+static struct dir_listing *read_directory_listing(const char *path)
+{
+    struct dir_listing *listing = calloc(1, sizeof(struct dir_listing));
+    if (listing == NULL)
+        return NULL;
+    listing->path = strdup(path);
+
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+    {
+        listing->failed = 1;
+        return listing;
+    }
+
+    char *buffer = malloc(GLOB_READ_BUFFER);
+    size_t names_used = 0, names_space = 4096;
+    int entry_space = 64;
+    listing->names = malloc(names_space);
+    listing->entries = malloc(entry_space * sizeof(struct listing_entry));
+    // Names get copied into a block that may move when it grows, so I store
+    // offsets first and turn them into pointers at the end
+    size_t *name_offsets = malloc(entry_space * sizeof(size_t));
+
+    long got;
+    while (buffer && listing->names && listing->entries && name_offsets &&
+           (got = syscall(SYS_getdents64, dir_fd, buffer, GLOB_READ_BUFFER)) > 0)
+    {
+        for (long pos = 0; pos < got;)
         {
-            // Couldn't open the file
-            fprintf(stderr, "Error: Can't open %s! Does it exist?\n", file_list[file_index]);
-            return 0; // Failed
+            struct kernel_dirent64 *record = (struct kernel_dirent64 *)(buffer + pos);
+            pos += record->d_reclen;
+
+            const char *name = record->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            unsigned char type = record->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                // Some filesystems don't fill in d_type, so ask stat instead
+                struct stat info;
+                type = DT_REG;
+                if (fstatat(dir_fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0)
+                {
+                    if (S_ISDIR(info.st_mode))
+                        type = DT_DIR;
+                    else if (S_ISLNK(info.st_mode))
+                        type = DT_LNK;
+                }
+            }
+
+            size_t name_length = strlen(name) + 1;
+            if (names_used + name_length > names_space)
+            {
+                while (names_used + name_length > names_space)
+                    names_space *= 2;
+                char *grown = realloc(listing->names, names_space);
+                if (grown == NULL)
+                    break;
+                listing->names = grown;
+            }
+            if (listing->entry_count == entry_space)
+            {
+                entry_space *= 2;
+                struct listing_entry *grown = realloc(listing->entries, entry_space * sizeof(struct listing_entry));
+                size_t *grown_offsets = realloc(name_offsets, entry_space * sizeof(size_t));
+                if (grown != NULL)
+                    listing->entries = grown;
+                if (grown_offsets != NULL)
+                    name_offsets = grown_offsets;
+                if (grown == NULL || grown_offsets == NULL)
+                    break;
+            }
+
+            memcpy(listing->names + names_used, name, name_length);
+            name_offsets[listing->entry_count] = names_used;
+            listing->entries[listing->entry_count].type = type;
+            listing->entry_count++;
+            names_used += name_length;
         }
+    }
 
-        // printf("\n----- Contents of %s -----\n", file_list[file_index]);
+    for (int i = 0; name_offsets != NULL && i < listing->entry_count; i++)
+        listing->entries[i].name = listing->names + name_offsets[i];
 
-        // Read this file in chunks and print each chunk
-        // Using a buffer is much faster than reading one byte at a time!
-        char data_chunk[1024]; // 1KB chunks seemed reasonable
-        int bytes_got;
+    free(name_offsets);
+    free(buffer);
+    close(dir_fd);
+    return listing;
+}
 
-        // Keep reading chunks until we reach the end of the file
-        while ((bytes_got = fread(data_chunk, 1, sizeof(data_chunk), current_file)) > 0)
+static uint64_t hash_path(const char *path)
+{
+    uint64_t hash = 1469598103934665603ULL; // FNV-1a again
+    while (*path)
+    {
+        hash ^= (unsigned char)*path++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Returns the listing for a directory, reading it only the first time
+ * Safe to call from several walker threads at once
+ */
+static struct dir_listing *get_directory_listing(const char *path)
+{
+    pthread_mutex_lock(&glob_cache_lock);
+    if (glob_cache_slots == NULL)
+    {
+        glob_cache_capacity = GLOB_CACHE_SLOTS;
+        glob_cache_slots = calloc(glob_cache_capacity, sizeof(struct dir_listing *));
+    }
+
+    size_t spot = hash_path(path) & (glob_cache_capacity - 1);
+    while (glob_cache_slots[spot] != NULL)
+    {
+        if (strcmp(glob_cache_slots[spot]->path, path) == 0)
         {
-            // Write this chunk to standard output
-            fwrite(data_chunk, 1, bytes_got, stdout);
+            struct dir_listing *found = glob_cache_slots[spot];
+            pthread_mutex_unlock(&glob_cache_lock);
+            return found;
         }
+        spot = (spot + 1) & (glob_cache_capacity - 1);
+    }
+    pthread_mutex_unlock(&glob_cache_lock);
 
-        // Done with this file, close it
-        fclose(current_file);
+    // Read the directory without holding the lock so other threads keep going
+    struct dir_listing *listing = read_directory_listing(path);
+    if (listing == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&glob_cache_lock);
+
+    // Grow the table when it's 70% full
+    if ((glob_cache_used + 1) * 10 > glob_cache_capacity * 7)
+    {
+        size_t new_capacity = glob_cache_capacity * 2;
+        struct dir_listing **new_slots = calloc(new_capacity, sizeof(struct dir_listing *));
+        if (new_slots != NULL)
+        {
+            for (size_t i = 0; i < glob_cache_capacity; i++)
+            {
+                if (glob_cache_slots[i] == NULL)
+                    continue;
+                size_t new_spot = hash_path(glob_cache_slots[i]->path) & (new_capacity - 1);
+                while (new_slots[new_spot] != NULL)
+                    new_spot = (new_spot + 1) & (new_capacity - 1);
+                new_slots[new_spot] = glob_cache_slots[i];
+            }
+            free(glob_cache_slots);
+            glob_cache_slots = new_slots;
+            glob_cache_capacity = new_capacity;
+        }
     }
 
-    // Let user know we're done
-    // printf("\n----- End of concatenation -----\n");
-    return 1; // Success!
+    // Another thread may have cached the same directory meanwhile - keep theirs
+    spot = hash_path(path) & (glob_cache_capacity - 1);
+    while (glob_cache_slots[spot] != NULL)
+    {
+        if (strcmp(glob_cache_slots[spot]->path, path) == 0)
+        {
+            struct dir_listing *found = glob_cache_slots[spot];
+            pthread_mutex_unlock(&glob_cache_lock);
+            free(listing->path);
+            free(listing->entries);
+            free(listing->names);
+            free(listing);
+            return found;
+        }
+        spot = (spot + 1) & (glob_cache_capacity - 1);
+    }
+    glob_cache_slots[spot] = listing;
+    glob_cache_used++;
+    pthread_mutex_unlock(&glob_cache_lock);
+    return listing;
+}
+
+// Returns 1 if the word has any glob special characters in it
+int has_glob_chars(const char *word)
+{
+    for (const char *p = word; *p; p++)
+    {
+        if (*p == '*' || *p == '?')
+            return 1;
+        if (*p == '[' && strchr(p + 1, ']') != NULL)
+            return 1;
+    }
+    return 0;
 }
 
 /**
- * This function handles the input/output redirection (<, >, >>)
- * I spent a long time figuring out how these special characters work!
+ * Matches one path component (no slashes) against a pattern
+ * Supports * (anything), ? (one char) and [abc] / [a-z] / [!abc] classes
  */
-int handle_redirection(char *input)
+static int glob_match_component(const char *pattern, const char *name)
 {
-    // First make a working copy of the input command
-    // I had trouble when I didn't copy the string
-    char command_string[MAX_INPUT_SIZE];
-    strcpy(command_string, input);
+    const char *star_pattern = NULL; // Where to go back to after a failed * attempt
+    const char *star_name = NULL;
+
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            // Remember this spot and first try matching zero characters
+            star_pattern = ++pattern;
+            star_name = name;
+            continue;
+        }
+
+        int matched = 0;
+        const char *next_pattern = pattern + 1;
+
+        if (*pattern == '?')
+        {
+            matched = 1;
+        }
+        else if (*pattern == '[' && strchr(pattern + 1, ']') != NULL)
+        {
+            const char *p = pattern + 1;
+            int negate = (*p == '!' || *p == '^');
+            if (negate)
+                p++;
+
+            int in_class = 0;
+            // A ] right at the start is a normal character in the class
+            do
+            {
+                if (p[1] == '-' && p[2] != ']' && p[2] != '\0')
+                {
+                    if ((unsigned char)*name >= (unsigned char)p[0] && (unsigned char)*name <= (unsigned char)p[2])
+                        in_class = 1;
+                    p += 3;
+                }
+                else
+                {
+                    if (*p == *name)
+                        in_class = 1;
+                    p++;
+                }
+            } while (*p != ']' && *p != '\0');
+
+            matched = (in_class != negate);
+            next_pattern = (*p == ']') ? p + 1 : p;
+        }
+        else
+        {
+            if (*pattern == '\\' && pattern[1] != '\0')
+            {
+                pattern++; // Backslash makes the next character literal
+                next_pattern = pattern + 1;
+            }
+            matched = (*pattern != '\0' && *pattern == *name);
+        }
+
+        if (matched)
+        {
+            pattern = next_pattern;
+            name++;
+        }
+        else if (star_pattern != NULL)
+        {
+            // Let the last * swallow one more character and retry
+            pattern = star_pattern;
+            name = ++star_name;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+// A growable list of matched paths
+struct glob_results
+{
+    char **paths;
+    int count;
+    int space;
+};
+
+static void glob_results_add(struct glob_results *results, const char *prefix, const char *name)
+{
+    if (results->count == results->space)
+    {
+        int new_space = results->space ? results->space * 2 : 16;
+        char **grown = realloc(results->paths, new_space * sizeof(char *));
+        if (grown == NULL)
+            return;
+        results->paths = grown;
+        results->space = new_space;
+    }
 
-    // Need to keep track of which redirections we found
-    // These are like on/off switches (0 = off, 1 = on)
-    int found_input_redir = 0;   // For < character
-    int found_output_redir = 0;  // For > character
-    int found_append_output = 0; // For >> characters
+    size_t prefix_length = strlen(prefix);
+    char *path = malloc(prefix_length + strlen(name) + 1);
+    if (path == NULL)
+        return;
+    memcpy(path, prefix, prefix_length);
+    strcpy(path + prefix_length, name);
+    results->paths[results->count++] = path;
+}
 
-    // Need to remember where each redirection operator is
-    char *where_is_input = NULL;  // Position of <
-    char *where_is_output = NULL; // Position of >
-    char *where_is_append = NULL; // Position of >>
+void free_glob_results(struct glob_results *results)
+{
+    for (int i = 0; i < results->count; i++)
+        free(results->paths[i]);
+    free(results->paths);
+    results->paths = NULL;
+    results->count = results->space = 0;
+}
 
-    // Variables to store the filenames for redirection
-    char *input_filename = NULL;  // File to read from (with <)
-    char *output_filename = NULL; // File to write to (with > or >>)
+// Prefixes look like "" or "logs/" - this gives the directory to actually open
+static const char *prefix_to_directory(const char *prefix, char *buffer, size_t size)
+{
+    if (prefix[0] == '\0')
+        return ".";
+    snprintf(buffer, size, "%s", prefix);
+    size_t length = strlen(buffer);
+    if (length > 1 && buffer[length - 1] == '/')
+        buffer[length - 1] = '\0';
+    return buffer;
+}
 
-    // The actual command part (before any redirection)
-    char *actual_command = command_string;
+// Shared state for the threads walking a tree for **
+struct tree_walk
+{
+    char **queue;   // Directories (as prefixes) nobody has read yet
+    int queued;
+    int queue_space;
+    int busy;       // Threads currently reading a directory
+    struct glob_results found; // Every directory we reached, including the start
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+};
+
+static void *tree_walk_worker(void *arg)
+{
+    struct tree_walk *walk = arg;
+    char directory[PATH_MAX];
 
-    // Need to check for >> first because it contains >
-    // This caused me bugs when I did it in the wrong order!
-    where_is_append = strstr(command_string, ">>");
-    if (where_is_append != NULL)
+    pthread_mutex_lock(&walk->lock);
+    while (1)
     {
-        // Found the >> operator
-        found_append_output = 1;
+        // Sleep until there's work, or until nobody can produce more work
+        while (walk->queued == 0 && walk->busy > 0)
+            pthread_cond_wait(&walk->work_ready, &walk->lock);
+        if (walk->queued == 0)
+            break;
+
+        char *prefix = walk->queue[--walk->queued];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        struct dir_listing *listing = get_directory_listing(prefix_to_directory(prefix, directory, sizeof(directory)));
+
+        pthread_mutex_lock(&walk->lock);
+        for (int i = 0; listing != NULL && i < listing->entry_count; i++)
+        {
+            // Skip hidden folders and don't follow symlinks (avoids loops)
+            if (listing->entries[i].type != DT_DIR || listing->entries[i].name[0] == '.')
+                continue;
+
+            if (walk->queued == walk->queue_space)
+            {
+                int new_space = walk->queue_space * 2;
+                char **grown = realloc(walk->queue, new_space * sizeof(char *));
+                if (grown == NULL)
+                    continue;
+                walk->queue = grown;
+                walk->queue_space = new_space;
+            }
+
+            size_t length = strlen(prefix) + strlen(listing->entries[i].name) + 2;
+            char *child = malloc(length);
+            if (child == NULL)
+                continue;
+            snprintf(child, length, "%s%s/", prefix, listing->entries[i].name);
+            walk->queue[walk->queued++] = child;
+        }
 
-        // Split the string at this point
-        *where_is_append = '\0';
+        // Record the directory itself (the list owns the string from now on)
+        glob_results_add(&walk->found, prefix, "");
+        free(prefix);
+        walk->busy--;
+        pthread_cond_broadcast(&walk->work_ready);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
 
-        // The output filename comes after >>
-        output_filename = where_is_append + 2;
+/**
+ * Finds every directory under start_prefix (including itself) for **
+ * Several threads pull directories from a shared queue and push the
+ * subdirectories they find, until the queue is empty and everyone is idle
+ */
+static void walk_directory_tree(const char *start_prefix, struct glob_results *directories)
+{
+    struct tree_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.queue_space = 256;
+    walk.queue = malloc(walk.queue_space * sizeof(char *));
+    if (walk.queue == NULL)
+        return;
+    walk.queue[walk.queued++] = strdup(start_prefix);
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.work_ready, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = (int)(cpus < 1 ? 1 : (cpus > GLOB_MAX_WALKERS ? GLOB_MAX_WALKERS : cpus));
+
+    pthread_t threads[GLOB_MAX_WALKERS];
+    int started = 0;
+    for (int t = 1; t < thread_count; t++)
+    {
+        if (pthread_create(&threads[started], NULL, tree_walk_worker, &walk) == 0)
+            started++;
     }
-    else
+    tree_walk_worker(&walk); // This thread helps too
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.work_ready);
+    free(walk.queue);
+    *directories = walk.found;
+}
+
+// Recursive part of the expansion: match components[index...] inside prefix
+static void glob_expand_from(const char *prefix, char **components, int count, int index,
+                             struct glob_results *results)
+{
+    const char *component = components[index];
+    int is_last = (index == count - 1);
+    char directory[PATH_MAX];
+
+    if (strcmp(component, "**") == 0)
     {
-        // No >> found, so check for > by itself
-        where_is_output = strchr(command_string, '>');
-        if (where_is_output != NULL)
+        // ** means "this directory and every directory below it"
+        struct glob_results directories = {0};
+        walk_directory_tree(prefix, &directories);
+
+        for (int i = 0; i < directories.count; i++)
         {
-            // Found the > operator
-            found_output_redir = 1;
+            if (!is_last)
+            {
+                glob_expand_from(directories.paths[i], components, count, index + 1, results);
+                continue;
+            }
 
-            // Split the string at this point
-            *where_is_output = '\0';
+            // A trailing ** matches everything (not hidden) under the tree
+            struct dir_listing *listing = get_directory_listing(
+                prefix_to_directory(directories.paths[i], directory, sizeof(directory)));
+            for (int e = 0; listing != NULL && e < listing->entry_count; e++)
+            {
+                if (listing->entries[e].name[0] != '.')
+                    glob_results_add(results, directories.paths[i], listing->entries[e].name);
+            }
+        }
+        free_glob_results(&directories);
+        return;
+    }
 
-            // The output filename comes after >
-            output_filename = where_is_output + 1;
+    if (!has_glob_chars(component))
+    {
+        // Plain name - no need to list anything, just check it's there at the end
+        size_t length = strlen(prefix) + strlen(component) + 2;
+        char *path = malloc(length);
+        if (path == NULL)
+            return;
+        snprintf(path, length, "%s%s", prefix, component);
+
+        if (is_last)
+        {
+            struct stat info;
+            if (lstat(path, &info) == 0)
+                glob_results_add(results, path, "");
+        }
+        else
+        {
+            strcat(path, "/");
+            glob_expand_from(path, components, count, index + 1, results);
         }
+        free(path);
+        return;
     }
 
-    // Now check for the < input redirection
-    where_is_input = strchr(command_string, '<');
-    if (where_is_input != NULL)
+    struct dir_listing *listing = get_directory_listing(prefix_to_directory(prefix, directory, sizeof(directory)));
+    if (listing == NULL || listing->failed)
+        return;
+
+    for (int i = 0; i < listing->entry_count; i++)
+    {
+        const char *name = listing->entries[i].name;
+
+        // Like other shells, * doesn't match hidden files unless you type the dot
+        if (name[0] == '.' && component[0] != '.')
+            continue;
+        if (!glob_match_component(component, name))
+            continue;
+
+        if (is_last)
+        {
+            glob_results_add(results, prefix, name);
+        }
+        else if (listing->entries[i].type == DT_DIR || listing->entries[i].type == DT_LNK)
+        {
+            size_t length = strlen(prefix) + strlen(name) + 2;
+            char *child = malloc(length);
+            if (child == NULL)
+                continue;
+            snprintf(child, length, "%s%s/", prefix, name);
+            glob_expand_from(child, components, count, index + 1, results);
+            free(child);
+        }
+    }
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Expands one glob pattern into the sorted list of paths it matches
+ * Returns the number of matches (0 means nothing matched)
+ */
+int expand_glob(const char *pattern, struct glob_results *results)
+{
+    memset(results, 0, sizeof(*results));
+
+    char *copy = strdup(pattern);
+    if (copy == NULL)
+        return 0;
+
+    // Break the pattern into path components
+    char *components[PATH_MAX / 2];
+    int count = 0;
+    char *save_position;
+    for (char *part = strtok_r(copy, "/", &save_position); part != NULL && count < PATH_MAX / 2;
+         part = strtok_r(NULL, "/", &save_position))
+    {
+        components[count++] = part;
+    }
+
+    if (count > 0)
+        glob_expand_from(pattern[0] == '/' ? "/" : "", components, count, 0, results);
+    free(copy);
+
+    // Sorted like other shells do, and with duplicates (from a/**/**/b) removed
+    qsort(results->paths, results->count, sizeof(char *), compare_paths);
+    int kept = 0;
+    for (int i = 0; i < results->count; i++)
+    {
+        if (kept > 0 && strcmp(results->paths[kept - 1], results->paths[i]) == 0)
+            free(results->paths[i]);
+        else
+            results->paths[kept++] = results->paths[i];
+    }
+    results->count = kept;
+    return kept;
+}
+
+/**
+ * Builds the final file list for the file operators (+, +m, #, ~)
+ * Plain names are kept as they are, patterns are replaced by their matches.
+ * Returns 0 (after printing an error) if a pattern matches nothing.
+ */
+int expand_file_list(char **names, int count, struct glob_results *files)
+{
+    memset(files, 0, sizeof(*files));
+    for (int i = 0; i < count; i++)
+    {
+        if (!has_glob_chars(names[i]))
+        {
+            glob_results_add(files, "", names[i]);
+            continue;
+        }
+
+        struct glob_results matches;
+        if (expand_glob(names[i], &matches) == 0)
+        {
+            fprintf(stderr, "Error: No files match %s\n", names[i]);
+            free_glob_results(files);
+            return 0;
+        }
+        for (int m = 0; m < matches.count; m++)
+            glob_results_add(files, "", matches.paths[m]);
+        free_glob_results(&matches);
+    }
+    return 1;
+}
+
+/**
+ * Expands globs in a NULL-terminated argument list
+ * Returns a new NULL-terminated list that must be freed with free_expanded_args().
+ * Words without glob characters (or with no matches) are kept as typed,
+ * and the expanded list can be longer than MAX_ARGS.
+ */
+char **expand_command_args(char **args)
+{
+    int space = 8, count = 0;
+    char **expanded = malloc(space * sizeof(char *));
+    if (expanded == NULL)
+        return NULL;
+
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        struct glob_results matches = {0};
+        int match_count = 0;
+
+        // The command name itself is never expanded
+        if (i > 0 && has_glob_chars(args[i]))
+            match_count = expand_glob(args[i], &matches);
+
+        int needed = match_count > 0 ? match_count : 1;
+        if (count + needed + 1 > space)
+        {
+            while (count + needed + 1 > space)
+                space *= 2;
+            char **grown = realloc(expanded, space * sizeof(char *));
+            if (grown == NULL)
+            {
+                free_glob_results(&matches);
+                break;
+            }
+            expanded = grown;
+        }
+
+        if (match_count > 0)
+        {
+            // Take ownership of the matched strings
+            for (int m = 0; m < match_count; m++)
+                expanded[count++] = matches.paths[m];
+            free(matches.paths);
+        }
+        else
+        {
+            expanded[count++] = strdup(args[i]);
+        }
+    }
+
+    expanded[count] = NULL;
+    return expanded;
+}
+
+void free_expanded_args(char **expanded)
+{
+    if (expanded == NULL)
+        return;
+    for (int i = 0; expanded[i] != NULL; i++)
+        free(expanded[i]);
+    free(expanded);
+}
+
+/**
+ * A growable output buffer for the in-process builtins
+ * Builtins write their output here and flush it to a file descriptor in big pieces
+ */
+struct text_buffer
+{
+    char *data;
+    size_t length;
+    size_t space;
+};
+
+// Makes sure there's room for extra more bytes (so we can read() straight into it)
+static int text_buffer_reserve(struct text_buffer *buffer, size_t extra)
+{
+    if (buffer->length + extra > buffer->space)
+    {
+        size_t new_space = buffer->space ? buffer->space : 64 * 1024;
+        while (new_space < buffer->length + extra)
+            new_space *= 2;
+        char *grown = realloc(buffer->data, new_space);
+        if (grown == NULL)
+            return 0;
+        buffer->data = grown;
+        buffer->space = new_space;
+    }
+    return 1;
+}
+
+static int text_buffer_add(struct text_buffer *buffer, const char *text, size_t length)
+{
+    if (!text_buffer_reserve(buffer, length))
+        return 0;
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+    return 1;
+}
+
+/**
+ * Finds needle inside haystack, like memmem but faster for long lines
+ * With SSE2 I check 16 positions at once: a position is only a candidate if
+ * both the first AND the last byte of the needle match there. Real text almost
+ * never passes that filter so memcmp hardly ever runs
+ */
+static const char *find_substring(const char *haystack, size_t haystack_length,
+                                  const char *needle, size_t needle_length)
+{
+    if (needle_length == 0)
+        return haystack;
+    if (needle_length > haystack_length)
+        return NULL;
+    if (needle_length == 1)
+        return memchr(haystack, needle[0], haystack_length);
+
+    size_t last_start = haystack_length - needle_length; // Last position a match can begin at
+    size_t pos = 0;
+
+#ifdef __SSE2__
+    const __m128i first_byte = _mm_set1_epi8(needle[0]);
+    const __m128i last_byte = _mm_set1_epi8(needle[needle_length - 1]);
+
+    while (pos + 16 <= last_start + 1)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + pos));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + pos + needle_length - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first_byte),
+                                                                  _mm_cmpeq_epi8(block_last, last_byte)));
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            // First and last byte match, now check the middle
+            if (memcmp(haystack + pos + bit + 1, needle + 1, needle_length - 2) == 0)
+                return haystack + pos + bit;
+            mask &= mask - 1; // Clear the lowest set bit
+        }
+        pos += 16;
+    }
+#endif
+
+    // Leftover tail (or the whole thing without SSE2) - let memchr find the first byte
+    while (pos <= last_start)
+    {
+        const char *candidate = memchr(haystack + pos, needle[0], last_start - pos + 1);
+        if (candidate == NULL)
+            return NULL;
+        if (memcmp(candidate + 1, needle + 1, needle_length - 1) == 0)
+            return candidate;
+        pos = (candidate - haystack) + 1;
+    }
+    return NULL;
+}
+
+/**
+ * Adds every line of data that contains the pattern to output
+ * Instead of going line by line I search the whole block and only look for
+ * the line boundaries around each match
+ */
+static int find_text_scan(const char *data, size_t length, const char *pattern,
+                          size_t pattern_length, const char *prefix, struct text_buffer *output)
+{
+    size_t pos = 0;
+    int matches = 0;
+
+    while (pos < length)
+    {
+        const char *hit = find_substring(data + pos, length - pos, pattern, pattern_length);
+        if (hit == NULL)
+            break;
+
+        // Walk back to the start of this line and forward to its end
+        const char *line_start = hit;
+        while (line_start > data + pos && line_start[-1] != '\n')
+            line_start--;
+        const char *line_end = memchr(hit, '\n', (data + length) - hit);
+        size_t line_length = line_end ? (size_t)(line_end - line_start) : (size_t)((data + length) - line_start);
+
+        if (prefix != NULL)
+        {
+            text_buffer_add(output, prefix, strlen(prefix));
+            text_buffer_add(output, ":", 1);
+        }
+        text_buffer_add(output, line_start, line_length);
+        text_buffer_add(output, "\n", 1);
+        matches++;
+
+        if (line_end == NULL)
+            break;
+        pos = (line_end - data) + 1; // Continue after this line
+    }
+    return matches;
+}
+
+// Work shared between the find-text threads when several files are given
+struct find_text_job
+{
+    char **file_names;
+    int file_count;
+    const char *pattern;
+    size_t pattern_length;
+    struct text_buffer *outputs; // One buffer per file so output stays in order
+    int *match_counts;
+    int next_file;               // Next file nobody has claimed yet
+    pthread_mutex_t lock;
+};
+
+// Searches one file. Regular files are mmap'd so we never copy them
+static int find_text_in_file(const char *file_name, const char *pattern, size_t pattern_length,
+                             const char *prefix, struct text_buffer *output)
+{
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "find-text: can't open %s: %s\n", file_name, strerror(errno));
+        return -1;
+    }
+
+    struct stat info;
+    int matches = 0;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+    {
+        if (info.st_size > 0)
+        {
+            char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                fprintf(stderr, "find-text: can't map %s: %s\n", file_name, strerror(errno));
+                close(fd);
+                return -1;
+            }
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            matches = find_text_scan(data, info.st_size, pattern, pattern_length, prefix, output);
+            munmap(data, info.st_size);
+        }
+    }
+    else
+    {
+        // Pipes and devices can't be mapped, so read them whole
+        struct text_buffer contents = {0};
+        char chunk[64 * 1024];
+        ssize_t got;
+        while ((got = read(fd, chunk, sizeof(chunk))) > 0)
+            text_buffer_add(&contents, chunk, got);
+        matches = find_text_scan(contents.data, contents.length, pattern, pattern_length, prefix, output);
+        free(contents.data);
+    }
+
+    close(fd);
+    return matches;
+}
+
+static void *find_text_worker(void *arg)
+{
+    struct find_text_job *job = arg;
+    while (1)
+    {
+        pthread_mutex_lock(&job->lock);
+        int index = job->next_file++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (index >= job->file_count)
+            return NULL;
+        job->match_counts[index] = find_text_in_file(job->file_names[index], job->pattern,
+                                                     job->pattern_length, job->file_names[index],
+                                                     &job->outputs[index]);
+    }
+}
+
+/**
+ * Builtin: find-text PATTERN [file ...]
+ * Prints every line containing PATTERN (a plain string, not a regex).
+ * With no files it reads from in_fd, so it can sit in the middle of a pipeline.
+ * With several files each one is searched on its own thread.
+ */
+int builtin_find_text(int argc, char **argv, int in_fd, int out_fd)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: find-text PATTERN [file ...]\n");
+        return 2;
+    }
+
+    const char *pattern = argv[1];
+    size_t pattern_length = strlen(pattern);
+    int file_count = argc - 2;
+    int total_matches = 0;
+    int had_error = 0;
+
+    if (file_count == 0)
+    {
+        // Streaming mode: read big chunks, only search up to the last full line
+        // and carry the unfinished line over to the next chunk
+        struct text_buffer pending = {0};
+        struct text_buffer output = {0};
+        char chunk[256 * 1024];
+        ssize_t got;
+
+        while ((got = read(in_fd, chunk, sizeof(chunk))) > 0)
+        {
+            text_buffer_add(&pending, chunk, got);
+            char *last_newline = memrchr(pending.data, '\n', pending.length);
+            if (last_newline == NULL)
+                continue;
+
+            size_t complete = (last_newline - pending.data) + 1;
+            total_matches += find_text_scan(pending.data, complete, pattern, pattern_length, NULL, &output);
+            memmove(pending.data, pending.data + complete, pending.length - complete);
+            pending.length -= complete;
+
+            if (output.length >= 64 * 1024)
+            {
+                if (!write_all(out_fd, output.data, output.length))
+                    break; // Reader went away (e.g. "| head")
+                output.length = 0;
+            }
+        }
+        total_matches += find_text_scan(pending.data, pending.length, pattern, pattern_length, NULL, &output);
+        write_all(out_fd, output.data, output.length);
+        free(pending.data);
+        free(output.data);
+        return total_matches > 0 ? 0 : 1;
+    }
+
+    if (file_count == 1)
+    {
+        struct text_buffer output = {0};
+        int matches = find_text_in_file(argv[2], pattern, pattern_length, NULL, &output);
+        write_all(out_fd, output.data, output.length);
+        free(output.data);
+        return matches < 0 ? 2 : (matches > 0 ? 0 : 1);
+    }
+
+    // Several files: one thread per CPU, each grabbing the next unclaimed file
+    struct find_text_job job;
+    job.file_names = argv + 2;
+    job.file_count = file_count;
+    job.pattern = pattern;
+    job.pattern_length = pattern_length;
+    job.outputs = calloc(file_count, sizeof(struct text_buffer));
+    job.match_counts = calloc(file_count, sizeof(int));
+    job.next_file = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (job.outputs == NULL || job.match_counts == NULL)
+    {
+        fprintf(stderr, "find-text: out of memory\n");
+        free(job.outputs);
+        free(job.match_counts);
+        return 2;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = (int)(cpus < 1 ? 1 : cpus);
+    if (thread_count > file_count)
+        thread_count = file_count;
+
+    pthread_t threads[thread_count];
+    int started = 0;
+    for (int t = 0; t < thread_count; t++)
+    {
+        if (pthread_create(&threads[t], NULL, find_text_worker, &job) == 0)
+            started++;
+    }
+    if (started == 0)
+        find_text_worker(&job); // Couldn't start any threads, do it ourselves
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    // Print results in the same order the files were given
+    for (int i = 0; i < file_count; i++)
+    {
+        if (job.match_counts[i] < 0)
+            had_error = 1;
+        else
+            total_matches += job.match_counts[i];
+        write_all(out_fd, job.outputs[i].data, job.outputs[i].length);
+        free(job.outputs[i].data);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(job.outputs);
+    free(job.match_counts);
+    return had_error ? 2 : (total_matches > 0 ? 0 : 1);
+}
+
+/**
+ * Hashing for the "sum" builtin
+ * XXH64 is the fast non-cryptographic mode (default), SHA-256 is the careful one.
+ * Both are written as streaming "update" functions so files never have to fit in memory
+ */
+#define SUM_BUFFER_SIZE (1024 * 1024) // 1MB aligned read buffer per worker thread
+
+static const uint64_t XXH_PRIME1 = 11400714785074694791ULL;
+static const uint64_t XXH_PRIME2 = 14029467366897019727ULL;
+static const uint64_t XXH_PRIME3 = 1609587929392839161ULL;
+static const uint64_t XXH_PRIME4 = 9650029242287828579ULL;
+static const uint64_t XXH_PRIME5 = 2870177450012600261ULL;
+
+struct xxh64_state
+{
+    uint64_t total_length;
+    uint64_t lanes[4];       // The four accumulators that each eat 8 bytes at a time
+    unsigned char stash[32]; // Bytes waiting for a full 32-byte stripe
+    size_t stash_length;
+};
+
+static uint64_t rotate_left64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t read_le64(const unsigned char *p)
+{
+    uint64_t value;
+    memcpy(&value, p, 8); // x86 and ARM Linux are little-endian, like XXH64 expects
+    return value;
+}
+
+static uint32_t read_le32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static uint64_t xxh64_round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * XXH_PRIME2;
+    accumulator = rotate_left64(accumulator, 31);
+    return accumulator * XXH_PRIME1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t hash, uint64_t lane)
+{
+    hash ^= xxh64_round(0, lane);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static void xxh64_init(struct xxh64_state *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->lanes[0] = XXH_PRIME1 + XXH_PRIME2; // Seed is always 0 for us
+    state->lanes[1] = XXH_PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = -XXH_PRIME1;
+}
+
+static void xxh64_update(struct xxh64_state *state, const unsigned char *data, size_t length)
+{
+    state->total_length += length;
+
+    // Finish a stripe that was started by the previous call
+    if (state->stash_length > 0)
+    {
+        size_t needed = 32 - state->stash_length;
+        if (length < needed)
+        {
+            memcpy(state->stash + state->stash_length, data, length);
+            state->stash_length += length;
+            return;
+        }
+        memcpy(state->stash + state->stash_length, data, needed);
+        for (int lane = 0; lane < 4; lane++)
+            state->lanes[lane] = xxh64_round(state->lanes[lane], read_le64(state->stash + lane * 8));
+        data += needed;
+        length -= needed;
+        state->stash_length = 0;
+    }
+
+    // The hot loop: 32 bytes per iteration, four independent lanes
+    while (length >= 32)
+    {
+        state->lanes[0] = xxh64_round(state->lanes[0], read_le64(data));
+        state->lanes[1] = xxh64_round(state->lanes[1], read_le64(data + 8));
+        state->lanes[2] = xxh64_round(state->lanes[2], read_le64(data + 16));
+        state->lanes[3] = xxh64_round(state->lanes[3], read_le64(data + 24));
+        data += 32;
+        length -= 32;
+    }
+
+    memcpy(state->stash, data, length);
+    state->stash_length = length;
+}
+
+static uint64_t xxh64_final(const struct xxh64_state *state)
+{
+    uint64_t hash;
+    if (state->total_length >= 32)
+    {
+        hash = rotate_left64(state->lanes[0], 1) + rotate_left64(state->lanes[1], 7) +
+               rotate_left64(state->lanes[2], 12) + rotate_left64(state->lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++)
+            hash = xxh64_merge_round(hash, state->lanes[lane]);
+    }
+    else
+    {
+        hash = state->lanes[2] + XXH_PRIME5;
+    }
+    hash += state->total_length;
+
+    // Mix in the leftover bytes
+    const unsigned char *p = state->stash;
+    const unsigned char *end = state->stash + state->stash_length;
+    while (p + 8 <= end)
+    {
+        hash ^= xxh64_round(0, read_le64(p));
+        hash = rotate_left64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        hash ^= (uint64_t)read_le32(p) * XXH_PRIME1;
+        hash = rotate_left64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        hash ^= (*p) * XXH_PRIME5;
+        hash = rotate_left64(hash, 11) * XXH_PRIME1;
+        p++;
+    }
+
+    // Final avalanche so every input bit affects every output bit
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+struct sha256_state
+{
+    uint32_t h[8];
+    uint64_t total_length;
+    unsigned char block[64];
+    size_t block_length;
+};
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static uint32_t rotate_right32(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void sha256_init(struct sha256_state *state)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(state->h, initial, sizeof(initial));
+    state->total_length = 0;
+    state->block_length = 0;
+}
+
+// Runs the compression function on one 64-byte block
+static void sha256_block(struct sha256_state *state, const unsigned char *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotate_right32(w[i - 15], 7) ^ rotate_right32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate_right32(w[i - 2], 17) ^ rotate_right32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state->h[0], b = state->h[1], c = state->h[2], d = state->h[3];
+    uint32_t e = state->h[4], f = state->h[5], g = state->h[6], h = state->h[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t s1 = rotate_right32(e, 6) ^ rotate_right32(e, 11) ^ rotate_right32(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choice + SHA256_K[i] + w[i];
+        uint32_t s0 = rotate_right32(a, 2) ^ rotate_right32(a, 13) ^ rotate_right32(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+
+    state->h[0] += a;
+    state->h[1] += b;
+    state->h[2] += c;
+    state->h[3] += d;
+    state->h[4] += e;
+    state->h[5] += f;
+    state->h[6] += g;
+    state->h[7] += h;
+}
+
+static void sha256_update(struct sha256_state *state, const unsigned char *data, size_t length)
+{
+    state->total_length += length;
+
+    if (state->block_length > 0)
+    {
+        size_t needed = 64 - state->block_length;
+        size_t take = length < needed ? length : needed;
+        memcpy(state->block + state->block_length, data, take);
+        state->block_length += take;
+        data += take;
+        length -= take;
+        if (state->block_length < 64)
+            return;
+        sha256_block(state, state->block);
+        state->block_length = 0;
+    }
+
+    while (length >= 64)
+    {
+        sha256_block(state, data);
+        data += 64;
+        length -= 64;
+    }
+
+    memcpy(state->block, data, length);
+    state->block_length = length;
+}
+
+static void sha256_final(struct sha256_state *state, unsigned char digest[32])
+{
+    uint64_t bit_length = state->total_length * 8;
+
+    // Padding: a 1 bit, zeros, then the length in the last 8 bytes of a block
+    state->block[state->block_length++] = 0x80;
+    if (state->block_length > 56)
+    {
+        memset(state->block + state->block_length, 0, 64 - state->block_length);
+        sha256_block(state, state->block);
+        state->block_length = 0;
+    }
+    memset(state->block + state->block_length, 0, 56 - state->block_length);
+    for (int i = 0; i < 8; i++)
+        state->block[56 + i] = (unsigned char)(bit_length >> (56 - i * 8));
+    sha256_block(state, state->block);
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i * 4] = (unsigned char)(state->h[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(state->h[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(state->h[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)state->h[i];
+    }
+}
+
+// Work shared by the sum threads - same "grab the next file" idea as find-text
+struct sum_job
+{
+    char **file_names;
+    int file_count;
+    int use_sha256;
+    char (*digests)[65];  // Hex digest for each file ("" if it failed)
+    uint64_t *byte_counts;
+    int next_file;
+    pthread_mutex_t lock;
+};
+
+/**
+ * Hashes everything readable from fd into a hex string
+ * Returns the number of bytes hashed, or -1 if reading failed
+ */
+static long long sum_hash_fd(int fd, int use_sha256, unsigned char *buffer, char hex[65])
+{
+    struct xxh64_state fast;
+    struct sha256_state careful;
+    long long total = 0;
+    ssize_t got;
+
+    if (use_sha256)
+        sha256_init(&careful);
+    else
+        xxh64_init(&fast);
+
+    while ((got = read(fd, buffer, SUM_BUFFER_SIZE)) > 0)
+    {
+        if (use_sha256)
+            sha256_update(&careful, buffer, got);
+        else
+            xxh64_update(&fast, buffer, got);
+        total += got;
+    }
+    if (got < 0)
+        return -1;
+
+    if (use_sha256)
+    {
+        unsigned char digest[32];
+        sha256_final(&careful, digest);
+        for (int i = 0; i < 32; i++)
+            sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+    else
+    {
+        sprintf(hex, "%016llx", (unsigned long long)xxh64_final(&fast));
+    }
+    return total;
+}
+
+static void *sum_worker(void *arg)
+{
+    struct sum_job *job = arg;
+
+    // Page-aligned buffer so the kernel can copy straight into whole pages
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, 4096, SUM_BUFFER_SIZE) != 0)
+    {
+        // Take the rest of the files off the list and leave their digests
+        // empty, so they show up as failed instead of quietly missing
+        fprintf(stderr, "sum: out of memory\n");
+        pthread_mutex_lock(&job->lock);
+        while (job->next_file < job->file_count)
+            job->digests[job->next_file++][0] = '\0';
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+
+    while (1)
+    {
+        pthread_mutex_lock(&job->lock);
+        int index = job->next_file++;
+        pthread_mutex_unlock(&job->lock);
+        if (index >= job->file_count)
+            break;
+
+        int fd = open(job->file_names[index], O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "sum: can't open %s: %s\n", job->file_names[index], strerror(errno));
+            continue;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // Ask for aggressive read-ahead
+
+        long long bytes = sum_hash_fd(fd, job->use_sha256, buffer, job->digests[index]);
+        if (bytes < 0)
+        {
+            fprintf(stderr, "sum: error reading %s: %s\n", job->file_names[index], strerror(errno));
+            job->digests[index][0] = '\0';
+        }
+        else
+        {
+            job->byte_counts[index] = bytes;
+        }
+        close(fd);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Builtin: sum [--xxh64 | --sha256] [file ...]
+ * Prints "digest  name" for every file (same layout as sha256sum) and a
+ * throughput line on stderr. Files are hashed in parallel on a thread pool.
+ */
+int builtin_sum(int argc, char **argv, int in_fd, int out_fd)
+{
+    int use_sha256 = 0;
+    int first_file = 1;
+
+    if (argc > 1 && strcmp(argv[1], "--sha256") == 0)
+    {
+        use_sha256 = 1;
+        first_file = 2;
+    }
+    else if (argc > 1 && strcmp(argv[1], "--xxh64") == 0)
+    {
+        first_file = 2;
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    int file_count = argc - first_file;
+    unsigned long long total_bytes = 0;
+    int had_error = 0;
+    struct text_buffer output = {0};
+
+    if (file_count == 0)
+    {
+        // No files: hash whatever comes in (so "cmd | sum" works)
+        void *buffer = NULL;
+        char hex[65];
+        if (posix_memalign(&buffer, 4096, SUM_BUFFER_SIZE) != 0)
+        {
+            fprintf(stderr, "sum: out of memory\n");
+            return 2;
+        }
+        long long bytes = sum_hash_fd(in_fd, use_sha256, buffer, hex);
+        free(buffer);
+        if (bytes < 0)
+        {
+            fprintf(stderr, "sum: error reading input: %s\n", strerror(errno));
+            return 1;
+        }
+        total_bytes = bytes;
+        text_buffer_add(&output, hex, strlen(hex));
+        text_buffer_add(&output, "  -\n", 4);
+    }
+    else
+    {
+        struct sum_job job;
+        job.file_names = argv + first_file;
+        job.file_count = file_count;
+        job.use_sha256 = use_sha256;
+        job.digests = calloc(file_count, sizeof(*job.digests));
+        job.byte_counts = calloc(file_count, sizeof(uint64_t));
+        job.next_file = 0;
+        pthread_mutex_init(&job.lock, NULL);
+
+        if (job.digests == NULL || job.byte_counts == NULL)
+        {
+            fprintf(stderr, "sum: out of memory\n");
+            free(job.digests);
+            free(job.byte_counts);
+            return 2;
+        }
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int thread_count = (int)(cpus < 1 ? 1 : cpus);
+        if (thread_count > file_count)
+            thread_count = file_count;
+
+        pthread_t threads[thread_count];
+        int started_threads = 0;
+        for (int t = 0; t < thread_count; t++)
+        {
+            if (pthread_create(&threads[t], NULL, sum_worker, &job) == 0)
+                started_threads++;
+        }
+        if (started_threads == 0)
+            sum_worker(&job);
+        for (int t = 0; t < started_threads; t++)
+            pthread_join(threads[t], NULL);
+
+        for (int i = 0; i < file_count; i++)
+        {
+            if (job.digests[i][0] == '\0')
+            {
+                had_error = 1;
+                continue;
+            }
+            total_bytes += job.byte_counts[i];
+            text_buffer_add(&output, job.digests[i], strlen(job.digests[i]));
+            text_buffer_add(&output, "  ", 2);
+            text_buffer_add(&output, job.file_names[i], strlen(job.file_names[i]));
+            text_buffer_add(&output, "\n", 1);
+        }
+
+        pthread_mutex_destroy(&job.lock);
+        free(job.digests);
+        free(job.byte_counts);
+    }
+
+    write_all(out_fd, output.data, output.length);
+    free(output.data);
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    double megabytes = total_bytes / (1024.0 * 1024.0);
+    fprintf(stderr, "sum: %s, %.1f MB in %.3f s (%.1f MB/s)\n", use_sha256 ? "sha256" : "xxh64",
+            megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+
+    return had_error ? 1 : 0;
+}
+
+/**
+ * Coprocesses: "coproc NAME cmd [args]" keeps a program running with a pipe to
+ * its stdin and another from its stdout. coproc-write sends it request lines,
+ * coproc-read gets reply lines back and coproc-ask does both, so a line-based
+ * tool like bc or "sed -u" can answer thousands of requests from one process.
+ * The program has to flush after every reply line or coproc-read will wait.
+ */
+#define MAX_COPROCS 16
+#define COPROC_NAME_SIZE 32
+#define COPROC_BUFFER_SIZE 4096
+
+struct coprocess
+{
+    char name[COPROC_NAME_SIZE]; // Empty string = free slot
+    pid_t pid;
+    int to_fd;   // Write end, the program's stdin
+    int from_fd; // Read end, the program's stdout
+    // Separate locks so one pipeline stage can write while another reads
+    pthread_mutex_t write_lock;
+    pthread_mutex_t read_lock;
+    char buffer[COPROC_BUFFER_SIZE]; // Reply bytes read but not handed out yet
+    size_t buffered;
+};
+
+static struct coprocess coprocesses[MAX_COPROCS];
+static pthread_mutex_t coproc_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Finds a running coprocess by name, returns NULL if there isn't one
+static struct coprocess *find_coprocess(const char *name)
+{
+    struct coprocess *found = NULL;
+    pthread_mutex_lock(&coproc_table_lock);
+    for (int i = 0; i < MAX_COPROCS; i++)
+    {
+        if (coprocesses[i].name[0] != '\0' && strcmp(coprocesses[i].name, name) == 0)
+        {
+            found = &coprocesses[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&coproc_table_lock);
+    return found;
+}
+
+/**
+ * Writes to a coprocess without letting SIGPIPE kill the shell if it already exited
+ * Any SIGPIPE we caused is taken off the pending list before unblocking again
+ */
+static int coproc_send(struct coprocess *coproc, const char *data, size_t length)
+{
+    sigset_t block_pipe, old_mask;
+    sigemptyset(&block_pipe);
+    sigaddset(&block_pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block_pipe, &old_mask);
+
+    int worked = write_all(coproc->to_fd, data, length);
+    if (!worked && errno == EPIPE)
+    {
+        struct timespec no_wait = {0, 0};
+        sigtimedwait(&block_pipe, NULL, &no_wait);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return worked;
+}
+
+/**
+ * Copies one reply line from the coprocess to out_fd
+ * Returns 1 if a line came back, 0 if the program closed its output
+ */
+static int coproc_read_line(struct coprocess *coproc, int out_fd)
+{
+    while (1)
+    {
+        char *newline = memchr(coproc->buffer, '\n', coproc->buffered);
+        if (newline != NULL)
+        {
+            size_t length = newline - coproc->buffer + 1;
+            write_all(out_fd, coproc->buffer, length);
+            coproc->buffered -= length;
+            memmove(coproc->buffer, coproc->buffer + length, coproc->buffered);
+            return 1;
+        }
+
+        // A line longer than the buffer just gets passed along in pieces
+        if (coproc->buffered == COPROC_BUFFER_SIZE)
+        {
+            write_all(out_fd, coproc->buffer, coproc->buffered);
+            coproc->buffered = 0;
+        }
+
+        ssize_t got = read(coproc->from_fd, coproc->buffer + coproc->buffered,
+                           COPROC_BUFFER_SIZE - coproc->buffered);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            // Last line without a newline still counts as a reply
+            if (coproc->buffered == 0)
+                return 0;
+            write_all(out_fd, coproc->buffer, coproc->buffered);
+            write_all(out_fd, "\n", 1);
+            coproc->buffered = 0;
+            return 1;
+        }
+        coproc->buffered += got;
+    }
+}
+
+// Joins words into one request line ending in '\n', returns 0 if it doesn't fit
+static int coproc_join_words(char **words, int count, char *line, size_t size)
+{
+    size_t used = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int written = snprintf(line + used, size - used, "%s%s", i > 0 ? " " : "", words[i]);
+        if (written < 0 || (size_t)written >= size - used)
+            return 0;
+        used += written;
+    }
+    if (used + 2 > size)
+        return 0;
+    line[used++] = '\n';
+    line[used] = '\0';
+    return 1;
+}
+
+/**
+ * coproc-write NAME [text...]
+ * Sends the text as one line, or with no text copies our stdin to the coprocess
+ * (so "cat requests.txt | coproc-write calc" works)
+ */
+int builtin_coproc_write(int argc, char **argv, int in_fd, int out_fd)
+{
+    (void)out_fd;
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: coproc-write NAME [text...]\n");
+        return 2;
+    }
+    struct coprocess *coproc = find_coprocess(argv[1]);
+    if (coproc == NULL)
+    {
+        fprintf(stderr, "coproc-write: no coprocess named %s\n", argv[1]);
+        return 1;
+    }
+
+    int worked = 1;
+    pthread_mutex_lock(&coproc->write_lock);
+    if (argc > 2)
+    {
+        char line[MAX_INPUT_SIZE + 2];
+        if (!coproc_join_words(argv + 2, argc - 2, line, sizeof(line)))
+        {
+            fprintf(stderr, "coproc-write: request is too long\n");
+            worked = 0;
+        }
+        else
+        {
+            worked = coproc_send(coproc, line, strlen(line));
+        }
+    }
+    else
+    {
+        char chunk[COPROC_BUFFER_SIZE];
+        ssize_t got;
+        while (worked && ((got = read(in_fd, chunk, sizeof(chunk))) > 0 || (got < 0 && errno == EINTR)))
+        {
+            if (got > 0)
+                worked = coproc_send(coproc, chunk, got);
+        }
+    }
+    pthread_mutex_unlock(&coproc->write_lock);
+
+    if (!worked)
+    {
+        fprintf(stderr, "coproc-write: %s is not accepting input\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * coproc-read NAME [LINES]
+ * Prints the next LINES reply lines (default 1), exit status 1 if it ran out
+ */
+int builtin_coproc_read(int argc, char **argv, int in_fd, int out_fd)
+{
+    (void)in_fd;
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: coproc-read NAME [LINES]\n");
+        return 2;
+    }
+    struct coprocess *coproc = find_coprocess(argv[1]);
+    if (coproc == NULL)
+    {
+        fprintf(stderr, "coproc-read: no coprocess named %s\n", argv[1]);
+        return 1;
+    }
+
+    long lines = (argc == 3) ? atol(argv[2]) : 1;
+    int status = 0;
+    pthread_mutex_lock(&coproc->read_lock);
+    for (long i = 0; i < lines; i++)
+    {
+        if (!coproc_read_line(coproc, out_fd))
+        {
+            status = 1; // The coprocess finished before answering
+            break;
+        }
+    }
+    pthread_mutex_unlock(&coproc->read_lock);
+    return status;
+}
+
+/**
+ * coproc-ask NAME text...
+ * Sends one request line and prints the one reply line
+ */
+int builtin_coproc_ask(int argc, char **argv, int in_fd, int out_fd)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: coproc-ask NAME text...\n");
+        return 2;
+    }
+    int status = builtin_coproc_write(argc, argv, in_fd, out_fd);
+    if (status != 0)
+        return status;
+    char *read_args[] = {argv[0], argv[1], NULL};
+    return builtin_coproc_read(2, read_args, in_fd, out_fd);
+}
+
+/**
+ * coproc NAME cmd [args] - starts a coprocess
+ * coproc                 - lists the running ones
+ */
+int start_coprocess(char **args)
+{
+    if (args[1] == NULL)
+    {
+        pthread_mutex_lock(&coproc_table_lock);
+        for (int i = 0; i < MAX_COPROCS; i++)
+        {
+            if (coprocesses[i].name[0] != '\0')
+                printf("%-16s pid %d\n", coprocesses[i].name, (int)coprocesses[i].pid);
+        }
+        pthread_mutex_unlock(&coproc_table_lock);
+        return 0;
+    }
+    if (args[2] == NULL)
+    {
+        fprintf(stderr, "Usage: coproc NAME command [args]\n");
+        return 2;
+    }
+    if (strlen(args[1]) >= COPROC_NAME_SIZE)
+    {
+        fprintf(stderr, "coproc: name is too long\n");
+        return 2;
+    }
+    if (find_coprocess(args[1]) != NULL)
+    {
+        fprintf(stderr, "coproc: %s is already running\n", args[1]);
+        return 1;
+    }
+
+    struct coprocess *slot = NULL;
+    for (int i = 0; i < MAX_COPROCS && slot == NULL; i++)
+    {
+        if (coprocesses[i].name[0] == '\0')
+            slot = &coprocesses[i];
+    }
+    if (slot == NULL)
+    {
+        fprintf(stderr, "coproc: already running %d coprocesses\n", MAX_COPROCS);
+        return 1;
+    }
+
+    char **expanded_args = expand_command_args(args + 2);
+    if (expanded_args == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory expanding arguments\n");
+        return 1;
+    }
+
+    // O_CLOEXEC so later commands don't hold the coprocess pipes open
+    int to_pipe[2], from_pipe[2];
+    if (pipe2(to_pipe, O_CLOEXEC) < 0)
+    {
+        perror("coproc: can't create pipe");
+        free_expanded_args(expanded_args);
+        return 1;
+    }
+    if (pipe2(from_pipe, O_CLOEXEC) < 0)
+    {
+        perror("coproc: can't create pipe");
+        close(to_pipe[0]);
+        close(to_pipe[1]);
+        free_expanded_args(expanded_args);
+        return 1;
+    }
+
+    pid_t pid = spawn_program(expanded_args, to_pipe[0], from_pipe[1]);
+    free_expanded_args(expanded_args);
+    close(to_pipe[0]);
+    close(from_pipe[1]);
+    if (pid < 0)
+    {
+        perror("coproc: couldn't start the command");
+        close(to_pipe[1]);
+        close(from_pipe[0]);
+        return 1;
+    }
+
+    pthread_mutex_lock(&coproc_table_lock);
+    strcpy(slot->name, args[1]);
+    slot->pid = pid;
+    slot->to_fd = to_pipe[1];
+    slot->from_fd = from_pipe[0];
+    slot->buffered = 0;
+    pthread_mutex_init(&slot->write_lock, NULL);
+    pthread_mutex_init(&slot->read_lock, NULL);
+    pthread_mutex_unlock(&coproc_table_lock);
+    return 0;
+}
+
+/**
+ * coproc-close NAME
+ * Closes the coprocess's stdin so it sees EOF, then waits for it to exit
+ * Leftover reply lines are printed so nothing gets lost
+ */
+int close_coprocess(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "Usage: coproc-close NAME\n");
+        return 2;
+    }
+    struct coprocess *coproc = find_coprocess(args[1]);
+    if (coproc == NULL)
+    {
+        fprintf(stderr, "coproc-close: no coprocess named %s\n", args[1]);
+        return 1;
+    }
+
+    close(coproc->to_fd);
+    fflush(stdout);
+    while (coproc_read_line(coproc, STDOUT_FILENO))
+        ;
+    close(coproc->from_fd);
+
+    int status = 0;
+    int exit_status = 1;
+    if (wait_program(coproc->pid, &status))
+    {
+        remember_exit_status(status);
+        exit_status = last_exit_status;
+    }
+
+    pthread_mutex_lock(&coproc_table_lock);
+    pthread_mutex_destroy(&coproc->write_lock);
+    pthread_mutex_destroy(&coproc->read_lock);
+    coproc->name[0] = '\0';
+    pthread_mutex_unlock(&coproc_table_lock);
+    return exit_status;
+}
+
+/**
+ * Builtins that run inside the shell process instead of fork + exec
+ * There are two kinds:
+ *  - stage builtins get argv plus the fds they should read from and write to,
+ *    and return an exit status just like a real program would (0 = success).
+ *    They can be a pipeline stage (on a thread). Plugins add more of these
+ *  - shell commands (killterm, stats, coproc, ...) change the shell itself,
+ *    so they only run as a plain command on the main thread
+ * handle_special_commands() looks everything up here
+ */
+typedef w25_builtin_function stage_builtin_function;
+typedef int (*shell_command_function)(char **args);
+
+#define MAX_BUILTINS 256
+#define BUILTIN_NAME_SIZE 32
+
+struct builtin_command
+{
+    char name[BUILTIN_NAME_SIZE];
+    stage_builtin_function run;     // Stage builtin, or NULL
+    shell_command_function command; // Shell command, or NULL
+    int plugin;                     // Index in loaded_plugins, -1 for our own
+};
+
+// Entries are only ever added, so a pointer to one stays good
+struct builtin_command builtins[MAX_BUILTINS] = {
+    {"find-text", builtin_find_text, NULL, -1},
+    {"sum", builtin_sum, NULL, -1},
+    {"coproc-write", builtin_coproc_write, NULL, -1},
+    {"coproc-read", builtin_coproc_read, NULL, -1},
+    {"coproc-ask", builtin_coproc_ask, NULL, -1},
+};
+int builtin_count = 5;
+
+// Looks up a builtin by name, returns NULL for normal programs
+struct builtin_command *find_builtin(const char *name)
+{
+    for (int i = 0; i < builtin_count; i++)
+    {
+        if (strcmp(builtins[i].name, name) == 0)
+            return &builtins[i];
+    }
+    return NULL;
+}
+
+// Same, but only builtins that can run as a pipeline stage
+struct builtin_command *find_stage_builtin(const char *name)
+{
+    struct builtin_command *builtin = find_builtin(name);
+    return builtin != NULL && builtin->run != NULL ? builtin : NULL;
+}
+
+// Adds a builtin, returns 0 or -1 (name taken, too long, or the table is full)
+int add_builtin(const char *name, stage_builtin_function run, shell_command_function command, int plugin)
+{
+    if (name == NULL || name[0] == '\0' || strlen(name) >= BUILTIN_NAME_SIZE || strpbrk(name, " \t|;&<>") != NULL ||
+        find_builtin(name) != NULL || builtin_count == MAX_BUILTINS)
+        return -1;
+    struct builtin_command *builtin = &builtins[builtin_count];
+    snprintf(builtin->name, sizeof(builtin->name), "%s", name);
+    builtin->run = run;
+    builtin->command = command;
+    builtin->plugin = plugin;
+    builtin_count++; // Last, so the entry is complete before anyone can find it
+    return 0;
+}
+
+// Everything a pipeline thread needs to run one builtin stage
+struct stage_thread
+{
+    pthread_t thread;
+    struct builtin_command *builtin;
+    char **argv; // Glob-expanded copy of the arguments, owned by the thread
+    int argc;
+    int in_fd;
+    int out_fd;
+    int exit_status;
+};
+
+static void *stage_thread_main(void *arg)
+{
+    struct stage_thread *stage = arg;
+
+    // If the next stage quits early, writing to the pipe raises SIGPIPE which
+    // would kill the whole shell. Blocking it here makes write() return EPIPE instead
+    sigset_t block_pipe;
+    sigemptyset(&block_pipe);
+    sigaddset(&block_pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block_pipe, NULL);
+
+    stage->exit_status = stage->builtin->run(stage->argc, stage->argv, stage->in_fd, stage->out_fd);
+
+    // Closing our pipe ends is what tells the neighbours we're done
+    if (stage->in_fd != STDIN_FILENO)
+        close(stage->in_fd);
+    if (stage->out_fd != STDOUT_FILENO)
+        close(stage->out_fd);
+    return NULL;
+}
+
+/**
+ * Placement of pipeline stages: which CPUs they run on and at what priority
+ *   place pin=auto nice=5 sched=batch -- producer | filter | consumer
+ *   producer | pin=2 filter | pin=3 nice=10 consumer
+ * Options before "--" cover every stage, a stage's own pin=/nice=/sched=
+ * words come on top. pin=auto gives each stage its own core, picked so
+ * neighbouring stages share an L2 (or at least an L3) cache - then the data
+ * going through the pipe stays in cache instead of crossing sockets.
+ */
+#define MAX_TOPOLOGY_CPUS 1024
+
+// Parses a CPU list like "0-3,8,10-11" into a set, returns 0 if it's not one
+static int parse_cpu_list(const char *text, size_t length, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    const char *end = text + length;
+    while (text < end)
+    {
+        char *after;
+        long first = strtol(text, &after, 10);
+        long last = first;
+        if (after == text || first < 0)
+            return 0;
+        if (after < end && *after == '-')
+        {
+            text = after + 1;
+            last = strtol(text, &after, 10);
+            if (after == text || last < first)
+                return 0;
+        }
+        if (last >= CPU_SETSIZE)
+            return 0;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+        text = after;
+        if (text < end && *text != ',')
+            return 0;
+        if (text < end)
+            text++;
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+/**
+ * Looks at one word (up to length) and adds it to place if it's pin=, nice= or sched=
+ * Returns 1 if it was a placement option, 0 if it's some other word, -1 if the value is bad
+ */
+static int parse_placement_option(const char *word, size_t length, struct placement *place)
+{
+    if (length > 4 && strncmp(word, "pin=", 4) == 0)
+    {
+        if (length == 8 && strncmp(word + 4, "auto", 4) == 0)
+        {
+            place->pin_auto = 1;
+            place->has_cpus = 0;
+            return 1;
+        }
+        if (!parse_cpu_list(word + 4, length - 4, &place->cpus))
+        {
+            fprintf(stderr, "Error: pin= wants auto or a CPU list like 0-3,6\n");
+            return -1;
+        }
+        place->has_cpus = 1;
+        place->pin_auto = 0;
+        return 1;
+    }
+    if (length > 5 && strncmp(word, "nice=", 5) == 0)
+    {
+        char *after;
+        long value = strtol(word + 5, &after, 10);
+        if (after != word + length || value < -20 || value > 19)
+        {
+            fprintf(stderr, "Error: nice= wants a number from -20 to 19\n");
+            return -1;
+        }
+        place->has_nice = 1;
+        place->nice = (int)value;
+        return 1;
+    }
+    if (length > 6 && strncmp(word, "sched=", 6) == 0)
+    {
+        const char *value = word + 6;
+        size_t value_length = length - 6;
+        if (value_length == 5 && strncmp(value, "batch", 5) == 0)
+            place->policy = SCHED_BATCH;
+        else if (value_length == 4 && strncmp(value, "idle", 4) == 0)
+            place->policy = SCHED_IDLE;
+        else if (value_length == 5 && strncmp(value, "other", 5) == 0)
+            place->policy = SCHED_OTHER;
+        else
+        {
+            fprintf(stderr, "Error: sched= wants batch, idle or other\n");
+            return -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Same idea for the limit options: mem=2G, cpu=150% and nofile=4096
+ * Returns 1 if it was one, 0 if it's some other word, -1 if the value is bad
+ */
+static int parse_limit_option(const char *word, size_t length, struct placement *place)
+{
+    char *after;
+    if (length > 4 && strncmp(word, "mem=", 4) == 0)
+    {
+        double value = strtod(word + 4, &after);
+        double unit = 1;
+        if (after < word + length)
+        {
+            switch (*after++)
+            {
+            case 'k': case 'K': unit = 1024.0; break;
+            case 'm': case 'M': unit = 1024.0 * 1024; break;
+            case 'g': case 'G': unit = 1024.0 * 1024 * 1024; break;
+            case 't': case 'T': unit = 1024.0 * 1024 * 1024 * 1024; break;
+            default: unit = 0; break;
+            }
+        }
+        // Written so that nan and anything past LLONG_MAX fail too (the cast would overflow)
+        double bytes = value * unit;
+        if (after != word + length || unit == 0 || !(bytes >= 1024 * 1024 && bytes < (double)LLONG_MAX))
+        {
+            fprintf(stderr, "Error: mem= wants a size from 1M up to 8388607T, like 512M or 2G\n");
+            return -1;
+        }
+        place->mem_bytes = (long long)bytes;
+        return 1;
+    }
+    if (length > 4 && strncmp(word, "cpu=", 4) == 0)
+    {
+        long value = strtol(word + 4, &after, 10);
+        if (after < word + length && *after == '%')
+            after++;
+        if (after != word + length || value < 1 || value > 100 * CPU_SETSIZE)
+        {
+            fprintf(stderr, "Error: cpu= wants a percentage of one CPU, like 50%% or 150%%\n");
+            return -1;
+        }
+        place->cpu_percent = (int)value;
+        return 1;
+    }
+    if (length > 7 && strncmp(word, "nofile=", 7) == 0)
+    {
+        long value = strtol(word + 7, &after, 10);
+        if (after != word + length || value < 1)
+        {
+            fprintf(stderr, "Error: nofile= wants a number of open files\n");
+            return -1;
+        }
+        place->nofile = value;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Reads placement words (and limit words too if with_limits) off the front of a command
+ * Returns where the real command starts, or NULL if an option was bad
+ */
+static char *take_placement_prefix(char *command, struct placement *place, int with_limits)
+{
+    while (1)
+    {
+        while (*command == ' ' || *command == '\t')
+            command++;
+        size_t length = strcspn(command, " \t");
+        int found = parse_placement_option(command, length, place);
+        if (found == 0)
+        {
+            struct placement ignored;
+            if (!with_limits && parse_limit_option(command, length, &ignored) != 0)
+            {
+                // Limits cover the whole job (one cgroup), so they can't go on a single stage
+                fprintf(stderr, "Error: %.*s goes in \"limit ... --\" at the start of the line\n", (int)length, command);
+                return NULL;
+            }
+            if (with_limits)
+                found = parse_limit_option(command, length, place);
+        }
+        if (found < 0)
+            return NULL;
+        if (found == 0)
+            return command;
+        command += length;
+    }
+}
+
+// Does the line start with a placement word followed by a command? ("nice=5 make")
+// Only looks at the names, a bad value gets reported when the line runs
+int starts_with_placement(const char *line)
+{
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (strncmp(line, "pin=", 4) != 0 && strncmp(line, "nice=", 5) != 0 && strncmp(line, "sched=", 6) != 0)
+        return 0;
+    line += strcspn(line, " \t");
+    while (*line == ' ' || *line == '\t')
+        line++;
+    return *line != '\0';
+}
+
+/**
+ * Job cgroups for "limit"
+ * rlimits are per process and can't cap CPU share at all, so when we can
+ * write to a cgroup v2 directory every limited job gets its own child
+ * cgroup with memory.max/cpu.max, and we read its accounting back at the end.
+ * The parent directory is $W25_CGROUP if set, otherwise the cgroup the shell
+ * is in (that only works if it was delegated to us, e.g. systemd-run -p Delegate=yes)
+ */
+static char cgroup_parent[200];      // Short enough that a job directory under it fits placement.cgroup
+static int cgroup_state = -1;        // -1 not looked yet, 0 no usable cgroup, 1 ready
+static int cgroup_job_count = 0;
+static char cgroup_leftover[PATH_MAX]; // A job directory we couldn't remove yet
+
+static int write_cgroup_file(const char *directory, const char *name, const char *value)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    int ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok;
+}
+
+// Reads a small cgroup file into buffer, returns 0 if it isn't there
+static int read_cgroup_file(const char *directory, const char *name, char *buffer, size_t size)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    ssize_t got = read(fd, buffer, size - 1);
+    close(fd);
+    if (got < 0)
+        return 0;
+    buffer[got] = '\0';
+    return 1;
+}
+
+// Finds a cgroup v2 directory we can make job cgroups in, with memory and cpu turned on
+static int find_cgroup_parent(void)
+{
+    const char *chosen = getenv("W25_CGROUP");
+    if (chosen != NULL && *chosen != '\0')
+    {
+        if (snprintf(cgroup_parent, sizeof(cgroup_parent), "%s", chosen) >= (int)sizeof(cgroup_parent))
+            return 0;
+    }
+    else
+    {
+        // Where cgroup2 is mounted ("/sys/fs/cgroup", or ".../unified" on hybrid systems)
+        char mount_point[PATH_MAX] = "", line[PATH_MAX];
+        FILE *mounts = fopen("/proc/self/mounts", "re");
+        if (mounts == NULL)
+            return 0;
+        while (fgets(line, sizeof(line), mounts) != NULL)
+        {
+            char where[PATH_MAX], type[32];
+            if (sscanf(line, "%*s %4095s %31s", where, type) == 2 && strcmp(type, "cgroup2") == 0)
+            {
+                snprintf(mount_point, sizeof(mount_point), "%s", where);
+                break;
+            }
+        }
+        fclose(mounts);
+
+        // And which cgroup we're in ("0::/user.slice/...")
+        char own[PATH_MAX] = "";
+        FILE *membership = fopen("/proc/self/cgroup", "re");
+        if (membership == NULL)
+            return 0;
+        while (fgets(line, sizeof(line), membership) != NULL)
+        {
+            if (strncmp(line, "0::", 3) == 0)
+            {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(own, sizeof(own), "%s", line + 3);
+            }
+        }
+        fclose(membership);
+        if (mount_point[0] == '\0' || own[0] == '\0' ||
+            snprintf(cgroup_parent, sizeof(cgroup_parent), "%s%s", mount_point, strcmp(own, "/") == 0 ? "" : own) >=
+                (int)sizeof(cgroup_parent))
+            return 0;
+    }
+
+    char controllers[256];
+    if (!read_cgroup_file(cgroup_parent, "cgroup.controllers", controllers, sizeof(controllers)) ||
+        strstr(controllers, "memory") == NULL || strstr(controllers, "cpu") == NULL)
+        return 0;
+    if (access(cgroup_parent, W_OK) < 0)
+        return 0;
+    if (write_cgroup_file(cgroup_parent, "cgroup.subtree_control", "+memory +cpu"))
+        return 1;
+    if (errno != EBUSY)
+        return 0;
+
+    // A cgroup with processes in it can't hand controllers down ("no internal
+    // processes"). If the only ones in it are the shell and its zygote, we move
+    // those two into a leaf. Anybody else isn't ours to move, so then it's rlimits
+    char procs_path[PATH_MAX];
+    snprintf(procs_path, sizeof(procs_path), "%s/cgroup.procs", cgroup_parent);
+    FILE *procs = fopen(procs_path, "re");
+    if (procs == NULL)
+        return 0;
+    char pid_text[32];
+    int only_ours = 1;
+    while (fgets(pid_text, sizeof(pid_text), procs) != NULL)
+    {
+        pid_t pid = (pid_t)strtol(pid_text, NULL, 10);
+        if (pid != getpid() && (zygote_pid <= 0 || pid != zygote_pid))
+            only_ours = 0;
+    }
+    fclose(procs);
+    if (!only_ours)
+        return 0;
+
+    char leaf[PATH_MAX];
+    snprintf(leaf, sizeof(leaf), "%s/w25shell", cgroup_parent);
+    if (mkdir(leaf, 0755) < 0 && errno != EEXIST)
+        return 0;
+    snprintf(pid_text, sizeof(pid_text), "%d", getpid());
+    if (!write_cgroup_file(leaf, "cgroup.procs", pid_text))
+        return 0;
+    if (zygote_pid > 0)
+    {
+        snprintf(pid_text, sizeof(pid_text), "%d", zygote_pid);
+        write_cgroup_file(leaf, "cgroup.procs", pid_text);
+    }
+    return write_cgroup_file(cgroup_parent, "cgroup.subtree_control", "+memory +cpu");
+}
+
+/**
+ * Gets a job ready for its limits: makes its cgroup when mem= or cpu= was
+ * given and a cgroup v2 is writable, otherwise leaves place->cgroup empty
+ * so the children fall back to rlimits
+ */
+static void create_job_cgroup(struct placement *place)
+{
+    place->cgroup[0] = '\0';
+    if (place->mem_bytes == 0 && place->cpu_percent == 0)
+        return; // nofile= is an rlimit either way
+
+    // An error part way through the last pipeline can skip finish_job_cgroup
+    if (cgroup_leftover[0] != '\0' && (rmdir(cgroup_leftover) == 0 || errno == ENOENT))
+        cgroup_leftover[0] = '\0';
+
+    if (cgroup_state < 0)
+    {
+        cgroup_state = find_cgroup_parent();
+        if (!cgroup_state)
+            fprintf(stderr, "Note: no writable cgroup v2 (set W25_CGROUP to a delegated one), limit uses rlimits only\n");
+    }
+
+    char directory[sizeof(place->cgroup)];
+    int made = 0;
+    if (cgroup_state == 1)
+    {
+        made = snprintf(directory, sizeof(directory), "%s/job-%d-%d", cgroup_parent, getpid(), ++cgroup_job_count) <
+                   (int)sizeof(directory) &&
+               mkdir(directory, 0755) == 0;
+    }
+    if (made)
+    {
+        char value[64];
+        int ok = 1;
+        if (place->mem_bytes > 0)
+        {
+            snprintf(value, sizeof(value), "%lld", place->mem_bytes);
+            ok = write_cgroup_file(directory, "memory.max", value);
+            write_cgroup_file(directory, "memory.swap.max", "0"); // Otherwise it just swaps instead (no file without swap)
+        }
+        if (ok && place->cpu_percent > 0)
+        {
+            // cpu.max is "quota period" in microseconds: 150% = 150ms of CPU every 100ms
+            snprintf(value, sizeof(value), "%ld 100000", place->cpu_percent * 1000L);
+            ok = write_cgroup_file(directory, "cpu.max", value);
+        }
+        if (ok)
+        {
+            snprintf(place->cgroup, sizeof(place->cgroup), "%s", directory);
+            return;
+        }
+        perror("Warning: couldn't set the job's cgroup limits, using rlimits");
+        rmdir(directory);
+    }
+
+    if (place->cpu_percent > 0)
+        fprintf(stderr, "Warning: cpu= needs a cgroup, running without a CPU limit\n");
+}
+
+// Prints what the job used and removes its cgroup, once every stage has been waited for
+static void finish_job_cgroup(struct placement *place)
+{
+    if (place->cgroup[0] == '\0')
+        return;
+
+    char text[1024];
+    double cpu_seconds = 0;
+    long long peak = -1, oom_kills = 0;
+    if (read_cgroup_file(place->cgroup, "cpu.stat", text, sizeof(text)))
+    {
+        char *usage = strstr(text, "usage_usec ");
+        if (usage != NULL)
+            cpu_seconds = strtoll(usage + 11, NULL, 10) / 1e6;
+    }
+    if (read_cgroup_file(place->cgroup, "memory.peak", text, sizeof(text))) // Linux 5.19 and newer
+        peak = strtoll(text, NULL, 10);
+    if (read_cgroup_file(place->cgroup, "memory.events", text, sizeof(text)))
+    {
+        char *kills = strstr(text, "oom_kill ");
+        if (kills != NULL)
+            oom_kills = strtoll(kills + 9, NULL, 10);
+    }
+
+    fprintf(stderr, "limit: %.2f s CPU", cpu_seconds);
+    if (peak >= 0)
+        fprintf(stderr, ", peak memory %.1f MB", peak / (1024.0 * 1024));
+    if (oom_kills > 0)
+        fprintf(stderr, ", %lld process%s killed for going over mem=", oom_kills, oom_kills == 1 ? "" : "es");
+    fprintf(stderr, "\n");
+
+    if (rmdir(place->cgroup) < 0 && errno != ENOENT)
+        snprintf(cgroup_leftover, sizeof(cgroup_leftover), "%s", place->cgroup); // Try again next job
+    place->cgroup[0] = '\0';
+}
+
+// One CPU as seen in /sys, the keys are the first CPU of each sharing group
+struct topology_cpu
+{
+    int cpu;
+    int l3_key;
+    int l2_key;
+    int core_key;
+};
+
+static struct topology_cpu topology_cpus[MAX_TOPOLOGY_CPUS];
+static int topology_count = -1; // -1 until /sys has been read
+
+// First number of a /sys list file like "4-7" (-1 if it can't be read)
+static int read_first_cpu(const char *path)
+{
+    FILE *file = fopen(path, "re");
+    if (file == NULL)
+        return -1;
+    int value = -1;
+    if (fscanf(file, "%d", &value) != 1)
+        value = -1;
+    fclose(file);
+    return value;
+}
+
+// First CPU that shares the given cache level with cpu
+static int cache_group(int cpu, int level)
+{
+    char path[128];
+    for (int index = 0; index < 10; index++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        int found_level = read_first_cpu(path);
+        if (found_level < 0)
+            break;
+        if (found_level == level)
+        {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+            return read_first_cpu(path);
+        }
+    }
+    return -1;
+}
+
+static int compare_topology(const void *a, const void *b)
+{
+    const struct topology_cpu *x = a, *y = b;
+    if (x->l3_key != y->l3_key)
+        return x->l3_key - y->l3_key;
+    if (x->l2_key != y->l2_key)
+        return x->l2_key - y->l2_key;
+    if (x->core_key != y->core_key)
+        return x->core_key - y->core_key;
+    return x->cpu - y->cpu;
+}
+
+// Reads the cache layout once, sorted so CPUs that share caches sit together
+static void load_topology(void)
+{
+    if (topology_count >= 0)
+        return;
+    topology_count = 0;
+    char path[128];
+    for (int cpu = 0; cpu < MAX_TOPOLOGY_CPUS; cpu++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        int core = read_first_cpu(path);
+        if (core < 0)
+            continue; // Offline or not there
+        struct topology_cpu *entry = &topology_cpus[topology_count++];
+        entry->cpu = cpu;
+        entry->core_key = core;
+        entry->l2_key = cache_group(cpu, 2);
+        entry->l3_key = cache_group(cpu, 3);
+        if (entry->l2_key < 0)
+            entry->l2_key = core;
+        if (entry->l3_key < 0)
+        {
+            // No L3 info (VMs often hide it), fall back to the socket
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+            entry->l3_key = read_first_cpu(path);
+        }
+    }
+    qsort(topology_cpus, topology_count, sizeof(struct topology_cpu), compare_topology);
+}
+
+/**
+ * Picks a CPU for each of count stages for pin=auto
+ * Real cores first (hyperthread siblings only once every core has a stage),
+ * walking through the caches in order, starting in the L3 we're running on now
+ * Returns 0 if there's no topology to go on
+ */
+static int pick_auto_cpus(int count, int *chosen)
+{
+    load_topology();
+    cpu_set_t allowed;
+    if (topology_count == 0 || sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return 0;
+
+    int order[MAX_TOPOLOGY_CPUS];
+    int order_count = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < topology_count; i++)
+        {
+            struct topology_cpu *entry = &topology_cpus[i];
+            int first_thread = entry->cpu == entry->core_key;
+            if (CPU_ISSET(entry->cpu, &allowed) && first_thread == (pass == 0))
+                order[order_count++] = i;
+        }
+    }
+    if (order_count == 0)
+        return 0;
+
+    int start = 0;
+    int current = sched_getcpu();
+    for (int i = 0; i < order_count; i++)
+    {
+        if (topology_cpus[order[i]].cpu == current)
+        {
+            int l3 = topology_cpus[order[i]].l3_key;
+            for (start = 0; topology_cpus[order[start]].l3_key != l3; start++)
+                ;
+            break;
+        }
+    }
+
+    for (int stage = 0; stage < count; stage++)
+        chosen[stage] = topology_cpus[order[(start + stage) % order_count]].cpu;
+    return 1;
+}
+
+/**
+ * pipestat: watching a pipeline to find its slowest stage
+ *   pipestat [--relay] cmd1 | cmd2 | cmd3
+ * While the pipeline runs the shell samples every stage (CPU time and state
+ * from /proc/PID/stat, bytes read/written from /proc/PID/io) and every pipe
+ * between stages (how full it is, with FIONREAD). A full pipe means the
+ * writer is waiting on the reader, an empty one means the reader is starving.
+ * With --relay the shell sits in the middle of each pipe and moves the data
+ * with splice(), which gives an exact byte count per link.
+ * Live lines go to stderr, then a summary names the limiting stage.
+ */
+#define PIPESTAT_NAME_SIZE 24
+
+struct pipestat_link
+{
+    int relaying;          // 1 with --relay
+    int relay_in;          // Upstream pipe's read end (relay only)
+    int relay_out;         // Downstream pipe's write end (relay only)
+    pthread_t relay;
+    pthread_mutex_t lock;  // Guards bytes and closed
+    long long bytes;       // Moved by the relay so far
+    int closed;            // Relay finished and closed its fds
+    long long last_bytes;
+    double rate;           // MB/s over the last sample
+    int capacity;          // Pipe size, 0 until we've seen the pipe
+    int occupancy;         // Bytes sitting in the pipe at the last sample (-1 unknown)
+};
+
+struct pipestat_stage
+{
+    pid_t pid; // 0 for builtin stages (they're threads, nothing to read in /proc)
+    char name[PIPESTAT_NAME_SIZE];
+    int gone;
+    char state;
+    unsigned long long ticks, last_ticks; // utime + stime
+    unsigned long long rchar, wchar, last_rchar, last_wchar;
+    int samples, busy, waiting_input, waiting_output;
+    double in_rate, out_rate, cpu_percent;
+    int has_final; // final_ticks/final_wchar were read from the zombie, right before it was reaped
+    unsigned long long final_ticks, final_wchar;
+};
+
+struct pipestat
+{
+    int stage_count;
+    struct pipestat_stage stages[MAX_COMMANDS];
+    struct pipestat_link links[MAX_COMMANDS - 1];
+    int live_tty;
+    int lines_drawn;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    pthread_t thread;
+    struct timespec started;
+};
+
+// Moves one link's data with splice, counting as it goes
+static void *pipestat_relay_main(void *arg)
+{
+    struct pipestat_link *link = arg;
+    sigset_t block_pipe;
+    sigemptyset(&block_pipe);
+    sigaddset(&block_pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block_pipe, NULL); // EPIPE instead of killing the shell
+
+    while (1)
+    {
+        ssize_t moved = splice(link->relay_in, NULL, link->relay_out, NULL, 1 << 20, SPLICE_F_MOVE);
+        if (moved < 0 && errno == EINTR)
+            continue;
+        if (moved <= 0)
+            break; // EOF from upstream, or downstream went away
+        pthread_mutex_lock(&link->lock);
+        link->bytes += moved;
+        pthread_mutex_unlock(&link->lock);
+    }
+
+    // Closing both ends passes the EOF (or the EPIPE) on to the neighbours
+    pthread_mutex_lock(&link->lock);
+    link->closed = 1;
+    close(link->relay_in);
+    close(link->relay_out);
+    pthread_mutex_unlock(&link->lock);
+    return NULL;
+}
+
+// Reads state and CPU ticks from /proc/PID/stat, returns 0 once the process is gone
+// (or has exited, unless zombie_ok - a zombie still has its totals until it's reaped)
+static int pipestat_read_stat(struct pipestat_stage *stage, int zombie_ok)
+{
+    char path[64], buffer[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", stage->pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    ssize_t got = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (got <= 0)
+        return 0;
+    buffer[got] = '\0';
+
+    // The command name can have spaces in it, so start after the last ')'
+    char *after_name = strrchr(buffer, ')');
+    unsigned long long user_ticks, system_ticks;
+    char state;
+    if (after_name == NULL ||
+        sscanf(after_name + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &state, &user_ticks,
+               &system_ticks) != 3)
+        return 0;
+    if ((state == 'Z' && !zombie_ok) || state == 'X')
+        return 0;
+    stage->state = state;
+    stage->ticks = user_ticks + system_ticks;
+
+    // Bytes in and out, if the kernel lets us see them
+    snprintf(path, sizeof(path), "/proc/%d/io", stage->pid);
+    FILE *io = fopen(path, "re");
+    if (io != NULL)
+    {
+        char line[128];
+        while (fgets(line, sizeof(line), io) != NULL)
+        {
+            sscanf(line, "rchar: %llu", &stage->rchar);
+            sscanf(line, "wchar: %llu", &stage->wchar);
+        }
+        fclose(io);
+    }
+    return 1;
+}
+
+/**
+ * How full is the pipe between stage index and index + 1?
+ * With the relay we have the fds ourselves. Without it the shell closed its
+ * copies (holding a read end would stop writers getting EPIPE), so we open the
+ * reader's stdin through /proc just long enough to ask
+ */
+static void pipestat_read_link(struct pipestat *stat, int index)
+{
+    struct pipestat_link *link = &stat->links[index];
+    link->occupancy = -1;
+
+    if (link->relaying)
+    {
+        pthread_mutex_lock(&link->lock);
+        if (!link->closed)
+        {
+            int upstream = 0, downstream = 0;
+            ioctl(link->relay_in, FIONREAD, &upstream);
+            ioctl(link->relay_out, FIONREAD, &downstream);
+            link->occupancy = upstream + downstream;
+            if (link->capacity == 0)
+                link->capacity = fcntl(link->relay_in, F_GETPIPE_SZ) + fcntl(link->relay_out, F_GETPIPE_SZ);
+        }
+        pthread_mutex_unlock(&link->lock);
+        return;
+    }
+
+    struct pipestat_stage *reader = &stat->stages[index + 1];
+    if (reader->pid == 0 || reader->gone)
+        return;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/0", reader->pid);
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat info;
+    int waiting;
+    if (fstat(fd, &info) == 0 && S_ISFIFO(info.st_mode) && ioctl(fd, FIONREAD, &waiting) == 0)
+    {
+        link->occupancy = waiting;
+        link->capacity = fcntl(fd, F_GETPIPE_SZ);
+    }
+    close(fd);
+}
+
+// Prints one line per stage (redrawn in place on a terminal)
+static void pipestat_draw(struct pipestat *stat, double elapsed)
+{
+    if (stat->live_tty && stat->lines_drawn > 0)
+        fprintf(stderr, "\033[%dA", stat->lines_drawn); // Back up over the last block
+    stat->lines_drawn = 0;
+
+    if (!stat->live_tty)
+        fprintf(stderr, "pipestat %.1fs\n", elapsed);
+    for (int i = 0; i < stat->stage_count; i++)
+    {
+        struct pipestat_stage *stage = &stat->stages[i];
+        const char *waiting = "";
+        if (stage->gone)
+            waiting = "finished";
+        else if (stage->pid == 0)
+            waiting = "builtin";
+        else if (stage->state == 'R')
+            waiting = "running";
+        else if (i < stat->stage_count - 1 && stat->links[i].capacity > 0 &&
+                 stat->links[i].occupancy >= stat->links[i].capacity - 4096)
+            waiting = "blocked on write";
+        else if (i > 0 && stat->links[i - 1].occupancy == 0)
+            waiting = "blocked on read";
+
+        char pipe_text[32] = "";
+        if (i < stat->stage_count - 1 && stat->links[i].occupancy >= 0)
+            snprintf(pipe_text, sizeof(pipe_text), "pipe %4dK/%dK", stat->links[i].occupancy / 1024,
+                     stat->links[i].capacity / 1024);
+        char relay_text[32] = "";
+        if (i < stat->stage_count - 1 && stat->links[i].relaying)
+            snprintf(relay_text, sizeof(relay_text), "relay %.1f MB/s", stat->links[i].rate);
+
+        if (stat->live_tty)
+            fprintf(stderr, "\033[K"); // Clear what's left of the old line
+        fprintf(stderr, "[%d] %-14.14s in %8.1f MB/s  out %8.1f MB/s  cpu %3.0f%%  %-16s %s %s\n", i + 1,
+                stage->name, stage->in_rate, stage->out_rate, stage->cpu_percent, waiting, pipe_text, relay_text);
+        stat->lines_drawn++;
+    }
+    fflush(stderr);
+}
+
+// Takes one sample of everything and sorts each stage into busy / waiting
+static void pipestat_sample(struct pipestat *stat, double interval)
+{
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+    for (int i = 0; i < stat->stage_count - 1; i++)
+    {
+        pipestat_read_link(stat, i);
+        if (stat->links[i].relaying)
+        {
+            pthread_mutex_lock(&stat->links[i].lock);
+            long long bytes = stat->links[i].bytes;
+            pthread_mutex_unlock(&stat->links[i].lock);
+            stat->links[i].rate = (bytes - stat->links[i].last_bytes) / 1e6 / interval;
+            stat->links[i].last_bytes = bytes;
+        }
+    }
+
+    for (int i = 0; i < stat->stage_count; i++)
+    {
+        struct pipestat_stage *stage = &stat->stages[i];
+        if (stage->pid == 0 || stage->gone)
+            continue;
+        if (!pipestat_read_stat(stage, 0))
+        {
+            stage->gone = 1;
+            stage->in_rate = stage->out_rate = stage->cpu_percent = 0;
+            continue;
+        }
+
+        stage->in_rate = (stage->rchar - stage->last_rchar) / 1e6 / interval;
+        stage->out_rate = (stage->wchar - stage->last_wchar) / 1e6 / interval;
+        stage->cpu_percent = 100.0 * (stage->ticks - stage->last_ticks) / ticks_per_second / interval;
+        stage->last_rchar = stage->rchar;
+        stage->last_wchar = stage->wchar;
+        stage->last_ticks = stage->ticks;
+
+        // Same rules as the live display
+        stage->samples++;
+        struct pipestat_link *out_link = i < stat->stage_count - 1 ? &stat->links[i] : NULL;
+        struct pipestat_link *in_link = i > 0 ? &stat->links[i - 1] : NULL;
+        if (stage->state == 'R')
+            stage->busy++;
+        else if (out_link != NULL && out_link->capacity > 0 && out_link->occupancy >= out_link->capacity - 4096)
+            stage->waiting_output++;
+        else if (in_link != NULL && in_link->occupancy == 0)
+            stage->waiting_input++;
+        else
+            stage->busy++; // Sleeping on something else (disk, network) - still its own work
+    }
+}
+
+static void *pipestat_main(void *arg)
+{
+    struct pipestat *stat = arg;
+    double interval = stat->live_tty ? 0.5 : 1.0;
+    struct timespec last = stat->started;
+
+    pthread_mutex_lock(&stat->lock);
+    while (!stat->done)
+    {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += (long)(interval * 1e9);
+        wake.tv_sec += wake.tv_nsec / 1000000000;
+        wake.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&stat->finished, &stat->lock, &wake);
+        if (stat->done)
+            break;
+        pthread_mutex_unlock(&stat->lock);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double since_last = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        double elapsed = (now.tv_sec - stat->started.tv_sec) + (now.tv_nsec - stat->started.tv_nsec) / 1e9;
+        last = now;
+        pipestat_sample(stat, since_last > 0 ? since_last : interval);
+        pipestat_draw(stat, elapsed);
+
+        pthread_mutex_lock(&stat->lock);
+    }
+    pthread_mutex_unlock(&stat->lock);
+    return NULL;
+}
+
+/**
+ * Starts watching a pipeline whose stages are already running
+ * pids[i] is 0 for builtin stages, relay_fds[i] are the relay's {in, out} or -1
+ */
+static struct pipestat *start_pipestat(int stage_count, pid_t *pids, char names[][PIPESTAT_NAME_SIZE],
+                                       int relay_fds[][2])
+{
+    struct pipestat *stat = calloc(1, sizeof(struct pipestat));
+    if (stat == NULL)
+        return NULL;
+    stat->stage_count = stage_count;
+    stat->live_tty = isatty(STDERR_FILENO);
+    pthread_mutex_init(&stat->lock, NULL);
+    pthread_cond_init(&stat->finished, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &stat->started);
+
+    for (int i = 0; i < stage_count; i++)
+    {
+        stat->stages[i].pid = pids[i];
+        memcpy(stat->stages[i].name, names[i], PIPESTAT_NAME_SIZE);
+        if (pids[i] > 0)
+            pipestat_read_stat(&stat->stages[i], 0);
+        stat->stages[i].last_rchar = stat->stages[i].rchar;
+        stat->stages[i].last_wchar = stat->stages[i].wchar;
+        stat->stages[i].last_ticks = stat->stages[i].ticks;
+    }
+    for (int i = 0; i < stage_count - 1; i++)
+    {
+        struct pipestat_link *link = &stat->links[i];
+        pthread_mutex_init(&link->lock, NULL);
+        link->occupancy = -1;
+        if (relay_fds[i][0] >= 0)
+        {
+            link->relaying = 1;
+            link->relay_in = relay_fds[i][0];
+            link->relay_out = relay_fds[i][1];
+            if (pthread_create(&link->relay, NULL, pipestat_relay_main, link) != 0)
+            {
+                // No thread to move the data - close up so the stages see EOF/EPIPE
+                close(link->relay_in);
+                close(link->relay_out);
+                link->relaying = 0;
+                link->closed = 1;
+                fprintf(stderr, "Warning: pipestat couldn't start the relay for link %d\n", i + 1);
+            }
+        }
+    }
+
+    if (pthread_create(&stat->thread, NULL, pipestat_main, stat) != 0)
+        stat->done = 1; // Carry on without the live lines, the relays still run
+    return stat;
+}
+
+/**
+ * Called for each process stage before it's reaped: waits for it to exit
+ * (WNOWAIT leaves the zombie) and reads its final CPU time and bytes written.
+ * By the time the summary prints they're all reaped and /proc has nothing left
+ */
+static void pipestat_final_reading(struct pipestat *stat, int index)
+{
+    struct pipestat_stage *stage = &stat->stages[index];
+    if (stage->pid <= 0)
+        return;
+    timed_job_wait(stage->pid); // So a timeout can still step in while we wait
+    siginfo_t info;
+    int waited;
+    while ((waited = waitid(P_PID, stage->pid, &info, WEXITED | WNOWAIT)) < 0 && errno == EINTR)
+        ;
+    if (waited < 0)
+        return;
+
+    // Read into a copy, the sampler thread may be looking at the stage right now
+    struct pipestat_stage last = {0};
+    last.pid = stage->pid;
+    if (pipestat_read_stat(&last, 1))
+    {
+        stage->final_ticks = last.ticks;
+        stage->final_wchar = last.wchar;
+        stage->has_final = 1;
+    }
+}
+
+// Stops the sampler once every stage has exited and prints the summary
+static void finish_pipestat(struct pipestat *stat)
+{
+    pthread_mutex_lock(&stat->lock);
+    int sampler_running = !stat->done;
+    stat->done = 1;
+    pthread_cond_signal(&stat->finished);
+    pthread_mutex_unlock(&stat->lock);
+    if (sampler_running)
+        pthread_join(stat->thread, NULL);
+    for (int i = 0; i < stat->stage_count - 1; i++)
+    {
+        if (stat->links[i].relaying)
+        {
+            pthread_join(stat->links[i].relay, NULL);
+        }
+        pthread_mutex_destroy(&stat->links[i].lock);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - stat->started.tv_sec) + (now.tv_nsec - stat->started.tv_nsec) / 1e9;
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+    fprintf(stderr, "pipestat summary (%.2f s):\n", elapsed);
+    int limiting = -1, most_cpu = -1;
+    double most_busy = -1;
+    unsigned long long most_ticks = 0;
+    for (int i = 0; i < stat->stage_count; i++)
+    {
+        struct pipestat_stage *stage = &stat->stages[i];
+        if (stage->pid == 0)
+        {
+            fprintf(stderr, "  [%d] %-14.14s (builtin, not sampled)\n", i + 1, stage->name);
+            continue;
+        }
+        // The totals from right before it was reaped, the last sample can be a second old
+        unsigned long long ticks = stage->has_final ? stage->final_ticks : stage->ticks;
+        unsigned long long wrote = stage->has_final ? stage->final_wchar : stage->wchar;
+        int samples = stage->samples > 0 ? stage->samples : 1;
+        double busy = 100.0 * stage->busy / samples;
+        fprintf(stderr, "  [%d] %-14.14s cpu %7.2f s  wrote %9.1f MB  busy %3.0f%%  waiting for input %3.0f%%  "
+                        "waiting for output %3.0f%%\n",
+                i + 1, stage->name, (double)ticks / ticks_per_second, wrote / 1e6, busy,
+                100.0 * stage->waiting_input / samples, 100.0 * stage->waiting_output / samples);
+        if (stage->samples > 0 && busy > most_busy)
+        {
+            most_busy = busy;
+            limiting = i;
+        }
+        if (ticks > most_ticks)
+        {
+            most_ticks = ticks;
+            most_cpu = i;
+        }
+    }
+    for (int i = 0; i < stat->stage_count - 1; i++)
+    {
+        if (stat->links[i].relaying)
+            fprintf(stderr, "  link %d->%d moved %.1f MB (%.1f MB/s)\n", i + 1, i + 2, stat->links[i].bytes / 1e6,
+                    stat->links[i].bytes / 1e6 / (elapsed > 0 ? elapsed : 1));
+    }
+
+    // Builtin stages are threads we can't sample, so if every process spent
+    // most of its time waiting the builtin is the one they were waiting on
+    int builtin_blamed = 0;
+    for (int i = 0; i < stat->stage_count && !builtin_blamed && (limiting < 0 || most_busy < 50); i++)
+    {
+        if (stat->stages[i].pid == 0)
+        {
+            fprintf(stderr, "Limiting stage: probably [%d] %s (the sampled stages mostly wait)\n", i + 1,
+                    stat->stages[i].name);
+            builtin_blamed = 1;
+        }
+    }
+
+    if (builtin_blamed)
+        fprintf(stderr, "(builtins run on threads, so pipestat can't see how busy they are)\n");
+    else if (limiting >= 0)
+        fprintf(stderr, "Limiting stage: [%d] %s (busy %.0f%% of the time, the others wait on it)\n", limiting + 1,
+                stat->stages[limiting].name, most_busy);
+    else if (most_cpu >= 0)
+        fprintf(stderr, "Limiting stage: probably [%d] %s (finished before the first sample, used the most CPU)\n",
+                most_cpu + 1, stat->stages[most_cpu].name);
+    else
+        fprintf(stderr, "Pipeline finished before the first sample, nothing to blame\n");
+
+    pthread_mutex_destroy(&stat->lock);
+    pthread_cond_destroy(&stat->finished);
+    free(stat);
+}
+
+/**
+ * Reads "place OPTIONS --" or "limit OPTIONS --" off the front of a command into place
+ * (both take either kind of option). Cuts the line at the --
+ * Returns where the command starts (the line itself if there's no prefix), or NULL if it was bad
+ */
+static char *take_job_prefix(char *line, struct placement *place)
+{
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if ((strncmp(line, "place", 5) != 0 && strncmp(line, "limit", 5) != 0) || (line[5] != ' ' && line[5] != '\t'))
+        return line;
+
+    char *options_end = strstr(line, " --");
+    if (options_end == NULL)
+    {
+        fprintf(stderr, "Usage: place|limit [pin=auto|LIST] [nice=N] [sched=batch|idle|other] [mem=SIZE] [cpu=N%%] "
+                        "[nofile=N] -- command [| command...]\n");
+        return NULL;
+    }
+    *options_end = '\0';
+    char *leftover = take_placement_prefix(line + 5, place, 1);
+    if (leftover == NULL)
+        return NULL;
+    if (*leftover != '\0')
+    {
+        fprintf(stderr, "Error: %.5s only takes pin=, nice=, sched=, mem=, cpu= and nofile= before --\n", line);
+        return NULL;
+    }
+    return options_end + 3;
+}
+
+/**
+ * Redirections for a builtin pipeline stage. It's a thread sharing our fd table,
+ * so < > and >> can't be dup2()ed onto 0 and 1 - the files become its in_fd and
+ * out_fd instead. A 2> file gets made like it would for a program, but the builtin's
+ * own error messages still go to our stderr. Anything that needs the fd table
+ * itself (2>&1, &>, n>&-, >z, fds above 2) is refused
+ * Returns 1 with in_fd and out_fd set (-1 = not redirected), 0 after an error
+ */
+static int open_stage_redirections(const char *name, const struct file_actions *actions, int *in_fd, int *out_fd)
+{
+    *in_fd = *out_fd = -1;
+    for (int i = 0; i < actions->count; i++)
+    {
+        const struct file_action *action = &actions->list[i];
+        int fd = -1;
+        if (action->kind != FILE_ACTION_OPEN || action->fd > STDERR_FILENO)
+            fprintf(stderr, "Error: %s runs on a thread in a pipeline, so it only takes <, >, >> and 2> redirections\n",
+                    name);
+        else if ((fd = open(action->path, action->flags | O_CLOEXEC, 0644)) < 0)
+            fprintf(stderr, "w25shell: %s: %s\n", action->path, strerror(errno));
+        if (fd < 0)
+        {
+            if (*in_fd >= 0)
+                close(*in_fd);
+            if (*out_fd >= 0)
+                close(*out_fd);
+            return 0;
+        }
+
+        int *slot = action->fd == STDIN_FILENO ? in_fd : action->fd == STDOUT_FILENO ? out_fd : NULL;
+        if (slot == NULL)
+        {
+            close(fd); // 2>: the file is made, that's all we can do for a thread
+            continue;
+        }
+        if (*slot >= 0)
+            close(*slot); // The last one wins, same as bash
+        *slot = fd;
+    }
+    return 1;
+}
+
+/**
+ * This function handles commands with multiple pipes like "ls | grep txt | wc -l"
+ * I had to learn a lot about pipes to make this work!
+ * Stage here_stage reads here_fd instead of the pipe (or our stdin) in front of it,
+ * that's how "cat <<< hi | tr a-z A-Z" gets its text. The caller still closes here_fd
+ */
+static int run_pipeline(char *input, int here_stage, int here_fd)
+{
+    // First I need to make a copy of the input string because strtok will change it
+    // I learned this the hard way when my original input got messed up
+    char my_input_copy[MAX_INPUT_SIZE];
+    strcpy(my_input_copy, input);
+    char *pipeline = my_input_copy;
+
+    // "pipestat [--relay] a | b" watches the pipeline while it runs
+    int watching = 0, relaying = 0;
+    if (strncmp(pipeline, "pipestat", 8) == 0 && (pipeline[8] == ' ' || pipeline[8] == '\t'))
+    {
+        watching = 1;
+        pipeline += 8;
+        while (*pipeline == ' ' || *pipeline == '\t')
+            pipeline++;
+        if (strncmp(pipeline, "--relay", 7) == 0 && (pipeline[7] == ' ' || pipeline[7] == '\t'))
+        {
+            relaying = 1;
+            pipeline += 7;
+            while (*pipeline == ' ' || *pipeline == '\t')
+                pipeline++;
+        }
+    }
+
+    // "place pin=auto nice=5 -- a | b" sets placement for every stage, and
+    // "limit mem=2G cpu=150% -- a | b" limits the whole job
+    struct placement pipeline_place;
+    placement_reset(&pipeline_place);
+    pipeline = take_job_prefix(pipeline, &pipeline_place);
+    if (pipeline == NULL)
+        return 0;
+
+    // Now I need to count how many pipe symbols are in the command
+    // This tells me how many commands the user wants to connect
+    int number_of_pipes = 0;
+    int position = 0;
+
+    // Loop through each character and count the pipes
+    while (pipeline[position] != '\0')
+    {
+        if (pipeline[position] == '|')
+        {
+            number_of_pipes = number_of_pipes + 1; // Count this pipe
+        }
+        position = position + 1;
+    }
+
+    // Professor said we only need to support up to 5 pipes
+    if (number_of_pipes > 5)
+    {
+        fprintf(stderr, "Error: Too many pipes! I can only handle 5 pipe operations\n");
+        return 0; // Return error
+    }
+
+    // Figure out how many commands we have (always 1 more than pipes)
+    // For example: "ls | grep | wc" has 2 pipes but 3 commands
+    int number_of_commands = number_of_pipes + 1;
+
+    // Make an array to store each command as a string
+    char *command_strings[MAX_COMMANDS];
+
+    // Split the input at each pipe symbol
+    char *part = strtok(pipeline, "|");
+    int command_index = 0;
+
+    // Get all the command parts and store them
+    while (part != NULL && command_index < number_of_commands)
+    {
+        // Remove spaces at the beginning of commands
+        // I noticed these cause problems with execution
+        while (*part == ' ')
+        {
+            part++; // Move past space
+        }
+
+        // Save this command
+        command_strings[command_index] = part;
+        command_index++;
+
+        // Get the next command part
+        part = strtok(NULL, "|");
+    }
+
+    // Now I need to create actual pipe connections between commands
+    // Each pipe has 2 ends: read end and write end
+    int my_pipes[MAX_COMMANDS - 1][2]; // Need one pipe between each pair of commands
+
+    // Create all the pipes we need
+    for (int i = 0; i < number_of_pipes; i++)
+    {
+        // The pipe() function creates a pipe and puts file descriptors in my_pipes[i][0] and my_pipes[i][1]
+        // O_CLOEXEC means each child only keeps the two ends it gets as stdin/stdout
+        if (pipe2(my_pipes[i], O_CLOEXEC) < 0)
+        {
+            // Uh oh, pipe creation failed
+            perror("Oh no! Can't create pipe");
+            return 0;
+        }
+    }
+
+    // With --relay each writer gets its own pipe and a relay thread splices it
+    // into my_pipes[i], so the shell sees every byte that crosses the link
+    int writer_end[MAX_COMMANDS - 1];
+    int relay_fds[MAX_COMMANDS - 1][2];
+    for (int i = 0; i < number_of_pipes; i++)
+    {
+        writer_end[i] = my_pipes[i][1];
+        relay_fds[i][0] = relay_fds[i][1] = -1;
+        int upstream[2];
+        if (relaying && pipe2(upstream, O_CLOEXEC) == 0)
+        {
+            writer_end[i] = upstream[1];
+            relay_fds[i][0] = upstream[0];
+            relay_fds[i][1] = my_pipes[i][1];
+        }
+    }
+    char stage_names[MAX_COMMANDS][PIPESTAT_NAME_SIZE];
+
+    // Now for the tricky part - creating a process for each command
+    pid_t child_pids[MAX_COMMANDS]; // Store the process IDs
+
+    // Builtin stages run on threads instead, and those threads own (and close)
+    // their pipe ends, so the parent must not close them below
+    struct stage_thread *stage_threads[MAX_COMMANDS] = {NULL};
+    int fd_owned_by_thread[MAX_COMMANDS - 1][2] = {{0}};
+
+    // A builtin writing straight to fd 1 must not overtake our own buffered output
+    fflush(stdout);
+
+    // CPUs for pin=auto, worked out the first time a stage asks for one
+    int auto_cpus[MAX_COMMANDS];
+    int auto_cpus_ready = -1;
+
+    // mem=/cpu= get the job its own cgroup, which every stage copies from pipeline_place
+    create_job_cgroup(&pipeline_place);
+
+    // Create a process for each command
+    for (int cmd_idx = 0; cmd_idx < number_of_commands; cmd_idx++)
+    {
+        // First, break down this command into its arguments
+        char *cmd_args[MAX_ARGS + 1]; // +1 because execvp needs NULL at the end
+
+        // This stage's own pin=/nice=/sched= words go on top of the pipeline's
+        struct placement stage_place = pipeline_place;
+        char *stage_text = take_placement_prefix(command_strings[cmd_idx], &stage_place, 0);
+        if (stage_text == NULL)
+            return 0;
+        if (stage_place.pin_auto)
+        {
+            if (auto_cpus_ready < 0)
+                auto_cpus_ready = pick_auto_cpus(number_of_commands, auto_cpus);
+            if (auto_cpus_ready)
+            {
+                CPU_ZERO(&stage_place.cpus);
+                CPU_SET(auto_cpus[cmd_idx], &stage_place.cpus);
+                stage_place.has_cpus = 1;
+            }
+        }
+        int placed = placement_is_set(&stage_place);
+
+        // Split command into arguments (program name and its options)
+        // and pull out any redirections like 2>err.txt as we go
+        struct file_actions stage_actions;
+        int num_args = split_redirections(stage_text, cmd_args, MAX_ARGS, &stage_actions);
+        if (num_args < 0)
+            return 0;
+
+        // Check if command has valid number of arguments (rule 3 of assignment)
+        if (num_args == 0 || num_args > MAX_ARGS)
+        {
+            fprintf(stderr, "Error: Each command must have between 1 and 5 arguments\n");
+            return 0;
+        }
+        const char *short_name = strrchr(cmd_args[0], '/');
+        snprintf(stage_names[cmd_idx], PIPESTAT_NAME_SIZE, "%s", short_name != NULL ? short_name + 1 : cmd_args[0]);
+
+        // In-process builtins (like find-text) become a thread - no fork or exec
+        struct builtin_command *builtin = find_stage_builtin(cmd_args[0]);
+        int redirected_in = -1, redirected_out = -1;
+        if (builtin != NULL && !open_stage_redirections(cmd_args[0], &stage_actions, &redirected_in, &redirected_out))
+            return 0;
+        if (builtin != NULL)
+        {
+            struct stage_thread *stage = calloc(1, sizeof(struct stage_thread));
+            // The thread outlives cmd_copy, so it gets its own (expanded) argv
+            if (stage == NULL || (stage->argv = expand_command_args(cmd_args)) == NULL)
+            {
+                fprintf(stderr, "Error: Out of memory starting %s\n", cmd_args[0]);
+                free(stage);
+                if (redirected_in >= 0)
+                    close(redirected_in);
+                if (redirected_out >= 0)
+                    close(redirected_out);
+                return 0;
+            }
+            while (stage->argv[stage->argc] != NULL)
+                stage->argc++;
+            stage->builtin = builtin;
+
+            // Same pipe wiring a child would get (the thread closes its in_fd, so it gets its own here_fd)
+            // A < or > file on the stage wins over the pipe, and then the pipe end stays ours to close
+            stage->in_fd = STDIN_FILENO;
+            stage->out_fd = STDOUT_FILENO;
+            if (redirected_in >= 0)
+            {
+                stage->in_fd = redirected_in;
+            }
+            else if (cmd_idx == here_stage && here_fd != STDIN_FILENO)
+            {
+                stage->in_fd = fcntl(here_fd, F_DUPFD_CLOEXEC, 0);
+                if (stage->in_fd < 0)
+                    stage->in_fd = STDIN_FILENO;
+            }
+            else if (cmd_idx > 0)
+            {
+                stage->in_fd = my_pipes[cmd_idx - 1][0];
+                fd_owned_by_thread[cmd_idx - 1][0] = 1;
+            }
+            if (redirected_out >= 0)
+            {
+                stage->out_fd = redirected_out;
+            }
+            else if (cmd_idx < number_of_commands - 1)
+            {
+                stage->out_fd = writer_end[cmd_idx];
+                fd_owned_by_thread[cmd_idx][1] = 1;
+            }
+
+            if (pthread_create(&stage->thread, NULL, stage_thread_main, stage) != 0)
+            {
+                fprintf(stderr, "Error: Couldn't start a thread for %s\n", cmd_args[0]);
+                if (redirected_in >= 0)
+                    close(redirected_in);
+                if (redirected_out >= 0)
+                    close(redirected_out);
+                free_expanded_args(stage->argv);
+                free(stage);
+                return 0;
+            }
+            stage_threads[cmd_idx] = stage;
+            child_pids[cmd_idx] = 0;
+
+            // A thread can be pinned, but nice= and sched= would hit the whole shell
+            if (stage_place.has_cpus)
+                pthread_setaffinity_np(stage->thread, sizeof(stage_place.cpus), &stage_place.cpus);
+            continue;
+        }
+
+        // Expand any *.txt style patterns before we fork
+        char **stage_args = expand_command_args(cmd_args);
+        if (stage_args == NULL)
+        {
+            fprintf(stderr, "Error: Out of memory expanding arguments\n");
+            return 0;
+        }
+
+        // Start the command with its stdin/stdout hooked to the right pipes
+        // (the first command keeps our stdin, the last one keeps our stdout)
+        int stage_in = (cmd_idx > 0) ? my_pipes[cmd_idx - 1][0] : STDIN_FILENO;
+        if (cmd_idx == here_stage)
+            stage_in = here_fd;
+        int stage_out = (cmd_idx < number_of_commands - 1) ? writer_end[cmd_idx] : STDOUT_FILENO;
+        // pipestat reads each stage's totals from its zombie, so it has to be our own child
+        zygote_bypass = watching;
+        child_pids[cmd_idx] = spawn_program_placed(stage_args, stage_in, stage_out, &stage_actions,
+                                                   placed ? &stage_place : NULL);
+        zygote_bypass = 0;
+        free_expanded_args(stage_args);
+
+        // Check if fork worked
+        if (child_pids[cmd_idx] < 0)
+        {
+            perror("Fork failed! Can't create process");
+            return 0;
+        }
+    }
+
+    // Parent process code (continues here after creating all children)
+
+    // Parent should close all pipe ends since it doesn't use them
+    // Otherwise pipes won't close properly
+    for (int p = 0; p < number_of_pipes; p++)
+    {
+        if (!fd_owned_by_thread[p][0])
+            close(my_pipes[p][0]); // Close read end
+        if (!fd_owned_by_thread[p][1])
+            close(writer_end[p]); // Close write end
+        // (a relay's two fds belong to its thread, it closes them when the data stops)
+    }
+
+    struct pipestat *stat = NULL;
+    if (watching)
+    {
+        stat = start_pipestat(number_of_commands, child_pids, stage_names, relay_fds);
+        if (stat == NULL)
+            fprintf(stderr, "Warning: pipestat is out of memory, running without it\n");
+        for (int p = 0; p < number_of_pipes && stat == NULL; p++)
+        {
+            if (relay_fds[p][0] >= 0)
+            {
+                close(relay_fds[p][0]);
+                close(relay_fds[p][1]);
+            }
+        }
+    }
+
+    // Wait for all child processes (and builtin threads) to finish
+    for (int c = 0; c < number_of_commands; c++)
+    {
+        if (stage_threads[c] != NULL)
+        {
+            pthread_join(stage_threads[c]->thread, NULL);
+            if (c == number_of_commands - 1)
+                last_exit_status = stage_threads[c]->exit_status;
+            free_expanded_args(stage_threads[c]->argv);
+            free(stage_threads[c]);
+            continue;
+        }
+
+        int stage_status;
+        if (stat != NULL)
+            pipestat_final_reading(stat, c);
+        if (wait_program(child_pids[c], &stage_status) && c == number_of_commands - 1)
+            remember_exit_status(stage_status); // The pipeline's status is the last command's
+    }
+
+    if (stat != NULL)
+        finish_pipestat(stat);
+    finish_job_cgroup(&pipeline_place);
+
+    // Everything worked!
+    return 1;
+}
+
+int handle_multi_pipe(char *input)
+{
+    return run_pipeline(input, 0, STDIN_FILENO);
+}
+
+/**
+ * place-bench [MB]
+ * Pushes MB of data through a 4 stage pipeline (head | cat | cat | wc) a few
+ * times without any placement and then with pin=auto, and prints the best
+ * MB/s of each so you can see what pinning does on this machine
+ */
+int run_place_bench(char **args)
+{
+    int megabytes = args[1] ? atoi(args[1]) : 1024;
+    if (megabytes <= 0)
+    {
+        fprintf(stderr, "Usage: place-bench [MB]\n");
+        return 2;
+    }
+
+    int chosen[4];
+    if (pick_auto_cpus(4, chosen))
+        printf("pin=auto picks CPUs %d, %d, %d, %d\n", chosen[0], chosen[1], chosen[2], chosen[3]);
+    else
+        printf("No CPU topology in /sys, pin=auto won't pin anything\n");
+
+    const char *labels[2] = {"unpinned", "pin=auto"};
+    const char *prefixes[2] = {"", "place pin=auto -- "};
+    for (int mode = 0; mode < 2; mode++)
+    {
+        double best = 0;
+        for (int round = 0; round < 3; round++)
+        {
+            char line[MAX_INPUT_SIZE];
+            snprintf(line, sizeof(line), "%shead -c %dM /dev/zero | cat | cat | wc -c >/dev/null",
+                     prefixes[mode], megabytes);
+            struct timespec started, finished;
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            if (!handle_multi_pipe(line) || last_exit_status != 0)
+                return 1;
+            clock_gettime(CLOCK_MONOTONIC, &finished);
+            double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+            if (megabytes / seconds > best)
+                best = megabytes / seconds;
+        }
+        printf("%-9s %8.0f MB/s (best of 3, %d MB)\n", labels[mode], best, megabytes);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+/**
+ * This function handles reverse piping with the = symbol
+ * It's like regular piping but runs commands in reverse order
+ */
+int handle_reverse_pipe(char *input)
+{
+    // Need to copy the input because strtok will change it
+    char copied_input[MAX_INPUT_SIZE];
+    strcpy(copied_input, input);
+
+    // Count how many = symbols are in the command
+    int reverse_pipe_count = 0;
+    for (int index = 0; input[index] != '\0'; index++)
+    {
+        if (input[index] == '=')
+            reverse_pipe_count++;
+    }
+
+    // Assignment says maximum 5 pipe operations
+    if (reverse_pipe_count > 5)
+    {
+        fprintf(stderr, "Error: Maximum 5 reverse pipe operations are supported\n");
+        return 0;
+    }
+
+    // Calculate how many commands we have
+    int command_count = reverse_pipe_count + 1;
+
+    // Make an array to store all the commands
+    char *command_list[MAX_COMMANDS];
+
+    // Split the input by = symbol to get each command
+    char *command_piece = strtok(copied_input, "=");
+    int index = 0;
+
+    // Get each command and store it
+    while (command_piece != NULL && index < command_count)
+    {
+        // Remove spaces at the beginning
+        while (*command_piece == ' ')
+            command_piece++;
+
+        // Store this command
+        command_list[index] = command_piece;
+        index++;
+
+        // Get next command
+        command_piece = strtok(NULL, "=");
+    }
+
+    // Need to make pipes to connect the commands
+    // Each pipe connects two commands together
+    int pipe_array[MAX_COMMANDS - 1][2];
+
+    // Create all the pipes we need
+    for (int p = 0; p < reverse_pipe_count; p++)
+    {
+        if (pipe2(pipe_array[p], O_CLOEXEC) < 0)
+        {
+            perror("Error creating pipe");
+            return 0;
+        }
+    }
+
+    // For reverse piping, we need to start from the last command
+    // This is different from regular piping!
+    pid_t process_ids[MAX_COMMANDS];
+
+    // Create processes in reverse order (from right to left)
+    for (int cmd_index = command_count - 1; cmd_index >= 0; cmd_index--)
+    {
+        // We need to break down each command into its parts (and its redirections)
+        char *arguments[MAX_ARGS + 1];
+        struct file_actions stage_actions;
+        int arg_count = split_redirections(command_list[cmd_index], arguments, MAX_ARGS, &stage_actions);
+        if (arg_count < 0)
+            return 0;
+
+        // Check if command has valid number of arguments
+        if (arg_count == 0 || arg_count > MAX_ARGS)
+        {
+            fprintf(stderr, "Error: Each command must have between 1 and 5 arguments\n");
+            return 0;
+        }
+
+        // Expand any glob patterns in the arguments
+        char **expanded_args = expand_command_args(arguments);
+        if (expanded_args == NULL)
+        {
+            fprintf(stderr, "Error: Out of memory expanding arguments\n");
+            return 0;
+        }
+
+        // The tricky part - connecting pipes in reverse
+        // The rightmost command reads our stdin, the leftmost writes our stdout
+        int stage_in = (cmd_index < command_count - 1) ? pipe_array[cmd_index][0] : STDIN_FILENO;
+        int stage_out = (cmd_index > 0) ? pipe_array[cmd_index - 1][1] : STDOUT_FILENO;
+        process_ids[cmd_index] = spawn_program_redirected(expanded_args, stage_in, stage_out, &stage_actions);
+        free_expanded_args(expanded_args);
+
+        if (process_ids[cmd_index] < 0)
+        {
+            perror("Error forking process");
+            return 0;
+        }
+    }
+
+    // Parent process needs to close all pipes
+    for (int p = 0; p < reverse_pipe_count; p++)
+    {
+        close(pipe_array[p][0]);
+        close(pipe_array[p][1]);
+    }
+
+    // Wait for all children to finish
+    for (int c = 0; c < command_count; c++)
+    {
+        int stage_status;
+        if (wait_program(process_ids[c], &stage_status) && c == 0)
+            remember_exit_status(stage_status); // Leftmost command writes the final output
+    }
+
+    return 1; // Success
+}
+
+/**
+ * Reading the stats back: the "stats" builtin and the Prometheus text file
+ */
+static char metrics_path[PATH_MAX]; // --metrics-file, "" when off
+static double metrics_interval = 15;
+static pid_t metrics_owner;          // Only this process writes the file
+
+// Latency at fraction (0.5 = median) of the histogram, in us (middle of its bucket)
+static uint64_t stats_percentile(const struct latency_histogram *histogram, double fraction)
+{
+    uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    if (count == 0)
+        return 0;
+    // Nearest rank: the ceil(fraction * count)-th smallest sample, counting from 1
+    // (so p50 of 2 samples is the lower one), done without libm
+    double scaled = fraction * count;
+    uint64_t rank = (uint64_t)scaled;
+    if ((double)rank < scaled)
+        rank++;
+    rank = rank > 0 ? rank - 1 : 0;
+    if (rank >= count)
+        rank = count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+    {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (seen > rank)
+        {
+            uint64_t width;
+            uint64_t value = stats_bucket_start(i, &width) + width / 2;
+            return value < histogram->max_us ? value : histogram->max_us;
+        }
+    }
+    return histogram->max_us;
+}
+
+static void format_latency(uint64_t us, char *text, size_t size)
+{
+    if (us < 1000)
+        snprintf(text, size, "%lluus", (unsigned long long)us);
+    else if (us < 1000000)
+        snprintf(text, size, "%.2fms", us / 1e3);
+    else
+        snprintf(text, size, "%.2fs", us / 1e6);
+}
+
+static void print_histogram_row(const char *name, const struct latency_histogram *histogram)
+{
+    uint64_t count = histogram->count;
+    if (count == 0)
+        return;
+    char p50[24], p90[24], p99[24], max[24], mean[24];
+    format_latency(stats_percentile(histogram, 0.50), p50, sizeof(p50));
+    format_latency(stats_percentile(histogram, 0.90), p90, sizeof(p90));
+    format_latency(stats_percentile(histogram, 0.99), p99, sizeof(p99));
+    format_latency(histogram->max_us, max, sizeof(max));
+    format_latency(histogram->sum_us / count, mean, sizeof(mean));
+    printf("  %-16.16s %8llu %9s %9s %9s %9s %9s\n", name, (unsigned long long)count, p50, p90, p99, max, mean);
+}
+
+// Adds one Prometheus histogram (coarse le= buckets summed from the fine ones)
+static void metrics_add_histogram(struct text_buffer *out, const char *metric, const char *label, const char *value,
+                                  const struct latency_histogram *histogram)
+{
+    static const double bounds[] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+                                    0.5,    1,     2.5,    5,     10,   30,    60,   300};
+    char line[512];
+    int bucket = 0;
+    uint64_t below = 0;
+    for (size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++)
+    {
+        // A fine bucket counts once it fits under the bound completely
+        uint64_t limit_us = (uint64_t)(bounds[b] * 1e6);
+        uint64_t width;
+        while (bucket < STATS_BUCKETS && stats_bucket_start(bucket, &width) + width <= limit_us)
+            below += histogram->buckets[bucket++];
+        int length = snprintf(line, sizeof(line), "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", metric, label, value,
+                              bounds[b], (unsigned long long)below);
+        text_buffer_add(out, line, length);
+    }
+    int length = snprintf(line, sizeof(line),
+                          "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n%s_sum{%s=\"%s\"} %.6f\n%s_count{%s=\"%s\"} %llu\n",
+                          metric, label, value, (unsigned long long)histogram->count, metric, label, value,
+                          histogram->sum_us / 1e6, metric, label, value, (unsigned long long)histogram->count);
+    text_buffer_add(out, line, length);
+}
+
+// Builds the whole metrics text in Prometheus' text format
+static int build_metrics_text(struct text_buffer *out)
+{
+    char line[512];
+    int length;
+
+    length = snprintf(line, sizeof(line),
+                      "# HELP w25shell_line_duration_seconds Time to run a command line, by operator\n"
+                      "# TYPE w25shell_line_duration_seconds histogram\n");
+    text_buffer_add(out, line, length);
+    for (int op = 0; op < STATS_OP_COUNT; op++)
+        if (shell_stats->operators[op].count > 0)
+            metrics_add_histogram(out, "w25shell_line_duration_seconds", "operator", stats_operator_names[op],
+                                  &shell_stats->operators[op]);
+
+    length = snprintf(line, sizeof(line),
+                      "# HELP w25shell_command_duration_seconds Time from starting a program to reaping it\n"
+                      "# TYPE w25shell_command_duration_seconds histogram\n");
+    text_buffer_add(out, line, length);
+    int commands = __atomic_load_n(&shell_stats->command_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i <= commands; i++)
+    {
+        int slot = (i == commands) ? STATS_MAX_COMMANDS : i;
+        if (shell_stats->commands[slot].count == 0)
+            continue;
+        // Label values need \, " and newlines escaped
+        char escaped[STATS_NAME_SIZE * 2];
+        const char *name = (i == commands) ? "(other)" : shell_stats->command_names[i];
+        size_t used = 0;
+        for (; *name != '\0' && used < sizeof(escaped) - 3; name++)
+        {
+            if (*name == '\\' || *name == '"' || *name == '\n')
+                escaped[used++] = '\\';
+            escaped[used++] = (*name == '\n') ? 'n' : *name;
+        }
+        escaped[used] = '\0';
+        metrics_add_histogram(out, "w25shell_command_duration_seconds", "command", escaped, &shell_stats->commands[slot]);
+    }
+
+    length = snprintf(line, sizeof(line),
+                      "# HELP w25shell_forks_total Programs started by the shell or its zygote\n"
+                      "# TYPE w25shell_forks_total counter\nw25shell_forks_total %llu\n"
+                      "# HELP w25shell_exec_failures_total Programs that couldn't be executed\n"
+                      "# TYPE w25shell_exec_failures_total counter\nw25shell_exec_failures_total %llu\n"
+                      "# HELP w25shell_file_operator_bytes_total File data processed by the ~, # and + operators\n"
+                      "# TYPE w25shell_file_operator_bytes_total counter\n",
+                      (unsigned long long)shell_stats->forks, (unsigned long long)shell_stats->exec_failures);
+    text_buffer_add(out, line, length);
+    int file_operators[] = {STATS_OP_APPEND, STATS_OP_WORD_COUNT, STATS_OP_CONCAT};
+    for (int i = 0; i < 3; i++)
+    {
+        length = snprintf(line, sizeof(line), "w25shell_file_operator_bytes_total{operator=\"%s\"} %llu\n",
+                          stats_operator_names[file_operators[i]],
+                          (unsigned long long)shell_stats->operator_bytes[file_operators[i]]);
+        text_buffer_add(out, line, length);
+    }
+    return out->data != NULL;
+}
+
+// Writes the file next to itself and renames it, so node_exporter never reads half of it
+static void write_metrics_file(void)
+{
+    if (shell_stats == NULL || metrics_path[0] == '\0')
+        return;
+    struct text_buffer text = {NULL, 0, 0};
+    char temporary[PATH_MAX + 8];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", metrics_path);
+    if (build_metrics_text(&text))
+    {
+        int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0)
+        {
+            int ok = write_all(fd, text.data, text.length);
+            close(fd);
+            if (!ok || rename(temporary, metrics_path) < 0)
+                unlink(temporary);
+        }
+    }
+    free(text.data);
+}
+
+static void *metrics_thread_main(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        struct timespec pause = {(time_t)metrics_interval,
+                                 (long)((metrics_interval - (time_t)metrics_interval) * 1e9)};
+        while (nanosleep(&pause, &pause) < 0 && errno == EINTR)
+            ;
+        write_metrics_file();
+    }
+    return NULL;
+}
+
+// One last write when the shell exits (killterm calls exit())
+static void write_metrics_at_exit(void)
+{
+    if (getpid() == metrics_owner)
+        write_metrics_file();
+}
+
+// Starts the background writer for --metrics-file
+static void start_metrics_export(void)
+{
+    if (shell_stats == NULL || metrics_path[0] == '\0')
+        return;
+    metrics_owner = getpid();
+    atexit(write_metrics_at_exit);
+    write_metrics_file();
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_thread_main, NULL) == 0)
+        pthread_detach(thread);
+    else
+        fprintf(stderr, "Warning: couldn't start the metrics writer, %s is only written at exit\n", metrics_path);
+}
+
+/**
+ * stats            latency table per operator and per command, plus counters
+ * stats reset      start counting again
+ * stats prometheus the same numbers in the --metrics-file format
+ */
+int run_stats_command(char **args)
+{
+    if (shell_stats == NULL)
+    {
+        fprintf(stderr, "stats: not available (couldn't map the shared stats memory)\n");
+        return 1;
+    }
+    if (args[1] != NULL && strcmp(args[1], "reset") == 0)
+    {
+        pthread_mutex_lock(&shell_stats->names_lock);
+        size_t skip = offsetof(struct shell_stats, command_count);
+        memset((char *)shell_stats + skip, 0, sizeof(struct shell_stats) - skip);
+        pthread_mutex_unlock(&shell_stats->names_lock);
+        return 0;
+    }
+    if (args[1] != NULL && strcmp(args[1], "prometheus") == 0)
+    {
+        struct text_buffer text = {NULL, 0, 0};
+        fflush(stdout);
+        int ok = build_metrics_text(&text) && write_all(STDOUT_FILENO, text.data, text.length);
+        free(text.data);
+        return ok ? 0 : 1;
+    }
+    if (args[1] != NULL)
+    {
+        fprintf(stderr, "Usage: stats [reset|prometheus]\n");
+        return 2;
+    }
+
+    printf("  %-16s %8s %9s %9s %9s %9s %9s\n", "operator", "count", "p50", "p90", "p99", "max", "mean");
+    for (int op = 0; op < STATS_OP_COUNT; op++)
+        print_histogram_row(stats_operator_names[op], &shell_stats->operators[op]);
+    printf("  %-16s %8s %9s %9s %9s %9s %9s\n", "command", "count", "p50", "p90", "p99", "max", "mean");
+    int commands = __atomic_load_n(&shell_stats->command_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < commands; i++)
+        print_histogram_row(shell_stats->command_names[i], &shell_stats->commands[i]);
+    print_histogram_row("(other)", &shell_stats->commands[STATS_MAX_COMMANDS]);
+    printf("forks %llu, exec failures %llu\n", (unsigned long long)shell_stats->forks,
+           (unsigned long long)shell_stats->exec_failures);
+    printf("file operator bytes: ~ %.1f MB, # %.1f MB, + %.1f MB\n", shell_stats->operator_bytes[STATS_OP_APPEND] / 1e6,
+           shell_stats->operator_bytes[STATS_OP_WORD_COUNT] / 1e6, shell_stats->operator_bytes[STATS_OP_CONCAT] / 1e6);
+    return 0;
+}
+
+int run_command_line(char *user_command); // Defined with the script VM further down
+
+/**
+ * watch-run [--debounce MS] [--cancel] [--runs N] [paths...] -- command-line
+ * Runs the line, then sleeps in inotify until one of the paths (or a file the
+ * line's own +, #, ~ or < operators use) changes, and runs it again.
+ * Replaces "while true; do cmd; sleep 1; done" - no polling, no wasted runs.
+ * Every file is watched through its directory, so editors that save by
+ * writing a new file and renaming it over the old one still count.
+ */
+#define WATCH_MAX_TARGETS 32
+#define WATCH_DEFAULT_DEBOUNCE_MS 100
+
+struct watch_target
+{
+    int wd;                // inotify watch on the directory
+    char name[NAME_MAX + 1]; // File in that directory, "" for anything in it
+    char path[PATH_MAX];   // What the user called it, for the messages
+};
+
+static volatile sig_atomic_t watch_interrupted = 0;
+
+static void watch_interrupt_handler(int signal_number)
+{
+    (void)signal_number;
+    watch_interrupted = 1;
+}
+
+// Adds a watch for path (a file, a directory, or a file that doesn't exist yet)
+static int watch_add_target(int inotify_fd, struct watch_target *targets, int *count, const char *path)
+{
+    if (*count == WATCH_MAX_TARGETS)
+    {
+        fprintf(stderr, "watch-run: only %d paths can be watched, ignoring %s\n", WATCH_MAX_TARGETS, path);
+        return 0;
+    }
+    struct watch_target *target = &targets[*count];
+    snprintf(target->path, sizeof(target->path), "%s", path);
+
+    char directory[PATH_MAX];
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISDIR(info.st_mode))
+    {
+        snprintf(directory, sizeof(directory), "%s", path);
+        target->name[0] = '\0';
+    }
+    else
+    {
+        const char *slash = strrchr(path, '/');
+        if (slash == NULL)
+            snprintf(directory, sizeof(directory), ".");
+        else if (slash == path)
+            snprintf(directory, sizeof(directory), "/");
+        else
+            snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path), path);
+        snprintf(target->name, sizeof(target->name), "%s", slash != NULL ? slash + 1 : path);
+    }
+
+    // A second watch on the same directory just gives back the same wd
+    target->wd = inotify_add_watch(inotify_fd, directory,
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB);
+    if (target->wd < 0)
+    {
+        fprintf(stderr, "watch-run: can't watch %s: %s\n", directory, strerror(errno));
+        return 0;
+    }
+    (*count)++;
+    return 1;
+}
+
+/**
+ * Finds the files a command line reads through the shell's own operators:
+ * both sides of ~, every file of + and #, and the word after <
+ * A pattern like *.txt watches its directory instead
+ */
+static void watch_add_operator_files(int inotify_fd, struct watch_target *targets, int *count, const char *line)
+{
+    char copy[MAX_INPUT_SIZE];
+    snprintf(copy, sizeof(copy), "%s", line);
+    int whole_line = strpbrk(copy, "~+#") != NULL;
+
+    char *words[MAX_INPUT_SIZE / 2];
+    int word_count = 0;
+    for (char *word = strtok(copy, " \t"); word != NULL && word_count < MAX_INPUT_SIZE / 2; word = strtok(NULL, " \t"))
+        words[word_count++] = word;
+
+    for (int i = 0; i < word_count; i++)
+    {
+        char *word = words[i];
+        const char *file = NULL;
+        if (word[0] == '<' && word[1] != '<' && word[1] != '(')
+            file = word[1] != '\0' ? word + 1 : (i + 1 < word_count ? words[++i] : NULL);
+        else if (whole_line && strchr("~+#>", word[0]) == NULL && strcmp(word, "top") != 0 && strcmp(word, "-k") != 0 &&
+                 strspn(word, "0123456789") != strlen(word))
+            file = word; // Operands of ~, + and # are file names (after > is the output, not an input)
+        else if (word[0] == '>')
+        {
+            if (word[1] == '\0' || strcmp(word, ">>") == 0)
+                i++; // Skip the output file
+            continue;
+        }
+        if (file == NULL || *file == '\0')
+            continue;
+
+        // "+m" and "#top" are options glued to the operator, not files
+        if (strcmp(file, "m") == 0)
+            continue;
+        if (has_glob_chars(file))
+        {
+            char directory[PATH_MAX];
+            const char *slash = strrchr(file, '/');
+            snprintf(directory, sizeof(directory), "%.*s", slash != NULL ? (int)(slash - file) : 1,
+                     slash != NULL ? file : ".");
+            watch_add_target(inotify_fd, targets, count, directory);
+        }
+        else
+        {
+            watch_add_target(inotify_fd, targets, count, file);
+        }
+    }
+}
+
+// Runs the line in a forked copy of the shell, so we can keep watching (and cancel it)
+static pid_t watch_start_run(char *line)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        signal(SIGINT, SIG_DFL);
+        int status = run_command_line(line);
+        fflush(stdout);
+        _exit(status);
+    }
+    if (pid < 0)
+        perror("watch-run: fork failed");
+    return pid;
+}
+
+// Reads a batch of inotify events, returns the target that matched first (-1 for none)
+static int watch_read_events(int inotify_fd, struct watch_target *targets, int count)
+{
+    char events[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int matched = -1;
+    ssize_t got;
+    while ((got = read(inotify_fd, events, sizeof(events))) > 0)
+    {
+        for (char *at = events; at < events + got;)
+        {
+            struct inotify_event *event = (struct inotify_event *)at;
+            for (int i = 0; i < count && matched < 0; i++)
+            {
+                if (targets[i].wd == event->wd &&
+                    (targets[i].name[0] == '\0' || (event->len > 0 && strcmp(targets[i].name, event->name) == 0)))
+                    matched = i;
+            }
+            at += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return matched;
+}
+
+int run_watch_command(char *line)
+{
+    // Options and paths come before " -- ", the command line after it
+    char copy[MAX_INPUT_SIZE];
+    snprintf(copy, sizeof(copy), "%s", line);
+    char *separator = strstr(copy, " -- ");
+    if (separator == NULL || separator[4] == '\0')
+    {
+        fprintf(stderr, "Usage: watch-run [--debounce MS] [--cancel] [--runs N] [paths...] -- command-line\n");
+        return 2;
+    }
+    *separator = '\0';
+    char *command_line = separator + 4;
+    while (*command_line == ' ')
+        command_line++;
+
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+    {
+        perror("watch-run: inotify_init1");
+        return 1;
+    }
+
+    struct watch_target targets[WATCH_MAX_TARGETS];
+    int target_count = 0;
+    int debounce_ms = WATCH_DEFAULT_DEBOUNCE_MS, cancel = 0;
+    long runs_left = -1;
+    char *word = strtok(copy, " \t");
+    word = strtok(NULL, " \t"); // Skip "watch-run" itself
+    for (; word != NULL; word = strtok(NULL, " \t"))
+    {
+        if (strcmp(word, "--cancel") == 0)
+            cancel = 1;
+        else if (strcmp(word, "--debounce") == 0 || strcmp(word, "--runs") == 0)
+        {
+            char *value = strtok(NULL, " \t");
+            long number = value != NULL ? strtol(value, NULL, 10) : -1;
+            if (number < (strcmp(word, "--runs") == 0 ? 1 : 0))
+            {
+                fprintf(stderr, "watch-run: %s wants a number\n", word);
+                close(inotify_fd);
+                return 2;
+            }
+            if (strcmp(word, "--runs") == 0)
+                runs_left = number;
+            else
+                debounce_ms = (int)number;
+        }
+        else
+            watch_add_target(inotify_fd, targets, &target_count, word);
+    }
+    watch_add_operator_files(inotify_fd, targets, &target_count, command_line);
+    if (target_count == 0)
+    {
+        fprintf(stderr, "watch-run: nothing to watch - name some paths before --\n");
+        close(inotify_fd);
+        return 2;
+    }
+
+    fprintf(stderr, "watch-run: watching %d path%s, Ctrl-C to stop\n", target_count, target_count == 1 ? "" : "s");
+
+    // Ctrl-C ends watch-run (and the run in progress), not the whole shell
+    struct sigaction stop, previous;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = watch_interrupt_handler;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, &previous);
+    watch_interrupted = 0;
+
+    int status = 0;
+    int pending = 1; // Run once straight away
+    pid_t running = -1;
+    int running_pidfd = -1;
+    struct timespec run_started;
+    while (!watch_interrupted)
+    {
+        if (pending && running < 0)
+        {
+            if (runs_left == 0)
+                break;
+            pending = 0;
+            if (runs_left > 0)
+                runs_left--;
+            clock_gettime(CLOCK_MONOTONIC, &run_started);
+            running = watch_start_run(command_line);
+            running_pidfd = running > 0 ? (int)syscall(SYS_pidfd_open, running, 0) : -1;
+            if (running > 0 && running_pidfd < 0)
+            {
+                // No pidfd (old kernel): just wait for this run
+                waitpid(running, &status, 0);
+                running = -1;
+            }
+        }
+
+        struct pollfd watched[2] = {{inotify_fd, POLLIN, 0}, {running_pidfd, POLLIN, 0}};
+        int ready = poll(watched, running >= 0 ? 2 : 1, (runs_left == 0 && running < 0) ? 0 : -1);
+        if (ready < 0)
+            continue; // EINTR, most likely Ctrl-C
+        if (ready == 0 && running < 0 && runs_left == 0)
+            break;
+
+        if (running >= 0 && (watched[1].revents & POLLIN))
+        {
+            waitpid(running, &status, 0);
+            close(running_pidfd);
+            running = -1;
+            remember_exit_status(status);
+            fprintf(stderr, "watch-run: exit %d after %.0f ms\n", last_exit_status,
+                    stats_microseconds_since(&run_started) / 1e3);
+            if (runs_left == 0)
+                break;
+        }
+
+        if (watched[0].revents & POLLIN)
+        {
+            int changed = watch_read_events(inotify_fd, targets, target_count);
+            if (changed < 0)
+                continue;
+
+            // Debounce: a save or a build touches files in bursts, wait for it to go quiet
+            struct pollfd quiet = {inotify_fd, POLLIN, 0};
+            while (!watch_interrupted && poll(&quiet, 1, debounce_ms) > 0)
+                watch_read_events(inotify_fd, targets, target_count);
+
+            fprintf(stderr, "watch-run: %s changed\n", targets[changed].path);
+            pending = 1;
+            if (running >= 0 && cancel)
+            {
+                fprintf(stderr, "watch-run: cancelling the run in progress\n");
+                signal_process_tree(running, SIGTERM);
+            }
+        }
+    }
+
+    if (running >= 0)
+    {
+        signal_process_tree(running, SIGTERM);
+        waitpid(running, &status, 0);
+        close(running_pidfd);
+        remember_exit_status(status);
+    }
+    sigaction(SIGINT, &previous, NULL);
+    close(inotify_fd);
+    if (watch_interrupted)
+        fprintf(stderr, "\nwatch-run: stopped\n");
+    return last_exit_status;
+}
+
+/**
+ * every INTERVAL [options] -- line   and   at HH:MM [options] -- line
+ * A small cron inside a long-running w25shell, so periodic checks don't pay
+ * for a whole new shell each time. Options:
+ *   --overlap skip|queue|kill   what to do if the last run is still going (skip)
+ *   --jitter D                  start each run up to D late, so checks don't all line up
+ * "schedules" lists them and "unschedule ID|all" removes them.
+ *
+ * The schedules live in a hierarchical timer wheel: 4 levels of 64 slots,
+ * a level-0 slot is 10ms and a level-3 slot is ~43 minutes, so it covers
+ * ~46 hours (a daily "at" fits). Adding and removing are O(1). Entries far
+ * away sit in a coarse slot and drop down a level (cascade) as their time
+ * gets close. The prompt sleeps in poll() until the next occupied slot, so
+ * thousands of idle schedules cost nothing but their memory.
+ * Runs only start while the shell waits at the prompt: one that comes due
+ * during a foreground command starts as soon as that command is done.
+ */
+#define WHEEL_TICK_MS 10
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SPAN (1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) // Ticks the wheel can hold
+#define SCHEDULE_POLL_PIDFDS 64
+
+enum schedule_overlap
+{
+    OVERLAP_SKIP,
+    OVERLAP_QUEUE,
+    OVERLAP_KILL
+};
+
+struct schedule
+{
+    int id;
+    char *line;
+    char when[32];   // "every 5s" or "at 02:00", for the listing
+    double interval; // every: seconds between runs
+    int at_minute;   // at: minute of the day, -1 for every
+    double jitter;
+    enum schedule_overlap overlap;
+    uint64_t nominal; // Tick the run is due, before jitter
+    uint64_t expires; // Tick it actually fires
+    int wheel_level, wheel_slot;
+    struct schedule *wheel_next, **wheel_prev; // Slot list, wheel_prev is NULL when not in the wheel
+    struct schedule *next;                     // All schedules, in id order
+    pid_t running;
+    int running_pidfd;
+    int queued;
+    unsigned long runs, skipped, killed;
+    int last_status;
+};
+
+struct timer_wheel
+{
+    uint64_t current;                // Last tick processed
+    struct timespec epoch;           // When tick 0 was
+    uint64_t occupied[WHEEL_LEVELS]; // One bit per non-empty slot
+    struct schedule *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static struct timer_wheel schedule_wheel;
+static struct schedule *schedules;
+static int schedule_count, schedules_running, schedule_next_id = 1;
+static int stdin_closed; // Input ended but schedules keep the shell going
+static uint64_t jitter_state;
+
+static uint64_t wheel_now(void)
+{
+    return stats_microseconds_since(&schedule_wheel.epoch) / (WHEEL_TICK_MS * 1000);
+}
+
+static void wheel_add(struct schedule *s)
+{
+    struct timer_wheel *wheel = &schedule_wheel;
+    uint64_t when = s->expires > wheel->current ? s->expires : wheel->current;
+    if (when - wheel->current >= WHEEL_SPAN)
+        when = wheel->current + WHEEL_SPAN - 1; // Too far: park in the last slot, it gets re-added when it cascades
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && when - wheel->current >= (1ULL << (WHEEL_SLOT_BITS * (level + 1))))
+        level++;
+    int slot = (when >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1);
+
+    s->wheel_level = level;
+    s->wheel_slot = slot;
+    s->wheel_next = wheel->slots[level][slot];
+    if (s->wheel_next != NULL)
+        s->wheel_next->wheel_prev = &s->wheel_next;
+    s->wheel_prev = &wheel->slots[level][slot];
+    wheel->slots[level][slot] = s;
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+static void wheel_remove(struct schedule *s)
+{
+    if (s->wheel_prev == NULL)
+        return;
+    *s->wheel_prev = s->wheel_next;
+    if (s->wheel_next != NULL)
+        s->wheel_next->wheel_prev = s->wheel_prev;
+    if (schedule_wheel.slots[s->wheel_level][s->wheel_slot] == NULL)
+        schedule_wheel.occupied[s->wheel_level] &= ~(1ULL << s->wheel_slot);
+    s->wheel_prev = NULL;
+    s->wheel_next = NULL;
+}
+
+// Takes a whole slot off the wheel and returns its list
+static struct schedule *wheel_take_slot(int level, int slot)
+{
+    struct schedule *list = schedule_wheel.slots[level][slot];
+    schedule_wheel.slots[level][slot] = NULL;
+    schedule_wheel.occupied[level] &= ~(1ULL << slot);
+    for (struct schedule *s = list; s != NULL; s = s->wheel_next)
+        s->wheel_prev = NULL;
+    return list;
+}
+
+/**
+ * Moves the wheel forward to tick target
+ * Returns the schedules that came due, linked through wheel_next
+ */
+static struct schedule *wheel_advance(uint64_t target)
+{
+    struct timer_wheel *wheel = &schedule_wheel;
+    struct schedule *due = NULL;
+    while (wheel->current < target)
+    {
+        // If the low levels are empty nothing can fire or cascade until the
+        // next boundary of the first level that has something, so jump there
+        int empty = 0;
+        while (empty < WHEEL_LEVELS && wheel->occupied[empty] == 0)
+            empty++;
+        if (empty == WHEEL_LEVELS)
+        {
+            wheel->current = target;
+            break;
+        }
+        if (empty > 0)
+        {
+            uint64_t skip_to = wheel->current | ((1ULL << (WHEEL_SLOT_BITS * empty)) - 1);
+            wheel->current = skip_to < target ? skip_to : target;
+            if (wheel->current == target)
+                break;
+        }
+
+        wheel->current++;
+        // Entering a new slot at a higher level brings that slot's entries down
+        for (int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            if (wheel->current & ((1ULL << (WHEEL_SLOT_BITS * level)) - 1))
+                break;
+            int slot = (wheel->current >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1);
+            struct schedule *list = wheel_take_slot(level, slot);
+            while (list != NULL)
+            {
+                struct schedule *next = list->wheel_next;
+                wheel_add(list);
+                list = next;
+            }
+        }
+
+        // Everything in the level-0 slot is due now
+        struct schedule *list = wheel_take_slot(0, wheel->current & (WHEEL_SLOTS - 1));
+        while (list != NULL)
+        {
+            struct schedule *next = list->wheel_next;
+            list->wheel_next = due;
+            due = list;
+            list = next;
+        }
+    }
+    return due;
+}
+
+// Ticks until the wheel next has work: a level-0 slot to fire or a slot to cascade
+static uint64_t wheel_ticks_to_next(void)
+{
+    struct timer_wheel *wheel = &schedule_wheel;
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        uint64_t bits = wheel->occupied[level];
+        if (bits == 0)
+            continue;
+        int shift = WHEEL_SLOT_BITS * level;
+        uint64_t index = wheel->current >> shift;
+        // First occupied slot after the current one, going round
+        int turn = (index + 1) & (WHEEL_SLOTS - 1);
+        uint64_t rotated = turn ? (bits >> turn) | (bits << (WHEEL_SLOTS - turn)) : bits;
+        uint64_t tick = (index + __builtin_ctzll(rotated) + 1) << shift;
+        if (tick - wheel->current < best)
+            best = tick - wheel->current;
+    }
+    return best;
+}
+
+// Seconds from now until the next HH:MM local time (tomorrow if it's passed today)
+static double seconds_until_minute(int minute_of_day)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct tm when;
+    localtime_r(&now.tv_sec, &when);
+    when.tm_hour = minute_of_day / 60;
+    when.tm_min = minute_of_day % 60;
+    when.tm_sec = 0;
+    when.tm_isdst = -1;
+    time_t target = mktime(&when);
+    if (target <= now.tv_sec)
+    {
+        when.tm_mday++;
+        when.tm_hour = minute_of_day / 60;
+        when.tm_min = minute_of_day % 60;
+        when.tm_isdst = -1;
+        target = mktime(&when);
+    }
+    return difftime(target, now.tv_sec) - now.tv_nsec / 1e9;
+}
+
+// Works out the next tick s is due (after now) and puts it on the wheel
+static void schedule_arm(struct schedule *s, int first)
+{
+    uint64_t now = wheel_now();
+    if (s->at_minute >= 0)
+    {
+        s->nominal = now + (uint64_t)(seconds_until_minute(s->at_minute) * 1000 / WHEEL_TICK_MS);
+    }
+    else
+    {
+        uint64_t interval = (uint64_t)(s->interval * 1000 / WHEEL_TICK_MS);
+        if (interval == 0)
+            interval = 1;
+        // Stay on the original grid so runs don't drift; runs missed while
+        // the shell was busy are dropped, not all fired at once
+        s->nominal = first ? now + interval : s->nominal + interval;
+        if (s->nominal <= now)
+            s->nominal += ((now - s->nominal) / interval + 1) * interval;
+    }
+
+    s->expires = s->nominal;
+    if (s->jitter > 0)
+    {
+        jitter_state ^= jitter_state << 13;
+        jitter_state ^= jitter_state >> 7;
+        jitter_state ^= jitter_state << 17;
+        s->expires += jitter_state % ((uint64_t)(s->jitter * 1000 / WHEEL_TICK_MS) + 1);
+    }
+    if (s->expires <= schedule_wheel.current)
+        s->expires = schedule_wheel.current + 1; // The current tick is already processed
+    wheel_add(s);
+}
+
+// Runs the line in a forked copy of the shell, the prompt stays usable
+static void schedule_start_run(struct schedule *s)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int status = run_command_line(s->line);
+        fflush(stdout);
+        _exit(status);
+    }
+    if (pid < 0)
+    {
+        perror("every: fork failed");
+        return;
+    }
+    s->running = pid;
+    s->running_pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    s->runs++;
+    schedules_running++;
+}
+
+static void schedule_finished(struct schedule *s, int status)
+{
+    s->last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (s->running_pidfd >= 0)
+        close(s->running_pidfd);
+    s->running = -1;
+    s->running_pidfd = -1;
+    schedules_running--;
+}
+
+// Reaps s's run if it's done, and starts the queued one if there is one
+static void schedule_reap(struct schedule *s)
+{
+    int status;
+    if (s->running <= 0 || waitpid(s->running, &status, WNOHANG) != s->running)
+        return;
+    schedule_finished(s, status);
+    if (s->queued)
+    {
+        s->queued = 0;
+        schedule_start_run(s);
+    }
+}
+
+// Stops s's run and everything it started: SIGTERM, then SIGKILL after 2 seconds
+static void schedule_stop_run(struct schedule *s)
+{
+    if (s->running <= 0)
+        return;
+    signal_process_tree(s->running, SIGTERM);
+    if (s->running_pidfd >= 0)
+    {
+        struct pollfd exited = {s->running_pidfd, POLLIN, 0};
+        if (poll(&exited, 1, 2000) == 0)
+            signal_process_tree(s->running, SIGKILL);
+    }
+    int status;
+    waitpid(s->running, &status, 0);
+    schedule_finished(s, status);
+}
+
+static void schedule_fire(struct schedule *s)
+{
+    schedule_reap(s); // It may have just finished
+    if (s->running <= 0)
+        schedule_start_run(s);
+    else if (s->overlap == OVERLAP_SKIP || (s->overlap == OVERLAP_QUEUE && s->queued))
+        s->skipped++; // The queue holds one run, more would only pile up
+    else if (s->overlap == OVERLAP_QUEUE)
+        s->queued = 1;
+    else
+    {
+        schedule_stop_run(s);
+        s->killed++;
+        schedule_start_run(s);
+    }
+    schedule_arm(s, 0);
+}
+
+// Reaps finished runs and fires whatever came due; the prompt calls this while it waits
+static void schedules_service(void)
+{
+    for (struct schedule *s = schedules; s != NULL && schedules_running > 0; s = s->next)
+        schedule_reap(s);
+
+    struct schedule *due = wheel_advance(wheel_now());
+    while (due != NULL)
+    {
+        struct schedule *next = due->wheel_next;
+        due->wheel_next = NULL;
+        schedule_fire(due);
+        due = next;
+    }
+}
+
+// Milliseconds the prompt can sleep before the wheel needs a turn
+static int schedule_poll_timeout(void)
+{
+    uint64_t ticks = wheel_ticks_to_next();
+    if (ticks == UINT64_MAX)
+        return -1;
+    int64_t wait_ms = (int64_t)((schedule_wheel.current + ticks) * WHEEL_TICK_MS) -
+                      (int64_t)(stats_microseconds_since(&schedule_wheel.epoch) / 1000);
+    if (wait_ms < 0)
+        return 0;
+    return wait_ms > INT_MAX ? INT_MAX : (int)wait_ms;
+}
+
+// Has stdio already read part of the next line ahead? poll() can't see that
+static int stdin_has_buffered_input(void)
+{
+#ifdef __GLIBC__
+    return stdin->_IO_read_ptr < stdin->_IO_read_end;
+#else
+    return 1; // Can't tell, so don't sleep in poll(): schedules then only run between lines
+#endif
+}
+
+/**
+ * Reads the next command line, keeping the schedules going while it waits
+ * Returns 0 at the end of input (or straight away once input has ended)
+ */
+int read_command_line(char *buffer, int size)
+{
+    while (schedule_count > 0 || schedules_running > 0)
+    {
+        // Catch up on anything that came due while a command was running
+        schedules_service();
+        if (!stdin_closed && stdin_has_buffered_input())
+            break;
+
+        struct pollfd fds[1 + SCHEDULE_POLL_PIDFDS];
+        int count = 0, too_many = 0;
+        if (!stdin_closed)
+            fds[count++] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+        for (struct schedule *s = schedules; s != NULL; s = s->next)
+        {
+            if (s->running <= 0)
+                continue;
+            if (s->running_pidfd >= 0 && count < 1 + SCHEDULE_POLL_PIDFDS)
+                fds[count++] = (struct pollfd){s->running_pidfd, POLLIN, 0};
+            else
+                too_many = 1;
+        }
+
+        int timeout = schedule_poll_timeout();
+        if (too_many && (timeout < 0 || timeout > 100))
+            timeout = 100; // Runs we can't poll for get checked 10 times a second
+        int ready = poll(fds, count, timeout);
+        if (!stdin_closed && ready > 0 && fds[0].revents != 0)
+            break;
+    }
+    if (stdin_closed)
+        return 0;
+    return fgets(buffer, size, stdin) != NULL;
+}
+
+int run_schedule_command(char *line)
+{
+    char copy[MAX_INPUT_SIZE];
+    snprintf(copy, sizeof(copy), "%s", line);
+    char *separator = strstr(copy, " -- ");
+    if (separator == NULL || separator[4] == '\0')
+    {
+        fprintf(stderr, "Usage: every INTERVAL [--overlap skip|queue|kill] [--jitter D] -- command-line\n"
+                        "       at HH:MM [--overlap skip|queue|kill] [--jitter D] -- command-line\n");
+        return 2;
+    }
+    *separator = '\0';
+    char *command_line = separator + 4;
+    while (*command_line == ' ')
+        command_line++;
+
+    struct schedule settings = {0};
+    settings.at_minute = -1;
+    char *kind = strtok(copy, " \t");
+    char *when = strtok(NULL, " \t");
+    if (when == NULL)
+    {
+        fprintf(stderr, "%s: missing the %s\n", kind, strcmp(kind, "at") == 0 ? "time (HH:MM)" : "interval");
+        return 2;
+    }
+    if (strcmp(kind, "at") == 0)
+    {
+        int hour, minute;
+        char extra;
+        if (sscanf(when, "%d:%d%c", &hour, &minute, &extra) != 2 || hour < 0 || hour > 23 || minute < 0 || minute > 59)
+        {
+            fprintf(stderr, "at: the time should look like 02:00 or 14:30\n");
+            return 2;
+        }
+        settings.at_minute = hour * 60 + minute;
+        snprintf(settings.when, sizeof(settings.when), "at %02d:%02d", hour, minute);
+    }
+    else
+    {
+        if (!parse_duration(when, &settings.interval) || settings.interval * 1000 < WHEEL_TICK_MS)
+        {
+            fprintf(stderr, "every: the interval should be a duration like 5s, 10m or 1h (at least 10ms)\n");
+            return 2;
+        }
+        snprintf(settings.when, sizeof(settings.when), "every %.20s", when);
+    }
+
+    for (char *option = strtok(NULL, " \t"); option != NULL; option = strtok(NULL, " \t"))
+    {
+        char *value = strtok(NULL, " \t");
+        if (strcmp(option, "--jitter") == 0 && value != NULL && parse_duration(value, &settings.jitter))
+            continue;
+        if (strcmp(option, "--overlap") == 0 && value != NULL)
+        {
+            if (strcmp(value, "skip") == 0)
+                settings.overlap = OVERLAP_SKIP;
+            else if (strcmp(value, "queue") == 0)
+                settings.overlap = OVERLAP_QUEUE;
+            else if (strcmp(value, "kill") == 0 || strcmp(value, "kill-previous") == 0)
+                settings.overlap = OVERLAP_KILL;
+            else
+                value = NULL;
+            if (value != NULL)
+                continue;
+        }
+        fprintf(stderr, "%s: bad option %s (use --overlap skip|queue|kill or --jitter DURATION)\n", kind, option);
+        return 2;
+    }
+
+    struct schedule *s = malloc(sizeof(*s));
+    char *saved_line = strdup(command_line);
+    if (s == NULL || saved_line == NULL)
+    {
+        free(s);
+        free(saved_line);
+        fprintf(stderr, "%s: out of memory\n", kind);
+        return 1;
+    }
+    *s = settings;
+    s->id = schedule_next_id++;
+    s->line = saved_line;
+    s->running = -1;
+    s->running_pidfd = -1;
+
+    if (schedule_count == 0 && schedules_running == 0)
+    {
+        // Fresh wheel: tick 0 is now
+        memset(&schedule_wheel, 0, sizeof(schedule_wheel));
+        clock_gettime(CLOCK_MONOTONIC, &schedule_wheel.epoch);
+        jitter_state = ((uint64_t)schedule_wheel.epoch.tv_nsec << 20) ^ (uint64_t)getpid() ^ 0x9e3779b97f4a7c15ULL;
+    }
+    // Append so the list stays in id order
+    struct schedule **tail = &schedules;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = s;
+    schedule_count++;
+    schedule_arm(s, 1);
+
+    printf("schedule %d: %s: %s\n", s->id, s->when, s->line);
+    return 0;
+}
+
+// schedules: lists them, with when each one runs next
+int run_schedules_command(char **args)
+{
+    (void)args;
+    if (schedule_count == 0)
+    {
+        printf("No schedules (add one with: every 5m -- command)\n");
+        return 0;
+    }
+    static const char *overlap_names[] = {"skip", "queue", "kill"};
+    uint64_t now = wheel_now();
+    printf("  id  when              next in  overlap   runs  skipped  killed  last  state    command\n");
+    for (struct schedule *s = schedules; s != NULL; s = s->next)
+    {
+        schedule_reap(s);
+        double next_in = s->expires > now ? (s->expires - now) * WHEEL_TICK_MS / 1000.0 : 0;
+        printf("%4d  %-16s %8.1fs  %-7s %6lu %8lu %7lu %5d  %-8s %s\n", s->id, s->when, next_in,
+               overlap_names[s->overlap], s->runs, s->skipped, s->killed, s->last_status,
+               s->running > 0 ? (s->queued ? "queued" : "running") : "idle", s->line);
+    }
+    return 0;
+}
+
+// unschedule ID|all: removes schedules, stopping a run that's still going
+int run_unschedule_command(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "Usage: unschedule ID|all\n");
+        return 2;
+    }
+    int all = strcmp(args[1], "all") == 0;
+    int id = all ? 0 : atoi(args[1]);
+    int removed = 0;
+    struct schedule **link = &schedules;
+    while (*link != NULL)
+    {
+        struct schedule *s = *link;
+        if (!all && s->id != id)
+        {
+            link = &s->next;
+            continue;
+        }
+        *link = s->next;
+        wheel_remove(s);
+        schedule_stop_run(s);
+        free(s->line);
+        free(s);
+        schedule_count--;
+        removed++;
+    }
+    if (removed == 0 && !all)
+    {
+        fprintf(stderr, "unschedule: no schedule %s\n", args[1]);
+        return 1;
+    }
+    return 0;
+}
+
+// "every ... -- line" and "at HH:MM ... -- line" take the rest of the line as it is
+static int is_schedule_line(const char *line)
+{
+    return (strncmp(line, "every ", 6) == 0 || strncmp(line, "at ", 3) == 0) && strstr(line, " -- ") != NULL;
+}
+
+/**
+ * First special command: killterm (exits just this shell)
+ */
+int exit_this_shell(char **args)
+{
+    (void)args;
+    // Tell user what's happening
+    printf("Goodbye! Closing this shell now...\n");
+
+    // exit(0) terminates program with success code
+    // I tried return 0 first but that doesn't actually exit!
+    exit(0);
+}
+
+/**
+ * Second special command: killallterms (exits ALL shells)
+ */
+int exit_all_shells(char **args)
+{
+    (void)args;
+    // Let user know we're working on it
+    printf("Starting termination of all w25shell processes...\n");
+
+    // Here's the tricky part! Need to find all processes named w25shell
+    // and send them termination signals
+
+    // First get our own process ID so we don't kill ourselves too early
+    pid_t my_own_pid = getpid();
+
+    // Using popen to run external command - cool trick I found online!
+    FILE *process_list;
+    char process_id_text[20]; // Should be enough for any PID
+
+    // Run pgrep command to find all w25shell processes
+    process_list = popen("pgrep -f w25shell", "r");
+
+    // Check if pgrep command worked
+    if (process_list == NULL)
+    {
+        // Something went wrong with pgrep
+        perror("Oops! Cannot find processes");
+        return 1;
+    }
+
+    // Count how many processes we kill (not necessary but interesting)
+    int kill_count = 0;
+
+    // For each line in the output (each process ID)
+    while (fgets(process_id_text, sizeof(process_id_text), process_list) != NULL)
+    {
+        // Convert text PID to number (atoi = ASCII to Integer)
+        int process_id_number = atoi(process_id_text);
+
+        // Don't kill ourselves yet - we need to finish the loop first!
+        if (process_id_number != my_own_pid)
+        {
+            // Try to kill this process
+            int kill_result = kill(process_id_number, SIGTERM);
+
+            // Did it work?
+            if (kill_result == 0)
+            {
+                // printf("Successfully terminated process: %d\n", process_id_number);
+                kill_count++;
+            }
+            else
+            {
+                // printf("Failed to terminate process: %d\n", process_id_number);
+            }
+        }
+    }
+
+    // Done with process list, close it
+    pclose(process_list);
+
+    // Tell user how many processes we killed
+    printf("Terminated %d other shell processes\n", kill_count);
+
+    // Now we can kill our own process
+    printf("Now terminating this shell... goodbye!\n");
+    exit(0);
+}
+
+/**
+ * load ./probe.so - adds the builtins in a plugin (see w25plugin.h)
+ * "load" on its own lists the plugins and what they added.
+ * Plugins stay loaded until the shell exits: a pipeline thread could still
+ * be running one of their builtins, so dlclose() is never safe
+ */
+#define MAX_PLUGINS 32
+
+struct loaded_plugin
+{
+    char path[PATH_MAX];
+    void *handle;
+};
+
+static struct loaded_plugin loaded_plugins[MAX_PLUGINS];
+static int plugin_count;
+static int plugin_being_loaded = -1; // Plugins can only register from inside w25_plugin_init()
+
+static int plugin_register_builtin(const char *name, w25_builtin_function run)
+{
+    if (run == NULL || plugin_being_loaded < 0)
+        return -1;
+    return add_builtin(name, run, NULL, plugin_being_loaded);
+}
+
+static int plugin_last_status(void)
+{
+    return last_exit_status;
+}
+
+int run_load_command(char **args)
+{
+    if (args[1] == NULL)
+    {
+        if (plugin_count == 0)
+            printf("No plugins loaded (load ./plugin.so)\n");
+        for (int p = 0; p < plugin_count; p++)
+        {
+            printf("%s:", loaded_plugins[p].path);
+            for (int i = 0; i < builtin_count; i++)
+                if (builtins[i].plugin == p)
+                    printf(" %s", builtins[i].name);
+            printf("\n");
+        }
+        return 0;
+    }
+    if (plugin_count == MAX_PLUGINS)
+    {
+        fprintf(stderr, "load: only %d plugins can be loaded\n", MAX_PLUGINS);
+        return 1;
+    }
+
+    void *handle = dlopen(args[1], RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL)
+    {
+        fprintf(stderr, "load: %s\n", dlerror());
+        return 1;
+    }
+    for (int p = 0; p < plugin_count; p++)
+    {
+        if (loaded_plugins[p].handle == handle)
+        {
+            dlclose(handle); // Just drops the count dlopen() added
+            fprintf(stderr, "load: %s is already loaded\n", args[1]);
+            return 1;
+        }
+    }
+    int (*plugin_init)(const struct w25_plugin_api *) = dlsym(handle, "w25_plugin_init");
+    if (plugin_init == NULL)
+    {
+        fprintf(stderr, "load: %s has no w25_plugin_init()\n", args[1]);
+        dlclose(handle);
+        return 1;
+    }
+
+    static const struct w25_plugin_api api = {W25_PLUGIN_ABI_VERSION, sizeof(struct w25_plugin_api),
+                                              plugin_register_builtin, plugin_last_status};
+    int first_new = builtin_count;
+    plugin_being_loaded = plugin_count;
+    int result = plugin_init(&api);
+    plugin_being_loaded = -1;
+    if (result != 0)
+    {
+        // Forget anything it registered before it gave up (nothing can be running it yet)
+        builtin_count = first_new;
+        dlclose(handle);
+        fprintf(stderr, "load: %s failed to start (w25_plugin_init returned %d)\n", args[1], result);
+        return 1;
+    }
+
+    snprintf(loaded_plugins[plugin_count].path, PATH_MAX, "%s", args[1]);
+    loaded_plugins[plugin_count++].handle = handle;
+    printf("Loaded %s: %d builtin%s\n", args[1], builtin_count - first_new, builtin_count - first_new == 1 ? "" : "s");
+    return 0;
+}
+
+// Puts the shell's own commands in the builtin table, main() calls this first thing
+static void register_shell_commands(void)
+{
+    static const struct
+    {
+        const char *name;
+        shell_command_function command;
+    } commands[] = {
+        {"killterm", exit_this_shell},
+        {"killallterms", exit_all_shells},
+        {"coproc", start_coprocess},           // Starts (or lists) coprocesses
+        {"coproc-close", close_coprocess},     // Ends one
+        {"spawn-bench", run_spawn_bench},      // Times how long starting a program takes
+        {"place-bench", run_place_bench},      // Pipeline throughput with and without pin=auto
+        {"stats", run_stats_command},          // Latency histograms and counters
+        {"schedules", run_schedules_command},  // Lists the "every" and "at" schedules
+        {"unschedule", run_unschedule_command},
+        {"load", run_load_command},            // Plugins with more builtins
+    };
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        add_builtin(commands[i].name, NULL, commands[i].command, -1);
+}
+
+// Is this one of the commands handle_special_commands() runs inside the shell?
+int is_special_command(const char *name)
+{
+    return find_builtin(name) != NULL;
+}
+
+/**
+ * Checks if the user typed any of our special shell commands
+ * First thing I learned: functions need return values!
+ * They all live in the builtin table now, plugins add to it with "load"
+ */
+int handle_special_commands(char **args)
+{
+    struct builtin_command *builtin = find_builtin(args[0]);
+    if (builtin == NULL)
+    {
+        // If we got here, it wasn't a special command
+        return 0;
+    }
+
+    // Shell commands change the shell itself, they just get the words
+    if (builtin->command != NULL)
+    {
+        last_exit_status = builtin->command(args);
+        return 1;
+    }
+
+    // Stage builtins like find-text (and plugin ones) run right here, no fork needed
+    char **expanded_args = expand_command_args(args);
+    if (expanded_args == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory expanding arguments\n");
+        return 1;
+    }
+
+    int argc = 0;
+    while (expanded_args[argc] != NULL)
+        argc++;
+
+    fflush(stdout); // The builtin writes to fd 1 directly
+    last_exit_status = builtin->run(argc, expanded_args, STDIN_FILENO, STDOUT_FILENO);
+    free_expanded_args(expanded_args);
+    return 1;
+}
+
+/**
+ * This function runs any command the user types
+ * It took me a while to understand how fork and exec work together!
+ */
+int execute_command(char **args)
+{
+    // First count the number of arguments
+    int arg_count = 0;
+    while (args[arg_count] != NULL)
+    {
+        arg_count++;
+    }
+
+    // Check if argument count exceeds maximum allowed (5)
+    if (arg_count > 5)
+    {
+        fprintf(stderr, "Error: Too many arguments. Maximum allowed is 5.\n");
+        return 0; // Return failure
+    }
+
+    // Turn patterns like *.txt into the real file names
+    char **expanded_args = expand_command_args(args);
+    if (expanded_args == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory expanding arguments\n");
+        return 0;
+    }
+
+    // We need these variables for process management
+    pid_t child_process_id;
+    int command_result;
+
+    // spawn_program() does the fork + execvp (or asks the zygote to)
+    // This basically makes a copy of our program and replaces it with the command!
+    // printf("Attempting to execute: %s\n", args[0]);
+    child_process_id = spawn_program(expanded_args, STDIN_FILENO, STDOUT_FILENO);
+    free_expanded_args(expanded_args);
+
+    // Check if fork worked correctly
+    if (child_process_id < 0)
+    {
+        // Something went wrong with creating the process
+        perror("Oh no! Fork creation failed");
+        return 0; // Return failure
+    }
+
+    // We need to wait for the child to finish
+    // The status variable will hold information about how the child exited
+    if (!wait_program(child_process_id, &command_result))
+    {
+        printf("Warning: Error waiting for command to finish\n");
+    }
+    else
+    {
+        remember_exit_status(command_result);
+    }
+
+    // If we got here, everything worked (or at least we tried)
+    return 1; // Return success
+}
+
+/**
+ * Locks for the ~ operator: an OFD lock (fcntl F_OFD_SETLKW) on the whole file,
+ * or flock() where the kernel has no OFD locks. Both belong to the open file,
+ * not the process, so threads and forked server workers are covered too
+ */
+static int lock_whole_file(int fd)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET; // l_start = l_len = 0 means all of it
+    while (fcntl(fd, F_OFD_SETLKW, &lock) < 0)
+    {
+        if (errno == EINTR)
+            continue;
+        if (errno != EINVAL)
+            return 0;
+        while (flock(fd, LOCK_EX) < 0)
+        {
+            if (errno != EINTR)
+                return 0;
+        }
+        return 1;
+    }
+    return 1;
+}
+
+#define APPEND_BLOCK_SIZE (4 * 1024 * 1024)
+
+/**
+ * Adds the first length bytes of src_fd to the end of dest_fd (the caller holds the locks)
+ * copy_file_range() does it inside the kernel; if the filesystem can't, big
+ * blocks go out with one O_APPEND write() each instead of lots of small stdio writes
+ */
+static int append_locked_range(int src_fd, off_t length, int dest_fd, const char *dest_name)
+{
+    struct stat dest_info;
+    if (fstat(dest_fd, &dest_info) < 0)
+        return 0;
+    off_t src_offset = 0, dest_offset = dest_info.st_size;
+    while (src_offset < length)
+    {
+        ssize_t copied = copy_file_range(src_fd, &src_offset, dest_fd, &dest_offset, length - src_offset, 0);
+        if (copied > 0 || (copied < 0 && errno == EINTR))
+            continue;
+        if (copied == 0 || errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+            break; // The source got shorter, or no copy_file_range here
+        fprintf(stderr, "Error: Can't append to %s: %s\n", dest_name, strerror(errno));
+        return 0;
+    }
+    if (src_offset >= length)
+        return 1;
+
+    size_t block_size = length - src_offset < APPEND_BLOCK_SIZE ? (size_t)(length - src_offset) : APPEND_BLOCK_SIZE;
+    char *block = malloc(block_size);
+    int flags = fcntl(dest_fd, F_GETFL);
+    int ok = block != NULL && flags >= 0 && fcntl(dest_fd, F_SETFL, flags | O_APPEND) == 0;
+    while (ok && src_offset < length)
+    {
+        size_t want = length - src_offset < (off_t)block_size ? (size_t)(length - src_offset) : block_size;
+        ssize_t got = pread(src_fd, block, want, src_offset);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        ok = write_all(dest_fd, block, got);
+        src_offset += got;
+    }
+    if (!ok)
+        fprintf(stderr, "Error: Can't append to %s: %s\n", dest_name, strerror(errno));
+    free(block);
+    return ok;
+}
+
+/**
+ * This function handles the special ~ operator which appends two text files to each other
+ * Assignment rule said we need to implement file1.txt ~ file2.txt to append them to each other
+ */
+int handle_append(char *input)
+{
+    // First need to make a copy because strtok will change the original string
+    // Took me some time to figure out this was needed!
+    char command_copy[MAX_INPUT_SIZE];
+    strcpy(command_copy, input);
+
+    // Need to find the two filenames on either side of the ~ symbol
+    char *first_filename = NULL;
+    char *second_filename = NULL;
+
+    // Split by the ~ character - this gives us the file names
+    first_filename = strtok(command_copy, "~");
+    second_filename = strtok(NULL, "~");
+
+    // Need to remove extra spaces around filenames
+    // First let's handle the first filename
+    if (first_filename != NULL)
+    {
+        // Skip spaces at the beginning
+        while (first_filename[0] == ' ')
+        {
+            first_filename++; // Move pointer past spaces
+        }
+
+        // Remove spaces at the end (this took me a while to figure out!)
+        int name_length = strlen(first_filename);
+        while (name_length > 0 && first_filename[name_length - 1] == ' ')
+        {
+            first_filename[name_length - 1] = '\0'; // Replace space with string terminator
+            name_length--;                          // Check next character
+        }
+    }
+
+    // Now same thing for the second filename
+    if (second_filename != NULL)
+    {
+        // Skip spaces at the beginning
+        while (second_filename[0] == ' ')
+        {
+            second_filename++; // Move pointer past spaces
+        }
+
+        // Remove spaces at the end
+        int name_length = strlen(second_filename);
+        while (name_length > 0 && second_filename[name_length - 1] == ' ')
+        {
+            second_filename[name_length - 1] = '\0';
+            name_length--;
+        }
+    }
+
+    // Make sure we have both filenames
+    if (first_filename == NULL || second_filename == NULL)
+    {
+        fprintf(stderr, "Error: Need two files for the ~ operation!\n");
+        return 0; // Failed
+    }
+
+    // Each side may be a pattern, but it has to pick out exactly one file
+    char first_match[PATH_MAX], second_match[PATH_MAX];
+    char *sides[2] = {first_filename, second_filename};
+    char *matched[2] = {first_match, second_match};
+    for (int side = 0; side < 2; side++)
+    {
+        if (!has_glob_chars(sides[side]))
+            continue;
+
+        struct glob_results matches;
+        int match_count = expand_glob(sides[side], &matches);
+        if (match_count != 1)
+        {
+            fprintf(stderr, "Error: %s matches %d files, the ~ operation needs exactly one\n",
+                    sides[side], match_count);
+            free_glob_results(&matches);
+            return 0; // Failed
+        }
+        snprintf(matched[side], PATH_MAX, "%s", matches.paths[0]);
+        free_glob_results(&matches);
+        sides[side] = matched[side];
+    }
+    first_filename = sides[0];
+    second_filename = sides[1];
+
+    // Now check if both files are .txt files (requirement from assignment)
+    // Need to find where the .txt part starts in each filename
+    char *dot_position_1 = strrchr(first_filename, '.'); // Find the last dot
+    char *dot_position_2 = strrchr(second_filename, '.');
+
+    // Check if extensions exist and are .txt
+    if (dot_position_1 == NULL || dot_position_2 == NULL ||
+        strcmp(dot_position_1, ".txt") != 0 || strcmp(dot_position_2, ".txt") != 0)
+    {
+        fprintf(stderr, "Error: Both files must be .txt files for ~ operation!\n");
+        return 0; // Failed
+    }
+
+    // Open both files for reading and writing, each one gets the other added to it
+    const char *names[2] = {first_filename, second_filename};
+    int fds[2];
+    struct stat infos[2];
+    for (int i = 0; i < 2; i++)
+    {
+        fds[i] = open(names[i], O_RDWR | O_CLOEXEC);
+        if (fds[i] < 0 || fstat(fds[i], &infos[i]) < 0)
+        {
+            perror(i == 0 ? "Can't open first file" : "Can't open second file");
+            if (fds[i] >= 0)
+                close(fds[i]);
+            if (i == 1)
+                close(fds[0]);
+            return 0; // Failed
+        }
+    }
+
+    // Lock both files, so two shells running ~ on the same files can't mix up
+    // each other's data. Locking in inode order means "a ~ b" in one shell and
+    // "b ~ a" in another can't end up waiting for each other forever
+    int same_file = (infos[0].st_dev == infos[1].st_dev && infos[0].st_ino == infos[1].st_ino);
+    int lock_first = (infos[1].st_dev < infos[0].st_dev ||
+                      (infos[1].st_dev == infos[0].st_dev && infos[1].st_ino < infos[0].st_ino));
+    if (!lock_whole_file(fds[lock_first]) || (!same_file && !lock_whole_file(fds[1 - lock_first])))
+    {
+        perror("Can't lock the files");
+        close(fds[0]);
+        close(fds[1]);
+        return 0; // Failed
+    }
+
+    // The sizes now (under the locks) are what gets appended, the bytes we add don't count
+    off_t file_bytes[2] = {0, 0};
+    int ok = 1;
+    for (int i = 0; i < 2 && ok; i++)
+    {
+        ok = fstat(fds[i], &infos[i]) == 0;
+        file_bytes[i] = infos[i].st_size;
+    }
+
+    // file2 goes on the end of file1, then file1 (as it was) on the end of file2
+    ok = ok && append_locked_range(fds[1], file_bytes[1], fds[0], names[0]) &&
+         append_locked_range(fds[0], file_bytes[0], fds[1], names[1]);
+
+    // Closing the files lets go of the locks
+    close(fds[0]);
+    close(fds[1]);
+    if (!ok)
+    {
+        return 0; // Failed
+    }
+    stats_count_bytes(STATS_OP_APPEND, file_bytes[0] + file_bytes[1]);
+
+    // Let user know it worked
+    printf("Successfully combined the files.\n");
+    return 1; // Success!
+}
+
+/**
+ * Helpers for the "#top K file.txt" mode of the # operator
+ * Instead of tr | sort | uniq -c | sort -rn | head (five processes!) I count
+ * every word in one pass with a hash table and keep only the K best in a heap
+ */
+#define TOP_READ_CHUNK (64 * 1024)  // How much of the file we read per read() call
+#define TOP_ARENA_BLOCK (1024 * 1024) // Word text is copied into 1MB arena blocks
+#define TOP_INITIAL_SLOTS 4096        // Starting size of the hash table (power of 2)
+
+// One slot of the open-addressing table. I keep the hash next to the count so
+// probing only touches this small struct and not the word text itself
+struct word_slot
+{
+    uint64_t hash;  // Full 64-bit hash (0 means the slot is empty)
+    char *word;     // Points into the arena, NOT null terminated
+    uint32_t length; // Length of the word in bytes
+    uint64_t count; // How many times we saw it
+};
+
+// A very simple bump allocator - words are never freed one by one, we just
+// throw away all the blocks at the end
+struct word_arena
+{
+    char **blocks;    // Every block we allocated so far
+    int block_count;  // How many blocks are in use
+    int block_space;  // How many block pointers fit in the blocks array
+    size_t used;      // Bytes used in the newest block
+    size_t block_size; // Size of the newest block
+};
+
+struct word_table
+{
+    struct word_slot *slots;
+    size_t capacity; // Always a power of 2 so I can use & instead of %
+    size_t used;     // Number of distinct words stored
+    struct word_arena arena;
+};
+
+// FNV-1a hash - simple and good enough for words
+static uint64_t hash_word(const char *text, size_t length)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+    // 0 marks an empty slot so never hand it out as a real hash
+    return hash ? hash : 1;
+}
+
+static char *arena_copy(struct word_arena *arena, const char *text, size_t length)
+{
+    // Start a new block if the word doesn't fit in the current one
+    if (arena->block_count == 0 || arena->used + length > arena->block_size)
+    {
+        if (arena->block_count == arena->block_space)
+        {
+            int new_space = arena->block_space ? arena->block_space * 2 : 16;
+            char **grown = realloc(arena->blocks, new_space * sizeof(char *));
+            if (grown == NULL)
+                return NULL;
+            arena->blocks = grown;
+            arena->block_space = new_space;
+        }
+
+        // Really long "words" get their own block
+        size_t size = length > TOP_ARENA_BLOCK ? length : TOP_ARENA_BLOCK;
+        char *block = malloc(size);
+        if (block == NULL)
+            return NULL;
+        arena->blocks[arena->block_count++] = block;
+        arena->block_size = size;
+        arena->used = 0;
+    }
+
+    char *copy = arena->blocks[arena->block_count - 1] + arena->used;
+    memcpy(copy, text, length);
+    arena->used += length;
+    return copy;
+}
+
+static void word_table_free(struct word_table *table)
+{
+    for (int i = 0; i < table->arena.block_count; i++)
+        free(table->arena.blocks[i]);
+    free(table->arena.blocks);
+    free(table->slots);
+}
+
+// Doubles the table and re-inserts every word (the hashes are saved so this is cheap)
+static int word_table_grow(struct word_table *table)
+{
+    size_t new_capacity = table->capacity * 2;
+    struct word_slot *new_slots = calloc(new_capacity, sizeof(struct word_slot));
+    if (new_slots == NULL)
+        return 0;
+
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        if (table->slots[i].hash == 0)
+            continue;
+        size_t spot = table->slots[i].hash & (new_capacity - 1);
+        while (new_slots[spot].hash != 0)
+            spot = (spot + 1) & (new_capacity - 1); // Linear probing
+        new_slots[spot] = table->slots[i];
+    }
+
+    free(table->slots);
+    table->slots = new_slots;
+    table->capacity = new_capacity;
+    return 1;
+}
+
+// Adds one to the count of a word, inserting it if it's new
+static int word_table_add(struct word_table *table, const char *text, size_t length)
+{
+    // Keep the table at most 70% full so probe chains stay short
+    if ((table->used + 1) * 10 > table->capacity * 7 && !word_table_grow(table))
+        return 0;
+
+    uint64_t hash = hash_word(text, length);
+    size_t spot = hash & (table->capacity - 1);
+
+    while (table->slots[spot].hash != 0)
+    {
+        struct word_slot *slot = &table->slots[spot];
+        if (slot->hash == hash && slot->length == length && memcmp(slot->word, text, length) == 0)
+        {
+            slot->count++;
+            return 1;
+        }
+        spot = (spot + 1) & (table->capacity - 1);
+    }
+
+    char *copy = arena_copy(&table->arena, text, length);
+    if (copy == NULL)
+        return 0;
+
+    table->slots[spot].hash = hash;
+    table->slots[spot].word = copy;
+    table->slots[spot].length = (uint32_t)length;
+    table->slots[spot].count = 1;
+    table->used++;
+    return 1;
+}
+
+// Returns 1 if slot a should be ranked below slot b
+// (fewer occurrences, or same count but later alphabetically)
+static int word_ranks_lower(const struct word_slot *a, const struct word_slot *b)
+{
+    if (a->count != b->count)
+        return a->count < b->count;
+
+    size_t shorter = a->length < b->length ? a->length : b->length;
+    int order = memcmp(a->word, b->word, shorter);
+    if (order != 0)
+        return order > 0;
+    return a->length > b->length;
+}
+
+// Moves heap[index] down until the min-heap property holds again
+static void top_heap_sift_down(struct word_slot **heap, int size, int index)
+{
+    while (1)
+    {
+        int lowest = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+
+        if (left < size && word_ranks_lower(heap[left], heap[lowest]))
+            lowest = left;
+        if (right < size && word_ranks_lower(heap[right], heap[lowest]))
+            lowest = right;
+        if (lowest == index)
+            return;
+
+        struct word_slot *swap = heap[index];
+        heap[index] = heap[lowest];
+        heap[lowest] = swap;
+        index = lowest;
+    }
+}
+
+static void top_heap_sift_up(struct word_slot **heap, int index)
+{
+    while (index > 0)
+    {
+        int parent = (index - 1) / 2;
+        if (!word_ranks_lower(heap[index], heap[parent]))
+            return;
+        struct word_slot *swap = heap[index];
+        heap[index] = heap[parent];
+        heap[parent] = swap;
+        index = parent;
+    }
+}
+
+/**
+ * Counts every word in a file and prints the top_k most frequent ones
+ * The heap only ever holds top_k entries so picking the winners is O(n log k)
+ */
+int count_top_words(const char *filename, int top_k)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("Cannot open file for counting");
+        return 0;
+    }
+
+    struct word_table table;
+    memset(&table, 0, sizeof(table));
+    table.capacity = TOP_INITIAL_SLOTS;
+    table.slots = calloc(table.capacity, sizeof(struct word_slot));
+
+    char *chunk = malloc(TOP_READ_CHUNK);
+    // A word can be cut in half at the end of a chunk, so I keep the start
+    // of it here until the next chunk arrives
+    char *partial = NULL;
+    size_t partial_length = 0, partial_space = 0;
+    uint64_t total_words = 0;
+    int ok = (table.slots != NULL && chunk != NULL);
+
+    ssize_t bytes_got = 0;
+    while (ok && (bytes_got = read(fd, chunk, TOP_READ_CHUNK)) > 0)
+    {
+        stats_count_bytes(STATS_OP_WORD_COUNT, bytes_got);
+        ssize_t pos = 0;
+        while (ok && pos < bytes_got)
+        {
+            // A word saved from the last chunk ends right here if this chunk
+            // starts with a separator
+            if (partial_length > 0 && (chunk[pos] == ' ' || chunk[pos] == '\n' || chunk[pos] == '\t'))
+            {
+                ok = word_table_add(&table, partial, partial_length);
+                partial_length = 0;
+                total_words++;
+            }
+
+            // Skip separators (same ones the normal # count uses)
+            while (pos < bytes_got && (chunk[pos] == ' ' || chunk[pos] == '\n' || chunk[pos] == '\t'))
+                pos++;
+            ssize_t start = pos;
+            while (pos < bytes_got && chunk[pos] != ' ' && chunk[pos] != '\n' && chunk[pos] != '\t')
+                pos++;
+
+            if (pos == bytes_got)
+            {
+                // Word may continue in the next chunk - save it for later.
+                // A chunk ending in separators has nothing to save, and
+                // partial can still be NULL then
+                size_t piece = pos - start;
+                if (piece == 0)
+                    break;
+                if (partial_length + piece > partial_space)
+                {
+                    partial_space = (partial_length + piece) * 2;
+                    char *grown = realloc(partial, partial_space);
+                    if (grown == NULL)
+                    {
+                        ok = 0;
+                        break;
+                    }
+                    partial = grown;
+                }
+                memcpy(partial + partial_length, chunk + start, piece);
+                partial_length += piece;
+                break;
+            }
+
+            // We hit a separator, so the word is complete
+            if (partial_length > 0)
+            {
+                // Glue the saved beginning onto this piece first
+                size_t piece = pos - start;
+                if (partial_length + piece > partial_space)
+                {
+                    partial_space = (partial_length + piece) * 2;
+                    char *grown = realloc(partial, partial_space);
+                    if (grown == NULL)
+                    {
+                        ok = 0;
+                        break;
+                    }
+                    partial = grown;
+                }
+                memcpy(partial + partial_length, chunk + start, piece);
+                ok = word_table_add(&table, partial, partial_length + piece);
+                partial_length = 0;
+                total_words++;
+            }
+            else if (pos > start)
+            {
+                ok = word_table_add(&table, chunk + start, pos - start);
+                total_words++;
+            }
+        }
+    }
+
+    // The file might end in the middle of a word
+    if (ok && partial_length > 0)
+    {
+        ok = word_table_add(&table, partial, partial_length);
+        total_words++;
+    }
+
+    if (bytes_got < 0)
+    {
+        perror("Error reading file");
+        ok = 0;
+    }
+    close(fd);
+    free(chunk);
+    free(partial);
+
+    if (!ok)
+    {
+        fprintf(stderr, "Error: Couldn't count words in %s\n", filename);
+        word_table_free(&table);
+        return 0;
+    }
+
+    // Now pick the winners with a min-heap of size top_k
+    // The smallest of the current winners sits at heap[0] so it's easy to replace
+    // (a K bigger than the number of different words just means all of them)
+    if ((size_t)top_k > table.used)
+        top_k = table.used > 0 ? (int)table.used : 1;
+    int heap_size = 0;
+    struct word_slot **heap = malloc(sizeof(struct word_slot *) * top_k);
+    if (heap == NULL)
+    {
+        fprintf(stderr, "Error: Can't allocate memory for top words\n");
+        word_table_free(&table);
+        return 0;
+    }
+
+    for (size_t i = 0; i < table.capacity; i++)
+    {
+        struct word_slot *slot = &table.slots[i];
+        if (slot->hash == 0)
+            continue;
+
+        if (heap_size < top_k)
+        {
+            heap[heap_size] = slot;
+            top_heap_sift_up(heap, heap_size);
+            heap_size++;
+        }
+        else if (word_ranks_lower(heap[0], slot))
+        {
+            heap[0] = slot;
+            top_heap_sift_down(heap, heap_size, 0);
+        }
+    }
+
+    // Pop the heap from the back so the output ends up sorted best-first
+    struct word_slot **ranked = malloc(sizeof(struct word_slot *) * (heap_size ? heap_size : 1));
+    int ranked_count = heap_size;
+    for (int i = heap_size - 1; i >= 0 && ranked != NULL; i--)
+    {
+        ranked[i] = heap[0];
+        heap[0] = heap[--heap_size];
+        top_heap_sift_down(heap, heap_size, 0);
+    }
+
+    printf("Top %d words in %s (%llu words, %zu distinct):\n", ranked_count, filename,
+           (unsigned long long)total_words, table.used);
+    for (int i = 0; i < ranked_count && ranked != NULL; i++)
+    {
+        printf("%7llu %.*s\n", (unsigned long long)ranked[i]->count,
+               (int)ranked[i]->length, ranked[i]->word);
+    }
+
+    free(ranked);
+    free(heap);
+    word_table_free(&table);
+    return 1;
+}
+
+/**
+ * The file operators only take .txt files (assignment rule), but the
+ * /dev/fd/N paths that <(cmd) turns into are allowed too
+ */
+int is_text_file_name(const char *name)
+{
+    const char *extension = strrchr(name, '.');
+    if (extension != NULL && strcmp(extension, ".txt") == 0)
+        return 1;
+    return strncmp(name, "/dev/fd/", 8) == 0;
+}
+
+/**
+ * Counts the words in one .txt file (or shows its top words when top_k > 0)
+ * This used to live inside handle_word_count, I moved it out so # can count
+ * every file a pattern matches
+ */
+int count_words_in_file(char *file_to_count, int top_k)
+{
+    int total_words = 0;       // Counter for words
+    int currently_in_word = 0; // This is like a flag - are we in a word right now?
+    FILE *text_file;           // For opening the file
+    char current_character;    // To read file character by character
+
+    // Check if it's a .txt file (or a <(cmd) stream)
+    // The assignment says we must only count words in .txt files
+    char *dot_position = strrchr(file_to_count, '.');
+
+    if (!is_text_file_name(file_to_count))
+    {
+        // Check if there's a dot and if it's followed by "txt"
+        if (dot_position == NULL)
+        {
+            fprintf(stderr, "Error: Filename has no extension - must be .txt\n");
+        }
+        else
+        {
+            fprintf(stderr, "Error: File must have .txt extension, not %s\n", dot_position);
+        }
+        return 0;
+    }
+
+    // The top-K mode has its own streaming counter
+    if (top_k > 0)
+    {
+        return count_top_words(file_to_count, top_k);
+    }
+
+    // Try to open the file
+    text_file = fopen(file_to_count, "r"); // r means read mode
+
+    if (text_file == NULL)
+    {
+        // Couldn't open the file
+        perror("Cannot open file for counting");
+        return 0;
+    }
+
+    // Count the words!
+    // This algorithm was tricky for me to understand at first
+    // We read character by character and count transitions from non-word to word
+
+    printf("Counting words in %s...\n", file_to_count);
+
+    // Loop through each character in the file
+    while ((current_character = fgetc(text_file)) != EOF) // EOF means End Of File
+    {
+        // Check if this character is a word separator
+        int is_separator = (current_character == ' ' ||
+                            current_character == '\n' ||
+                            current_character == '\t');
+
+        // Case 1: We were in a word, but hit a separator
+        if (is_separator && currently_in_word == 1)
+        {
+            // We just left a word
+            currently_in_word = 0;
+        }
+        // Case 2: We weren't in a word, but hit a non-separator
+        else if (!is_separator && currently_in_word == 0)
+        {
+            // We just started a new word!
+            currently_in_word = 1;
+            // Count this new word
+            total_words = total_words + 1;
+        }
+        // (Other cases: still in a word or still in separators - do nothing)
+    }
+
+    // Close the file and show the results
+    long bytes_counted = ftell(text_file);
+    if (bytes_counted > 0)
+        stats_count_bytes(STATS_OP_WORD_COUNT, bytes_counted);
+    fclose(text_file);
+
+    // Print the result for the user
+    printf("Number of words in %s: %d\n", file_to_count, total_words);
+
+    // Everything worked!
+    return 1;
+}
+
+/**
+ * This function counts all the words in a text file
+ * I used the # symbol as required in the assignment
+ */
+int handle_word_count(char *input)
+{
+    // Need to copy input string because we'll change it
+    // I had a bug before when I didn't do this!
+    char command_copy[MAX_INPUT_SIZE];
+    strcpy(command_copy, input);
+
+    // Setting up variables we'll need
+    char *file_to_count = NULL; // Will store the filename
+
+    // Step 1: Need to find where the # symbol is
+    char *hash_symbol_location = strchr(command_copy, '#');
+
+    // Make sure the command has the # symbol
+    if (hash_symbol_location == NULL)
+    {
+        // No # symbol found!
+        fprintf(stderr, "Error: Can't find # symbol in the command\n");
+        return 0; // Return failure
+    }
+
+    // Step 2: Get the filename after the # symbol
+    // Need to skip past the # and any spaces after it
+    char *after_hash = hash_symbol_location + 1; // +1 moves past the #
+
+    // Skip any spaces or tabs
+    while (*after_hash == ' ' || *after_hash == '\t')
+    {
+        after_hash = after_hash + 1; // Move forward one character
+    }
+
+    // "#top K file.txt" asks for the K most frequent words instead of a total
+    int top_k = 0;
+    if (strncmp(after_hash, "top", 3) == 0 && (after_hash[3] == ' ' || after_hash[3] == '\t'))
+    {
+        char *number_end;
+        errno = 0;
+        long asked = strtol(after_hash + 3, &number_end, 10);
+        if (asked <= 0 || asked > INT_MAX || errno == ERANGE || number_end == after_hash + 3)
+        {
+            fprintf(stderr, "Error: Usage is #top K file.txt (K must be a number from 1 to %d)\n", INT_MAX);
+            return 0;
+        }
+        top_k = (int)asked;
+
+        after_hash = number_end;
+        while (*after_hash == ' ' || *after_hash == '\t')
+        {
+            after_hash = after_hash + 1;
+        }
+    }
+
+    // Now after_hash should point to the filename
+    file_to_count = after_hash;
+
+    // Step 3: Remove any spaces at the end of filename
+    int filename_length = strlen(file_to_count);
+
+    // Keep removing spaces/tabs from the end
+    while (filename_length > 0)
+    {
+        // Check if last character is space or tab
+        if (file_to_count[filename_length - 1] == ' ' ||
+            file_to_count[filename_length - 1] == '\t')
+        {
+            // Replace with string terminator
+            file_to_count[filename_length - 1] = '\0';
+            // Reduce length by 1
+            filename_length = filename_length - 1;
+        }
+        else
+        {
+            // No more spaces at the end
+            break;
+        }
+    }
+
+    // Step 4: Make sure we actually have a filename
+    if (filename_length == 0)
+    {
+        fprintf(stderr, "Error: You didn't provide a filename after #\n");
+        return 0; // Return failure
+    }
+
+    // Step 5: File names can be patterns like logs/*.txt - count each match
+    if (has_glob_chars(file_to_count))
+    {
+        struct glob_results matches;
+        if (expand_glob(file_to_count, &matches) == 0)
+        {
+            fprintf(stderr, "Error: No files match %s\n", file_to_count);
+            return 0;
+        }
+
+        int all_worked = 1;
+        for (int i = 0; i < matches.count; i++)
+        {
+            if (!count_words_in_file(matches.paths[i], top_k))
+                all_worked = 0;
+        }
+        free_glob_results(&matches);
+        return all_worked;
+    }
+
+    return count_words_in_file(file_to_count, top_k);
+}
+
+/**
+ * Streaming k-way merge for "+m [-k N] a.txt b.txt ..." (like sort -m but in the shell)
+ * Every input must already be sorted. I keep one current line per file and a
+ * min-heap of the files, so memory only grows with the number of files
+ */
+#define MERGE_BUFFER_SIZE (1024 * 1024) // Big stdio buffers mean fewer read() calls
+
+struct merge_input
+{
+    FILE *file;
+    char *read_buffer; // Our own big buffer handed to setvbuf
+    char *line;        // Current line (from getline)
+    size_t line_space;
+    ssize_t line_length;
+    const char *key;   // Start of the key column inside line
+    size_t key_length;
+    int order;         // Position on the command line, used to break ties
+};
+
+// Finds the key column (1-based, whitespace separated) in the current line
+// Column 0 means "use the whole line" just like plain sort -m
+static void merge_find_key(struct merge_input *input, int key_column)
+{
+    const char *text = input->line;
+    size_t length = input->line_length;
+
+    // The newline isn't part of the key
+    if (length > 0 && text[length - 1] == '\n')
+        length--;
+
+    if (key_column <= 0)
+    {
+        input->key = text;
+        input->key_length = length;
+        return;
+    }
+
+    size_t pos = 0;
+    for (int column = 1; ; column++)
+    {
+        while (pos < length && (text[pos] == ' ' || text[pos] == '\t'))
+            pos++;
+        size_t start = pos;
+        while (pos < length && text[pos] != ' ' && text[pos] != '\t')
+            pos++;
+
+        if (column == key_column || pos >= length)
+        {
+            // Lines with too few columns get an empty key (they sort first)
+            input->key = text + start;
+            input->key_length = (column == key_column) ? pos - start : 0;
+            return;
+        }
+    }
+}
+
+// Returns 1 if input a should come out before input b
+static int merge_comes_first(const struct merge_input *a, const struct merge_input *b)
+{
+    size_t shorter = a->key_length < b->key_length ? a->key_length : b->key_length;
+    int order = memcmp(a->key, b->key, shorter);
+    if (order != 0)
+        return order < 0;
+    if (a->key_length != b->key_length)
+        return a->key_length < b->key_length;
+    return a->order < b->order; // Equal keys keep command line order (stable)
+}
+
+static void merge_sift_down(struct merge_input **heap, int size, int index)
+{
+    while (1)
+    {
+        int first = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+
+        if (left < size && merge_comes_first(heap[left], heap[first]))
+            first = left;
+        if (right < size && merge_comes_first(heap[right], heap[first]))
+            first = right;
+        if (first == index)
+            return;
+
+        struct merge_input *swap = heap[index];
+        heap[index] = heap[first];
+        heap[first] = swap;
+        index = first;
+    }
+}
+
+static void merge_free_inputs(struct merge_input *inputs, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (inputs[i].file != NULL)
+            fclose(inputs[i].file);
+        free(inputs[i].read_buffer);
+        free(inputs[i].line);
+    }
+    free(inputs);
+}
+
+/**
+ * This function handles "+m" - it merges already sorted .txt files into one
+ * sorted stream on standard output in a single pass
+ */
+int handle_merge(char *arguments)
+{
+    int key_column = 0;
+    int file_count = 0;
+    int file_space = 8;
+    char **file_names = malloc(file_space * sizeof(char *));
+    if (file_names == NULL)
+    {
+        fprintf(stderr, "Error: Can't allocate memory for merge\n");
+        return 0;
+    }
+
+    // Collect the options and file names (any number of files is fine here)
+    char *word = strtok(arguments, " \t");
+    while (word != NULL)
+    {
+        if (strcmp(word, "-k") == 0)
+        {
+            char *number = strtok(NULL, " \t");
+            key_column = number ? atoi(number) : 0;
+            if (key_column <= 0)
+            {
+                fprintf(stderr, "Error: -k needs a column number starting at 1\n");
+                free(file_names);
+                return 0;
+            }
+        }
+        else
+        {
+            if (!is_text_file_name(word))
+            {
+                fprintf(stderr, "Error: File %s isn't a .txt file! All files must end with .txt\n", word);
+                free(file_names);
+                return 0;
+            }
+
+            if (file_count == file_space)
+            {
+                file_space *= 2;
+                char **grown = realloc(file_names, file_space * sizeof(char *));
+                if (grown == NULL)
+                {
+                    fprintf(stderr, "Error: Can't allocate memory for merge\n");
+                    free(file_names);
+                    return 0;
+                }
+                file_names = grown;
+            }
+            file_names[file_count++] = word;
+        }
+        word = strtok(NULL, " \t");
+    }
+
+    if (file_count == 0)
+    {
+        fprintf(stderr, "Error: Usage is +m [-k column] file1.txt file2.txt ...\n");
+        free(file_names);
+        return 0;
+    }
+
+    // Shard patterns like part-*.txt become the real list of files
+    struct glob_results expanded_files;
+    int expanded_ok = expand_file_list(file_names, file_count, &expanded_files);
+    free(file_names);
+    if (!expanded_ok)
+        return 0;
+    file_names = expanded_files.paths;
+    file_count = expanded_files.count;
+
+    // Open every input with its own big read buffer
+    struct merge_input *inputs = calloc(file_count, sizeof(struct merge_input));
+    struct merge_input **heap = malloc(file_count * sizeof(struct merge_input *));
+    if (inputs == NULL || heap == NULL)
+    {
+        fprintf(stderr, "Error: Can't allocate memory for merge\n");
+        free(inputs);
+        free(heap);
+        free_glob_results(&expanded_files);
+        return 0;
+    }
+
+    int heap_size = 0;
+    for (int i = 0; i < file_count; i++)
+    {
+        inputs[i].order = i;
+        inputs[i].file = fopen(file_names[i], "r");
+        if (inputs[i].file == NULL)
+        {
+            fprintf(stderr, "Error: Can't open %s! Does it exist?\n", file_names[i]);
+            merge_free_inputs(inputs, file_count);
+            free(heap);
+            free_glob_results(&expanded_files);
+            return 0;
+        }
+
+        inputs[i].read_buffer = malloc(MERGE_BUFFER_SIZE);
+        if (inputs[i].read_buffer != NULL)
+            setvbuf(inputs[i].file, inputs[i].read_buffer, _IOFBF, MERGE_BUFFER_SIZE);
+
+        // Prime the heap with the first line of each file (empty files just drop out)
+        inputs[i].line_length = getline(&inputs[i].line, &inputs[i].line_space, inputs[i].file);
+        if (inputs[i].line_length > 0)
+        {
+            merge_find_key(&inputs[i], key_column);
+            heap[heap_size++] = &inputs[i];
+        }
+    }
+    free_glob_results(&expanded_files);
+
+    for (int i = heap_size / 2 - 1; i >= 0; i--)
+        merge_sift_down(heap, heap_size, i);
+
+    // Output also goes through one big buffer, written straight to stdout
+    fflush(stdout);
+    char *output = malloc(MERGE_BUFFER_SIZE);
+    size_t output_used = 0;
+    if (output == NULL)
+    {
+        fprintf(stderr, "Error: Can't allocate memory for merge output\n");
+        free(heap);
+        merge_free_inputs(inputs, file_count);
+        return 0;
+    }
+    int ok = 1;
+
+    while (ok && heap_size > 0)
+    {
+        struct merge_input *smallest = heap[0];
+        const char *text = smallest->line;
+        size_t length = smallest->line_length;
+        int needs_newline = (text[length - 1] != '\n'); // Last line of a file may lack one
+
+        stats_count_bytes(STATS_OP_CONCAT, length);
+        if (output_used + length + 1 > MERGE_BUFFER_SIZE)
+        {
+            ok = write_all(STDOUT_FILENO, output, output_used);
+            output_used = 0;
+        }
+
+        if (length + 1 > MERGE_BUFFER_SIZE)
+        {
+            // Huge line - skip the buffer
+            ok = ok && write_all(STDOUT_FILENO, text, length) &&
+                 (!needs_newline || write_all(STDOUT_FILENO, "\n", 1));
+        }
+        else
+        {
+            memcpy(output + output_used, text, length);
+            output_used += length;
+            if (needs_newline)
+                output[output_used++] = '\n';
+        }
+
+        // Advance that file and restore the heap
+        smallest->line_length = getline(&smallest->line, &smallest->line_space, smallest->file);
+        if (smallest->line_length > 0)
+            merge_find_key(smallest, key_column);
+        else
+            heap[0] = heap[--heap_size]; // This file is finished
+        merge_sift_down(heap, heap_size, 0);
+    }
+
+    if (ok && output_used > 0)
+        ok = write_all(STDOUT_FILENO, output, output_used);
+    if (!ok)
+        perror("Error writing merged output");
+
+    free(output);
+    free(heap);
+    merge_free_inputs(inputs, file_count);
+    return ok;
+}
+
+/**
+ * "a.txt + b.txt > out.txt" builds out.txt inside the kernel instead of
+ * pushing every byte through a buffer in the shell:
+ *  - FICLONERANGE (a reflink) makes the output share the input's blocks on
+ *    btrfs and XFS, no data gets copied at all. The spot in the output has to
+ *    be on a block boundary, so after an input with an odd size the next one
+ *    gets copied instead
+ *  - copy_file_range() copies without the data coming up to user space
+ *  - pipes like <(cmd), and kernels or filesystems that refuse both, get
+ *    plain read() + pwrite()
+ *  - an output that isn't a regular file (/dev/null, a terminal, a pipe
+ *    behind /dev/stdout) can't be cloned into or written at an offset, so
+ *    it only ever gets read() + write()
+ */
+#define CONCAT_COPY_BUFFER (1024 * 1024)
+
+// Adds one input to the output at *out_offset, moves *out_offset past it
+// out_regular = 0 means the output is a device or pipe: plain write() and *out_offset only counts
+static int append_file_in_kernel(int in_fd, const struct stat *in_info, int out_fd, int out_regular,
+                                 off_t *out_offset, blksize_t block, int *try_clone)
+{
+    off_t in_offset = 0;
+    if (S_ISREG(in_info->st_mode) && out_regular)
+    {
+        off_t size = in_info->st_size;
+#ifdef FICLONERANGE
+        if (*try_clone && size > 0 && *out_offset % block == 0)
+        {
+            struct file_clone_range range = {in_fd, 0, (uint64_t)size, (uint64_t)*out_offset};
+            if (ioctl(out_fd, FICLONERANGE, &range) == 0)
+            {
+                *out_offset += size;
+                return 1;
+            }
+            // Filesystem can't clone at all: stop asking (EINVAL is just this range)
+            if (errno == EOPNOTSUPP || errno == EXDEV || errno == ENOTTY || errno == EPERM)
+                *try_clone = 0;
+        }
+#endif
+        while (in_offset < size)
+        {
+            ssize_t copied = copy_file_range(in_fd, &in_offset, out_fd, out_offset, size - in_offset, 0);
+            if (copied > 0 || (copied < 0 && errno == EINTR))
+                continue;
+            if (copied == 0 || errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+                break; // File got shorter, or no copy_file_range here: the loop below does the rest
+            return 0;
+        }
+        if (in_offset >= size)
+            return 1;
+        if (lseek(in_fd, in_offset, SEEK_SET) < 0)
+            return 0;
+    }
+
+    char *buffer = malloc(CONCAT_COPY_BUFFER);
+    if (buffer == NULL)
+        return 0;
+    ssize_t got;
+    int ok = 1;
+    while (ok && ((got = read(in_fd, buffer, CONCAT_COPY_BUFFER)) > 0 || (got < 0 && errno == EINTR)))
+    {
+        for (ssize_t done = 0; ok && got > 0 && done < got;)
+        {
+            ssize_t written = out_regular ? pwrite(out_fd, buffer + done, got - done, *out_offset)
+                                          : write(out_fd, buffer + done, got - done);
+            if (written < 0 && errno == EINTR)
+                continue;
+            ok = written > 0;
+            if (ok)
+            {
+                done += written;
+                *out_offset += written;
+            }
+        }
+    }
+    free(buffer);
+    return ok && got == 0;
+}
+
+// The "> out.txt" (or ">> out.txt") half of handle_concat
+static int concat_into_file(struct glob_results *files, const char *target, int append)
+{
+    // Reading a file we've just truncated (or are growing) would lose or repeat data
+    struct stat target_info, in_info;
+    int target_exists = stat(target, &target_info) == 0;
+    for (int i = 0; i < files->count; i++)
+    {
+        if (!is_text_file_name(files->paths[i]))
+        {
+            fprintf(stderr, "Error: File %s isn't a .txt file! All files must end with .txt\n", files->paths[i]);
+            return 0;
+        }
+        if (target_exists && stat(files->paths[i], &in_info) == 0 && in_info.st_dev == target_info.st_dev &&
+            in_info.st_ino == target_info.st_ino)
+        {
+            fprintf(stderr, "Error: %s is both an input and the output!\n", files->paths[i]);
+            return 0;
+        }
+    }
+
+    // No O_APPEND: copy_file_range() and FICLONERANGE refuse append-only fds, so >> starts at the end instead
+    int out_fd = open(target, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644);
+    struct stat out_info;
+    if (out_fd < 0 || fstat(out_fd, &out_info) < 0)
+    {
+        fprintf(stderr, "Error: Can't write %s: %s\n", target, strerror(errno));
+        if (out_fd >= 0)
+            close(out_fd);
+        return 0;
+    }
+    int out_regular = S_ISREG(out_info.st_mode);
+    off_t out_offset = append && out_regular ? out_info.st_size : 0;
+    blksize_t block = out_info.st_blksize > 0 ? out_info.st_blksize : 4096;
+    int try_clone = 1;
+
+    int ok = 1;
+    for (int i = 0; ok && i < files->count; i++)
+    {
+        int in_fd = open(files->paths[i], O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0 || fstat(in_fd, &in_info) < 0)
+        {
+            fprintf(stderr, "Error: Can't open %s! Does it exist?\n", files->paths[i]);
+            if (in_fd >= 0)
+                close(in_fd);
+            ok = 0;
+            break;
+        }
+        off_t before = out_offset;
+        ok = append_file_in_kernel(in_fd, &in_info, out_fd, out_regular, &out_offset, block, &try_clone);
+        if (!ok)
+            fprintf(stderr, "Error: Copying %s into %s failed: %s\n", files->paths[i], target, strerror(errno));
+        stats_count_bytes(STATS_OP_CONCAT, out_offset - before);
+        close(in_fd);
+    }
+
+    // A shorter result than what was there before (>> never shrinks anything,
+    // and /dev/null or a terminal has nothing to cut off)
+    if (ok && !append && out_regular && ftruncate(out_fd, out_offset) < 0)
+    {
+        fprintf(stderr, "Error: Can't cut %s down to its new size: %s\n", target, strerror(errno));
+        ok = 0;
+    }
+    close(out_fd);
+    return ok;
+}
+
+/**
+ * This function combines multiple text files and shows their content
+ * I needed to learn about file handling for this one!
+ */
+int handle_concat(char *input)
+{
+    // Need to make a copy of the input string
+    // I tried without copying once and got weird bugs
+    char my_command[MAX_INPUT_SIZE];
+    strcpy(my_command, input);
+
+    // "+m file1.txt file2.txt ..." means merge sorted files instead of concatenating
+    char *first_word = my_command;
+    while (*first_word == ' ' || *first_word == '\t')
+        first_word++;
+    if (first_word[0] == '+' && first_word[1] == 'm' &&
+        (first_word[2] == ' ' || first_word[2] == '\t' || first_word[2] == '\0'))
+    {
+        return handle_merge(first_word + 2);
+    }
+
+    // "a.txt + b.txt > out.txt" (or >>) puts the result in a file instead of on the screen
+    char *output_target = NULL;
+    int append_output = 0;
+    char *redirect = strchr(my_command, '>');
+    if (redirect != NULL)
+    {
+        append_output = (redirect[1] == '>');
+        *redirect = '\0';
+        output_target = redirect + 1 + append_output;
+        while (*output_target == ' ' || *output_target == '\t')
+            output_target++;
+        char *after_name = output_target + strcspn(output_target, " \t");
+        int extra_words = after_name[strspn(after_name, " \t")] != '\0';
+        *after_name = '\0';
+        if (*output_target == '\0' || extra_words || strchr(output_target, '>') != NULL)
+        {
+            fprintf(stderr, "Error: > needs one output file name after it\n");
+            return 0;
+        }
+    }
+
+    // Keep track of files and how many we've found
+    char *file_list[5]; // Assignment says max 5 files
+    int num_files = 0;
+    FILE *current_file; // For opening each file
+
+    // First, need to split the command by + symbols
+    // strtok is really useful for this!
+    char *file_name = strtok(my_command, "+");
+
+    // Process each file name we find
+    while (file_name != NULL && num_files < 5)
+    {
+        // Get rid of spaces at the beginning
+        // These spaces caused problems when I tried to open files
+        while (*file_name == ' ' || *file_name == '\t')
+        {
+            file_name = file_name + 1; // Move past the space
+        }
+
+        // Remove spaces at the end too
+        int name_length = strlen(file_name);
+        while (name_length > 0 && (file_name[name_length - 1] == ' ' || file_name[name_length - 1] == '\t'))
+        {
+            file_name[name_length - 1] = '\0'; // Replace with string terminator
+            name_length = name_length - 1;
+        }
+
+        // If there's anything left after trimming spaces, save it
+        if (name_length > 0)
+        {
+            // Add this file to our list
+            file_list[num_files] = file_name;
+            num_files = num_files + 1;
+
+            // Debug message - helpful when I was testing
+            // printf("Found file: %s\n", file_name);
+        }
+
+        // Get the next file name
+        file_name = strtok(NULL, "+");
+    }
+
+    // Make sure we have at least one file
+    if (num_files == 0)
+    {
+        fprintf(stderr, "Error: You need to specify at least one file to concatenate!\n");
+        return 0; // Failed
+    }
+
+    // Make sure we don't have too many files
+    if (file_name != NULL) // If there are still more tokens
+    {
+        fprintf(stderr, "Error: Too many files! I can only handle up to 5 files.\n");
+        return 0; // Failed
+    }
+
+    // Patterns like chapter*.txt turn into every matching file (sorted)
+    struct glob_results all_files;
+    if (!expand_file_list(file_list, num_files, &all_files))
+    {
+        return 0; // Failed
+    }
+
+    // With an output file the kernel does the copying
+    int all_worked = 1;
+    if (output_target != NULL)
+    {
+        all_worked = concat_into_file(&all_files, output_target, append_output);
+        free_glob_results(&all_files);
+        return all_worked;
+    }
+
+    // Now we can process each file one by one
+    for (int file_index = 0; file_index < all_files.count; file_index++)
+    {
+        char *this_file = all_files.paths[file_index];
+
+        // First check if it's a .txt file (or a <(cmd) stream)
+        // The assignment says we must only use .txt files
+        if (!is_text_file_name(this_file))
+        {
+            fprintf(stderr, "Error: File %s isn't a .txt file! All files must end with .txt\n",
+                    this_file);
+            all_worked = 0; // Failed
+            break;
+        }
+
+        // Try to open the file
+        current_file = fopen(this_file, "r");
+
+        if (current_file == NULL)
+        {
+            // Couldn't open the file
+            fprintf(stderr, "Error: Can't open %s! Does it exist?\n", this_file);
+            all_worked = 0; // Failed
+            break;
+        }
+
+        // printf("\n----- Contents of %s -----\n", this_file);
+
+        // Read this file in chunks and print each chunk
+        // Using a buffer is much faster than reading one byte at a time!
+        char data_chunk[1024]; // 1KB chunks seemed reasonable
+        int bytes_got;
+
+        // Keep reading chunks until we reach the end of the file
+        while ((bytes_got = fread(data_chunk, 1, sizeof(data_chunk), current_file)) > 0)
+        {
+            // Write this chunk to standard output
+            fwrite(data_chunk, 1, bytes_got, stdout);
+            stats_count_bytes(STATS_OP_CONCAT, bytes_got);
+        }
+
+        // Done with this file, close it
+        fclose(current_file);
+    }
+
+    free_glob_results(&all_files);
+    if (!all_worked)
+    {
+        return 0;
+    }
+
+    // Let user know we're done
+    // printf("\n----- End of concatenation -----\n");
+    return 1; // Success!
+}
+
+/**
+ * Here-documents and here-strings
+ *   sort <<EOF         - the lines typed after this one (up to "EOF") are sort's input
+ *   tr a-z A-Z <<< hi  - the rest of the line is the input
+ * The main loop (or the server, for a multi-line 'L' frame) collects the
+ * body before running the line and leaves it in heredoc_body for us
+ */
+#define HEREDOC_PIPE_LIMIT 16384 // Anything bigger goes in a memfd instead of a pipe
+
+static struct text_buffer heredoc_body; // Body for the line being run
+static int heredoc_ready = 0;
+
+/**
+ * Finds a "<<WORD" marker (not "<<<") in a line and copies out the delimiter
+ * Quotes around the word are dropped, "<<-" means strip leading tabs
+ * Returns a pointer to the "<<", or NULL if the line doesn't have one
+ */
+// How long the word after << or <<< is: up to a space or an operator like | or >,
+// or up to the closing quote if it starts with one ("<<< 'two words' | wc")
+static size_t here_word_length(const char *word)
+{
+    if (word[0] == '"' || word[0] == '\'')
+    {
+        const char *close = strchr(word + 1, word[0]);
+        if (close != NULL)
+            return close + 1 - word;
+    }
+    return strcspn(word, " \t|;&<>");
+}
+
+char *find_heredoc_marker(const char *line, char *delimiter, size_t size, int *strip_tabs)
+{
+    const char *marker = strstr(line, "<<");
+    while (marker != NULL && marker[2] == '<')
+    {
+        // Skip over a here-string, and any '<' right after it
+        marker += 3;
+        while (*marker == '<')
+            marker++;
+        marker = strstr(marker, "<<");
+    }
+    if (marker == NULL)
+        return NULL;
+
+    const char *word = marker + 2;
+    *strip_tabs = 0;
+    if (*word == '-')
+    {
+        *strip_tabs = 1;
+        word++;
+    }
+    while (*word == ' ' || *word == '\t')
+        word++;
+
+    size_t length = here_word_length(word);
+    if (length >= 2 && (word[0] == '\'' || word[0] == '"') && word[length - 1] == word[0])
+    {
+        word++;
+        length -= 2;
+    }
+    if (length == 0 || length >= size)
+        return NULL;
+
+    memcpy(delimiter, word, length);
+    delimiter[length] = '\0';
+    return (char *)marker;
+}
+
+/**
+ * Reads the here-document lines that follow a command from the terminal
+ * Stops at the delimiter line (or end of input) and fills in heredoc_body
+ */
+void read_heredoc_body(FILE *input, const char *line)
+{
+    char delimiter[256];
+    int strip_tabs;
+    heredoc_body.length = 0;
+    heredoc_ready = 0;
+    if (find_heredoc_marker(line, delimiter, sizeof(delimiter), &strip_tabs) == NULL)
+        return;
+
+    // getline so body lines can be longer than a command line
+    char *body_line = NULL;
+    size_t body_space = 0;
+    ssize_t got;
+    int finished = 0;
+    while (1)
+    {
+        printf("> ");
+        fflush(stdout);
+        if ((got = getline(&body_line, &body_space, input)) < 0)
+            break;
+
+        char *text = body_line;
+        if (strip_tabs)
+        {
+            while (*text == '\t')
+                text++;
+        }
+        size_t text_length = got - (text - body_line);
+        size_t compare_length = text_length;
+        if (compare_length > 0 && text[compare_length - 1] == '\n')
+            compare_length--;
+        if (compare_length == strlen(delimiter) && memcmp(text, delimiter, compare_length) == 0)
+        {
+            finished = 1;
+            break;
+        }
+        text_buffer_add(&heredoc_body, text, text_length);
+    }
+    free(body_line);
+
+    if (!finished)
+        fprintf(stderr, "Warning: here-document ended before \"%s\"\n", delimiter);
+    heredoc_ready = 1;
+}
+
+/**
+ * Server version: the body is whatever came after the first newline of the frame
+ * Lines after the delimiter (if any) are ignored
+ */
+void set_heredoc_body(const char *line, const char *body)
+{
+    char delimiter[256];
+    int strip_tabs;
+    heredoc_body.length = 0;
+    heredoc_ready = 0;
+    if (body == NULL || find_heredoc_marker(line, delimiter, sizeof(delimiter), &strip_tabs) == NULL)
+        return;
+
+    size_t delimiter_length = strlen(delimiter);
+    while (*body != '\0')
+    {
+        const char *text = body;
+        if (strip_tabs)
+        {
+            while (*text == '\t')
+                text++;
+        }
+        const char *newline = strchr(text, '\n');
+        size_t line_length = newline ? (size_t)(newline - text) : strlen(text);
+        if (line_length == delimiter_length && memcmp(text, delimiter, line_length) == 0)
+            break;
+        text_buffer_add(&heredoc_body, text, line_length);
+        text_buffer_add(&heredoc_body, "\n", 1);
+        if (newline == NULL)
+            break;
+        body = newline + 1;
+    }
+    heredoc_ready = 1;
+}
+
+/**
+ * Makes a read-only fd holding the given bytes, for a command's stdin
+ * Small payloads go through a pipe (fits in the pipe buffer so writing can't block)
+ * Big ones go in a memfd that gets sealed, so the command sees exactly what we wrote
+ * and never has to wait for us to copy it in. Returns the fd or -1
+ */
+int make_input_fd(const char *data, size_t length)
+{
+    if (length <= HEREDOC_PIPE_LIMIT)
+    {
+        int pipe_ends[2];
+        if (pipe2(pipe_ends, O_CLOEXEC) == 0)
+        {
+            int capacity = fcntl(pipe_ends[1], F_GETPIPE_SZ);
+            if (capacity > 0 && length <= (size_t)capacity)
+            {
+                int wrote = write_all(pipe_ends[1], data, length);
+                close(pipe_ends[1]); // Command sees EOF after the payload
+                if (wrote)
+                    return pipe_ends[0];
+                close(pipe_ends[0]);
+                return -1;
+            }
+            close(pipe_ends[0]); // Pipe is smaller than usual, use a memfd
+            close(pipe_ends[1]);
+        }
+    }
+
+    int memory_fd = memfd_create("w25-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memory_fd < 0)
+        return -1;
+    if (!write_all(memory_fd, data, length) || lseek(memory_fd, 0, SEEK_SET) < 0)
+    {
+        close(memory_fd);
+        return -1;
+    }
+    // No more writes or size changes from anybody, then lock the seals too
+    fcntl(memory_fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    return memory_fd;
+}
+
+/**
+ * Runs words[0] inside the shell if it's in the builtin table. The redirections
+ * are done on our own fds for the length of the command and then put back, and
+ * in_fd (if it isn't STDIN_FILENO) stands in for stdin the same way
+ * Returns 1 if it was a builtin (its status is in last_exit_status), 0 for a program
+ */
+static int run_builtin_redirected(char **words, int in_fd, const struct file_actions *actions)
+{
+    if (!is_special_command(words[0]))
+        return 0;
+
+    int saved_fds[MAX_FILE_ACTIONS];
+    int saved_stdin = -1;
+    fflush(stdout);
+    if (in_fd != STDIN_FILENO)
+    {
+        saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if (!apply_file_actions_here(actions, saved_fds))
+    {
+        last_exit_status = 1;
+    }
+    else
+    {
+        handle_special_commands(words);
+        fflush(stdout);
+        undo_file_actions_here(actions, saved_fds, actions->count);
+    }
+    if (saved_stdin >= 0)
+    {
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+    }
+    return 1;
+}
+
+/**
+ * This function handles the input/output redirection (<, >, >>, 2>, 2>&1, &> ...)
+ * I spent a long time figuring out how these special characters work!
+ * The redirections become file actions that the child carries out before exec
+ */
+int handle_redirection(char *input)
+{
+    // First make a working copy of the input command
+    // I had trouble when I didn't copy the string
+    char command_string[MAX_INPUT_SIZE];
+    strcpy(command_string, input);
+
+    // Input that comes from the command line itself instead of a file
+    const char *here_data = NULL;
+    size_t here_length = 0;
+    char here_string[MAX_INPUT_SIZE + 1];
+    char *here_at = NULL; // Where the << or <<< was
+
+    // A here-string is one word ("<<< hi" or "<<< 'two words'"). It gets blanked out
+    // like a heredoc marker, so the > < and | after it are parsed as usual
+    char *where_is_here_string = strstr(command_string, "<<<");
+    if (where_is_here_string != NULL)
+    {
+        char *text = where_is_here_string + 3;
+        while (*text == ' ' || *text == '\t')
+            text++;
+        size_t word_length = here_word_length(text);
+        size_t text_length = word_length;
+        const char *start = text;
+        // Drop one pair of quotes so <<< "two words" works
+        if (text_length >= 2 && (text[0] == '"' || text[0] == '\'') && text[text_length - 1] == text[0])
+        {
+            start++;
+            text_length -= 2;
+        }
+        memcpy(here_string, start, text_length);
+        here_string[text_length] = '\n'; // Same as bash, the command gets a full line
+        here_data = here_string;
+        here_length = text_length + 1;
+        memset(where_is_here_string, ' ', text + word_length - where_is_here_string);
+        here_at = where_is_here_string;
+    }
+    else
+    {
+        char delimiter[256];
+        int strip_tabs;
+        char *marker = find_heredoc_marker(command_string, delimiter, sizeof(delimiter), &strip_tabs);
+        if (marker != NULL)
+        {
+            // Blank out "<<WORD" so something like "> out.txt" or "| wc" after it still works
+            char *end = marker + 2;
+            if (*end == '-')
+                end++;
+            while (*end == ' ' || *end == '\t')
+                end++;
+            end += here_word_length(end);
+            memset(marker, ' ', end - marker);
+            here_at = marker;
+
+            here_data = "";
+            if (heredoc_ready && heredoc_body.length > 0)
+            {
+                here_data = heredoc_body.data;
+                here_length = heredoc_body.length;
+            }
+        }
+    }
+
+    // "cat <<< hi | tr a-z A-Z": the rest is a pipeline, and the command that had
+    // the << in it reads the text (count the | in front of it to know which one)
+    if (strchr(command_string, '|') != NULL && strstr(command_string, "||") == NULL)
+    {
+        int here_stage = 0;
+        for (char *p = command_string; here_at != NULL && p < here_at; p++)
+            here_stage += *p == '|';
+
+        int input_fd = STDIN_FILENO;
+        if (here_data != NULL)
+        {
+            input_fd = make_input_fd(here_data, here_length);
+            if (input_fd < 0)
+            {
+                perror("Couldn't set up the here-document");
+                return 0;
+            }
+        }
+        stats_line_operator = STATS_OP_PIPE;
+        int worked = run_pipeline(command_string, here_stage, input_fd);
+        if (input_fd != STDIN_FILENO)
+            close(input_fd);
+        return worked;
+    }
+
+    // Now break the rest into words and redirections
+    // "sort<in.txt>out.txt" works too, the operators end a word on their own
+    char *command_words[MAX_ARGS + 1]; // +1 for NULL at the end
+    struct file_actions actions;
+    int word_count = split_redirections(command_string, command_words, MAX_ARGS, &actions);
+    if (word_count < 0)
+    {
+        last_exit_status = 1;
+        return 0;
+    }
+    if (word_count > MAX_ARGS)
+    {
+        fprintf(stderr, "Error: Too many arguments. Maximum allowed is 5.\n");
+        return 0;
+    }
+
+    // Make sure we actually have a command to run
+    if (word_count == 0)
+    {
+        fprintf(stderr, "Error: You didn't specify a command to run!\n");
+        return 0; // Failed
+    }
+
+    // The here-document/here-string text gets its own fd, the child reads it like a file
+    // (a "<file" later on the line still wins, same as bash)
+    int input_fd = STDIN_FILENO;
+    if (here_data != NULL)
+    {
+        input_fd = make_input_fd(here_data, here_length);
+        if (input_fd < 0)
+        {
+            perror("Couldn't set up the here-document");
+            return 0;
+        }
+    }
+
+    // Builtins run inside the shell
+    if (run_builtin_redirected(command_words, input_fd, &actions))
+    {
+        if (input_fd != STDIN_FILENO)
+            close(input_fd);
+        return 1;
+    }
+
+    // Expand glob patterns in the command's arguments
+    char **expanded_words = expand_command_args(command_words);
+    if (expanded_words == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory expanding arguments\n");
+        if (input_fd != STDIN_FILENO)
+            close(input_fd);
+        return 0;
+    }
+
+    // Create a child process, it opens the files itself right before exec
+    pid_t child_pid = spawn_program_redirected(expanded_words, input_fd, STDOUT_FILENO, &actions);
+    free_expanded_args(expanded_words);
+
+    // The child has its own copy now
+    if (input_fd != STDIN_FILENO)
+        close(input_fd);
+
+    // Check if fork worked
+    if (child_pid < 0)
+    {
+        // Something went wrong with fork()
+        perror("Oh no! Couldn't create process");
+        return 0; // Failed
+    }
+
+    // We just need to wait for the child to finish
+    int status;
+    if (wait_program(child_pid, &status))
+    {
+        remember_exit_status(status);
+
+        // Could check status here to see if command worked
+        if (WIFEXITED(status))
+        {
+            int exit_code = WEXITSTATUS(status);
+            if (exit_code != 0)
+            {
+                printf("Command exited with status %d\n", exit_code);
+            }
+        }
+    }
+
+    // Successfully handled the redirection
+    return 1;
+}
+
+/**
+ * Placement for one command of a ; or && / || line: "place|limit ... --" and
+ * pin=/nice=/sched= words all go on just that command, like the timeout prefix does
+ * Returns where the command starts, or NULL if an option was bad
+ */
+static char *take_command_placement(char *command, struct placement *place)
+{
+    placement_reset(place);
+    command = take_job_prefix(command, place);
+    if (command != NULL)
+        command = take_placement_prefix(command, place, 0);
+    if (command != NULL && place->pin_auto)
+    {
+        int cpu;
+        if (pick_auto_cpus(1, &cpu))
+        {
+            CPU_ZERO(&place->cpus);
+            CPU_SET(cpu, &place->cpus);
+            place->has_cpus = 1;
+        }
+    }
+    return command;
+}
+
+/**
+ * This function runs multiple commands one after another when separated by ;
+ * I learned this is called "sequential execution" in shell programming
+ */
+int handle_sequential(char *input)
+{
+    // Need to make a copy of the input string to work with
+    // The original might be needed elsewhere and strtok changes the string
+    char command_string[MAX_INPUT_SIZE];
+    strcpy(command_string, input);
+
+    // According to assignment, we can have up to 4 commands with ;
+    char *separate_commands[4];
+    int command_count = 0;
+
+    // Split the input by semicolons to get each command
+    // strtok is really useful for this kind of string splitting
+    char *one_command = strtok(command_string, ";");
+
+    // Get all commands and store them in our array
+    while (one_command != NULL && command_count < 4)
+    {
+        // Save this command for later execution
+        separate_commands[command_count] = one_command;
+        command_count = command_count + 1; // Increment our counter
+
+        // Get next command after semicolon
+        one_command = strtok(NULL, ";");
+    }
+
+    // Make sure we don't have too many commands
+    if (one_command != NULL)
+    {
+        printf("Error: Too many commands! The limit is 4 commands with semicolons\n");
+        return 0; // Failed
+    }
+
+    // "timeout D a ; b" only limits a, the same as "a ; timeout D b" only limits b,
+    // so the line's timeout goes to the first command and the rest get --timeout
+    double line_seconds = timed_job.active ? timed_job.seconds : 0;
+    double line_kill_after = timed_job.kill_after;
+
+    // Execute commands one by one
+    // printf("Running %d commands in sequence\n", command_count);
+
+    for (int index = 0; index < command_count; index++)
+    {
+        // First check if this command is empty (like if someone typed ;;)
+        if (separate_commands[index][0] == '\0' ||
+            (separate_commands[index][0] == ' ' && separate_commands[index][1] == '\0'))
+        {
+            printf("Skipping empty command at position %d\n", index + 1);
+            continue; // Skip to next command
+        }
+
+        // "a ; timeout 5 b" gives just this command a timeout
+        double command_seconds = index == 0 ? line_seconds : default_timeout;
+        double command_kill_after = index == 0 ? line_kill_after : default_kill_after;
+        separate_commands[index] = take_timeout_prefix(separate_commands[index], &command_seconds, &command_kill_after);
+        if (separate_commands[index] == NULL)
+        {
+            last_exit_status = 2;
+            continue;
+        }
+
+        // Same for "a ; nice=5 b" and "a ; limit mem=1G -- b"
+        struct placement place;
+        separate_commands[index] = take_command_placement(separate_commands[index], &place);
+        if (separate_commands[index] == NULL)
+        {
+            last_exit_status = 2;
+            continue;
+        }
+
+        // Now break the command into its arguments (words) and redirections
+        char *arguments[MAX_ARGS + 1]; // Extra space for NULL at end
+        struct file_actions command_actions;
+        int arg_count = split_redirections(separate_commands[index], arguments, MAX_ARGS, &command_actions);
+        if (arg_count < 0)
+        {
+            last_exit_status = 1;
+            continue; // Bad redirection, bash also just moves on to the next one
+        }
+
+        // Check if command is empty after parsing
+        if (arg_count == 0)
+        {
+            continue; // Nothing to do
+        }
+
+        // Check if there are too many arguments
+        if (arg_count > MAX_ARGS)
+        {
+            printf("Error: Command '%s' has too many arguments (max is 5)\n",
+                   separate_commands[index]);
+            continue; // Skip this command
+        }
+
+        // The commands before this one may have made files, so glob from fresh listings
+        glob_cache_reset();
+
+        // killterm, find-text, sum and plugin builtins run inside the shell,
+        // the same as when they're typed on their own
+        if (run_builtin_redirected(arguments, STDIN_FILENO, &command_actions))
+            continue;
+
+        // Expand glob patterns like *.txt
+        char **expanded_args = expand_command_args(arguments);
+        if (expanded_args == NULL)
+        {
+            fprintf(stderr, "Error: Out of memory expanding arguments\n");
+            return 0;
+        }
+
+        // Each command's clock starts fresh
+        timed_job_start(command_seconds, command_kill_after);
+
+        // Need to create a new process for this command
+        create_job_cgroup(&place);
+        pid_t child = spawn_program_placed(expanded_args, STDIN_FILENO, STDOUT_FILENO, &command_actions,
+                                           placement_is_set(&place) ? &place : NULL);
+        free_expanded_args(expanded_args);
+
+        if (child < 0)
+        {
+            // Fork failed
+            perror("Cannot create process for command");
+            return 0;
+        }
+
+        // Wait for the command to finish before starting the next one
+        int result;
+        if (wait_program(child, &result))
+        {
+            remember_exit_status(result);
+        }
+        finish_job_cgroup(&place);
+        if (timed_job.fired)
+            last_exit_status = timed_out_status();
+
+        // Print a separator between command outputs
+        // printf("--------------------\n");
+    }
+
+    return 1; // Success!
+}
+
+/**
+ * This function handles conditional commands with && and || operators
+ * This was the trickiest part for me to implement!
+ */
+int handle_conditional(char *input)
+{
+    // Need a working copy of the input string
+    // I kept having problems when I modified the original string
+    char command_string[MAX_INPUT_SIZE];
+    strcpy(command_string, input);
+
+    // These arrays will store all the parts needed for conditional execution
+    char *command_pieces[6]; // Can have up to 6 commands (with 5 operators)
+    char operator_types[5];  // Will store '&' for && or '|' for ||
+    int command_count = 0;   // How many commands we found
+    int operator_count = 0;  // How many operators we found
+
+    // Variables to help parse the command string
+    char *current_position = command_string; // Where we're currently looking
+    char *and_operator_pos;                  // Position of next && operator
+    char *or_operator_pos;                   // Position of next || operator
+    char *next_operator_pos;                 // Which operator comes first
+
+    // Keep parsing until we've found all commands or reached our limit
+    // printf("Parsing conditional command: %s\n", input);
+
+    while (current_position != NULL && *current_position != '\0' && command_count < 6)
+    {
+        // Look for both kinds of operators
+        and_operator_pos = strstr(current_position, "&&");
+        or_operator_pos = strstr(current_position, "||");
+
+        // Need to figure out which operator comes first (if any)
+        // This was confusing at first - had to draw it out on paper!
+        if (and_operator_pos != NULL && (or_operator_pos == NULL || and_operator_pos < or_operator_pos))
+        {
+            // && comes first
+            next_operator_pos = and_operator_pos;
+            operator_types[operator_count] = '&'; // Mark as AND operator
+            operator_count = operator_count + 1;
+        }
+        else if (or_operator_pos != NULL)
+        {
+            // || comes first
+            next_operator_pos = or_operator_pos;
+            operator_types[operator_count] = '|'; // Mark as OR operator
+            operator_count = operator_count + 1;
+        }
+        else
+        {
+            // No more operators found
+            next_operator_pos = NULL;
+        }
+
+        if (next_operator_pos != NULL)
+        {
+            // We found an operator!
+
+            // Replace the operator with a null terminator to split the string
+            *next_operator_pos = '\0';
+
+            // Save this command
+            command_pieces[command_count] = current_position;
+            command_count = command_count + 1;
+
+            // Move our position past the operator (either && or ||)
+            current_position = next_operator_pos + 2; // +2 to skip both characters
+
+            // If the second character wasn't replaced (like in "&&&"), skip it
+            if (*current_position == '&' || *current_position == '|')
+            {
+                current_position = current_position + 1;
+            }
+
+            // Skip any spaces at the beginning of the next command
+            while (*current_position == ' ')
+            {
+                current_position = current_position + 1;
+            }
+        }
+        else
+        {
+            // No more operators, this is the last command
+            command_pieces[command_count] = current_position;
+            command_count = command_count + 1;
+            break; // Exit the loop
+        }
+    }
+
+    // Make sure we don't have too many operators
+    if (operator_count > 5)
+    {
+        printf("Error: Too many operators! Maximum is 5 && or || operators\n");
+        return 0; // Failed
+    }
+
+    // Printing what we found (useful for debugging)
+    // printf("Found %d commands with %d operators\n", command_count, operator_count);
+
+    // Now execute the commands based on the conditions
+    // I need to keep track of whether commands succeed or fail
+    int previous_command_success = 1; // Start with success so first command always runs
+    int command_status;
+
+    // "timeout D a ; b" only limits a, the same as "a ; timeout D b" only limits b,
+    // so the line's timeout goes to the first command and the rest get --timeout
+    double line_seconds = timed_job.active ? timed_job.seconds : 0;
+    double line_kill_after = timed_job.kill_after;
+
+    // Process each command
+    for (int cmd_index = 0; cmd_index < command_count; cmd_index++)
+    {
+        // Get this command and trim leading spaces
+        char *current_command = command_pieces[cmd_index];
+        while (*current_command == ' ')
+        {
+            current_command = current_command + 1;
+        }
+
+        // Here's the clever part - conditional execution!
+        // We need to decide whether to run this command based on:
+        // 1. The operator that came before it (& or |)
+        // 2. Whether the previous command succeeded or failed
+
+        if (cmd_index > 0) // Skip this check for the first command
+        {
+            // For && operator: only run if previous command succeeded
+            if (operator_types[cmd_index - 1] == '&' && previous_command_success == 0)
+            {
+                // printf("Skipping command due to && after failed command\n");
+                continue; // Skip to next command
+            }
+
+            // For || operator: only run if previous command failed
+            if (operator_types[cmd_index - 1] == '|' && previous_command_success == 1)
+            {
+                // printf("Skipping command due to || after successful command\n");
+                continue; // Skip to next command
+            }
+        }
+
+        // If we get here, we need to execute this command
+        // printf("Executing command: %s\n", current_command);
+
+        // "a && timeout 5 b" gives just this command a timeout
+        double command_seconds = cmd_index == 0 ? line_seconds : default_timeout;
+        double command_kill_after = cmd_index == 0 ? line_kill_after : default_kill_after;
+        current_command = take_timeout_prefix(current_command, &command_seconds, &command_kill_after);
+        if (current_command == NULL)
+        {
+            previous_command_success = 0;
+            last_exit_status = 2;
+            continue;
+        }
+
+        // Same for "a && nice=5 b" and "a && limit mem=1G -- b"
+        struct placement place;
+        current_command = take_command_placement(current_command, &place);
+        if (current_command == NULL)
+        {
+            previous_command_success = 0;
+            last_exit_status = 2;
+            continue;
+        }
+
+        // Parse this command into its arguments (like "ls", "-l", etc.)
+        // Redirections like "2> err.txt" come out separately
+        char *argument_list[MAX_ARGS + 1]; // +1 for NULL at end
+        struct file_actions command_actions;
+        int arg_count = split_redirections(current_command, argument_list, MAX_ARGS, &command_actions);
+        if (arg_count < 0)
+        {
+            // A broken redirection counts as a failed command
+            previous_command_success = 0;
+            last_exit_status = 1;
+            continue;
+        }
+        if (arg_count > MAX_ARGS)
+            arg_count = MAX_ARGS; // Same as before: extra words are dropped
+
+        // Skip empty commands
+        if (arg_count == 0)
+        {
+            // printf("Skipping empty command\n");
+            continue;
+        }
+
+        // Fresh directory listings for the globs, like in ; lines
+        glob_cache_reset();
+
+        // Builtins run inside the shell, and their status decides && / || like a program's would
+        if (run_builtin_redirected(argument_list, STDIN_FILENO, &command_actions))
+        {
+            previous_command_success = last_exit_status == 0;
+            printf("Command exited with status %d (%s)\n", last_exit_status,
+                   previous_command_success ? "success" : "failure");
+            continue;
+        }
+
+        // Expand glob patterns before running it
+        char **expanded_args = expand_command_args(argument_list);
+        if (expanded_args == NULL)
+        {
+            fprintf(stderr, "Error: Out of memory expanding arguments\n");
+            return 0;
+        }
+
+        // Every && / || element's clock starts fresh
+        timed_job_start(command_seconds, command_kill_after);
+
+        // Normal command - spawn_program does the fork and exec
+        create_job_cgroup(&place);
+        pid_t child_pid = spawn_program_placed(expanded_args, STDIN_FILENO, STDOUT_FILENO, &command_actions,
+                                               placement_is_set(&place) ? &place : NULL);
+        free_expanded_args(expanded_args);
+
+        if (child_pid < 0)
+        {
+            // Error during fork
+            perror("Couldn't create process");
+            return 0;
+        }
+
+        // Wait for the child to finish
+        int waited = wait_program(child_pid, &command_status);
+        finish_job_cgroup(&place);
+        if (!waited)
+        {
+            previous_command_success = 0;
+            continue;
+        }
+        remember_exit_status(command_status);
+
+        // Figure out if the command succeeded or failed
+        // This is important for deciding whether to run the next command!
+        if (timed_job.fired)
+        {
+            last_exit_status = timed_out_status();
+            previous_command_success = 0;
+            printf("Command timed out - considering it failed\n");
+        }
+        else if (WIFEXITED(command_status))
+        {
+            // The child process exited normally
+            int exit_code = WEXITSTATUS(command_status);
+            previous_command_success = (exit_code == 0) ? 1 : 0;
+
+            printf("Command exited with status %d (%s)\n",
+                   exit_code,
+                   previous_command_success ? "success" : "failure");
+        }
+        else
+        {
+            // The child process didn't exit normally
+            // (maybe it was killed by a signal)
+            previous_command_success = 0; // Consider it failed
+            printf("Command didn't exit normally - considering it failed\n");
+        }
+    }
+
+    // We're done!
+    return 1; // Success
+}
+
+// Does the line, or any command after a ; && or | in it, start with "place", "limit" or pin=/nice=/sched=?
+static int line_has_placement(const char *line)
+{
+    while (line != NULL)
+    {
+        while (*line == ' ' || *line == '\t')
+            line++;
+        if (strncmp(line, "place ", 6) == 0 || strncmp(line, "limit ", 6) == 0 || starts_with_placement(line))
+            return 1;
+        line = strpbrk(line, ";&|");
+        if (line != NULL)
+            line++;
+    }
+    return 0;
+}
+
+/**
+ * Figures out what kind of command a line is and calls the right handler
+ * Returns the exit status of the line (0 = success)
+ */
+static int run_line_handlers(char *user_command)
+{
+    // Handlers return 1 when they worked and 0 when they failed
+    int handled_ok = 1;
+    last_exit_status = 0;
+    stats_line_operator = STATS_OP_COMMAND;
+
+    // Directory listings cached by glob expansion only live for one line
+    glob_cache_reset();
+
+    // Lines with placement prefixes on their commands, and lines with more than one command
+    int placed = line_has_placement(user_command);
+    int chained = strchr(user_command, ';') != NULL || strstr(user_command, "&&") != NULL ||
+                  strstr(user_command, "||") != NULL;
+
+    // Some debug output - helped me see what was happening
+    // printf("Command received: %s\n", user_command);
+
+    // Figure out which type of command this is
+    // Need to check special characters in a specific order
+
+    // watch-run owns the whole line, the operators after its -- are for the runs
+    if (strncmp(user_command, "watch-run ", 10) == 0)
+    {
+        stats_line_operator = STATS_OP_BUILTIN;
+        last_exit_status = run_watch_command(user_command);
+        return last_exit_status;
+    }
+    // So do "every 5s -- line" and "at 02:00 -- line", the line runs later
+    else if (is_schedule_line(user_command))
+    {
+        stats_line_operator = STATS_OP_BUILTIN;
+        last_exit_status = run_schedule_command(user_command);
+        return last_exit_status;
+    }
+    // Here-strings and here-documents go first, a | or + in their text is just data
+    else if (strstr(user_command, "<<") != NULL)
+    {
+        stats_line_operator = STATS_OP_REDIRECTION;
+        handled_ok = handle_redirection(user_command);
+    }
+    // Then check for piping operations ("||" is conditional, not a pipe)
+    // "place ... --", "limit ... --", "pipestat ..." and "nice=5 cmd" go here too, even without a pipe,
+    // but with ; && or || in the line the prefix only belongs to its own command
+    else if ((strchr(user_command, '|') != NULL && strstr(user_command, "||") == NULL) ||
+             strncmp(user_command, "pipestat ", 9) == 0 || (placed && !chained))
+    {
+        // printf("Detected pipe operation!\n");
+        stats_line_operator = STATS_OP_PIPE;
+        handled_ok = handle_multi_pipe(user_command);
+    }
+    // Check for reverse piping (the = in "a ; nice=5 b" isn't one)
+    else if (strchr(user_command, '=') != NULL && !placed)
+    {
+        // printf("Detected reverse pipe operation!\n");
+        stats_line_operator = STATS_OP_REVERSE_PIPE;
+        handled_ok = handle_reverse_pipe(user_command);
+    }
+    // Check for file append operation
+    else if (strchr(user_command, '~') != NULL)
+    {
+        // printf("Detected file append operation!\n");
+        stats_line_operator = STATS_OP_APPEND;
+        handled_ok = handle_append(user_command);
+    }
+    // Check for word count operation
+    else if (strchr(user_command, '#') != NULL)
+    {
+        // printf("Detected word count operation!\n");
+        stats_line_operator = STATS_OP_WORD_COUNT;
+        handled_ok = handle_word_count(user_command);
+    }
+    // Check for file concatenation
+    else if (strchr(user_command, '+') != NULL)
+    {
+        // printf("Detected file concatenation operation!\n");
+        stats_line_operator = STATS_OP_CONCAT;
+        handled_ok = handle_concat(user_command);
+    }
+    // Check for input/output redirection
+    // With ; or && in the line each command does its own redirections instead
+    else if ((strchr(user_command, '<') != NULL || strchr(user_command, '>') != NULL) && !chained)
+    {
+        // printf("Detected I/O redirection!\n");
+        stats_line_operator = STATS_OP_REDIRECTION;
+        handled_ok = handle_redirection(user_command);
+    }
+    // Check for sequential execution
+    else if (strchr(user_command, ';') != NULL)
+    {
+        // printf("Detected sequential execution!\n");
+        stats_line_operator = STATS_OP_SEQUENTIAL;
+        handled_ok = handle_sequential(user_command);
+    }
+    // Check for conditional execution (need to check for && before ||)
+    else if (strstr(user_command, "&&") != NULL || strstr(user_command, "||") != NULL)
+    {
+        // printf("Detected conditional execution!\n");
+        stats_line_operator = STATS_OP_CONDITIONAL;
+        handled_ok = handle_conditional(user_command);
+    }
+    // If no special characters, it's a regular command
+    else
+    {
+        // Regular command - need to parse it into arguments
+        char *args_array[MAX_ARGS + 1]; // Local array for arguments
+
+        // Use our parsing function to break command into words
+        int arg_count = parse_command(user_command, args_array);
+
+        // Make sure we actually got some arguments
+        if (arg_count > 0)
+        {
+            // First check if it's one of our special built-in commands
+            if (handle_special_commands(args_array))
+            {
+                stats_line_operator = STATS_OP_BUILTIN;
+                // If special command was handled, go back to prompt
+                // printf("Special command executed\n");
+                return last_exit_status;
+            }
+
+            // Otherwise execute it as a normal command
+            // printf("Executing regular command: %s\n", args_array[0]);
+            int result = execute_command(args_array);
+            if (result == 0)
+            {
+                // Command failed before it could even start
+                last_exit_status = 1;
+            }
+        }
+        else
+        {
+            printf("Error: No valid command found\n");
+            last_exit_status = 1;
+        }
+    }
+
+    // A handler that failed before running anything still counts as a failure
+    if (!handled_ok && last_exit_status == 0)
+    {
+        last_exit_status = 1;
+    }
+    return last_exit_status;
+}
+
+/**
+ * Runs one line through the handlers, inside a timed job when it starts with
+ * "timeout D" or the shell has a --timeout default
+ * This used to be inside main() but server mode and the script VM need it too
+ * Returns the exit status of the line (0 = success)
+ */
+int dispatch_command_line(char *user_command)
+{
+    double seconds = default_timeout, kill_after = default_kill_after;
+    char *command = take_timeout_prefix(user_command, &seconds, &kill_after);
+    if (command == NULL)
+        return last_exit_status = 2;
+
+    // A line run from inside another timed line gets its own clock, then puts the outer one back
+    struct timed_job outer = timed_job;
+    timed_job_start(seconds, kill_after);
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int status = run_line_handlers(command);
+    if (shell_stats != NULL)
+        stats_record(&shell_stats->operators[stats_line_operator], stats_microseconds_since(&started));
+    if (timed_job.fired)
+        status = last_exit_status = timed_out_status();
+    timed_job = outer;
+    return status;
+}
+
+/**
+ * Scripting: variables, let arithmetic, for/while/until/if and functions
+ *
+ *   x=5      let n=n+i      for i in 1..100000; do let n+=i; done
+ *   for f in *.txt; do # $f; done      while let i<5; do let i++; done
+ *   if test -d out; then ls out; else mkdir out; fi
+ *   greet() { echo hello $1; }      files=$(ls | wc -l)
+ *
+ * A line that uses any of this is compiled once into bytecode for a small stack
+ * VM, so loop bodies are never parsed again. Variables get a slot number at
+ * compile time, and numbers stay numbers until something needs the text, so
+ * let and assignments never touch malloc or strtoll in a hot loop. Anything
+ * that isn't a VM builtin goes to the normal handlers: execute_command() for
+ * plain commands, or the whole dispatcher if the command uses |, >, + etc.
+ */
+#define VM_STACK_SIZE 64      // Arithmetic stack per function call
+#define VM_MAX_CALL_DEPTH 100 // Stops runaway recursion
+#define VM_MAX_LISTS 16       // Nested "for x in list" loops per function
+#define VM_MAX_LOOP_DEPTH 16  // Nested loops the compiler keeps track of
+#define VM_MAX_JUMPS 64       // break/continue statements per loop
+
+// Shell variables live in one table, the compiler turns names into indexes
+struct shell_variable
+{
+    char *name;
+    char *text; // Only current when text_valid is set
+    size_t text_space;
+    long long number; // Only current when number_valid is set
+    unsigned char text_valid;
+    unsigned char number_valid;
+    unsigned char is_set;
+};
+
+static struct shell_variable *shell_variables = NULL;
+static int shell_variable_count = 0;
+static int shell_variable_space = 0;
+
+// Returns the slot for a variable name, adding it if it's new (-1 if out of memory)
+static int variable_slot(const char *name, size_t length)
+{
+    for (int i = 0; i < shell_variable_count; i++)
+    {
+        if (strncmp(shell_variables[i].name, name, length) == 0 && shell_variables[i].name[length] == '\0')
+            return i;
+    }
+
+    if (shell_variable_count == shell_variable_space)
+    {
+        int new_space = shell_variable_space ? shell_variable_space * 2 : 32;
+        struct shell_variable *grown = realloc(shell_variables, sizeof(struct shell_variable) * new_space);
+        if (grown == NULL)
+            return -1;
+        shell_variables = grown;
+        shell_variable_space = new_space;
+    }
+
+    struct shell_variable *variable = &shell_variables[shell_variable_count];
+    memset(variable, 0, sizeof(*variable));
+    variable->name = strndup(name, length);
+    if (variable->name == NULL)
+        return -1;
+    return shell_variable_count++;
+}
+
+static void variable_set_number(int slot, long long value)
+{
+    struct shell_variable *variable = &shell_variables[slot];
+    variable->number = value;
+    variable->number_valid = 1;
+    variable->text_valid = 0; // Text gets rebuilt only if someone asks for it
+    variable->is_set = 1;
+}
+
+static int variable_set_text(int slot, const char *text, size_t length)
+{
+    struct shell_variable *variable = &shell_variables[slot];
+    if (length + 1 > variable->text_space)
+    {
+        size_t new_space = length + 1 < 32 ? 32 : length + 1;
+        char *grown = realloc(variable->text, new_space);
+        if (grown == NULL)
+            return 0;
+        variable->text = grown;
+        variable->text_space = new_space;
+    }
+    memcpy(variable->text, text, length);
+    variable->text[length] = '\0';
+    variable->text_valid = 1;
+    variable->number_valid = 0;
+    variable->is_set = 1;
+    return 1;
+}
+
+static void variable_unset(int slot)
+{
+    shell_variables[slot].is_set = 0;
+    shell_variables[slot].text_valid = 0;
+    shell_variables[slot].number_valid = 0;
+}
+
+// Text value of a variable, falling back to the environment, NULL if unset
+static const char *variable_text(int slot)
+{
+    struct shell_variable *variable = &shell_variables[slot];
+    if (!variable->is_set)
+        return getenv(variable->name);
+    if (!variable->text_valid)
+    {
+        if (variable->text_space < 24 && !variable_set_text(slot, "", 0))
+            return "";
+        snprintf(variable->text, variable->text_space, "%lld", variable->number);
+        variable->text_valid = 1;
+        variable->number_valid = 1; // variable_set_text cleared it, but it's still right
+    }
+    return variable->text;
+}
+
+// Numeric value of a variable - text that isn't a number counts as 0
+static long long variable_number(int slot)
+{
+    struct shell_variable *variable = &shell_variables[slot];
+    if (variable->is_set && variable->number_valid)
+        return variable->number;
+
+    const char *text = variable_text(slot);
+    long long value = text ? strtoll(text, NULL, 10) : 0;
+    if (variable->is_set)
+    {
+        variable->number = value;
+        variable->number_valid = 1;
+    }
+    return value;
+}
+
+// A word like "file$i.txt" is stored as parts: "file", $i, ".txt"
+enum word_part_kind
+{
+    PART_TEXT,
+    PART_VARIABLE,   // $name or ${name}
+    PART_POSITIONAL, // $1 .. $9
+    PART_STATUS,     // $?
+    PART_ARG_COUNT,  // $#
+    PART_PID,        // $$
+    PART_COMMAND,    // $(command) or `command`, text holds the command
+    PART_READ_FROM,  // <(command) - becomes a /dev/fd/N path to read its output
+    PART_WRITE_TO    // >(command) - becomes a /dev/fd/N path that feeds its input
+};
+
+struct word_part
+{
+    int kind;
+    int index; // Variable slot or positional number
+    char *text;
+    size_t length;
+};
+
+struct vm_word
+{
+    struct word_part *parts;
+    int part_count;
+};
+
+enum vm_opcode
+{
+    OP_PUSH_NUMBER,       // push numbers[a]
+    OP_PUSH_VAR,          // push variable a as a number
+    OP_PUSH_SPECIAL,      // push $1..$9, $? or $# as a number (a = part kind, b = index)
+    OP_PUSH_WORD,         // expand words[a] and push it as a number
+    OP_STORE_VAR,         // variable a = top of stack (the value stays on the stack)
+    OP_PUSH_LOCAL,        // push locals[a]
+    OP_POP,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+    OP_LESS, OP_LESS_EQUAL, OP_GREATER, OP_GREATER_EQUAL, OP_EQUAL, OP_NOT_EQUAL,
+    OP_AND, OP_OR, OP_NEGATE, OP_NOT,
+    OP_STATUS_FROM_VALUE, // pop, status = 0 if it wasn't 0 (that's how let works)
+    OP_SET_STATUS,        // status = a
+    OP_JUMP,              // jump to a
+    OP_JUMP_IF_FAILED,    // jump to a if status != 0
+    OP_JUMP_IF_OK,        // jump to a if status == 0
+    OP_RANGE_START,       // pop end and start: variable a = start, locals b/b+1 = end/step
+    OP_RANGE_CHECK,       // jump to c if variable a went past locals[b]
+    OP_RANGE_STEP,        // variable a += locals[b + 1]
+    OP_LIST_START,        // expand command a (with globs) into a new list
+    OP_LIST_NEXT,         // variable a = next item, or jump to c when there's none left
+    OP_LIST_END,          // drop the innermost list
+    OP_ASSIGN,            // variable a = words[b]
+    OP_UNSET,             // unset variable a
+    OP_EXPORT,            // export variable a (b = value word, or -1)
+    OP_RUN,               // run command a (builtin, function or program)
+    OP_RUN_LINE,          // expand words[a] and hand it to the operator dispatcher
+    OP_DEFINE,            // define functions[a]
+    OP_RETURN             // leave the function (a = 1 if the status is on the stack)
+};
+
+struct vm_instruction
+{
+    int op;
+    int a, b, c;
+};
+
+// A simple command is a run of words in the program's word table
+struct vm_command
+{
+    int first_word;
+    int word_count;
+};
+
+struct vm_function;
+
+struct vm_program
+{
+    struct vm_instruction *code;
+    int code_count, code_space;
+    long long *numbers;
+    int number_count, number_space;
+    struct vm_word *words;
+    int word_count, word_space;
+    struct vm_command *commands;
+    int command_count, command_space;
+    struct vm_function **functions; // Functions defined inside this program
+    int function_count, function_space;
+    int local_count; // Hidden per-call slots (for loop bounds)
+};
+
+struct vm_function
+{
+    char *name;
+    struct vm_program *body;
+    int references; // Held by the program that defines it, the function table and running calls
+};
+
+static struct vm_function **shell_functions = NULL;
+static int shell_function_count = 0;
+static int shell_function_space = 0;
+
+static unsigned long long vm_instructions_run = 0;
+static int vm_call_depth = 0;
+static struct text_buffer vm_scratch = {0}; // Reused for expanding words
+
+// Makes room for one more item in a growing array
+static int vm_grow(void **array, int *space, int count, size_t item_size)
+{
+    if (count < *space)
+        return 1;
+    int new_space = *space ? *space * 2 : 16;
+    void *grown = realloc(*array, item_size * new_space);
+    if (grown == NULL)
+        return 0;
+    *array = grown;
+    *space = new_space;
+    return 1;
+}
+
+static void vm_release_function(struct vm_function *function);
+
+static void vm_free_program(struct vm_program *program)
+{
+    if (program == NULL)
+        return;
+    for (int w = 0; w < program->word_count; w++)
+    {
+        for (int p = 0; p < program->words[w].part_count; p++)
+            free(program->words[w].parts[p].text);
+        free(program->words[w].parts);
+    }
+    for (int f = 0; f < program->function_count; f++)
+        vm_release_function(program->functions[f]);
+    free(program->code);
+    free(program->numbers);
+    free(program->words);
+    free(program->commands);
+    free(program->functions);
+    free(program);
+}
+
+static void vm_release_function(struct vm_function *function)
+{
+    if (--function->references > 0)
+        return;
+    vm_free_program(function->body);
+    free(function->name);
+    free(function);
+}
+
+static struct vm_function *find_shell_function(const char *name)
+{
+    for (int i = 0; i < shell_function_count; i++)
+    {
+        if (strcmp(shell_functions[i]->name, name) == 0)
+            return shell_functions[i];
+    }
+    return NULL;
+}
+
+/**
+ * Tokens: words, and the ; && || separators between commands
+ * Everything else (|, >, +, ...) stays inside the words for the dispatcher
+ */
+enum vm_token_type
+{
+    TOKEN_WORD,
+    TOKEN_SEMI,
+    TOKEN_AND,
+    TOKEN_OR,
+    TOKEN_END
+};
+
+struct vm_token
+{
+    int type;
+    const char *start;
+    int length;
+};
+
+struct vm_loop_jumps
+{
+    int break_jumps[VM_MAX_JUMPS];
+    int break_count;
+    int continue_jumps[VM_MAX_JUMPS];
+    int continue_count;
+};
+
+struct vm_compiler
+{
+    struct vm_program *program;
+    struct vm_token *tokens;
+    int token_count;
+    int position;
+    struct vm_loop_jumps *loops[VM_MAX_LOOP_DEPTH];
+    int loop_depth;
+    int in_function;
+    int timed; // Line started with "time"
+    const char *error;
+};
+
+static int vm_tokenize(const char *line, struct vm_token *tokens, int max_tokens)
+{
+    int count = 0;
+    const char *cursor = line;
+
+    while (count < max_tokens - 1)
+    {
+        while (*cursor == ' ' || *cursor == '\t')
+            cursor++;
+        if (*cursor == '\0')
+            break;
+
+        struct vm_token *token = &tokens[count++];
+        token->start = cursor;
+        if (*cursor == ';')
+        {
+            token->type = TOKEN_SEMI;
+            token->length = 1;
+        }
+        else if (strncmp(cursor, "&&", 2) == 0 || strncmp(cursor, "||", 2) == 0)
+        {
+            token->type = (*cursor == '&') ? TOKEN_AND : TOKEN_OR;
+            token->length = 2;
+        }
+        else
+        {
+            // Spaces and ; inside $( ... ), <( ... ) or `...` belong to the inner command
+            const char *end = cursor;
+            int depth = 0, in_backquote = 0;
+            while (*end != '\0')
+            {
+                if (depth == 0 && !in_backquote &&
+                    (*end == ' ' || *end == '\t' || *end == ';' ||
+                     strncmp(end, "&&", 2) == 0 || strncmp(end, "||", 2) == 0))
+                    break;
+                if (*end == '`')
+                    in_backquote = !in_backquote;
+                else if (!in_backquote && (end[0] == '$' || end[0] == '<' || end[0] == '>') && end[1] == '(')
+                {
+                    depth++;
+                    end++;
+                }
+                else if (depth > 0 && *end == '(')
+                    depth++;
+                else if (depth > 0 && *end == ')')
+                    depth--;
+                end++;
+            }
+            token->type = TOKEN_WORD;
+            token->length = end - cursor;
+        }
+        cursor += token->length;
+    }
+
+    tokens[count].type = TOKEN_END;
+    tokens[count].start = cursor;
+    tokens[count].length = 0;
+    return count;
+}
+
+static struct vm_token *vm_peek(struct vm_compiler *c)
+{
+    return &c->tokens[c->position];
+}
+
+// Is the next token this exact word?
+static int vm_next_is(struct vm_compiler *c, const char *word)
+{
+    struct vm_token *token = vm_peek(c);
+    return token->type == TOKEN_WORD && (int)strlen(word) == token->length &&
+           strncmp(token->start, word, token->length) == 0;
+}
+
+static int vm_expect(struct vm_compiler *c, const char *word, const char *error)
+{
+    // "for ... ; do" - the ; before a keyword is optional
+    if (vm_peek(c)->type == TOKEN_SEMI)
+        c->position++;
+    if (!vm_next_is(c, word))
+    {
+        c->error = error;
+        return 0;
+    }
+    c->position++;
+    return 1;
+}
+
+static int vm_emit(struct vm_compiler *c, int op, int a, int b, int cc)
+{
+    struct vm_program *program = c->program;
+    if (!vm_grow((void **)&program->code, &program->code_space, program->code_count, sizeof(struct vm_instruction)))
+    {
+        c->error = "out of memory";
+        return -1;
+    }
+    struct vm_instruction *instruction = &program->code[program->code_count];
+    instruction->op = op;
+    instruction->a = a;
+    instruction->b = b;
+    instruction->c = cc;
+    return program->code_count++;
+}
+
+// Points an earlier jump at the next instruction to be emitted
+static void vm_patch_jump(struct vm_compiler *c, int instruction)
+{
+    if (instruction < 0)
+        return;
+    struct vm_instruction *jump = &c->program->code[instruction];
+    if (jump->op == OP_RANGE_CHECK || jump->op == OP_LIST_NEXT)
+        jump->c = c->program->code_count;
+    else
+        jump->a = c->program->code_count;
+}
+
+static int vm_add_number(struct vm_compiler *c, long long value)
+{
+    struct vm_program *program = c->program;
+    if (!vm_grow((void **)&program->numbers, &program->number_space, program->number_count, sizeof(long long)))
+    {
+        c->error = "out of memory";
+        return -1;
+    }
+    program->numbers[program->number_count] = value;
+    return program->number_count++;
+}
+
+static int is_name_start(char ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
+}
+
+static int is_name_char(char ch)
+{
+    return is_name_start(ch) || (ch >= '0' && ch <= '9');
+}
+
+static int vm_add_part(struct vm_compiler *c, struct vm_word *word, int kind, int index,
+                       const char *text, size_t length)
+{
+    int space = word->part_count; // parts grows one at a time, words are short
+    struct word_part *grown = realloc(word->parts, sizeof(struct word_part) * (space + 1));
+    if (grown == NULL)
+    {
+        c->error = "out of memory";
+        return 0;
+    }
+    word->parts = grown;
+    struct word_part *part = &word->parts[word->part_count++];
+    part->kind = kind;
+    part->index = index;
+    part->text = NULL;
+    part->length = length;
+    if ((kind == PART_TEXT || kind >= PART_COMMAND) && (part->text = strndup(text, length)) == NULL)
+    {
+        c->error = "out of memory";
+        return 0;
+    }
+    return 1;
+}
+
+// text[0] is '(' - returns how many bytes up to and including its ')', 0 if unclosed
+static size_t matching_paren_length(const char *text, size_t length)
+{
+    int depth = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (text[i] == '(')
+            depth++;
+        else if (text[i] == ')' && --depth == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+/**
+ * Reads a $ reference at text[0] and says how long it is
+ * kind/index describe it; returns 0 when the $ is just a plain character
+ */
+static size_t parse_dollar(const char *text, size_t length, int *kind, const char **name, size_t *name_length)
+{
+    if (length < 2)
+        return 0;
+    char next = text[1];
+    if (next >= '1' && next <= '9')
+    {
+        *kind = PART_POSITIONAL;
+        *name_length = next - '0';
+        return 2;
+    }
+    if (next == '(')
+    {
+        // $( ... ) can have more parentheses (and $(...)) inside
+        size_t end = matching_paren_length(text + 1, length - 1);
+        if (end == 0)
+            return 0;
+        *kind = PART_COMMAND;
+        *name = text + 2;
+        *name_length = end - 2;
+        return end + 1;
+    }
+    if (next == '?' || next == '#' || next == '$')
+    {
+        *kind = (next == '?') ? PART_STATUS : (next == '#') ? PART_ARG_COUNT : PART_PID;
+        return 2;
+    }
+    if (next == '{')
+    {
+        size_t end = 2;
+        while (end < length && is_name_char(text[end]))
+            end++;
+        if (end == 2 || end >= length || text[end] != '}' || !is_name_start(text[2]))
+            return 0;
+        *kind = PART_VARIABLE;
+        *name = text + 2;
+        *name_length = end - 2;
+        return end + 1;
+    }
+    if (is_name_start(next))
+    {
+        size_t end = 1;
+        while (end < length && is_name_char(text[end]))
+            end++;
+        *kind = PART_VARIABLE;
+        *name = text + 1;
+        *name_length = end - 1;
+        return end;
+    }
+    return 0;
+}
+
+// Compiles a piece of text with $ references into a word, returns its index
+static int vm_add_word(struct vm_compiler *c, const char *text, size_t length)
+{
+    struct vm_program *program = c->program;
+    if (!vm_grow((void **)&program->words, &program->word_space, program->word_count, sizeof(struct vm_word)))
+    {
+        c->error = "out of memory";
+        return -1;
+    }
+    struct vm_word *word = &program->words[program->word_count++];
+    word->parts = NULL;
+    word->part_count = 0;
+
+    size_t literal_start = 0;
+    size_t i = 0;
+    while (i < length)
+    {
+        int kind = PART_TEXT;
+        const char *name = NULL;
+        size_t name_length = 0;
+        size_t used = 0;
+        if (text[i] == '$')
+        {
+            used = parse_dollar(text + i, length - i, &kind, &name, &name_length);
+        }
+        else if (text[i] == '`')
+        {
+            const char *close = memchr(text + i + 1, '`', length - i - 1);
+            if (close != NULL)
+            {
+                kind = PART_COMMAND;
+                name = text + i + 1;
+                name_length = close - name;
+                used = name_length + 2;
+            }
+        }
+        else if ((text[i] == '<' || text[i] == '>') && i + 1 < length && text[i + 1] == '(')
+        {
+            size_t paren = matching_paren_length(text + i + 1, length - i - 1);
+            if (paren > 0)
+            {
+                kind = (text[i] == '<') ? PART_READ_FROM : PART_WRITE_TO;
+                name = text + i + 2;
+                name_length = paren - 2;
+                used = paren + 1;
+            }
+        }
+        if (used == 0)
+        {
+            i++;
+            continue;
+        }
+
+        if (i > literal_start && !vm_add_part(c, word, PART_TEXT, 0, text + literal_start, i - literal_start))
+            return -1;
+        int index = (int)name_length;
+        if (kind == PART_VARIABLE && (index = variable_slot(name, name_length)) < 0)
+        {
+            c->error = "out of memory";
+            return -1;
+        }
+        if (!vm_add_part(c, word, kind, index, name, name_length))
+            return -1;
+        i += used;
+        literal_start = i;
+    }
+    if (length > literal_start && !vm_add_part(c, word, PART_TEXT, 0, text + literal_start, length - literal_start))
+        return -1;
+    return program->word_count - 1;
+}
+
+/**
+ * Arithmetic for let: compiled straight into stack instructions
+ * Supports + - * / %, comparisons, && || !, parentheses, = += -= *= /= %= and ++ --
+ */
+struct arith_parser
+{
+    struct vm_compiler *c;
+    const char *text;
+    size_t pos;
+    size_t length;
+};
+
+static void arith_skip_spaces(struct arith_parser *p)
+{
+    while (p->pos < p->length && (p->text[p->pos] == ' ' || p->text[p->pos] == '\t'))
+        p->pos++;
+}
+
+// Consumes an operator if it's next (and isn't the start of a longer one)
+static int arith_accept(struct arith_parser *p, const char *op)
+{
+    arith_skip_spaces(p);
+    size_t length = strlen(op);
+    if (p->pos + length > p->length || strncmp(p->text + p->pos, op, length) != 0)
+        return 0;
+    // Don't read "<=" as "<", or "==" as "="
+    char after = (p->pos + length < p->length) ? p->text[p->pos + length] : '\0';
+    if ((strcmp(op, "<") == 0 || strcmp(op, ">") == 0 || strcmp(op, "=") == 0 || strcmp(op, "!") == 0) && after == '=')
+        return 0;
+    if ((strcmp(op, "+") == 0 && after == '+') || (strcmp(op, "-") == 0 && after == '-'))
+        return 0;
+    if ((strcmp(op, "&") == 0 || strcmp(op, "|") == 0) && after == op[0])
+        return 0;
+    p->pos += length;
+    return 1;
+}
+
+// Reads a variable name (with or without $), returns its slot or -1
+static int arith_variable(struct arith_parser *p)
+{
+    arith_skip_spaces(p);
+    size_t start = p->pos;
+    if (p->pos < p->length && p->text[p->pos] == '$')
+        p->pos++;
+    if (p->pos >= p->length || !is_name_start(p->text[p->pos]))
+    {
+        p->pos = start;
+        return -1;
+    }
+    size_t name_start = p->pos;
+    while (p->pos < p->length && is_name_char(p->text[p->pos]))
+        p->pos++;
+    int slot = variable_slot(p->text + name_start, p->pos - name_start);
+    if (slot < 0)
+        p->c->error = "out of memory";
+    return slot;
+}
+
+static int arith_expression(struct arith_parser *p);
+
+static int arith_primary(struct arith_parser *p)
+{
+    arith_skip_spaces(p);
+    if (p->pos >= p->length)
+    {
+        p->c->error = "let: expression is incomplete";
+        return 0;
+    }
+
+    char ch = p->text[p->pos];
+    if (ch == '(')
+    {
+        p->pos++;
+        if (!arith_expression(p))
+            return 0;
+        if (!arith_accept(p, ")"))
+        {
+            p->c->error = "let: missing )";
+            return 0;
+        }
+        return 1;
+    }
+
+    if (ch >= '0' && ch <= '9')
+    {
+        char *end;
+        long long value = strtoll(p->text + p->pos, &end, 10);
+        p->pos = end - p->text;
+        int index = vm_add_number(p->c, value);
+        return index >= 0 && vm_emit(p->c, OP_PUSH_NUMBER, index, 0, 0) >= 0;
+    }
+
+    if (ch == '$' && p->pos + 1 < p->length)
+    {
+        char next = p->text[p->pos + 1];
+        int kind = -1, index = 0;
+        if (next >= '1' && next <= '9')
+        {
+            kind = PART_POSITIONAL;
+            index = next - '0';
+        }
+        else if (next == '?')
+            kind = PART_STATUS;
+        else if (next == '#')
+            kind = PART_ARG_COUNT;
+        if (kind >= 0)
+        {
+            p->pos += 2;
+            return vm_emit(p->c, OP_PUSH_SPECIAL, kind, index, 0) >= 0;
+        }
+    }
+
+    int slot = arith_variable(p);
+    if (slot < 0)
+    {
+        if (p->c->error == NULL)
+            p->c->error = "let: expected a number or a variable";
+        return 0;
+    }
+    if (vm_emit(p->c, OP_PUSH_VAR, slot, 0, 0) < 0)
+        return 0;
+
+    // Postfix i++ / i--: store the new value but leave the old one on the stack
+    int delta = arith_accept(p, "++") ? 1 : arith_accept(p, "--") ? -1 : 0;
+    if (delta != 0)
+    {
+        int one = vm_add_number(p->c, 1);
+        return one >= 0 && vm_emit(p->c, OP_PUSH_VAR, slot, 0, 0) >= 0 &&
+               vm_emit(p->c, OP_PUSH_NUMBER, one, 0, 0) >= 0 &&
+               vm_emit(p->c, delta > 0 ? OP_ADD : OP_SUB, 0, 0, 0) >= 0 &&
+               vm_emit(p->c, OP_STORE_VAR, slot, 0, 0) >= 0 && vm_emit(p->c, OP_POP, 0, 0, 0) >= 0;
+    }
+    return 1;
+}
+
+static int arith_unary(struct arith_parser *p)
+{
+    // Prefix ++i / --i
+    size_t before = p->pos;
+    int delta = arith_accept(p, "++") ? 1 : arith_accept(p, "--") ? -1 : 0;
+    if (delta != 0)
+    {
+        int slot = arith_variable(p);
+        if (slot < 0)
+        {
+            p->pos = before;
+            p->c->error = "let: ++ and -- need a variable";
+            return 0;
+        }
+        int one = vm_add_number(p->c, 1);
+        return one >= 0 && vm_emit(p->c, OP_PUSH_VAR, slot, 0, 0) >= 0 &&
+               vm_emit(p->c, OP_PUSH_NUMBER, one, 0, 0) >= 0 &&
+               vm_emit(p->c, delta > 0 ? OP_ADD : OP_SUB, 0, 0, 0) >= 0 &&
+               vm_emit(p->c, OP_STORE_VAR, slot, 0, 0) >= 0;
+    }
+    if (arith_accept(p, "-"))
+        return arith_unary(p) && vm_emit(p->c, OP_NEGATE, 0, 0, 0) >= 0;
+    if (arith_accept(p, "!"))
+        return arith_unary(p) && vm_emit(p->c, OP_NOT, 0, 0, 0) >= 0;
+    if (arith_accept(p, "+"))
+        return arith_unary(p);
+    return arith_primary(p);
+}
+
+// One level of left-associative binary operators
+struct arith_level
+{
+    const char *ops[4];
+    int opcodes[4];
+};
+
+static const struct arith_level arith_levels[] = {
+    {{"||"}, {OP_OR}},
+    {{"&&"}, {OP_AND}},
+    {{"==", "!="}, {OP_EQUAL, OP_NOT_EQUAL}},
+    {{"<=", ">=", "<", ">"}, {OP_LESS_EQUAL, OP_GREATER_EQUAL, OP_LESS, OP_GREATER}},
+    {{"+", "-"}, {OP_ADD, OP_SUB}},
+    {{"*", "/", "%"}, {OP_MUL, OP_DIV, OP_MOD}},
+};
+#define ARITH_LEVEL_COUNT ((int)(sizeof(arith_levels) / sizeof(arith_levels[0])))
+
+static int arith_binary(struct arith_parser *p, int level)
+{
+    if (level == ARITH_LEVEL_COUNT)
+        return arith_unary(p);
+    if (!arith_binary(p, level + 1))
+        return 0;
+
+    while (1)
+    {
+        int matched = -1;
+        for (int i = 0; i < 4 && arith_levels[level].ops[i] != NULL; i++)
+        {
+            if (arith_accept(p, arith_levels[level].ops[i]))
+            {
+                matched = i;
+                break;
+            }
+        }
+        if (matched < 0)
+            return 1;
+        if (!arith_binary(p, level + 1) || vm_emit(p->c, arith_levels[level].opcodes[matched], 0, 0, 0) < 0)
+            return 0;
+    }
+}
+
+static int arith_expression(struct arith_parser *p)
+{
+    // Assignment: name = expr, name += expr, ... (right to left, like C)
+    size_t start = p->pos;
+    int slot = arith_variable(p);
+    if (slot >= 0)
+    {
+        static const char *assign_ops[] = {"=", "+=", "-=", "*=", "/=", "%="};
+        static const int assign_opcodes[] = {-1, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD};
+        for (int i = 0; i < 6; i++)
+        {
+            if (!arith_accept(p, assign_ops[i]))
+                continue;
+            if (assign_opcodes[i] >= 0 && vm_emit(p->c, OP_PUSH_VAR, slot, 0, 0) < 0)
+                return 0;
+            if (!arith_expression(p))
+                return 0;
+            if (assign_opcodes[i] >= 0 && vm_emit(p->c, assign_opcodes[i], 0, 0, 0) < 0)
+                return 0;
+            return vm_emit(p->c, OP_STORE_VAR, slot, 0, 0) >= 0;
+        }
+    }
+    else if (p->c->error != NULL)
+    {
+        return 0;
+    }
+    p->pos = start;
+    return arith_binary(p, 0);
+}
+
+// let expr: the status is 0 when the value isn't 0, just like bash
+static int vm_compile_let(struct vm_compiler *c, const char *text, size_t length)
+{
+    struct arith_parser parser = {c, text, 0, length};
+    if (!arith_expression(&parser))
+        return 0;
+    arith_skip_spaces(&parser);
+    if (parser.pos != parser.length)
+    {
+        c->error = "let: unexpected text in expression";
+        return 0;
+    }
+    return vm_emit(c, OP_STATUS_FROM_VALUE, 0, 0, 0) >= 0;
+}
+
+// Keywords that end a list ("do echo hi; done" - done ends the loop body)
+static int vm_at_list_end(struct vm_compiler *c)
+{
+    static const char *terminators[] = {"do", "done", "then", "else", "elif", "fi", "}", NULL};
+    if (vm_peek(c)->type == TOKEN_END)
+        return 1;
+    for (int i = 0; terminators[i] != NULL; i++)
+    {
+        if (vm_next_is(c, terminators[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static int vm_compile_list(struct vm_compiler *c);
+
+// Index of the first token after the current simple command
+static int vm_command_end(struct vm_compiler *c)
+{
+    int end = c->position;
+    while (c->tokens[end].type == TOKEN_WORD)
+        end++;
+    return end;
+}
+
+// Raw text covering tokens first..end-1, for the dispatcher and for let
+static void vm_token_span(struct vm_compiler *c, int first, int end, const char **text, size_t *length)
+{
+    *text = c->tokens[first].start;
+    *length = (c->tokens[end - 1].start + c->tokens[end - 1].length) - *text;
+}
+
+// Does this command use one of the operators that only the dispatcher knows?
+// $#, $?, ${...}, $(...), `...`, <(...) and >(...) don't count, those are ours
+static int vm_needs_dispatcher(const char *text, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (text[i] == '$')
+        {
+            int kind;
+            const char *name;
+            size_t name_length;
+            size_t used = parse_dollar(text + i, length - i, &kind, &name, &name_length);
+            if (used > 0)
+                i += used - 1;
+            continue;
+        }
+        if (text[i] == '`')
+        {
+            const char *close = memchr(text + i + 1, '`', length - i - 1);
+            if (close != NULL)
+                i = close - text;
+            continue;
+        }
+        if ((text[i] == '<' || text[i] == '>') && i + 1 < length && text[i + 1] == '(')
+        {
+            size_t paren = matching_paren_length(text + i + 1, length - i - 1);
+            if (paren > 0)
+            {
+                i += paren;
+                continue;
+            }
+        }
+        if (strchr("|=~#+<>", text[i]) != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+static int vm_is_assignment(const struct vm_token *token)
+{
+    if (token->type != TOKEN_WORD || !is_name_start(token->start[0]))
+        return 0;
+    int i = 1;
+    while (i < token->length && is_name_char(token->start[i]))
+        i++;
+    return i < token->length && token->start[i] == '=';
+}
+
+// pin=, nice= and sched= look like assignments, but in front of a command they're its placement
+static int vm_is_placement_word(const struct vm_token *token)
+{
+    return (token->length > 4 && strncmp(token->start, "pin=", 4) == 0) ||
+           (token->length > 5 && strncmp(token->start, "nice=", 5) == 0) ||
+           (token->length > 6 && strncmp(token->start, "sched=", 6) == 0);
+}
+
+static int vm_compile_simple(struct vm_compiler *c)
+{
+    int first = c->position;
+    int end = vm_command_end(c);
+    struct vm_token *word = &c->tokens[first];
+    const char *text;
+    size_t length;
+    vm_token_span(c, first, end, &text, &length);
+
+    // true, false and : don't need a process
+    if (end - first == 1 && ((word->length == 4 && strncmp(word->start, "true", 4) == 0) ||
+                             (word->length == 1 && word->start[0] == ':')))
+    {
+        c->position = end;
+        return vm_emit(c, OP_SET_STATUS, 0, 0, 0) >= 0;
+    }
+    if (end - first == 1 && word->length == 5 && strncmp(word->start, "false", 5) == 0)
+    {
+        c->position = end;
+        return vm_emit(c, OP_SET_STATUS, 1, 0, 0) >= 0;
+    }
+
+    // NAME=value (several are allowed: a=1 b=2), "nice=5 cmd" goes on to the dispatcher below
+    if (vm_is_assignment(word) && !(end - first > 1 && vm_is_placement_word(word)))
+    {
+        for (int t = first; t < end; t++)
+        {
+            if (!vm_is_assignment(&c->tokens[t]))
+            {
+                c->error = "NAME=value in front of a command isn't supported";
+                return 0;
+            }
+            const char *equals = memchr(c->tokens[t].start, '=', c->tokens[t].length);
+            int slot = variable_slot(c->tokens[t].start, equals - c->tokens[t].start);
+            int value = vm_add_word(c, equals + 1, c->tokens[t].length - (equals + 1 - c->tokens[t].start));
+            if (slot < 0 || value < 0 || vm_emit(c, OP_ASSIGN, slot, value, 0) < 0)
+                return 0;
+        }
+        c->position = end;
+        return 1;
+    }
+
+    if (vm_next_is(c, "let"))
+    {
+        if (end - first < 2)
+        {
+            c->error = "let needs an expression";
+            return 0;
+        }
+        const char *expression;
+        size_t expression_length;
+        vm_token_span(c, first + 1, end, &expression, &expression_length);
+        c->position = end;
+        return vm_compile_let(c, expression, expression_length);
+    }
+
+    if (vm_next_is(c, "unset") || vm_next_is(c, "export"))
+    {
+        int is_export = vm_next_is(c, "export");
+        for (int t = first + 1; t < end; t++)
+        {
+            const char *name = c->tokens[t].start;
+            const char *equals = memchr(name, '=', c->tokens[t].length);
+            size_t name_length = equals ? (size_t)(equals - name) : (size_t)c->tokens[t].length;
+            if (name_length == 0 || !is_name_start(name[0]) || (!is_export && equals != NULL))
+            {
+                c->error = "not a valid variable name";
+                return 0;
+            }
+            int slot = variable_slot(name, name_length);
+            int value = -1;
+            if (equals != NULL)
+                value = vm_add_word(c, equals + 1, c->tokens[t].length - name_length - 1);
+            if (slot < 0 || (equals != NULL && value < 0) ||
+                vm_emit(c, is_export ? OP_EXPORT : OP_UNSET, slot, value, 0) < 0)
+                return 0;
+        }
+        c->position = end;
+        return 1;
+    }
+
+    if (vm_next_is(c, "break") || vm_next_is(c, "continue"))
+    {
+        int is_break = vm_next_is(c, "break");
+        c->position = end;
+        if (c->loop_depth == 0)
+        {
+            c->error = is_break ? "break outside a loop" : "continue outside a loop";
+            return 0;
+        }
+        struct vm_loop_jumps *loop = c->loops[c->loop_depth - 1];
+        int *count = is_break ? &loop->break_count : &loop->continue_count;
+        if (*count == VM_MAX_JUMPS)
+        {
+            c->error = "too many break/continue statements in one loop";
+            return 0;
+        }
+        int jump = vm_emit(c, OP_JUMP, 0, 0, 0);
+        if (jump < 0)
+            return 0;
+        (is_break ? loop->break_jumps : loop->continue_jumps)[(*count)++] = jump;
+        return 1;
+    }
+
+    if (vm_next_is(c, "return"))
+    {
+        if (!c->in_function)
+        {
+            c->error = "return is only allowed inside a function";
+            return 0;
+        }
+        if (end - first > 2)
+        {
+            c->error = "return takes at most one value";
+            return 0;
+        }
+        c->position = end;
+        if (end - first == 2)
+        {
+            int value = vm_add_word(c, c->tokens[first + 1].start, c->tokens[first + 1].length);
+            return value >= 0 && vm_emit(c, OP_PUSH_WORD, value, 0, 0) >= 0 &&
+                   vm_emit(c, OP_RETURN, 1, 0, 0) >= 0;
+        }
+        return vm_emit(c, OP_RETURN, 0, 0, 0) >= 0;
+    }
+
+    c->position = end;
+
+    // Commands with | > + and friends go through the normal dispatcher as one line
+    if (vm_needs_dispatcher(text, length))
+    {
+        int line = vm_add_word(c, text, length);
+        return line >= 0 && vm_emit(c, OP_RUN_LINE, line, 0, 0) >= 0;
+    }
+
+    struct vm_program *program = c->program;
+    if (!vm_grow((void **)&program->commands, &program->command_space, program->command_count, sizeof(struct vm_command)))
+    {
+        c->error = "out of memory";
+        return 0;
+    }
+    int first_word = program->word_count;
+    for (int t = first; t < end; t++)
+    {
+        if (vm_add_word(c, c->tokens[t].start, c->tokens[t].length) < 0)
+            return 0;
+    }
+    program->commands[program->command_count].first_word = first_word;
+    program->commands[program->command_count].word_count = end - first;
+    return vm_emit(c, OP_RUN, program->command_count++, 0, 0) >= 0;
+}
+
+// Loop bodies: keeps track of break/continue jumps that need patching
+static int vm_compile_loop_body(struct vm_compiler *c, struct vm_loop_jumps *loop)
+{
+    if (c->loop_depth == VM_MAX_LOOP_DEPTH)
+    {
+        c->error = "loops are nested too deeply";
+        return 0;
+    }
+    loop->break_count = 0;
+    loop->continue_count = 0;
+    c->loops[c->loop_depth++] = loop;
+    int worked = vm_expect(c, "do", "expected 'do'") && vm_compile_list(c) &&
+                 vm_expect(c, "done", "expected 'done'");
+    c->loop_depth--;
+    return worked;
+}
+
+static void vm_patch_loop_jumps(struct vm_compiler *c, int *jumps, int count)
+{
+    for (int i = 0; i < count; i++)
+        vm_patch_jump(c, jumps[i]);
+}
+
+// for NAME in A..B / for NAME in words...
+static int vm_compile_for(struct vm_compiler *c)
+{
+    c->position++; // "for"
+    struct vm_token *name = vm_peek(c);
+    if (name->type != TOKEN_WORD || !is_name_start(name->start[0]))
+    {
+        c->error = "for needs a variable name";
+        return 0;
+    }
+    int slot = variable_slot(name->start, name->length);
+    if (slot < 0)
+        return 0;
+    c->position++;
+    if (!vm_next_is(c, "in"))
+    {
+        c->error = "expected 'in' after the for variable";
+        return 0;
+    }
+    c->position++;
+
+    int first = c->position;
+    int end = vm_command_end(c);
+    c->position = end;
+
+    // A loop that runs zero times still succeeds
+    if (vm_emit(c, OP_SET_STATUS, 0, 0, 0) < 0)
+        return 0;
+
+    struct vm_loop_jumps loop;
+    const char *dots = (end - first == 1) ? strstr(c->tokens[first].start, "..") : NULL;
+    if (dots != NULL && dots < c->tokens[first].start + c->tokens[first].length)
+    {
+        // Counting loop: the variable itself is the counter, no list is built
+        const char *start_text = c->tokens[first].start;
+        const char *end_text = dots + 2;
+        size_t end_length = c->tokens[first].length - (end_text - start_text);
+        int start_word = vm_add_word(c, start_text, dots - start_text);
+        int end_word = vm_add_word(c, end_text, end_length);
+        int locals = c->program->local_count;
+        c->program->local_count += 2;
+        if (start_word < 0 || end_word < 0 || vm_emit(c, OP_PUSH_WORD, start_word, 0, 0) < 0 ||
+            vm_emit(c, OP_PUSH_WORD, end_word, 0, 0) < 0 || vm_emit(c, OP_RANGE_START, slot, locals, 0) < 0)
+            return 0;
+
+        int top = c->program->code_count;
+        int check = vm_emit(c, OP_RANGE_CHECK, slot, locals, 0);
+        if (check < 0 || !vm_compile_loop_body(c, &loop))
+            return 0;
+        vm_patch_loop_jumps(c, loop.continue_jumps, loop.continue_count);
+        if (vm_emit(c, OP_RANGE_STEP, slot, locals, 0) < 0 || vm_emit(c, OP_JUMP, top, 0, 0) < 0)
+            return 0;
+        vm_patch_jump(c, check);
+        vm_patch_loop_jumps(c, loop.break_jumps, loop.break_count);
+        return 1;
+    }
+
+    // Word list: expanded (globs too) when the loop starts
+    struct vm_program *program = c->program;
+    if (!vm_grow((void **)&program->commands, &program->command_space, program->command_count, sizeof(struct vm_command)))
+    {
+        c->error = "out of memory";
+        return 0;
+    }
+    int first_word = program->word_count;
+    for (int t = first; t < end; t++)
+    {
+        if (vm_add_word(c, c->tokens[t].start, c->tokens[t].length) < 0)
+            return 0;
+    }
+    program->commands[program->command_count].first_word = first_word;
+    program->commands[program->command_count].word_count = end - first;
+    if (vm_emit(c, OP_LIST_START, program->command_count++, 0, 0) < 0)
+        return 0;
+
+    int top = c->program->code_count;
+    int next = vm_emit(c, OP_LIST_NEXT, slot, 0, 0);
+    if (next < 0 || !vm_compile_loop_body(c, &loop))
+        return 0;
+    for (int i = 0; i < loop.continue_count; i++)
+        c->program->code[loop.continue_jumps[i]].a = top;
+    if (vm_emit(c, OP_JUMP, top, 0, 0) < 0)
+        return 0;
+    // Running out of items and break both land on LIST_END so the list gets freed
+    vm_patch_jump(c, next);
+    vm_patch_loop_jumps(c, loop.break_jumps, loop.break_count);
+    return vm_emit(c, OP_LIST_END, 0, 0, 0) >= 0;
+}
+
+// while LIST; do LIST; done (until is the same with the test flipped)
+static int vm_compile_while(struct vm_compiler *c)
+{
+    int is_until = vm_next_is(c, "until");
+    c->position++;
+
+    int top = c->program->code_count;
+    if (!vm_compile_list(c))
+        return 0;
+    int exit_jump = vm_emit(c, is_until ? OP_JUMP_IF_OK : OP_JUMP_IF_FAILED, 0, 0, 0);
+    struct vm_loop_jumps loop;
+    if (exit_jump < 0 || !vm_compile_loop_body(c, &loop))
+        return 0;
+    for (int i = 0; i < loop.continue_count; i++)
+        c->program->code[loop.continue_jumps[i]].a = top;
+    if (vm_emit(c, OP_JUMP, top, 0, 0) < 0)
+        return 0;
+    vm_patch_jump(c, exit_jump);
+    vm_patch_loop_jumps(c, loop.break_jumps, loop.break_count);
+    return vm_emit(c, OP_SET_STATUS, 0, 0, 0) >= 0;
+}
+
+// if LIST; then LIST; [elif LIST; then LIST;]... [else LIST;] fi
+static int vm_compile_if(struct vm_compiler *c)
+{
+    c->position++; // "if" or "elif"
+    if (!vm_compile_list(c))
+        return 0;
+    int skip_then = vm_emit(c, OP_JUMP_IF_FAILED, 0, 0, 0);
+    if (skip_then < 0 || !vm_expect(c, "then", "expected 'then'") || !vm_compile_list(c))
+        return 0;
+    int skip_else = vm_emit(c, OP_JUMP, 0, 0, 0);
+    if (skip_else < 0)
+        return 0;
+    vm_patch_jump(c, skip_then);
+
+    if (vm_peek(c)->type == TOKEN_SEMI)
+        c->position++;
+    if (vm_next_is(c, "elif"))
+    {
+        // elif is an if inside the else branch that shares our fi
+        if (!vm_compile_if(c))
+            return 0;
+        vm_patch_jump(c, skip_else);
+        return 1;
+    }
+    if (vm_next_is(c, "else"))
+    {
+        c->position++;
+        if (!vm_compile_list(c))
+            return 0;
+    }
+    else if (vm_emit(c, OP_SET_STATUS, 0, 0, 0) < 0) // No branch ran: success
+    {
+        return 0;
+    }
+    vm_patch_jump(c, skip_else);
+    return vm_expect(c, "fi", "expected 'fi'");
+}
+
+// NAME() { LIST; } - the body becomes its own program
+static int vm_compile_function(struct vm_compiler *c, const char *name, size_t name_length)
+{
+    if (!vm_expect(c, "{", "expected '{' after the function name"))
+        return 0;
+
+    struct vm_function *function = calloc(1, sizeof(struct vm_function));
+    struct vm_program *body = calloc(1, sizeof(struct vm_program));
+    struct vm_program *outer = c->program;
+    if (function == NULL || body == NULL || (function->name = strndup(name, name_length)) == NULL ||
+        !vm_grow((void **)&outer->functions, &outer->function_space, outer->function_count, sizeof(struct vm_function *)))
+    {
+        free(function ? function->name : NULL);
+        free(function);
+        free(body);
+        c->error = "out of memory";
+        return 0;
+    }
+    function->body = body;
+    function->references = 1; // The outer program's reference
+    outer->functions[outer->function_count] = function;
+
+    // Loops outside the function don't exist inside it
+    int saved_depth = c->loop_depth;
+    int saved_in_function = c->in_function;
+    c->program = body;
+    c->loop_depth = 0;
+    c->in_function = 1;
+    int worked = vm_compile_list(c) && vm_expect(c, "}", "expected '}' at the end of the function");
+    c->program = outer;
+    c->loop_depth = saved_depth;
+    c->in_function = saved_in_function;
+    if (!worked)
+    {
+        vm_release_function(function);
+        return 0;
+    }
+    return vm_emit(c, OP_DEFINE, outer->function_count++, 0, 0) >= 0;
+}
+
+static int vm_compile_command(struct vm_compiler *c)
+{
+    struct vm_token *token = vm_peek(c);
+    if (token->type != TOKEN_WORD)
+    {
+        c->error = "expected a command";
+        return 0;
+    }
+
+    int worked;
+    if (vm_next_is(c, "for"))
+        worked = vm_compile_for(c);
+    else if (vm_next_is(c, "while") || vm_next_is(c, "until"))
+        worked = vm_compile_while(c);
+    else if (vm_next_is(c, "if"))
+        worked = vm_compile_if(c);
+    else if (vm_next_is(c, "{"))
+    {
+        c->position++;
+        worked = vm_compile_list(c) && vm_expect(c, "}", "expected '}'");
+    }
+    else if (token->length > 2 && strncmp(token->start + token->length - 2, "()", 2) == 0)
+    {
+        c->position++;
+        worked = vm_compile_function(c, token->start, token->length - 2);
+    }
+    else if (c->tokens[c->position + 1].type == TOKEN_WORD && c->tokens[c->position + 1].length == 2 &&
+             strncmp(c->tokens[c->position + 1].start, "()", 2) == 0)
+    {
+        c->position += 2;
+        worked = vm_compile_function(c, token->start, token->length);
+    }
+    else
+        return vm_compile_simple(c);
+
+    // Compound commands can't have words after them ("done | wc" isn't supported)
+    if (worked && vm_peek(c)->type == TOKEN_WORD && !vm_at_list_end(c))
+    {
+        c->error = "unexpected word after the end of a loop, if or function";
+        return 0;
+    }
+    return worked;
+}
+
+// cmd && cmd || cmd - left to right, each jump skips just the next command
+static int vm_compile_and_or(struct vm_compiler *c)
+{
+    if (!vm_compile_command(c))
+        return 0;
+    while (vm_peek(c)->type == TOKEN_AND || vm_peek(c)->type == TOKEN_OR)
+    {
+        int op = (vm_peek(c)->type == TOKEN_AND) ? OP_JUMP_IF_FAILED : OP_JUMP_IF_OK;
+        c->position++;
+        int jump = vm_emit(c, op, 0, 0, 0);
+        if (jump < 0 || !vm_compile_command(c))
+            return 0;
+        vm_patch_jump(c, jump);
+    }
+    return 1;
+}
+
+static int vm_compile_list(struct vm_compiler *c)
+{
+    while (1)
+    {
+        while (vm_peek(c)->type == TOKEN_SEMI)
+            c->position++;
+        if (vm_at_list_end(c))
+            return 1;
+        if (!vm_compile_and_or(c))
+            return 0;
+        int type = vm_peek(c)->type;
+        if (type != TOKEN_SEMI && type != TOKEN_END && !vm_at_list_end(c))
+        {
+            c->error = "expected ; between commands";
+            return 0;
+        }
+    }
+}
+
+/**
+ * Compiles a whole command line, returns NULL (and prints why) on a syntax error
+ * timed is set when the line starts with "time"
+ */
+static struct vm_program *vm_compile_line(const char *line, int *timed)
+{
+    struct vm_token tokens[MAX_INPUT_SIZE + 1];
+    struct vm_compiler compiler;
+    memset(&compiler, 0, sizeof(compiler));
+    compiler.tokens = tokens;
+    compiler.token_count = vm_tokenize(line, tokens, MAX_INPUT_SIZE + 1);
+    compiler.program = calloc(1, sizeof(struct vm_program));
+    if (compiler.program == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory compiling the command\n");
+        return NULL;
+    }
+
+    if (vm_next_is(&compiler, "time"))
+    {
+        compiler.timed = 1;
+        compiler.position++;
+    }
+
+    if (!vm_compile_list(&compiler) || vm_peek(&compiler)->type != TOKEN_END)
+    {
+        struct vm_token *at = vm_peek(&compiler);
+        if (compiler.error == NULL)
+            compiler.error = "unexpected keyword";
+        if (at->type == TOKEN_END)
+            fprintf(stderr, "Syntax error: %s (at end of line)\n", compiler.error);
+        else
+            fprintf(stderr, "Syntax error: %s (near '%.*s')\n", compiler.error, at->length, at->start);
+        vm_free_program(compiler.program);
+        return NULL;
+    }
+    *timed = compiler.timed;
+    return compiler.program;
+}
+
+/**
+ * Process substitution: <(cmd) and >(cmd)
+ * The command runs in a forked copy of the shell, connected by a pipe. We keep
+ * the other end open (without O_CLOEXEC) and the word becomes /dev/fd/N, so
+ * the program we start next - or our own + and # operators - can open it like
+ * a file. Nothing touches the disk.
+ */
+#define MAX_PROCESS_SUBSTITUTIONS 16
+
+struct process_substitution
+{
+    int fd;    // Our end of the pipe, the one /dev/fd/N points at
+    pid_t pid; // The shell copy running the command
+};
+
+static struct process_substitution process_substitutions[MAX_PROCESS_SUBSTITUTIONS];
+static int process_substitution_count = 0;
+
+static int start_process_substitution(const char *command, int read_from, char *path, size_t path_size)
+{
+    if (process_substitution_count == MAX_PROCESS_SUBSTITUTIONS)
+    {
+        fprintf(stderr, "Error: Too many <(...) / >(...) in one command\n");
+        return 0;
+    }
+    char line[MAX_INPUT_SIZE];
+    if (strlen(command) >= sizeof(line))
+    {
+        fprintf(stderr, "Error: Process substitution is too long\n");
+        return 0;
+    }
+    strcpy(line, command);
+
+    int pipe_ends[2];
+    if (pipe2(pipe_ends, O_CLOEXEC) < 0)
+    {
+        perror("Process substitution failed");
+        return 0;
+    }
+    // <(cmd): cmd writes, we keep the read end. >(cmd): the other way round
+    int our_end = read_from ? pipe_ends[0] : pipe_ends[1];
+    int their_end = read_from ? pipe_ends[1] : pipe_ends[0];
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Process substitution failed");
+        close(our_end);
+        close(their_end);
+        return 0;
+    }
+    if (pid == 0)
+    {
+        // Hold on to no other substitution's pipe, or its reader would never see EOF
+        close(our_end);
+        for (int i = 0; i < process_substitution_count; i++)
+            close(process_substitutions[i].fd);
+        process_substitution_count = 0;
+        inherited_fd_count = 0;
+
+        dup2(their_end, read_from ? STDOUT_FILENO : STDIN_FILENO);
+        int status = run_command_line(line);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    close(their_end);
+    fcntl(our_end, F_SETFD, 0); // The program we start next has to inherit it
+    process_substitutions[process_substitution_count].fd = our_end;
+    process_substitutions[process_substitution_count].pid = pid;
+    process_substitution_count++;
+    inherited_fd_count++;
+    snprintf(path, path_size, "/dev/fd/%d", our_end);
+    return 1;
+}
+
+/**
+ * Called when the command that used the /dev/fd paths is done
+ * Closing our end gives >(cmd) its EOF (or stops an unread <(cmd) with SIGPIPE),
+ * then we wait so its output shows up before the next prompt
+ * Only substitutions newer than keep are finished, so $(...) inside a
+ * command can't close the ones its outer command still needs
+ */
+static void finish_process_substitutions(int keep)
+{
+    while (process_substitution_count > keep)
+    {
+        struct process_substitution *done = &process_substitutions[--process_substitution_count];
+        close(done->fd);
+        inherited_fd_count--;
+        int status;
+        while (waitpid(done->pid, &status, 0) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/**
+ * Runs a command line with stdout pointed at a memfd, then appends what it
+ * printed to out. This is how $(...) and `...` work.
+ * Nothing gets forked just for the substitution: builtins and operators like
+ * # run right here, and real programs inherit the memfd as their stdout.
+ * A memfd (instead of a pipe) means big outputs can't deadlock us.
+ * Trailing newlines are dropped and the others become spaces.
+ */
+static int capture_command_output(const char *command, struct text_buffer *out)
+{
+    char line[MAX_INPUT_SIZE];
+    if (strlen(command) >= sizeof(line))
+    {
+        fprintf(stderr, "Error: Command substitution is too long\n");
+        return 0;
+    }
+    strcpy(line, command);
+
+    int capture_fd = memfd_create("w25-substitution", MFD_CLOEXEC);
+    fflush(stdout); // Anything printed before belongs on the real stdout
+    int saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (capture_fd < 0 || saved_stdout < 0 || dup2(capture_fd, STDOUT_FILENO) < 0)
+    {
+        perror("Command substitution failed");
+        if (capture_fd >= 0)
+            close(capture_fd);
+        if (saved_stdout >= 0)
+            close(saved_stdout);
+        return 0;
+    }
+
+    // The inner line may use the VM too, so it gets its own scratch buffer
+    struct text_buffer saved_scratch = vm_scratch;
+    memset(&vm_scratch, 0, sizeof(vm_scratch));
+    int status = run_command_line(line);
+    fflush(stdout);
+    free(vm_scratch.data);
+    vm_scratch = saved_scratch;
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    // Read it all back in big chunks, straight into the expansion buffer
+    off_t size = lseek(capture_fd, 0, SEEK_END);
+    if (size < 0 || !text_buffer_reserve(out, size))
+    {
+        fprintf(stderr, "Error: Out of memory reading command output\n");
+        close(capture_fd);
+        return 0;
+    }
+    size_t start = out->length;
+    off_t offset = 0;
+    while (offset < size)
+    {
+        ssize_t got = pread(capture_fd, out->data + start + offset, size - offset, offset);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        offset += got;
+    }
+    close(capture_fd);
+
+    size_t length = offset;
+    while (length > 0 && out->data[start + length - 1] == '\n')
+        length--;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (out->data[start + i] == '\n')
+            out->data[start + i] = ' ';
+    }
+    out->length = start + length;
+    last_exit_status = status; // $? after x=$(cmd) is cmd's status
+    return 1;
+}
+
+// Positional parameters of the function that's running
+struct vm_frame
+{
+    char **args; // args[0] is the function name
+    int arg_count;
+};
+
+// Appends the expanded text of a word to the scratch buffer
+static int vm_expand_word(struct vm_word *word, struct vm_frame *frame, struct text_buffer *out)
+{
+    char number[32]; // Also holds /dev/fd/N paths
+    for (int p = 0; p < word->part_count; p++)
+    {
+        struct word_part *part = &word->parts[p];
+        const char *text = NULL;
+        size_t length = 0;
+        switch (part->kind)
+        {
+        case PART_TEXT:
+            text = part->text;
+            length = part->length;
+            break;
+        case PART_VARIABLE:
+            text = variable_text(part->index);
+            break;
+        case PART_POSITIONAL:
+            text = (part->index < frame->arg_count) ? frame->args[part->index] : NULL;
+            break;
+        case PART_COMMAND:
+            if (!capture_command_output(part->text, out))
+                return 0;
+            continue;
+        case PART_READ_FROM:
+        case PART_WRITE_TO:
+            if (!start_process_substitution(part->text, part->kind == PART_READ_FROM, number, sizeof(number)))
+                return 0;
+            text = number;
+            break;
+        case PART_STATUS:
+        case PART_ARG_COUNT:
+        case PART_PID:
+            snprintf(number, sizeof(number), "%d",
+                     part->kind == PART_STATUS ? last_exit_status
+                     : part->kind == PART_ARG_COUNT ? (frame->arg_count > 0 ? frame->arg_count - 1 : 0)
+                                                    : (int)getpid());
+            text = number;
+            break;
+        }
+        if (text == NULL)
+            continue; // Unset variables expand to nothing
+        if (part->kind != PART_TEXT)
+            length = strlen(text);
+        if (!text_buffer_add(out, text, length))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Expands a run of words into a NULL terminated argv
+ * The strings live in vm_scratch, so they're only good until the next expansion
+ */
+static char **vm_expand_words(struct vm_program *program, int first_word, int count, struct vm_frame *frame,
+                              int leading_slots)
+{
+    size_t offsets[MAX_INPUT_SIZE];
+    vm_scratch.length = 0;
+    for (int w = 0; w < count; w++)
+    {
+        offsets[w] = vm_scratch.length;
+        if (!vm_expand_word(&program->words[first_word + w], frame, &vm_scratch) ||
+            !text_buffer_add(&vm_scratch, "", 1))
+            return NULL;
+    }
+
+    char **argv = malloc(sizeof(char *) * (count + leading_slots + 1));
+    if (argv == NULL)
+        return NULL;
+    for (int w = 0; w < count; w++)
+        argv[leading_slots + w] = vm_scratch.data + offsets[w];
+    argv[leading_slots + count] = NULL;
+    return argv;
+}
+
+static long long vm_word_number(struct vm_program *program, int word, struct vm_frame *frame)
+{
+    vm_scratch.length = 0;
+    if (!vm_expand_word(&program->words[word], frame, &vm_scratch) || !text_buffer_add(&vm_scratch, "", 1))
+        return 0;
+    return strtoll(vm_scratch.data, NULL, 10);
+}
+
+static int vm_run(struct vm_program *program, struct vm_frame *frame);
+
+// Calls a shell function with argv as its positional parameters
+static int vm_call_function(struct vm_function *function, char **argv, int argc)
+{
+    if (vm_call_depth >= VM_MAX_CALL_DEPTH)
+    {
+        fprintf(stderr, "%s: functions nested too deeply\n", function->name);
+        last_exit_status = 1;
+        return 0;
+    }
+
+    // argv points into vm_scratch, which the function will reuse
+    struct vm_frame frame;
+    frame.arg_count = argc;
+    frame.args = malloc(sizeof(char *) * (argc + 1));
+    if (frame.args == NULL)
+        return 0;
+    for (int i = 0; i < argc; i++)
+        frame.args[i] = strdup(argv[i]);
+    frame.args[argc] = NULL;
+
+    function->references++; // It could redefine itself while running
+    vm_call_depth++;
+    int result = vm_run(function->body, &frame);
+    vm_call_depth--;
+    vm_release_function(function);
+
+    for (int i = 0; i < argc; i++)
+        free(frame.args[i]);
+    free(frame.args);
+    return result;
+}
+
+// Runs a simple command: shell function, builtin or a real program
+static int vm_run_command(struct vm_program *program, struct vm_command *command, struct vm_frame *frame)
+{
+    int substitutions_before = process_substitution_count;
+    char **argv = vm_expand_words(program, command->first_word, command->word_count, frame, 0);
+    if (argv == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory expanding arguments\n");
+        last_exit_status = 1;
+        finish_process_substitutions(substitutions_before);
+        return 1;
+    }
+
+    int keep_going = 1;
+    struct vm_function *function = find_shell_function(argv[0]);
+    if (function != NULL)
+    {
+        keep_going = vm_call_function(function, argv, command->word_count);
+    }
+    else if (command->word_count > MAX_ARGS)
+    {
+        fprintf(stderr, "Error: Too many arguments. Maximum allowed is 5.\n");
+        last_exit_status = 1;
+    }
+    else
+    {
+        glob_cache_reset(); // Earlier commands in the loop may have made files
+        if (!handle_special_commands(argv) && !execute_command(argv))
+            last_exit_status = 1;
+    }
+    free(argv);
+    finish_process_substitutions(substitutions_before);
+    return keep_going;
+}
+
+// Hands a command that uses the shell's operators (|, >, + ...) to the dispatcher
+static void vm_run_line(struct vm_program *program, int word, struct vm_frame *frame)
+{
+    int substitutions_before = process_substitution_count;
+    vm_scratch.length = 0;
+    if (!vm_expand_word(&program->words[word], frame, &vm_scratch) || vm_scratch.length >= MAX_INPUT_SIZE)
+    {
+        fprintf(stderr, "Error: Command is too long after expanding variables\n");
+        last_exit_status = 1;
+        finish_process_substitutions(substitutions_before);
+        return;
+    }
+    char line[MAX_INPUT_SIZE];
+    memcpy(line, vm_scratch.data, vm_scratch.length);
+    line[vm_scratch.length] = '\0';
+    last_exit_status = dispatch_command_line(line);
+    finish_process_substitutions(substitutions_before);
+}
+
+/**
+ * Splits expanded words at spaces, tabs and newlines, so "for f in $(ls)"
+ * loops over each name. words[0] is kept as it is. The pieces point into the
+ * same strings (they get cut up in place).
+ */
+static char **vm_split_words(char **words)
+{
+    int space = 16, count = 0;
+    char **split = malloc(sizeof(char *) * space);
+    if (split == NULL)
+        return NULL;
+    split[count++] = words[0];
+
+    for (int w = 1; words[w] != NULL; w++)
+    {
+        char *save = NULL;
+        for (char *piece = strtok_r(words[w], " \t\n", &save); piece != NULL; piece = strtok_r(NULL, " \t\n", &save))
+        {
+            if (count + 1 >= space)
+            {
+                space *= 2;
+                char **grown = realloc(split, sizeof(char *) * space);
+                if (grown == NULL)
+                {
+                    free(split);
+                    return NULL;
+                }
+                split = grown;
+            }
+            split[count++] = piece;
+        }
+    }
+    split[count] = NULL;
+    return split;
+}
+
+// State of one "for x in list" loop
+struct vm_list
+{
+    char **expanded; // From expand_command_args, expanded[0] is a placeholder
+    int next;
+};
+
+/**
+ * The interpreter loop
+ * Returns 1 normally, 0 if the line should stop (runtime error)
+ * last_exit_status doubles as the VM's status register
+ */
+static int vm_run(struct vm_program *program, struct vm_frame *frame)
+{
+    long long stack[VM_STACK_SIZE];
+    int top = 0;
+    long long locals[program->local_count + 1];
+    struct vm_list lists[VM_MAX_LISTS];
+    int list_count = 0;
+    int result = 1;
+    int pc = 0;
+
+#define VM_PUSH(value)                                                   \
+    do                                                                   \
+    {                                                                    \
+        if (top == VM_STACK_SIZE)                                        \
+        {                                                                \
+            fprintf(stderr, "let: expression is too complicated\n");     \
+            goto failed;                                                 \
+        }                                                                \
+        stack[top++] = (value);                                          \
+    } while (0)
+
+    while (pc < program->code_count)
+    {
+        struct vm_instruction *in = &program->code[pc++];
+        vm_instructions_run++;
+        long long right;
+
+        switch (in->op)
+        {
+        case OP_PUSH_NUMBER:
+            VM_PUSH(program->numbers[in->a]);
+            break;
+        case OP_PUSH_VAR:
+            VM_PUSH(variable_number(in->a));
+            break;
+        case OP_PUSH_SPECIAL:
+            if (in->a == PART_STATUS)
+                VM_PUSH(last_exit_status);
+            else if (in->a == PART_ARG_COUNT)
+                VM_PUSH(frame->arg_count > 0 ? frame->arg_count - 1 : 0);
+            else
+                VM_PUSH(in->b < frame->arg_count ? strtoll(frame->args[in->b], NULL, 10) : 0);
+            break;
+        case OP_PUSH_WORD:
+            VM_PUSH(vm_word_number(program, in->a, frame));
+            break;
+        case OP_STORE_VAR:
+            variable_set_number(in->a, stack[top - 1]);
+            break;
+        case OP_PUSH_LOCAL:
+            VM_PUSH(locals[in->a]);
+            break;
+        case OP_POP:
+            top--;
+            break;
+        case OP_ADD:
+            right = stack[--top];
+            stack[top - 1] += right;
+            break;
+        case OP_SUB:
+            right = stack[--top];
+            stack[top - 1] -= right;
+            break;
+        case OP_MUL:
+            right = stack[--top];
+            stack[top - 1] *= right;
+            break;
+        case OP_DIV:
+        case OP_MOD:
+            right = stack[--top];
+            if (right == 0)
+            {
+                fprintf(stderr, "let: division by zero\n");
+                goto failed;
+            }
+            stack[top - 1] = (in->op == OP_DIV) ? stack[top - 1] / right : stack[top - 1] % right;
+            break;
+        case OP_LESS:
+            right = stack[--top];
+            stack[top - 1] = stack[top - 1] < right;
+            break;
+        case OP_LESS_EQUAL:
+            right = stack[--top];
+            stack[top - 1] = stack[top - 1] <= right;
+            break;
+        case OP_GREATER:
+            right = stack[--top];
+            stack[top - 1] = stack[top - 1] > right;
+            break;
+        case OP_GREATER_EQUAL:
+            right = stack[--top];
+            stack[top - 1] = stack[top - 1] >= right;
+            break;
+        case OP_EQUAL:
+            right = stack[--top];
+            stack[top - 1] = stack[top - 1] == right;
+            break;
+        case OP_NOT_EQUAL:
+            right = stack[--top];
+            stack[top - 1] = stack[top - 1] != right;
+            break;
+        case OP_AND:
+            right = stack[--top];
+            stack[top - 1] = stack[top - 1] && right;
+            break;
+        case OP_OR:
+            right = stack[--top];
+            stack[top - 1] = stack[top - 1] || right;
+            break;
+        case OP_NEGATE:
+            stack[top - 1] = -stack[top - 1];
+            break;
+        case OP_NOT:
+            stack[top - 1] = !stack[top - 1];
+            break;
+        case OP_STATUS_FROM_VALUE:
+            last_exit_status = (stack[--top] != 0) ? 0 : 1;
+            break;
+        case OP_SET_STATUS:
+            last_exit_status = in->a;
+            break;
+        case OP_JUMP:
+            pc = in->a;
+            break;
+        case OP_JUMP_IF_FAILED:
+            if (last_exit_status != 0)
+                pc = in->a;
+            break;
+        case OP_JUMP_IF_OK:
+            if (last_exit_status == 0)
+                pc = in->a;
+            break;
+        case OP_RANGE_START:
+            locals[in->b] = stack[--top];
+            right = stack[--top];
+            locals[in->b + 1] = (right <= locals[in->b]) ? 1 : -1;
+            variable_set_number(in->a, right);
+            break;
+        case OP_RANGE_CHECK:
+        {
+            long long value = variable_number(in->a);
+            if (locals[in->b + 1] > 0 ? value > locals[in->b] : value < locals[in->b])
+                pc = in->c;
+            break;
+        }
+        case OP_RANGE_STEP:
+            variable_set_number(in->a, variable_number(in->a) + locals[in->b + 1]);
+            break;
+        case OP_LIST_START:
+        {
+            struct vm_command *command = &program->commands[in->a];
+            char **words = vm_expand_words(program, command->first_word, command->word_count, frame, 1);
+            if (list_count == VM_MAX_LISTS || words == NULL)
+            {
+                fprintf(stderr, "for: too many nested lists\n");
+                free(words);
+                goto failed;
+            }
+            // expand_command_args never expands argv[0], so give it a placeholder
+            words[0] = "for";
+            char **split = vm_split_words(words);
+            free(words);
+            if (split == NULL)
+            {
+                fprintf(stderr, "Error: Out of memory expanding arguments\n");
+                goto failed;
+            }
+            glob_cache_reset();
+            lists[list_count].expanded = expand_command_args(split);
+            lists[list_count].next = 1;
+            free(split);
+            if (lists[list_count].expanded == NULL)
+            {
+                fprintf(stderr, "Error: Out of memory expanding arguments\n");
+                goto failed;
+            }
+            list_count++;
+            break;
+        }
+        case OP_LIST_NEXT:
+        {
+            struct vm_list *list = &lists[list_count - 1];
+            char *item = list->expanded[list->next];
+            if (item == NULL)
+            {
+                pc = in->c;
+                break;
+            }
+            list->next++;
+            variable_set_text(in->a, item, strlen(item));
+            break;
+        }
+        case OP_LIST_END:
+            free_expanded_args(lists[--list_count].expanded);
+            break;
+        case OP_ASSIGN:
+        {
+            struct vm_word *word = &program->words[in->b];
+            last_exit_status = 0; // Unless a $(...) in the value sets it
+            // x=$i copies the number straight across, no text needed
+            if (word->part_count == 1 && word->parts[0].kind == PART_VARIABLE &&
+                shell_variables[word->parts[0].index].is_set &&
+                shell_variables[word->parts[0].index].number_valid &&
+                !shell_variables[word->parts[0].index].text_valid)
+            {
+                variable_set_number(in->a, shell_variables[word->parts[0].index].number);
+            }
+            else
+            {
+                vm_scratch.length = 0;
+                if (!vm_expand_word(word, frame, &vm_scratch) ||
+                    !variable_set_text(in->a, vm_scratch.data ? vm_scratch.data : "", vm_scratch.length))
+                {
+                    fprintf(stderr, "Error: Out of memory setting a variable\n");
+                    goto failed;
+                }
+            }
+            break;
+        }
+        case OP_UNSET:
+            variable_unset(in->a);
+            unsetenv(shell_variables[in->a].name);
+            last_exit_status = 0;
+            break;
+        case OP_EXPORT:
+        {
+            if (in->b >= 0)
+            {
+                vm_scratch.length = 0;
+                if (!vm_expand_word(&program->words[in->b], frame, &vm_scratch) ||
+                    !variable_set_text(in->a, vm_scratch.data ? vm_scratch.data : "", vm_scratch.length))
+                    goto failed;
+            }
+            const char *value = variable_text(in->a);
+            last_exit_status = (value != NULL && setenv(shell_variables[in->a].name, value, 1) == 0) ? 0 : 1;
+            break;
+        }
+        case OP_RUN:
+            if (!vm_run_command(program, &program->commands[in->a], frame))
+                goto failed;
+            break;
+        case OP_RUN_LINE:
+            vm_run_line(program, in->a, frame);
+            break;
+        case OP_DEFINE:
+        {
+            struct vm_function *function = program->functions[in->a];
+            struct vm_function *old = find_shell_function(function->name);
+            if (old == function)
+                break;
+            function->references++;
+            if (old != NULL)
+            {
+                for (int i = 0; i < shell_function_count; i++)
+                {
+                    if (shell_functions[i] == old)
+                        shell_functions[i] = function;
+                }
+                vm_release_function(old);
+            }
+            else if (!vm_grow((void **)&shell_functions, &shell_function_space, shell_function_count,
+                              sizeof(struct vm_function *)))
+            {
+                function->references--;
+                fprintf(stderr, "Error: Out of memory defining %s\n", function->name);
+                goto failed;
+            }
+            else
+            {
+                shell_functions[shell_function_count++] = function;
+            }
+            last_exit_status = 0;
+            break;
+        }
+        case OP_RETURN:
+            if (in->a)
+                last_exit_status = (int)(stack[--top] & 0xff);
+            goto finished;
+        }
+    }
+    goto finished;
+
+failed:
+    last_exit_status = 1;
+    result = 0;
+finished:
+    while (list_count > 0)
+        free_expanded_args(lists[--list_count].expanded);
+    return result;
+#undef VM_PUSH
+}
+
+/**
+ * Does this line need the script compiler? Plain commands skip it, so lines
+ * without variables, loops or functions behave exactly like before
+ */
+static int line_needs_script(const char *line)
+{
+    // A $ in a watch-run or every/at line belongs to each run, not to this one
+    if (strncmp(line, "watch-run ", 10) == 0 || is_schedule_line(line))
+        return 0;
+    if (strchr(line, '$') != NULL || strchr(line, '`') != NULL || strstr(line, "<(") != NULL ||
+        strstr(line, ">(") != NULL)
+        return 1;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+    char first[64];
+    size_t length = strcspn(line, " \t;&|");
+    if (length == 0 || length >= sizeof(first))
+        return 0;
+    memcpy(first, line, length);
+    first[length] = '\0';
+
+    static const char *keywords[] = {"for", "while", "until", "if", "let", "unset", "export", "time", "{", NULL};
+    for (int i = 0; keywords[i] != NULL; i++)
+    {
+        if (strcmp(first, keywords[i]) == 0)
+            return 1;
+    }
+
+    // NAME=value (but "pin=2 cmd" / "nice=5 cmd" is placement for the command)
+    struct vm_token token = {TOKEN_WORD, first, (int)length};
+    if (vm_is_assignment(&token) && !starts_with_placement(line))
+        return 1;
+
+    // NAME() { ... } or NAME () { ... }
+    if (length > 2 && strcmp(first + length - 2, "()") == 0)
+        return 1;
+    const char *next = line + length;
+    while (*next == ' ' || *next == '\t')
+        next++;
+    if (strncmp(next, "()", 2) == 0)
+        return 1;
+
+    return find_shell_function(first) != NULL;
+}
+
+/**
+ * Compiles and runs a line that uses variables, loops or functions
+ * "time ..." also prints how long it took and how many VM instructions ran
+ */
+int run_script_line(char *line)
+{
+    int timed = 0;
+    struct vm_program *program = vm_compile_line(line, &timed);
+    if (program == NULL)
+    {
+        last_exit_status = 2;
+        return last_exit_status;
+    }
+
+    struct timespec started, finished;
+    unsigned long long instructions_before = vm_instructions_run;
+    int substitutions_before = process_substitution_count;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    struct vm_frame frame = {NULL, 0};
+    vm_run(program, &frame);
+    finish_process_substitutions(substitutions_before); // Any left over from x=<(cmd) and such
+
+    if (timed)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+        unsigned long long instructions = vm_instructions_run - instructions_before;
+        fflush(stdout);
+        fprintf(stderr, "time: %.6f s, %llu VM instructions (%.1f million/s)\n", seconds, instructions,
+                seconds > 0 ? instructions / seconds / 1e6 : 0.0);
+    }
+
+    vm_free_program(program);
+    return last_exit_status;
+}
+
+/**
+ * Runs one command line - lines with variables, loops or functions go through
+ * the script VM, everything else straight to the dispatcher like before
+ * Returns the exit status of the line (0 = success)
+ */
+int run_command_line(char *user_command)
+{
+    if (line_needs_script(user_command))
     {
-        // Found the < operator
-        found_input_redir = 1;
+        glob_cache_reset();
+        return run_script_line(user_command);
+    }
+    return dispatch_command_line(user_command);
+}
 
-        // Split the string at this point
-        *where_is_input = '\0';
+/**
+ * Server mode: "w25shell --serve /path/to.sock"
+ *
+ * Orchestration code used to start a whole new shell for every command. Now one
+ * w25shell listens on a Unix socket and many clients can send it command lines.
+ * Every session keeps its own working directory and environment changes.
+ *
+ * Each message (in both directions) is a frame: 1 type byte, a 4-byte big-endian
+ * length, then that many bytes of payload.
+ *   client -> server:  'L' command line to run, 'C' change directory, 'V' NAME=value (or NAME to unset)
+ *   server -> client:  'O' stdout bytes, 'E' stderr bytes, 'X' exit status (4 bytes, big-endian)
+ *
+ * A session runs its lines one at a time, in order. Each line runs in a forked
+ * worker that calls run_command_line(), so all the normal operators work.
+ * One epoll loop watches the sockets, the workers' output pipes and their pidfds.
+ */
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_CHUNK (64 * 1024)
+#define SERVER_MAX_FRAME (1024 * 1024)    // Anything bigger than this is a broken client
+#define SERVER_OUTPUT_LIMIT (1024 * 1024) // Stop reading a job while this much waits for a slow client
 
-        // The input filename comes after <
-        input_filename = where_is_input + 1;
-    }
+enum server_watch_kind
+{
+    WATCH_LISTENER,
+    WATCH_CLIENT,
+    WATCH_JOB_STDOUT,
+    WATCH_JOB_STDERR,
+    WATCH_JOB_EXIT
+};
+
+// epoll hands one of these back so we know what became ready
+struct server_watch
+{
+    enum server_watch_kind kind;
+    struct server_session *session;
+};
 
-    // Clean up the command part by removing extra spaces
-    // Sometimes users type extra spaces so we need to remove them
-    while (*actual_command == ' ' || *actual_command == '\t')
-        actual_command++;
+struct server_session
+{
+    int socket_fd;
+    char cwd[PATH_MAX];
+    char **env_changes; // "NAME=value" to set or "NAME" to unset, applied in order
+    int env_change_count;
+    struct text_buffer input;  // Bytes from the client that aren't a full frame yet
+    struct text_buffer output; // Frames waiting to be sent to the client
+    size_t output_sent;
+    char **queued_lines; // Lines waiting for the current job to finish
+    int queued_count;
+    int queued_space;
+    pid_t job_pid; // 0 when nothing is running
+    int job_stdout; // -1 once closed
+    int job_stderr;
+    int job_pidfd;
+    int job_exited;
+    int job_status;
+    int job_paused; // 1 while we stopped reading the job because the client is slow
+    int closing;    // Client hung up, free the session once the job is gone
+    int retired;    // Finished with, freed after the current batch of events
+    struct server_watch client_watch, stdout_watch, stderr_watch, exit_watch;
+};
+
+static int server_epoll_fd = -1;
+static int server_listen_fd = -1;
+
+// Sessions can't be freed in the middle of an epoll batch because a later
+// event in the same batch may still point at them, so they wait here
+static struct server_session **server_retired = NULL;
+static int server_retired_count = 0;
+
+static void server_update_client_events(struct server_session *session)
+{
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLRDHUP;
+    if (session->output.length > session->output_sent)
+        event.events |= EPOLLOUT; // Only ask about writability when we have something to say
+    event.data.ptr = &session->client_watch;
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_MOD, session->socket_fd, &event);
+}
 
-    int command_length = strlen(actual_command);
+// Pauses or resumes reading the job's output pipes (backpressure for slow clients)
+static void server_set_job_reading(struct server_session *session, int enabled)
+{
+    if (session->job_paused == !enabled)
+        return;
+    session->job_paused = !enabled;
 
-    // Remove trailing spaces too
-    while (command_length > 0 && (actual_command[command_length - 1] == ' ' ||
-                                  actual_command[command_length - 1] == '\t'))
+    int fds[2] = {session->job_stdout, session->job_stderr};
+    struct server_watch *watches[2] = {&session->stdout_watch, &session->stderr_watch};
+    for (int i = 0; i < 2; i++)
     {
-        actual_command[command_length - 1] = '\0';
-        command_length--;
+        if (fds[i] < 0)
+            continue;
+        struct epoll_event event = {0};
+        event.events = enabled ? EPOLLIN : 0;
+        event.data.ptr = watches[i];
+        epoll_ctl(server_epoll_fd, EPOLL_CTL_MOD, fds[i], &event);
     }
+}
 
-    // Clean up the input filename if we have one
-    if (input_filename)
+static void server_send_frame(struct server_session *session, char type, const char *data, uint32_t length)
+{
+    unsigned char header[5];
+    header[0] = (unsigned char)type;
+    header[1] = (unsigned char)(length >> 24);
+    header[2] = (unsigned char)(length >> 16);
+    header[3] = (unsigned char)(length >> 8);
+    header[4] = (unsigned char)length;
+
+    // Drop what was already sent before the buffer grows again
+    if (session->output_sent > 0 && session->output_sent == session->output.length)
     {
-        // Skip past any leading spaces
-        while (*input_filename == ' ' || *input_filename == '\t')
-            input_filename++;
-
-        int filename_length = strlen(input_filename);
-
-        // Remove trailing spaces
-        while (filename_length > 0 && (input_filename[filename_length - 1] == ' ' ||
-                                       input_filename[filename_length - 1] == '\t'))
-        {
-            input_filename[filename_length - 1] = '\0';
-            filename_length--;
-        }
+        session->output.length = 0;
+        session->output_sent = 0;
     }
 
-    // Clean up the output filename if we have one
-    if (output_filename)
-    {
-        // Skip past any leading spaces
-        while (*output_filename == ' ' || *output_filename == '\t')
-            output_filename++;
-
-        int filename_length = strlen(output_filename);
+    text_buffer_add(&session->output, (const char *)header, sizeof(header));
+    text_buffer_add(&session->output, data, length);
+    server_update_client_events(session);
 
-        // Remove trailing spaces
-        while (filename_length > 0 && (output_filename[filename_length - 1] == ' ' ||
-                                       output_filename[filename_length - 1] == '\t'))
-        {
-            output_filename[filename_length - 1] = '\0';
-            filename_length--;
-        }
-    }
+    if (session->output.length - session->output_sent > SERVER_OUTPUT_LIMIT)
+        server_set_job_reading(session, 0);
+}
 
-    // Now I need to break the command into its separate words
-    char *command_words[MAX_ARGS + 1]; // +1 for NULL at the end
-    int word_count = 0;
+static void server_send_status(struct server_session *session, int status)
+{
+    char payload[4];
+    payload[0] = (char)(status >> 24);
+    payload[1] = (char)(status >> 16);
+    payload[2] = (char)(status >> 8);
+    payload[3] = (char)status;
+    server_send_frame(session, 'X', payload, 4);
+}
 
-    // strtok breaks the string into words separated by spaces or tabs
-    char *current_word = strtok(actual_command, " \t");
+static void server_close_job_fd(int *fd)
+{
+    if (*fd < 0)
+        return;
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
 
-    // Keep getting words until we run out or hit our limit
-    while (current_word != NULL && word_count < MAX_ARGS)
+/**
+ * Runs one command line for a session in a forked worker process
+ * The worker gets the session's directory and environment, and its stdout and
+ * stderr go into pipes that the event loop forwards to the client
+ */
+static void server_start_job(struct server_session *session, char *line, const char *heredoc)
+{
+    int out_pipe[2], err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) < 0)
     {
-        command_words[word_count] = current_word;
-        word_count++;
-        current_word = strtok(NULL, " \t");
+        server_send_frame(session, 'E', "server: can't create pipe\n", 26);
+        server_send_status(session, 1);
+        return;
     }
-
-    // Need to put NULL at the end for execvp
-    command_words[word_count] = NULL;
-
-    // Make sure we actually have a command to run
-    if (word_count == 0)
+    if (pipe2(err_pipe, O_CLOEXEC) < 0)
     {
-        fprintf(stderr, "Error: You didn't specify a command to run!\n");
-        return 0; // Failed
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        server_send_frame(session, 'E', "server: can't create pipe\n", 26);
+        server_send_status(session, 1);
+        return;
     }
 
-    // Now for the tricky part - need to create a new process
-    // and set up all the redirections
-    // printf("Running command: %s\n", command_words[0]);
-
-    // Create a child process
-    pid_t child_pid = fork();
-
-    // Check if fork worked
-    if (child_pid < 0)
+    fflush(stdout);
+    fflush(stderr);
+    pid_t worker = fork();
+    if (worker < 0)
     {
-        // Something went wrong with fork()
-        perror("Oh no! Couldn't create process");
-        return 0; // Failed
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        server_send_frame(session, 'E', "server: fork failed\n", 20);
+        server_send_status(session, 1);
+        return;
     }
-    else if (child_pid == 0)
+
+    if (worker == 0)
     {
-        // This code runs in the child process
+        // Worker: own process group so a hung-up client can kill the whole job
+        setpgid(0, 0);
+        close(server_listen_fd);
+        close(server_epoll_fd);
 
-        // Handle input redirection if requested
-        if (found_input_redir && input_filename)
+        if (chdir(session->cwd) < 0)
         {
-            // Try to open the input file
-            int input_fd = open(input_filename, O_RDONLY);
-
-            // Check if open worked
-            if (input_fd < 0)
-            {
-                perror("Couldn't open input file");
-                exit(EXIT_FAILURE);
-            }
-
-            // This is the magic part - redirect standard input to our file
-            // I needed to learn about dup2 for this assignment
-            if (dup2(input_fd, STDIN_FILENO) < 0)
-            {
-                perror("Input redirection failed");
-                exit(EXIT_FAILURE);
-            }
-
-            // Don't need the original file descriptor anymore
-            close(input_fd);
+            dprintf(err_pipe[1], "cd: %s: %s\n", session->cwd, strerror(errno));
+            _exit(1);
         }
-
-        // Handle output redirection if requested
-        if ((found_output_redir || found_append_output) && output_filename)
+        for (int i = 0; i < session->env_change_count; i++)
         {
-            // Set up flags for open() - always need write and create
-            int open_flags = O_WRONLY | O_CREAT;
-
-            // For >> we use append mode, for > we use truncate mode
-            if (found_append_output)
+            char *change = session->env_changes[i];
+            char *equals = strchr(change, '=');
+            if (equals == NULL)
             {
-                // >> means append to end of file
-                open_flags = open_flags | O_APPEND;
+                unsetenv(change);
             }
             else
             {
-                // > means overwrite the file
-                open_flags = open_flags | O_TRUNC;
-            }
-
-            // Try to open the output file
-            int output_fd = open(output_filename, open_flags, 0644);
-
-            // Check if open worked
-            if (output_fd < 0)
-            {
-                perror("Couldn't open output file");
-                exit(EXIT_FAILURE);
+                *equals = '\0';
+                setenv(change, equals + 1, 1);
+                *equals = '=';
             }
+        }
 
-            // Redirect standard output to our file
-            if (dup2(output_fd, STDOUT_FILENO) < 0)
-            {
-                perror("Output redirection failed");
-                exit(EXIT_FAILURE);
-            }
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0)
+        {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
 
-            // Don't need the original file descriptor anymore
-            close(output_fd);
+        // Everything else open here belongs to the server: other clients' sockets,
+        // their jobs' pipes and pidfds. They're close-on-exec, but the worker doesn't
+        // exec, and a client socket we hold open never sees its EOF when the server hangs up
+        if (syscall(SYS_close_range, 3, ~0U, 0) < 0)
+        {
+            long most = sysconf(_SC_OPEN_MAX);
+            for (long fd = 3; fd < (most > 0 && most < 65536 ? most : 65536); fd++)
+                close((int)fd);
         }
+        zygote_fd = -1;
 
-        // Finally, run the command
-        execvp(command_words[0], command_words);
+        char command[MAX_INPUT_SIZE];
+        snprintf(command, sizeof(command), "%s", line);
+        set_heredoc_body(command, heredoc);
+        run_command_line(command);
 
-        // If we get here, something went wrong with the command
-        perror("Command failed to run");
-        exit(EXIT_FAILURE);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(last_exit_status);
     }
-    else
-    {
-        // This is the parent process
-        // We just need to wait for the child to finish
-        int status;
-        waitpid(child_pid, &status, 0);
 
-        // Could check status here to see if command worked
-        if (WIFEXITED(status))
-        {
-            int exit_code = WEXITSTATUS(status);
-            if (exit_code != 0)
-            {
-                printf("Command exited with status %d\n", exit_code);
-            }
-        }
+    // Server side: remember the job and start watching it
+    setpgid(worker, worker); // Also done here so there's no race with kill()
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(err_pipe[0], F_SETFL, O_NONBLOCK);
+
+    session->job_pid = worker;
+    session->job_stdout = out_pipe[0];
+    session->job_stderr = err_pipe[0];
+    session->job_exited = 0;
+    session->job_status = 0;
+    session->job_paused = 0;
+    session->job_pidfd = (int)syscall(SYS_pidfd_open, worker, 0);
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = &session->stdout_watch;
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, session->job_stdout, &event);
+    event.data.ptr = &session->stderr_watch;
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, session->job_stderr, &event);
+    if (session->job_pidfd >= 0)
+    {
+        event.data.ptr = &session->exit_watch;
+        epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, session->job_pidfd, &event);
     }
-
-    // Successfully handled the redirection
-    return 1;
+    // Without pidfd (old kernels) we reap the worker once both pipes hit EOF
 }
 
-/**
- * This function runs multiple commands one after another when separated by ;
- * I learned this is called "sequential execution" in shell programming
- */
-int handle_sequential(char *input)
+static void server_free_session(struct server_session *session)
 {
-    // Need to make a copy of the input string to work with
-    // The original might be needed elsewhere and strtok changes the string
-    char command_string[MAX_INPUT_SIZE];
-    strcpy(command_string, input);
+    for (int i = 0; i < session->env_change_count; i++)
+        free(session->env_changes[i]);
+    free(session->env_changes);
+    for (int i = 0; i < session->queued_count; i++)
+        free(session->queued_lines[i]);
+    free(session->queued_lines);
+    free(session->input.data);
+    free(session->output.data);
+    free(session);
+}
 
-    // According to assignment, we can have up to 4 commands with ;
-    char *separate_commands[4];
-    int command_count = 0;
+// Closes the client connection now and frees the session after this batch
+static void server_retire_session(struct server_session *session)
+{
+    struct server_session **grown = realloc(server_retired, (server_retired_count + 1) * sizeof(*grown));
+    if (grown == NULL)
+        return; // Leak it rather than risk freeing it too early
+    server_retired = grown;
+    server_retired[server_retired_count++] = session;
+
+    session->retired = 1;
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_DEL, session->socket_fd, NULL);
+    close(session->socket_fd);
+}
 
-    // Split the input by semicolons to get each command
-    // strtok is really useful for this kind of string splitting
-    char *one_command = strtok(command_string, ";");
+// "cd DIR" has to change the session itself, not a worker that's about to exit
+static void server_change_directory(struct server_session *session, const char *target)
+{
+    char joined[PATH_MAX * 2];
+    char resolved[PATH_MAX];
 
-    // Get all commands and store them in our array
-    while (one_command != NULL && command_count < 4)
-    {
-        // Save this command for later execution
-        separate_commands[command_count] = one_command;
-        command_count = command_count + 1; // Increment our counter
+    while (*target == ' ' || *target == '\t')
+        target++;
+    if (*target == '\0')
+        target = getenv("HOME") ? getenv("HOME") : "/";
 
-        // Get next command after semicolon
-        one_command = strtok(NULL, ";");
-    }
+    if (target[0] == '/')
+        snprintf(joined, sizeof(joined), "%s", target);
+    else
+        snprintf(joined, sizeof(joined), "%s/%s", session->cwd, target);
 
-    // Make sure we don't have too many commands
-    if (one_command != NULL)
+    struct stat info;
+    if (realpath(joined, resolved) == NULL || stat(resolved, &info) < 0 || !S_ISDIR(info.st_mode))
     {
-        printf("Error: Too many commands! The limit is 4 commands with semicolons\n");
-        return 0; // Failed
+        char message[PATH_MAX + 64];
+        int length = snprintf(message, sizeof(message), "cd: %s: No such directory\n", target);
+        server_send_frame(session, 'E', message, length);
+        server_send_status(session, 1);
+        return;
     }
 
-    // Execute commands one by one
-    // printf("Running %d commands in sequence\n", command_count);
+    snprintf(session->cwd, sizeof(session->cwd), "%s", resolved);
+    server_send_status(session, 0);
+}
 
-    for (int index = 0; index < command_count; index++)
+// Starts queued lines until one of them turns into a running job
+static void server_run_next(struct server_session *session)
+{
+    while (session->job_pid == 0 && session->queued_count > 0 && !session->closing)
     {
-        // First check if this command is empty (like if someone typed ;;)
-        if (separate_commands[index][0] == '\0' ||
-            (separate_commands[index][0] == ' ' && separate_commands[index][1] == '\0'))
+        char *line = session->queued_lines[0];
+        session->queued_count--;
+        memmove(session->queued_lines, session->queued_lines + 1, session->queued_count * sizeof(char *));
+
+        // Anything after the first newline is a here-document body for the line
+        char *heredoc = strchr(line, '\n');
+        if (heredoc != NULL)
+            *heredoc++ = '\0';
+
+        if (strncmp(line, "cd", 2) == 0 && (line[2] == '\0' || line[2] == ' ' || line[2] == '\t'))
+            server_change_directory(session, line + 2);
+        else if (strlen(line) >= MAX_INPUT_SIZE)
         {
-            printf("Skipping empty command at position %d\n", index + 1);
-            continue; // Skip to next command
+            server_send_frame(session, 'E', "server: command line too long\n", 30);
+            server_send_status(session, 1);
         }
+        else if (line[0] == '\0')
+            server_send_status(session, 0);
+        else
+            server_start_job(session, line, heredoc);
+        free(line);
+    }
+}
 
-        // Need a working copy of this specific command
-        char this_command[MAX_INPUT_SIZE];
-        strcpy(this_command, separate_commands[index]);
+// Called whenever something about a job changed - finishes it once everything is done
+static void server_check_job_done(struct server_session *session)
+{
+    if (session->job_pid == 0 || session->job_stdout >= 0 || session->job_stderr >= 0)
+        return;
 
-        // Remove spaces at the beginning
-        char *command_start = this_command;
-        while (*command_start == ' ')
-        {
-            command_start = command_start + 1; // Move past spaces
-        }
+    if (!session->job_exited)
+    {
+        if (session->job_pidfd >= 0)
+            return; // The pidfd will tell us when it exits
+        // No pidfd: the pipes are closed, so the worker is finishing up anyway
+        waitpid(session->job_pid, &session->job_status, 0);
+        session->job_exited = 1;
+    }
 
-        // Now break the command into its arguments (words)
-        char *arguments[MAX_ARGS + 1]; // Extra space for NULL at end
-        int arg_count = 0;
+    if (session->job_pidfd >= 0)
+        server_close_job_fd(&session->job_pidfd);
 
-        // Use strtok to split by spaces
-        char *word = strtok(command_start, " ");
+    int status = 0;
+    if (WIFEXITED(session->job_status))
+        status = WEXITSTATUS(session->job_status);
+    else if (WIFSIGNALED(session->job_status))
+        status = 128 + WTERMSIG(session->job_status);
 
-        // Get all the words in this command
-        while (word != NULL && arg_count < MAX_ARGS)
-        {
-            arguments[arg_count] = word;
-            arg_count = arg_count + 1;
-            word = strtok(NULL, " ");
-        }
+    session->job_pid = 0;
+    if (session->closing)
+    {
+        server_retire_session(session);
+        return;
+    }
 
-        // Need NULL at the end for execvp to work
-        arguments[arg_count] = NULL;
+    server_send_status(session, status);
+    server_run_next(session);
+}
 
-        // Check if command is empty after parsing
-        if (arg_count == 0)
+// Adds a line to the session's queue (takes ownership of it)
+static int server_queue_line(struct server_session *session, char *line)
+{
+    if (session->queued_count == session->queued_space)
+    {
+        int new_space = session->queued_space ? session->queued_space * 2 : 8;
+        char **grown = realloc(session->queued_lines, new_space * sizeof(char *));
+        if (grown == NULL)
         {
-            continue; // Nothing to do
+            free(line);
+            return 0;
         }
+        session->queued_lines = grown;
+        session->queued_space = new_space;
+    }
+    session->queued_lines[session->queued_count++] = line;
+    return 1;
+}
 
-        // Check if there are too many arguments
-        if (arg_count > MAX_ARGS)
-        {
-            printf("Error: Command '%s' has too many arguments (max is 5)\n",
-                   separate_commands[index]);
-            continue; // Skip this command
-        }
+// Pulls complete frames out of the input buffer and acts on them
+static int server_handle_frames(struct server_session *session)
+{
+    size_t pos = 0;
+    while (session->input.length - pos >= 5)
+    {
+        unsigned char *header = (unsigned char *)session->input.data + pos;
+        uint32_t length = ((uint32_t)header[1] << 24) | ((uint32_t)header[2] << 16) |
+                          ((uint32_t)header[3] << 8) | header[4];
+        if (length > SERVER_MAX_FRAME)
+            return 0; // Garbage - drop this client
+        if (session->input.length - pos - 5 < length)
+            break; // Rest of the frame hasn't arrived yet
+
+        char *payload = malloc(length + 1);
+        if (payload == NULL)
+            return 0;
+        memcpy(payload, header + 5, length);
+        payload[length] = '\0';
 
-        // Check for special command: killterm
-        if (strcmp(arguments[0], "killterm") == 0)
+        if (header[0] == 'L')
         {
-            printf("Terminating this shell instance\n");
-            exit(0); // Exit immediately
+            if (!server_queue_line(session, payload))
+                return 0;
         }
-
-        // Check for special command: killallterms
-        if (strcmp(arguments[0], "killallterms") == 0)
+        else if (header[0] == 'C')
         {
-            printf("Hunting for all w25shell processes to terminate...\n");
-
-            // Need to find all w25shell processes
-            FILE *process_file;
-            char process_id_text[16]; // To store PIDs as strings
-            pid_t my_pid = getpid();  // Remember our own PID
-            int kill_count = 0;       // Track how many we've killed
-
-            // Use pgrep to find all processes with w25shell in the name
-            process_file = popen("pgrep -f w25shell", "r");
-            if (process_file == NULL)
-            {
-                perror("Failed to search for processes");
-                continue;
-            }
-
-            // Process each PID returned by pgrep
-            while (fgets(process_id_text, sizeof(process_id_text), process_file) != NULL)
+            // Queued like a "cd" line so its reply comes back in order
+            char *line = malloc(length + 4);
+            if (line == NULL)
             {
-                pid_t pid = atoi(process_id_text); // Convert string to number
-
-                // Don't kill ourselves yet - we need to finish this loop!
-                if (pid != my_pid)
-                {
-                    // Try to kill this process
-                    if (kill(pid, SIGTERM) == 0)
-                    {
-                        printf("Successfully terminated shell with PID: %d\n", pid);
-                        kill_count++;
-                    }
-                }
+                free(payload);
+                return 0;
             }
-
-            printf("Terminated %d other shell processes\n", kill_count);
-            pclose(process_file);
-
-            // Now we can terminate ourselves
-            printf("Now terminating this shell...\n");
-            exit(0);
-        }
-
-        // This is a regular command - execute it
-        // printf("Running command %d: %s\n", index + 1, arguments[0]);
-
-        // Need to create a new process for this command
-        pid_t child = fork();
-
-        if (child < 0)
-        {
-            // Fork failed
-            perror("Cannot create process for command");
-            return 0;
+            snprintf(line, length + 4, "cd %s", payload);
+            free(payload);
+            if (!server_queue_line(session, line))
+                return 0;
         }
-        else if (child == 0)
+        else if (header[0] == 'V')
         {
-            // Child process - run the command
-            execvp(arguments[0], arguments);
-
-            // If we get here, the command failed
-            // execvp only returns if there was an error
-            perror("Command failed");
-            exit(EXIT_FAILURE);
+            char **grown = realloc(session->env_changes, (session->env_change_count + 1) * sizeof(char *));
+            if (grown == NULL)
+            {
+                free(payload);
+                return 0;
+            }
+            session->env_changes = grown;
+            session->env_changes[session->env_change_count++] = payload;
         }
         else
         {
-            // Parent process - wait for child to finish
-            int result;
-            waitpid(child, &result, 0);
-
-            // Print a separator between command outputs
-            // printf("--------------------\n");
+            free(payload); // Unknown frame type, ignore it
         }
+        pos += 5 + length;
     }
 
-    return 1; // Success!
+    memmove(session->input.data, session->input.data + pos, session->input.length - pos);
+    session->input.length -= pos;
+    server_run_next(session);
+    return 1;
 }
 
-/**
- * This function handles conditional commands with && and || operators
- * This was the trickiest part for me to implement!
- */
-int handle_conditional(char *input)
+static void server_client_gone(struct server_session *session)
 {
-    // Need a working copy of the input string
-    // I kept having problems when I modified the original string
-    char command_string[MAX_INPUT_SIZE];
-    strcpy(command_string, input);
-
-    // These arrays will store all the parts needed for conditional execution
-    char *command_pieces[6]; // Can have up to 6 commands (with 5 operators)
-    char operator_types[5];  // Will store '&' for && or '|' for ||
-    int command_count = 0;   // How many commands we found
-    int operator_count = 0;  // How many operators we found
-
-    // Variables to help parse the command string
-    char *current_position = command_string; // Where we're currently looking
-    char *and_operator_pos;                  // Position of next && operator
-    char *or_operator_pos;                   // Position of next || operator
-    char *next_operator_pos;                 // Which operator comes first
-
-    // Keep parsing until we've found all commands or reached our limit
-    // printf("Parsing conditional command: %s\n", input);
-
-    while (current_position != NULL && *current_position != '\0' && command_count < 6)
+    session->closing = 1;
+    if (session->job_pid == 0)
     {
-        // Look for both kinds of operators
-        and_operator_pos = strstr(current_position, "&&");
-        or_operator_pos = strstr(current_position, "||");
-
-        // Need to figure out which operator comes first (if any)
-        // This was confusing at first - had to draw it out on paper!
-        if (and_operator_pos != NULL && (or_operator_pos == NULL || and_operator_pos < or_operator_pos))
-        {
-            // && comes first
-            next_operator_pos = and_operator_pos;
-            operator_types[operator_count] = '&'; // Mark as AND operator
-            operator_count = operator_count + 1;
-        }
-        else if (or_operator_pos != NULL)
-        {
-            // || comes first
-            next_operator_pos = or_operator_pos;
-            operator_types[operator_count] = '|'; // Mark as OR operator
-            operator_count = operator_count + 1;
-        }
-        else
-        {
-            // No more operators found
-            next_operator_pos = NULL;
-        }
-
-        if (next_operator_pos != NULL)
-        {
-            // We found an operator!
-
-            // Replace the operator with a null terminator to split the string
-            *next_operator_pos = '\0';
+        server_retire_session(session);
+        return;
+    }
+    // Nobody is listening any more, so stop the job (its whole process group)
+    kill(-session->job_pid, SIGTERM);
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_DEL, session->socket_fd, NULL);
+    server_set_job_reading(session, 1); // Keep draining so the job can't block on a full pipe
+}
 
-            // Save this command
-            command_pieces[command_count] = current_position;
-            command_count = command_count + 1;
+static void server_accept_clients(void)
+{
+    while (1)
+    {
+        int client = accept4(server_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0)
+            return; // EAGAIN means we've taken everyone who was waiting
 
-            // Move our position past the operator (either && or ||)
-            current_position = next_operator_pos + 2; // +2 to skip both characters
+        struct server_session *session = calloc(1, sizeof(struct server_session));
+        if (session == NULL)
+        {
+            close(client);
+            continue;
+        }
+        session->socket_fd = client;
+        session->job_stdout = session->job_stderr = session->job_pidfd = -1;
+        if (getcwd(session->cwd, sizeof(session->cwd)) == NULL)
+            strcpy(session->cwd, "/");
+        session->client_watch = (struct server_watch){WATCH_CLIENT, session};
+        session->stdout_watch = (struct server_watch){WATCH_JOB_STDOUT, session};
+        session->stderr_watch = (struct server_watch){WATCH_JOB_STDERR, session};
+        session->exit_watch = (struct server_watch){WATCH_JOB_EXIT, session};
+
+        struct epoll_event event = {0};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = &session->client_watch;
+        epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, client, &event);
+    }
+}
 
-            // If the second character wasn't replaced (like in "&&&"), skip it
-            if (*current_position == '&' || *current_position == '|')
+static void server_handle_client(struct server_session *session, uint32_t events)
+{
+    if (events & EPOLLOUT)
+    {
+        while (session->output_sent < session->output.length)
+        {
+            ssize_t sent = send(session->socket_fd, session->output.data + session->output_sent,
+                                session->output.length - session->output_sent, MSG_NOSIGNAL);
+            if (sent <= 0)
             {
-                current_position = current_position + 1;
+                if (sent < 0 && (errno == EAGAIN || errno == EINTR))
+                    break;
+                server_client_gone(session);
+                return;
             }
+            session->output_sent += sent;
+        }
+        server_update_client_events(session);
+        if (session->output.length - session->output_sent <= SERVER_OUTPUT_LIMIT)
+            server_set_job_reading(session, 1);
+    }
 
-            // Skip any spaces at the beginning of the next command
-            while (*current_position == ' ')
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        char chunk[SERVER_READ_CHUNK];
+        while (1)
+        {
+            ssize_t got = read(session->socket_fd, chunk, sizeof(chunk));
+            if (got > 0)
             {
-                current_position = current_position + 1;
+                text_buffer_add(&session->input, chunk, got);
+                continue;
             }
+            if (got < 0 && (errno == EAGAIN || errno == EINTR))
+                break;
+            // 0 = client closed the connection
+            server_client_gone(session);
+            return;
         }
-        else
+        if (!server_handle_frames(session))
+            server_client_gone(session);
+    }
+}
+
+static void server_handle_job_output(struct server_session *session, int is_stderr)
+{
+    int *fd = is_stderr ? &session->job_stderr : &session->job_stdout;
+    char chunk[SERVER_READ_CHUNK];
+
+    while (*fd >= 0 && !session->job_paused)
+    {
+        ssize_t got = read(*fd, chunk, sizeof(chunk));
+        if (got > 0)
         {
-            // No more operators, this is the last command
-            command_pieces[command_count] = current_position;
-            command_count = command_count + 1;
-            break; // Exit the loop
+            if (!session->closing)
+                server_send_frame(session, is_stderr ? 'E' : 'O', chunk, (uint32_t)got);
+            continue;
         }
+        if (got < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        server_close_job_fd(fd); // EOF - the job closed this stream
     }
+    server_check_job_done(session);
+}
 
-    // Make sure we don't have too many operators
-    if (operator_count > 5)
+/**
+ * The server's main loop - never returns unless setup fails
+ */
+int run_server(const char *socket_path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
     {
-        printf("Error: Too many operators! Maximum is 5 && or || operators\n");
-        return 0; // Failed
+        fprintf(stderr, "Error: Socket path is too long\n");
+        return 1;
     }
+    strcpy(address.sun_path, socket_path);
 
-    // Printing what we found (useful for debugging)
-    // printf("Found %d commands with %d operators\n", command_count, operator_count);
+    server_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_listen_fd < 0)
+    {
+        perror("Can't create server socket");
+        return 1;
+    }
+    unlink(socket_path); // Remove a stale socket from an old run
+    if (bind(server_listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(server_listen_fd, 128) < 0)
+    {
+        perror("Can't listen on server socket");
+        return 1;
+    }
 
-    // Now execute the commands based on the conditions
-    // I need to keep track of whether commands succeed or fail
-    int previous_command_success = 1; // Start with success so first command always runs
-    int command_status;
+    server_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server_epoll_fd < 0)
+    {
+        perror("Can't create epoll instance");
+        return 1;
+    }
 
-    // Process each command
-    for (int cmd_index = 0; cmd_index < command_count; cmd_index++)
+    static struct server_watch listener_watch = {WATCH_LISTENER, NULL};
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = &listener_watch;
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, server_listen_fd, &event);
+
+    printf("w25shell serving on %s\n", socket_path);
+    fflush(stdout);
+
+    struct epoll_event ready[SERVER_MAX_EVENTS];
+    while (1)
     {
-        // Get this command and trim leading spaces
-        char *current_command = command_pieces[cmd_index];
-        while (*current_command == ' ')
+        int count = epoll_wait(server_epoll_fd, ready, SERVER_MAX_EVENTS, -1);
+        if (count < 0)
         {
-            current_command = current_command + 1;
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            return 1;
         }
 
-        // Here's the clever part - conditional execution!
-        // We need to decide whether to run this command based on:
-        // 1. The operator that came before it (& or |)
-        // 2. Whether the previous command succeeded or failed
-
-        if (cmd_index > 0) // Skip this check for the first command
+        for (int i = 0; i < count; i++)
         {
-            // For && operator: only run if previous command succeeded
-            if (operator_types[cmd_index - 1] == '&' && previous_command_success == 0)
-            {
-                // printf("Skipping command due to && after failed command\n");
-                continue; // Skip to next command
-            }
+            struct server_watch *watch = ready[i].data.ptr;
+            struct server_session *session = watch->session;
+            if (session != NULL && session->retired)
+                continue;
 
-            // For || operator: only run if previous command failed
-            if (operator_types[cmd_index - 1] == '|' && previous_command_success == 1)
+            switch (watch->kind)
             {
-                // printf("Skipping command due to || after successful command\n");
-                continue; // Skip to next command
+            case WATCH_LISTENER:
+                server_accept_clients();
+                break;
+            case WATCH_CLIENT:
+                if (!session->closing)
+                    server_handle_client(session, ready[i].events);
+                break;
+            case WATCH_JOB_STDOUT:
+                server_handle_job_output(session, 0);
+                break;
+            case WATCH_JOB_STDERR:
+                server_handle_job_output(session, 1);
+                break;
+            case WATCH_JOB_EXIT:
+                if (waitpid(session->job_pid, &session->job_status, WNOHANG) > 0)
+                {
+                    // The pidfd stays readable after this (it's level-triggered), so it
+                    // goes now instead of once the job's pipes have closed
+                    server_close_job_fd(&session->job_pidfd);
+                    session->job_exited = 1;
+                    server_check_job_done(session);
+                }
+                break;
             }
         }
 
-        // If we get here, we need to execute this command
-        // printf("Executing command: %s\n", current_command);
+        for (int i = 0; i < server_retired_count; i++)
+            server_free_session(server_retired[i]);
+        server_retired_count = 0;
+    }
+}
 
-        // Parse this command into its arguments (like "ls", "-l", etc.)
-        char *argument_list[MAX_ARGS + 1]; // +1 for NULL at end
-        int arg_count = 0;
+/**
+ * Session recording and replay
+ *   w25shell --record session.rec          logs every line while you work
+ *   w25shell --replay session.rec [--speed N]   runs them again and diffs the timings
+ *
+ * The recording is plain text, one record per line, tab separated:
+ *   D <cwd>                 working directory, written when it changes
+ *   E <NAME=value>          environment variable set or changed since the last line
+ *   U <NAME>                environment variable removed since the last line
+ *   H <body>                here-document body for the next line
+ *   L <at ms> <took ms> <status> <line>   a command line, when it started
+ *                                         (from the start of the session), how
+ *                                         long it took and its exit status
+ * Backslashes and newlines in the text are written as \\ and \n.
+ * Replay puts the directory and environment back the way they were before
+ * each line, so the lines see the same state they did when recorded.
+ */
+static FILE *record_file;
+static struct timespec record_started;
+static char record_cwd[PATH_MAX];
+static char **record_environment; // Sorted copy of environ from the last line
+static int record_environment_count;
 
-        // Need to make a copy of just this command
-        char command_copy[MAX_INPUT_SIZE];
-        strcpy(command_copy, current_command);
+static int compare_env_entries(const void *a, const void *b)
+{
+    const char *x = *(const char *const *)a, *y = *(const char *const *)b;
+    size_t x_name = strcspn(x, "="), y_name = strcspn(y, "=");
+    int order = strncmp(x, y, x_name < y_name ? x_name : y_name);
+    return order != 0 ? order : (int)x_name - (int)y_name;
+}
 
-        // Break the command into words (arguments)
-        char *one_arg = strtok(command_copy, " \t");
+static void record_write_escaped(FILE *out, const char *text, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (text[i] == '\\')
+            fputs("\\\\", out);
+        else if (text[i] == '\n')
+            fputs("\\n", out);
+        else
+            fputc(text[i], out);
+    }
+}
 
-        // Get all arguments
-        while (one_arg != NULL && arg_count < MAX_ARGS)
+static void unescape_record_text(char *text)
+{
+    char *out = text;
+    for (char *in = text; *in != '\0'; in++)
+    {
+        if (*in == '\\' && in[1] == 'n')
+        {
+            *out++ = '\n';
+            in++;
+        }
+        else if (*in == '\\' && in[1] == '\\')
         {
-            argument_list[arg_count] = one_arg;
-            arg_count = arg_count + 1;
-            one_arg = strtok(NULL, " \t");
+            *out++ = '\\';
+            in++;
         }
+        else
+            *out++ = *in;
+    }
+    *out = '\0';
+}
+
+// Sorted copy of the current environment (the strings are copied too)
+static char **snapshot_environment(int *count)
+{
+    int total = 0;
+    while (environ[total] != NULL)
+        total++;
+    char **copy = malloc(sizeof(char *) * (total + 1));
+    if (copy == NULL)
+    {
+        *count = 0;
+        return NULL;
+    }
+    for (int i = 0; i < total; i++)
+        copy[i] = strdup(environ[i]);
+    qsort(copy, total, sizeof(char *), compare_env_entries);
+    *count = total;
+    return copy;
+}
 
-        // Add NULL at the end (needed for execvp)
-        argument_list[arg_count] = NULL;
+static void free_environment_snapshot(char **snapshot, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(snapshot[i]);
+    free(snapshot);
+}
 
-        // Skip empty commands
-        if (arg_count == 0)
+// Opens the recording; the environment we started with is the baseline, only changes get written
+static int start_recording(const char *path)
+{
+    record_file = fopen(path, "w");
+    if (record_file == NULL)
+    {
+        fprintf(stderr, "w25shell: can't record to %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    setvbuf(record_file, NULL, _IOLBF, 0); // A crash still leaves every finished line in the file
+    clock_gettime(CLOCK_MONOTONIC, &record_started);
+    time_t now = time(NULL);
+    char started[64];
+    strftime(started, sizeof(started), "%Y-%m-%d %H:%M:%S %z", localtime(&now));
+    fprintf(record_file, "# w25shell recording, started %s\n", started);
+    record_environment = snapshot_environment(&record_environment_count);
+    return 1;
+}
+
+/**
+ * Writes the records that go before a line: new cwd, environment changes
+ * and the here-document body. Returns the line's start time for record_line_finished()
+ */
+static double record_line_starting(void)
+{
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL && strcmp(cwd, record_cwd) != 0)
+    {
+        fputs("D\t", record_file);
+        record_write_escaped(record_file, cwd, strlen(cwd));
+        fputc('\n', record_file);
+        snprintf(record_cwd, sizeof(record_cwd), "%s", cwd);
+    }
+
+    // Both lists are sorted by name, so one merge pass finds the differences
+    int count;
+    char **current = snapshot_environment(&count);
+    int old = 0, now = 0;
+    while (old < record_environment_count || now < count)
+    {
+        int order = old == record_environment_count ? 1
+                    : now == count                  ? -1
+                                                    : compare_env_entries(&record_environment[old], &current[now]);
+        if (order < 0)
         {
-            // printf("Skipping empty command\n");
+            fputs("U\t", record_file);
+            record_write_escaped(record_file, record_environment[old], strcspn(record_environment[old], "="));
+            fputc('\n', record_file);
+            old++;
             continue;
         }
-
-        // Check for special shell commands
-        if (strcmp(argument_list[0], "killterm") == 0)
+        if (order > 0 || strcmp(record_environment[old], current[now]) != 0)
         {
-            printf("Terminating this shell instance\n");
-            exit(0); // Exit program
+            fputs("E\t", record_file);
+            record_write_escaped(record_file, current[now], strlen(current[now]));
+            fputc('\n', record_file);
         }
-        else if (strcmp(argument_list[0], "killallterms") == 0)
-        {
-            printf("Terminating all shell instances...\n");
+        if (order == 0)
+            old++;
+        now++;
+    }
+    free_environment_snapshot(record_environment, record_environment_count);
+    record_environment = current;
+    record_environment_count = count;
 
-            // This would normally call the killallterms function
-            // but for brevity I'm just exiting
-            exit(0);
-        }
+    if (heredoc_ready)
+    {
+        fputs("H\t", record_file);
+        record_write_escaped(record_file, heredoc_body.data, heredoc_body.length);
+        fputc('\n', record_file);
+    }
+    return stats_microseconds_since(&record_started) / 1000.0;
+}
+
+static void record_line_finished(double started_ms, const char *line)
+{
+    double took_ms = stats_microseconds_since(&record_started) / 1000.0 - started_ms;
+    fprintf(record_file, "L\t%.3f\t%.3f\t%d\t", started_ms, took_ms, last_exit_status);
+    record_write_escaped(record_file, line, strlen(line));
+    fputc('\n', record_file);
+}
 
-        // Normal command - need to use fork and exec
-        pid_t child_pid = fork();
+// One replayed line, kept for the report at the end
+struct replayed_line
+{
+    double recorded_ms, replayed_ms;
+    int recorded_status, replayed_status;
+    char *line;
+};
 
-        if (child_pid < 0)
+/**
+ * Runs a recording again and prints recorded vs replayed time for every line
+ * speed 0 runs the lines back to back; N > 0 keeps the recorded gaps between
+ * lines, N times faster (1 = real time)
+ * Returns 1 if any line finished with a different exit status
+ */
+int run_replay(const char *path, double speed)
+{
+    FILE *recording = fopen(path, "r");
+    if (recording == NULL)
+    {
+        fprintf(stderr, "w25shell: can't replay %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+
+    struct replayed_line *lines = NULL;
+    int line_count = 0, line_space = 0;
+    struct timespec replay_started;
+    clock_gettime(CLOCK_MONOTONIC, &replay_started);
+    char *record = NULL;
+    size_t record_space = 0;
+    ssize_t got;
+    heredoc_body.length = 0;
+    heredoc_ready = 0;
+
+    while ((got = getline(&record, &record_space, recording)) > 0)
+    {
+        if (record[got - 1] == '\n')
+            record[--got] = '\0';
+        if (record[0] == '#' || got < 2 || record[1] != '\t')
+            continue;
+        char *text = record + 2;
+
+        if (record[0] == 'D' || record[0] == 'E' || record[0] == 'U' || record[0] == 'H')
         {
-            // Error during fork
-            perror("Couldn't create process");
-            return 0;
+            unescape_record_text(text);
+            if (record[0] == 'D' && chdir(text) < 0)
+                fprintf(stderr, "replay: can't go to %s: %s\n", text, strerror(errno));
+            else if (record[0] == 'E')
+                putenv(strdup(text)); // putenv keeps the string, so it gets its own copy
+            else if (record[0] == 'U')
+                unsetenv(text);
+            else if (record[0] == 'H')
+            {
+                text_buffer_add(&heredoc_body, text, strlen(text));
+                heredoc_ready = 1;
+            }
+            continue;
         }
-        else if (child_pid == 0)
-        {
-            // This is the child process
-            // Replace it with the requested command
-            execvp(argument_list[0], argument_list);
+        if (record[0] != 'L')
+            continue;
 
-            // If we get here, execvp failed
-            perror("Command failed to execute");
-            exit(EXIT_FAILURE);
-        }
-        else
+        double at_ms, took_ms;
+        int status, offset = 0;
+        if (sscanf(text, "%lf\t%lf\t%d\t%n", &at_ms, &took_ms, &status, &offset) != 3 || offset == 0)
         {
-            // This is the parent process
-            // Wait for the child to finish
-            waitpid(child_pid, &command_status, 0);
+            fprintf(stderr, "replay: skipping a bad record: %.40s\n", record);
+            continue;
+        }
+        char line[MAX_INPUT_SIZE];
+        snprintf(line, sizeof(line), "%s", text + offset);
+        unescape_record_text(line);
 
-            // Figure out if the command succeeded or failed
-            // This is important for deciding whether to run the next command!
-            if (WIFEXITED(command_status))
+        // Keep the recorded pacing, if asked to
+        if (speed > 0)
+        {
+            double wait_ms = at_ms / speed - stats_microseconds_since(&replay_started) / 1000.0;
+            if (wait_ms > 0)
             {
-                // The child process exited normally
-                int exit_code = WEXITSTATUS(command_status);
-                previous_command_success = (exit_code == 0) ? 1 : 0;
-
-                printf("Command exited with status %d (%s)\n",
-                       exit_code,
-                       previous_command_success ? "success" : "failure");
+                struct timespec pause;
+                pause.tv_sec = (time_t)(wait_ms / 1000);
+                pause.tv_nsec = (long)((wait_ms - pause.tv_sec * 1000.0) * 1e6);
+                nanosleep(&pause, NULL);
             }
-            else
+        }
+
+        if (line_count == line_space)
+        {
+            line_space = line_space ? line_space * 2 : 64;
+            struct replayed_line *bigger = realloc(lines, sizeof(*lines) * line_space);
+            if (bigger == NULL)
             {
-                // The child process didn't exit normally
-                // (maybe it was killed by a signal)
-                previous_command_success = 0; // Consider it failed
-                printf("Command didn't exit normally - considering it failed\n");
+                fprintf(stderr, "replay: out of memory\n");
+                break;
             }
+            lines = bigger;
+        }
+        struct replayed_line *entry = &lines[line_count++];
+        entry->recorded_ms = took_ms;
+        entry->recorded_status = status;
+        entry->line = strdup(line);
+
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        run_command_line(line);
+        fflush(stdout);
+        entry->replayed_ms = stats_microseconds_since(&started) / 1000.0;
+        entry->replayed_status = last_exit_status;
+
+        heredoc_body.length = 0;
+        heredoc_ready = 0;
+    }
+    free(record);
+    fclose(recording);
+
+    // Side by side, on stderr so it stays apart from the commands' own output
+    double recorded_total = 0, replayed_total = 0;
+    double *ratios = malloc(sizeof(double) * (line_count > 0 ? line_count : 1));
+    int slower = 0, faster = 0, status_changes = 0;
+    fprintf(stderr, "\n%5s  %10s  %10s  %8s  %-7s %s\n", "#", "recorded", "replayed", "change", "status", "line");
+    for (int i = 0; i < line_count; i++)
+    {
+        struct replayed_line *entry = &lines[i];
+        double ratio = (entry->replayed_ms + 0.001) / (entry->recorded_ms + 0.001);
+        char status[24];
+        if (entry->recorded_status == entry->replayed_status)
+            snprintf(status, sizeof(status), "%d", entry->replayed_status);
+        else
+        {
+            snprintf(status, sizeof(status), "%d->%d", entry->recorded_status, entry->replayed_status);
+            status_changes++;
         }
+        char *newline = strchr(entry->line, '\n');
+        fprintf(stderr, "%5d  %8.2fms  %8.2fms  %+7.1f%%  %-7s %.*s\n", i + 1, entry->recorded_ms, entry->replayed_ms,
+                (ratio - 1) * 100, status, newline != NULL ? (int)(newline - entry->line) : 60, entry->line);
+        recorded_total += entry->recorded_ms;
+        replayed_total += entry->replayed_ms;
+        if (ratios != NULL)
+            ratios[i] = ratio;
+        slower += ratio > 1.2;
+        faster += ratio < 1 / 1.2;
+        free(entry->line);
     }
+    free(lines);
 
-    // We're done!
-    return 1; // Success
+    if (line_count > 0 && ratios != NULL)
+    {
+        fprintf(stderr, "total  %8.2fms  %8.2fms  %+7.1f%%\n", recorded_total, replayed_total,
+                (replayed_total / (recorded_total > 0 ? recorded_total : 1) - 1) * 100);
+        qsort(ratios, line_count, sizeof(double), compare_latencies);
+        fprintf(stderr, "%d lines: median change %+.1f%%, %d more than 20%% slower, %d more than 20%% faster, "
+                        "%d exit status changes\n",
+                line_count, (ratios[line_count / 2] - 1) * 100, slower, faster, status_changes);
+    }
+    else if (line_count == 0)
+        fprintf(stderr, "replay: no command lines in %s\n", path);
+    free(ratios);
+    return status_changes > 0;
 }
 
 /**
  * This is the heart of our shell program - the main function!
  * It took me a while to understand how all the pieces fit together
  */
-int main()
+int main(int argc, char **argv)
 {
+    // The stats memory has to exist before the zygote forks, so its children share it
+    stats_init();
+    register_shell_commands();
+
+    // "w25shell --zygote" forks the spawn helper before we allocate anything big
+    int first_option = 1;
+    if (argc > 1 && strcmp(argv[1], "--zygote") == 0)
+    {
+        start_zygote();
+        first_option = 2;
+    }
+
+    // "--timeout 30s [--kill-after 5s]" puts a time limit on every command,
+    // "--metrics-file F [--metrics-interval 15s]" writes the stats for Prometheus,
+    // "--record F" logs the session, "--replay F [--speed N]" runs a logged one again
+    const char *record_path = NULL, *replay_path = NULL;
+    double replay_speed = 0;
+    while (first_option + 1 < argc &&
+           (strcmp(argv[first_option], "--timeout") == 0 || strcmp(argv[first_option], "--kill-after") == 0 ||
+            strcmp(argv[first_option], "--metrics-interval") == 0 || strcmp(argv[first_option], "--metrics-file") == 0 ||
+            strcmp(argv[first_option], "--record") == 0 || strcmp(argv[first_option], "--replay") == 0 ||
+            strcmp(argv[first_option], "--speed") == 0))
+    {
+        if (strcmp(argv[first_option], "--metrics-file") == 0)
+        {
+            snprintf(metrics_path, sizeof(metrics_path), "%s", argv[first_option + 1]);
+            first_option += 2;
+            continue;
+        }
+        if (strcmp(argv[first_option], "--record") == 0 || strcmp(argv[first_option], "--replay") == 0)
+        {
+            if (strcmp(argv[first_option], "--record") == 0)
+                record_path = argv[first_option + 1];
+            else
+                replay_path = argv[first_option + 1];
+            first_option += 2;
+            continue;
+        }
+        if (strcmp(argv[first_option], "--speed") == 0)
+        {
+            char *end;
+            replay_speed = strtod(argv[first_option + 1], &end);
+            if (end == argv[first_option + 1] || *end != '\0' || replay_speed < 0)
+            {
+                fprintf(stderr, "w25shell: --speed wants a number (0 = no pauses, 1 = real time, 10 = 10x faster)\n");
+                return 2;
+            }
+            first_option += 2;
+            continue;
+        }
+        double *setting = strcmp(argv[first_option], "--timeout") == 0      ? &default_timeout
+                          : strcmp(argv[first_option], "--kill-after") == 0 ? &default_kill_after
+                                                                            : &metrics_interval;
+        if (!parse_duration(argv[first_option + 1], setting) || (setting == &metrics_interval && *setting < 0.1))
+        {
+            fprintf(stderr, "w25shell: %s wants a duration like 30s or 2m\n", argv[first_option]);
+            return 2;
+        }
+        first_option += 2;
+    }
+    start_metrics_export();
+
+    if (replay_path != NULL)
+    {
+        return run_replay(replay_path, replay_speed);
+    }
+    if (record_path != NULL && !start_recording(record_path))
+    {
+        return 2;
+    }
+
+    // "w25shell --serve /path/to.sock" runs the command server instead of a prompt
+    if (argc == first_option + 2 && strcmp(argv[first_option], "--serve") == 0)
+    {
+        return run_server(argv[first_option + 1]);
+    }
+
     // Need a big buffer to hold whatever the user types
     char user_command[MAX_INPUT_SIZE];
 
@@ -1694,7 +13000,8 @@ int main()
     while (1)
     {
         // Show the command prompt (added $ like real shells)
-        printf("w25shell$ ");
+        if (!stdin_closed)
+            printf("w25shell$ ");
 
         // Force output to appear right away - learned this from debugging
         // Sometimes output would be buffered and not appear immediately
@@ -1702,11 +13009,28 @@ int main()
 
         // Get input from user - fgets is safer than gets
         // I originally used gets but my professor said it's dangerous!
-        if (fgets(user_command, MAX_INPUT_SIZE, stdin) == NULL)
+        // (read_command_line runs the "every"/"at" schedules while we wait)
+        if (!read_command_line(user_command, MAX_INPUT_SIZE))
         {
-            // Handle error if fgets fails
-            perror("Oops! Something went wrong reading your command");
-            continue; // Try again
+            if (ferror(stdin) && errno == EINTR)
+            {
+                clearerr(stdin);
+                continue; // Interrupted, try again
+            }
+            if (ferror(stdin))
+                perror("Oops! Something went wrong reading your command");
+
+            // Used to spin here forever at end of input - now it's time to stop,
+            // unless there are schedules left to run
+            if (schedule_count > 0 && !stdin_closed)
+            {
+                stdin_closed = 1;
+                fprintf(stderr, "\nw25shell: end of input, still running %d schedule%s\n", schedule_count,
+                        schedule_count == 1 ? "" : "s");
+                continue;
+            }
+            printf("\n");
+            break;
         }
 
         // Remove the newline that fgets keeps
@@ -1719,100 +13043,28 @@ int main()
             continue;
         }
 
-        // Some debug output - helped me see what was happening
-        // printf("Command received: %s\n", user_command);
+        // A "<<WORD" line needs the lines after it before it can run
+        read_heredoc_body(stdin, user_command);
 
-        // Figure out which type of command this is
-        // Need to check special characters in a specific order
-
-        // First check for piping operations
-        if (strchr(user_command, '|') != NULL)
-        {
-            // printf("Detected pipe operation!\n");
-            handle_multi_pipe(user_command);
-        }
-        // Check for reverse piping
-        else if (strchr(user_command, '=') != NULL)
-        {
-            // printf("Detected reverse pipe operation!\n");
-            handle_reverse_pipe(user_command);
-        }
-        // Check for file append operation
-        else if (strchr(user_command, '~') != NULL)
-        {
-            // printf("Detected file append operation!\n");
-            handle_append(user_command);
-        }
-        // Check for word count operation
-        else if (strchr(user_command, '#') != NULL)
-        {
-            // printf("Detected word count operation!\n");
-            handle_word_count(user_command);
-        }
-        // Check for file concatenation
-        else if (strchr(user_command, '+') != NULL)
-        {
-            // printf("Detected file concatenation operation!\n");
-            handle_concat(user_command);
-        }
-        // Check for input/output redirection
-        else if (strchr(user_command, '<') != NULL || strchr(user_command, '>') != NULL)
-        {
-            // printf("Detected I/O redirection!\n");
-            handle_redirection(user_command);
-        }
-        // Check for sequential execution
-        else if (strchr(user_command, ';') != NULL)
-        {
-            // printf("Detected sequential execution!\n");
-            handle_sequential(user_command);
-        }
-        // Check for conditional execution (need to check for && before ||)
-        else if (strstr(user_command, "&&") != NULL || strstr(user_command, "||") != NULL)
+        // Hand the line to the dispatcher (server mode uses the same one)
+        if (record_file != NULL)
         {
-            // printf("Detected conditional execution!\n");
-            handle_conditional(user_command);
+            double started_ms = record_line_starting();
+            char recorded_line[MAX_INPUT_SIZE];
+            snprintf(recorded_line, sizeof(recorded_line), "%s", user_command); // The handlers cut the line up
+            run_command_line(user_command);
+            fflush(stdout);
+            record_line_finished(started_ms, recorded_line);
         }
-        // If no special characters, it's a regular command
         else
         {
-            // Regular command - need to parse it into arguments
-            char *args_array[MAX_ARGS + 1]; // Local array for arguments
-
-            // Use our parsing function to break command into words
-            int arg_count = parse_command(user_command, args_array);
-
-            // Make sure we actually got some arguments
-            if (arg_count > 0)
-            {
-                // First check if it's one of our special built-in commands
-                if (handle_special_commands(args_array))
-                {
-                    // If special command was handled, go back to prompt
-                    // printf("Special command executed\n");
-                    continue;
-                }
-
-                // Otherwise execute it as a normal command
-                // printf("Executing regular command: %s\n", args_array[0]);
-                int result = execute_command(args_array);
-                if (result == 0)
-                {
-                    // Command failed, continue to next iteration
-                    continue;
-                }
-            }
-            else
-            {
-                printf("Error: No valid command found\n");
-            }
+            run_command_line(user_command);
         }
 
         // Add a separator line to make output easier to read
         // printf("--------------------\n");
     }
 
-    // This code never actually runs (we exit with killterm)
-    // But I'm including it to be proper
-    return 0;
+    // We get here at the end of input (killterm exits straight away)
+    return last_exit_status;
 }
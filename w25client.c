@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * w25client - talks to a "w25shell --serve /path/to.sock" server
+ *
+ * Run one command:
+ *   w25client /tmp/w25.sock [-C dir] [-e NAME=value] command words...
+ * Load benchmark (many requests over a few connections):
+ *   w25client /tmp/w25.sock --bench REQUESTS [--clients N] command words...
+ *
+ * The frame format has to match the server in W25shell.c:
+ * 1 type byte, 4-byte big-endian length, then the payload.
+ */
+
+#define MAX_COMMAND_SIZE 1024 // Same as MAX_INPUT_SIZE in the shell
+#define MAX_BENCH_CLIENTS 256
+
+// Connects to the server's Unix socket, returns the fd or -1
+int connect_to_server(const char *socket_path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "w25client: socket path is too long\n");
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads exactly length bytes (the socket can hand them over in pieces)
+int read_exactly(int fd, void *buffer, size_t length)
+{
+    char *out = buffer;
+    while (length > 0)
+    {
+        ssize_t got = read(fd, out, length);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return 0;
+        out += got;
+        length -= got;
+    }
+    return 1;
+}
+
+int write_exactly(int fd, const void *buffer, size_t length)
+{
+    const char *data = buffer;
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return 0;
+        data += written;
+        length -= written;
+    }
+    return 1;
+}
+
+int send_frame(int fd, char type, const char *payload, uint32_t length)
+{
+    unsigned char header[5];
+    header[0] = (unsigned char)type;
+    header[1] = (unsigned char)(length >> 24);
+    header[2] = (unsigned char)(length >> 16);
+    header[3] = (unsigned char)(length >> 8);
+    header[4] = (unsigned char)length;
+    return write_exactly(fd, header, sizeof(header)) && write_exactly(fd, payload, length);
+}
+
+/**
+ * Reads frames until the 'X' (exit status) frame for the current command
+ * Output frames are copied to our stdout/stderr unless quiet is set
+ * Returns the command's exit status, or -1 if the connection broke
+ */
+int wait_for_exit_status(int fd, int quiet)
+{
+    char buffer[64 * 1024];
+
+    while (1)
+    {
+        unsigned char header[5];
+        if (!read_exactly(fd, header, sizeof(header)))
+            return -1;
+        uint32_t length = ((uint32_t)header[1] << 24) | ((uint32_t)header[2] << 16) |
+                          ((uint32_t)header[3] << 8) | header[4];
+
+        if (header[0] == 'X')
+        {
+            unsigned char status[4];
+            if (length != 4 || !read_exactly(fd, status, 4))
+                return -1;
+            return (int)(((uint32_t)status[0] << 24) | ((uint32_t)status[1] << 16) |
+                         ((uint32_t)status[2] << 8) | status[3]);
+        }
+
+        // Output frames can be bigger than our buffer, so copy them in pieces
+        while (length > 0)
+        {
+            size_t piece = length < sizeof(buffer) ? length : sizeof(buffer);
+            if (!read_exactly(fd, buffer, piece))
+                return -1;
+            if (!quiet)
+                write_exactly(header[0] == 'E' ? STDERR_FILENO : STDOUT_FILENO, buffer, piece);
+            length -= piece;
+        }
+    }
+}
+
+// Joins argv words back into one command line
+int join_command(char **words, int count, char *command, size_t size)
+{
+    size_t used = 0;
+    command[0] = '\0';
+    for (int i = 0; i < count; i++)
+    {
+        int written = snprintf(command + used, size - used, "%s%s", i > 0 ? " " : "", words[i]);
+        if (written < 0 || (size_t)written >= size - used)
+            return 0;
+        used += written;
+    }
+    return used > 0;
+}
+
+double seconds_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// One benchmark connection sends its share of requests back to back
+struct bench_client
+{
+    pthread_t thread;
+    const char *socket_path;
+    const char *command;
+    int requests;
+    double *latencies; // Seconds per request, filled in by the thread
+    int completed;
+    int failed;
+};
+
+void *bench_client_main(void *arg)
+{
+    struct bench_client *client = arg;
+    int fd = connect_to_server(client->socket_path);
+    if (fd < 0)
+    {
+        client->failed = client->requests;
+        return NULL;
+    }
+
+    for (int i = 0; i < client->requests; i++)
+    {
+        double started = seconds_now();
+        if (!send_frame(fd, 'L', client->command, strlen(client->command)) ||
+            wait_for_exit_status(fd, 1) < 0)
+        {
+            client->failed = client->requests - i;
+            break;
+        }
+        client->latencies[client->completed++] = seconds_now() - started;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int run_benchmark(const char *socket_path, const char *command, int requests, int clients)
+{
+    struct bench_client workers[MAX_BENCH_CLIENTS];
+    double *latencies = malloc(sizeof(double) * requests);
+    if (latencies == NULL)
+    {
+        fprintf(stderr, "w25client: out of memory\n");
+        return 1;
+    }
+
+    double started = seconds_now();
+    int given_out = 0;
+    for (int c = 0; c < clients; c++)
+    {
+        // Split the requests as evenly as we can
+        int share = requests / clients + (c < requests % clients ? 1 : 0);
+        workers[c] = (struct bench_client){0};
+        workers[c].socket_path = socket_path;
+        workers[c].command = command;
+        workers[c].requests = share;
+        workers[c].latencies = latencies + given_out;
+        given_out += share;
+        pthread_create(&workers[c].thread, NULL, bench_client_main, &workers[c]);
+    }
+
+    int completed = 0, failed = 0;
+    for (int c = 0; c < clients; c++)
+    {
+        pthread_join(workers[c].thread, NULL);
+        // Pack the finished latencies together for sorting
+        memmove(latencies + completed, workers[c].latencies, workers[c].completed * sizeof(double));
+        completed += workers[c].completed;
+        failed += workers[c].failed;
+    }
+    double elapsed = seconds_now() - started;
+
+    if (completed == 0)
+    {
+        fprintf(stderr, "w25client: no requests completed (is the server running?)\n");
+        free(latencies);
+        return 1;
+    }
+
+    qsort(latencies, completed, sizeof(double), compare_doubles);
+    printf("requests: %d ok, %d failed, %d connections\n", completed, failed, clients);
+    printf("throughput: %.1f requests/s over %.3f s\n", completed / elapsed, elapsed);
+    printf("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+           latencies[completed / 2] * 1000, latencies[(int)(completed * 0.90)] * 1000,
+           latencies[(int)(completed * 0.99)] * 1000, latencies[completed - 1] * 1000);
+
+    free(latencies);
+    return failed > 0;
+}
+
+void print_usage(void)
+{
+    fprintf(stderr, "Usage: w25client SOCKET [-C dir] [-e NAME=value] command...\n");
+    fprintf(stderr, "       w25client SOCKET --bench REQUESTS [--clients N] command...\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        print_usage();
+        return 2;
+    }
+
+    const char *socket_path = argv[1];
+    const char *directory = NULL;
+    char *env_changes[64];
+    int env_change_count = 0;
+    int bench_requests = 0;
+    int bench_clients = 1;
+
+    int arg = 2;
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-C") == 0 && arg + 1 < argc)
+            directory = argv[++arg];
+        else if (strcmp(argv[arg], "-e") == 0 && arg + 1 < argc && env_change_count < 64)
+            env_changes[env_change_count++] = argv[++arg];
+        else if (strcmp(argv[arg], "--bench") == 0 && arg + 1 < argc)
+            bench_requests = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--clients") == 0 && arg + 1 < argc)
+            bench_clients = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--") == 0)
+        {
+            arg++;
+            break;
+        }
+        else
+            break; // Looks like the command itself (e.g. "-" something)
+        arg++;
+    }
+
+    char command[MAX_COMMAND_SIZE];
+    if (!join_command(argv + arg, argc - arg, command, sizeof(command)))
+    {
+        print_usage();
+        return 2;
+    }
+
+    if (bench_requests > 0)
+    {
+        if (bench_clients < 1)
+            bench_clients = 1;
+        if (bench_clients > MAX_BENCH_CLIENTS)
+            bench_clients = MAX_BENCH_CLIENTS;
+        if (bench_clients > bench_requests)
+            bench_clients = bench_requests;
+        return run_benchmark(socket_path, command, bench_requests, bench_clients);
+    }
+
+    int fd = connect_to_server(socket_path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "w25client: can't connect to %s: %s\n", socket_path, strerror(errno));
+        return 2;
+    }
+
+    for (int i = 0; i < env_change_count; i++)
+        send_frame(fd, 'V', env_changes[i], strlen(env_changes[i]));
+    if (directory != NULL)
+    {
+        // The server answers a directory change with its own exit status
+        send_frame(fd, 'C', directory, strlen(directory));
+        int status = wait_for_exit_status(fd, 0);
+        if (status != 0)
+        {
+            close(fd);
+            return status < 0 ? 2 : status;
+        }
+    }
+
+    if (!send_frame(fd, 'L', command, strlen(command)))
+    {
+        fprintf(stderr, "w25client: lost connection to the server\n");
+        close(fd);
+        return 2;
+    }
+
+    int status = wait_for_exit_status(fd, 0);
+    close(fd);
+    if (status < 0)
+    {
+        fprintf(stderr, "w25client: lost connection to the server\n");
+        return 2;
+    }
+    return status;
+}
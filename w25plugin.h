@@ -0,0 +1,54 @@
+#ifndef W25PLUGIN_H
+#define W25PLUGIN_H
+
+/**
+ * w25plugin.h - the C interface for w25shell plugins
+ *
+ * A plugin is a shared library with new builtins in it:
+ *   gcc -shared -fPIC -o probe.so probe.c
+ *   w25shell$ load ./probe.so
+ * The builtins then run inside the shell process, with no fork or exec, both
+ * as plain commands ("probe args") and as pipeline stages ("probe | sort").
+ *
+ * The plugin exports one function, w25_plugin_init(), and the shell calls it
+ * once when the plugin is loaded. It registers its builtins through the api
+ * and returns 0 (anything else and the shell drops the plugin again).
+ *
+ * Rules for a builtin:
+ *  - Read input from in_fd and write output to out_fd with read()/write().
+ *    Don't use stdin/stdout/printf - in a pipeline those aren't your pipe
+ *  - Return the exit status (0 = success), never call exit()
+ *  - Don't close in_fd or out_fd, the shell does that
+ *  - In a pipeline the builtin runs on its own thread, maybe next to other
+ *    copies of itself, so anything global needs a lock
+ *  - SIGPIPE is blocked on pipeline threads: a write to a stage that has quit
+ *    fails with EPIPE, and the builtin should just stop
+ *
+ * The interface only grows: new api fields get added at the end and
+ * W25_PLUGIN_ABI_VERSION goes up, so a plugin built against an older
+ * header keeps working. A plugin that needs a newer field should check
+ * api->abi_version (or api->size) first.
+ */
+
+#define W25_PLUGIN_ABI_VERSION 1
+
+// argv[0] is the builtin's name, argv[argc] is NULL
+typedef int (*w25_builtin_function)(int argc, char **argv, int in_fd, int out_fd);
+
+struct w25_plugin_api
+{
+    int abi_version; // W25_PLUGIN_ABI_VERSION the shell was built with
+    int size;        // sizeof(struct w25_plugin_api) in the shell
+
+    // Adds a builtin, returns 0 or -1 if the name is taken (or the table is full).
+    // name is copied, so it doesn't have to outlive the call
+    int (*register_builtin)(const char *name, w25_builtin_function run);
+
+    // Exit status of the last command line, like $?
+    int (*last_status)(void);
+};
+
+// The one symbol every plugin exports
+int w25_plugin_init(const struct w25_plugin_api *api);
+
+#endif